@@ -0,0 +1,674 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <float.h>
+#include "ray.h"
+#include "particles.h"
+#include "scenecc.h"
+
+//co-prime with RAY_COUNT, so that the first RAY_COUNT * PRIM_COUNT tests are all different pairs
+#define PRIM_COUNT 1021
+#define RAY_COUNT 4096
+#define REPEATS 3
+#define MAX_REPORTED 5
+//one full group of the vector test in particles.c, so that a cloud is a single leaf tested at once
+#define LEAF_PARTICLES 8
+
+//the spheres and the triangles of the scene the whole scene searches are timed on, small enough to compile
+#define SCENE_PRIMS 32
+
+//the kinds of primitive a kernel tests
+#define PRIMS_SPHERES 0
+#define PRIMS_TRIANGLES 1
+#define PRIMS_LEAVES 2
+#define PRIMS_SCENE 3
+
+//These two structs are only used to check intersections of rays with triangles
+typedef struct
+{
+	double u;
+	double v;
+}vec_d_2D;
+
+typedef struct
+{
+	vec_d_2D p1;
+	vec_d_2D p2;
+	vec_d_2D p3;
+} triangle_2D;
+
+/**
+* an intersection kernel under test. prim is a sphere, a triangle, a particle cloud of one leaf or a bench_scene,
+* planes are tested against a triangle's plane
+*/
+typedef int (* kernel)(ray_d * ray, void * prim, vec_d * position);
+
+/**
+* a kernel of the renderer and the original code it has to agree with
+*/
+typedef struct
+{
+	const char * name;
+	kernel test;
+	kernel reference;
+	int prims;
+} kernel_case;
+
+/**
+* a scene of SCENE_PRIMS spheres and triangles and its compiled kernels, for the searches over a whole scene
+*/
+typedef struct
+{
+	scene * scn;
+	scene_kernels * kernels;
+} bench_scene;
+
+/**
+* The original scalar kernels, kept as they were so that faster versions in ray.c can be checked against them
+*/
+int ref_sphere_collide(ray_d * ray, sphere * sph, vec_d * position);
+int ref_triangle_collide(ray_d * ray, triangle * tri, vec_d * position);
+int ref_plane_collide(ray_d * ray, vec_d * p_point, vec_d * p_normal, vec_d * position);
+void ref_check_cross(vec_d_2D * p1, vec_d_2D * p2, int * cross_count, int * sign);
+void ref_project_2D(triangle * tri, vec_d * vec, triangle_2D * tri_proj, vec_d_2D * vec_proj);
+
+/**
+* Adapters giving every kernel the same signature
+*/
+int run_sphere(ray_d * ray, void * prim, vec_d * position);
+int run_triangle(ray_d * ray, void * prim, vec_d * position);
+int run_plane(ray_d * ray, void * prim, vec_d * position);
+int run_ref_sphere(ray_d * ray, void * prim, vec_d * position);
+int run_ref_triangle(ray_d * ray, void * prim, vec_d * position);
+int run_ref_plane(ray_d * ray, void * prim, vec_d * position);
+int run_particles(ray_d * ray, void * prim, vec_d * position);
+int run_ref_particles(ray_d * ray, void * prim, vec_d * position);
+int run_closest(ray_d * ray, void * prim, vec_d * position);
+int run_compiled_closest(ray_d * ray, void * prim, vec_d * position);
+int run_ref_closest(ray_d * ray, void * prim, vec_d * position);
+int run_any(ray_d * ray, void * prim, vec_d * position);
+int run_compiled_any(ray_d * ray, void * prim, vec_d * position);
+int run_ref_any(ray_d * ray, void * prim, vec_d * position);
+
+/**
+* Times a kernel and compares every result with its reference
+*
+* @param kernel_case * kc the kernel
+* @param ray_d * rays RAY_COUNT random rays
+* @param void ** prims PRIM_COUNT random primitives of the kind the kernel tests, see PRIMS_
+* @param long tests how many ray/primitive pairs to time
+*/
+void bench_kernel(kernel_case * kc, ray_d * rays, void ** prims, long tests);
+
+/**
+* Times the vector functions of vec.c
+*
+* @param vec_d * vecs RAY_COUNT random vectors
+* @param long tests how many calls to time
+*/
+void bench_vec(vec_d * vecs, long tests);
+
+/**
+* Prints one line of results
+*/
+void report(const char * name, double seconds, long tests, double hit_rate, long mismatches);
+
+/**
+* xorshift random numbers, the same on every platform for a given seed
+*
+* @return double a number from lo to hi
+*/
+double random_range(double lo, double hi);
+
+/**
+* Gets the seconds elapsed on a monotonic clock
+*/
+double now(void);
+
+unsigned long long g_rng = 88172645463325252ULL;
+volatile double g_sink;
+cloud_stats g_cloud_stats;
+
+int main(int argc, char * argv[])
+{
+	long tests = 2000000;
+	if (argc > 1 && (tests = atol(argv[1])) <= 0)
+	{
+		printf("Usage: %s [tests per kernel] [seed]\n", argv[0]);
+		return -1;
+	}
+	if (argc > 2)
+	{
+		g_rng ^= strtoull(argv[2], NULL, 10) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	//rays start around the primitives and point at a random spot among them, so that a fair share of them hit
+	ray_d * rays = (ray_d *) malloc(sizeof(ray_d) * RAY_COUNT);
+	vec_d * vecs = (vec_d *) malloc(sizeof(vec_d) * RAY_COUNT);
+	int i;
+	for (i = 0; i < RAY_COUNT; i++)
+	{
+		vec_d target = {random_range(-4, 4), random_range(-4, 4), random_range(-4, 4)};
+		rays[i].pos.x = random_range(-10, 10);
+		rays[i].pos.y = random_range(-10, 10);
+		rays[i].pos.z = random_range(-10, 10);
+		rays[i].dir = sub_vecs(&target, &rays[i].pos);
+		vec_normalize(&rays[i].dir);
+		vecs[i] = target;
+	}
+	void * spheres[PRIM_COUNT];
+	void * triangles[PRIM_COUNT];
+	void * leaves[PRIM_COUNT];
+	for (i = 0; i < PRIM_COUNT; i++)
+	{
+		sphere * sph = (sphere *) malloc(sizeof(sphere));
+		sph->center.x = random_range(-5, 5);
+		sph->center.y = random_range(-5, 5);
+		sph->center.z = random_range(-5, 5);
+		sph->radius = random_range(0.5, 4);
+		sph->mat = NULL;
+		spheres[i] = sph;
+
+		triangle * tri = (triangle *) malloc(sizeof(triangle));
+		vec_d c = {random_range(-5, 5), random_range(-5, 5), random_range(-5, 5)};
+		vec_d * corners[3] = {&tri->p1, &tri->p2, &tri->p3};
+		int j;
+		for (j = 0; j < 3; j++)
+		{
+			corners[j]->x = c.x + random_range(-4, 4);
+			corners[j]->y = c.y + random_range(-4, 4);
+			corners[j]->z = c.z + random_range(-4, 4);
+		}
+		calculate_triangle_normal(tri);
+		tri->mat = NULL;
+		triangles[i] = tri;
+
+		//small particles close together, like those of a leaf of a real cloud
+		float px[LEAF_PARTICLES], py[LEAF_PARTICLES], pz[LEAF_PARTICLES], radius[LEAF_PARTICLES];
+		c.x = random_range(-5, 5);
+		c.y = random_range(-5, 5);
+		c.z = random_range(-5, 5);
+		for (j = 0; j < LEAF_PARTICLES; j++)
+		{
+			px[j] = c.x + random_range(-1.5, 1.5);
+			py[j] = c.y + random_range(-1.5, 1.5);
+			pz[j] = c.z + random_range(-1.5, 1.5);
+			radius[j] = random_range(0.2, 1);
+		}
+		material * mat = (material *) malloc(sizeof(material));
+		init_material(mat);
+		compile_material(mat);
+		leaves[i] = make_particle_cloud(LEAF_PARTICLES, px, py, pz, radius, mat);
+	}
+	//the compiled searches have to match the generic ones exactly, and both the original kernels
+	bench_scene bench;
+	bench.scn = (scene *) malloc(sizeof(scene));
+	init_scene(bench.scn, 0, SCENE_PRIMS, SCENE_PRIMS);
+	for (i = 0; i < SCENE_PRIMS; i++)
+	{
+		bench.scn->spheres[i] = (sphere *) spheres[i];
+		bench.scn->triangles[i] = (triangle *) triangles[i];
+	}
+	int cached;
+	bench.kernels = load_scene_kernels(bench.scn, NULL, &cached);
+	void * scenes[PRIM_COUNT];
+	for (i = 0; i < PRIM_COUNT; i++)
+	{
+		scenes[i] = &bench;
+	}
+	void ** prims[4] = {spheres, triangles, leaves, scenes};
+
+	kernel_case cases[] = {
+		{"sphere_collide", run_sphere, run_ref_sphere, PRIMS_SPHERES},
+		{"triangle_collide", run_triangle, run_ref_triangle, PRIMS_TRIANGLES},
+		{"plane_collide", run_plane, run_ref_plane, PRIMS_TRIANGLES},
+		{"particle_leaf", run_particles, run_ref_particles, PRIMS_LEAVES},
+		{"closest_hit", run_closest, run_ref_closest, PRIMS_SCENE},
+		{"compiled_closest", run_compiled_closest, run_ref_closest, PRIMS_SCENE},
+		{"any_hit", run_any, run_ref_any, PRIMS_SCENE},
+		{"compiled_any", run_compiled_any, run_ref_any, PRIMS_SCENE},
+		{"ref_sphere_collide", run_ref_sphere, run_ref_sphere, PRIMS_SPHERES},
+		{"ref_triangle_collide", run_ref_triangle, run_ref_triangle, PRIMS_TRIANGLES},
+		{"ref_plane_collide", run_ref_plane, run_ref_plane, PRIMS_TRIANGLES},
+		{"ref_particle_leaf", run_ref_particles, run_ref_particles, PRIMS_LEAVES},
+		{"ref_closest", run_ref_closest, run_ref_closest, PRIMS_SCENE},
+		{"ref_any", run_ref_any, run_ref_any, PRIMS_SCENE}
+	};
+	printf("%-22s %10s %12s %8s %10s\n", "kernel", "ns/test", "Mtests/s", "hits", "mismatch");
+	for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++)
+	{
+		if (!bench.kernels && (cases[i].test == run_compiled_closest || cases[i].test == run_compiled_any))
+		{
+			printf("%-22s skipped: %s\n", cases[i].name, get_scenecc_error());
+			continue;
+		}
+		bench_kernel(&cases[i], rays, prims[cases[i].prims], tests);
+	}
+	bench_vec(vecs, tests);
+
+	for (i = 0; i < PRIM_COUNT; i++)
+	{
+		free(spheres[i]);
+		free(triangles[i]);
+		destroy_particle_cloud(leaves[i]);
+	}
+	unload_scene_kernels(bench.kernels);
+	//the primitives were freed with the others
+	free(bench.scn->spheres);
+	free(bench.scn->triangles);
+	bench.scn->spheres = NULL;
+	bench.scn->triangles = NULL;
+	bench.scn->sphere_count = 0;
+	bench.scn->triangle_count = 0;
+	destroy_scene(bench.scn);
+	free(rays);
+	free(vecs);
+	return 0;
+}
+
+void bench_kernel(kernel_case * kc, ray_d * rays, void ** prims, long tests)
+{
+	double best = 0;
+	long hits = 0;
+	long mismatches = 0;
+	long t;
+	int r;
+	vec_d position;
+	for (r = 0; r < REPEATS; r++)
+	{
+		double start = now();
+		double sum = 0;
+		hits = 0;
+		for (t = 0; t < tests; t++)
+		{
+			if (kc->test(&rays[t % RAY_COUNT], prims[t % PRIM_COUNT], &position))
+			{
+				hits++;
+				sum += position.x;
+			}
+		}
+		double elapsed = now() - start;
+		g_sink = sum;
+		if (!r || elapsed < best)
+		{
+			best = elapsed;
+		}
+	}
+	//every pair timed is checked once against the original code, outside of the timed loop
+	long checked = tests < (long) RAY_COUNT * PRIM_COUNT ? tests : (long) RAY_COUNT * PRIM_COUNT;
+	for (t = 0; t < checked; t++)
+	{
+		ray_d * ray = &rays[t % RAY_COUNT];
+		vec_d expected;
+		int hit = kc->test(ray, prims[t % PRIM_COUNT], &position);
+		int ref_hit = kc->reference(ray, prims[t % PRIM_COUNT], &expected);
+		double dist = hit ? vec_distance(&ray->pos, &position) : 0;
+		double ref_dist = ref_hit ? vec_distance(&ray->pos, &expected) : 0;
+		if (hit != ref_hit || fabs(dist - ref_dist) > 1e-9 * (1 + ref_dist))
+		{
+			if (mismatches < MAX_REPORTED)
+			{
+				printf("  mismatch in %s, test %ld: %s at %.17g, expected %s at %.17g\n", kc->name, t,
+					hit ? "hit" : "miss", dist, ref_hit ? "hit" : "miss", ref_dist);
+			}
+			mismatches++;
+		}
+	}
+	report(kc->name, best, tests, (double) hits / tests, mismatches);
+}
+
+void bench_vec(vec_d * vecs, long tests)
+{
+	const char * names[] = {"dot", "vec_cross", "vec_normalize", "vec_magnitude", "vec_distance", "sub_vecs", "vec_reflect"};
+	int f, r;
+	long t;
+	for (f = 0; f < (int) (sizeof(names) / sizeof(names[0])); f++)
+	{
+		double best = 0;
+		for (r = 0; r < REPEATS; r++)
+		{
+			double sum = 0;
+			double start = now();
+			for (t = 0; t < tests; t++)
+			{
+				vec_d * a = &vecs[t % RAY_COUNT];
+				vec_d * b = &vecs[(t + 1) % RAY_COUNT];
+				vec_d v;
+				switch (f)
+				{
+					case 0:
+						sum += dot(a, b);
+						break;
+					case 1:
+						v = vec_cross(a, b);
+						sum += v.x;
+						break;
+					case 2:
+						v = *a;
+						vec_normalize(&v);
+						sum += v.y;
+						break;
+					case 3:
+						sum += vec_magnitude(a);
+						break;
+					case 4:
+						sum += vec_distance(a, b);
+						break;
+					case 5:
+						v = sub_vecs(a, b);
+						sum += v.z;
+						break;
+					default:
+						v = vec_reflect(a, b);
+						sum += v.x;
+						break;
+				}
+			}
+			double elapsed = now() - start;
+			g_sink = sum;
+			if (!r || elapsed < best)
+			{
+				best = elapsed;
+			}
+		}
+		report(names[f], best, tests, -1, -1);
+	}
+}
+
+void report(const char * name, double seconds, long tests, double hit_rate, long mismatches)
+{
+	printf("%-22s %10.2f %12.2f", name, seconds * 1e9 / tests, tests / seconds / 1e6);
+	if (hit_rate >= 0)
+	{
+		printf(" %7.1f%% %10ld", hit_rate * 100, mismatches);
+	}
+	printf("\n");
+}
+
+double random_range(double lo, double hi)
+{
+	g_rng ^= g_rng << 13;
+	g_rng ^= g_rng >> 7;
+	g_rng ^= g_rng << 17;
+	return lo + (hi - lo) * ((g_rng >> 11) * (1.0 / 9007199254740992.0));
+}
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int run_sphere(ray_d * ray, void * prim, vec_d * position)
+{
+	return sphere_collide(ray, (sphere *) prim, position);
+}
+
+int run_triangle(ray_d * ray, void * prim, vec_d * position)
+{
+	return triangle_collide(ray, (triangle *) prim, position);
+}
+
+int run_plane(ray_d * ray, void * prim, vec_d * position)
+{
+	triangle * tri = (triangle *) prim;
+	return plane_collide(ray, &tri->p1, &tri->normal, position);
+}
+
+int run_ref_sphere(ray_d * ray, void * prim, vec_d * position)
+{
+	return ref_sphere_collide(ray, (sphere *) prim, position);
+}
+
+int run_ref_triangle(ray_d * ray, void * prim, vec_d * position)
+{
+	return ref_triangle_collide(ray, (triangle *) prim, position);
+}
+
+int run_ref_plane(ray_d * ray, void * prim, vec_d * position)
+{
+	triangle * tri = (triangle *) prim;
+	return ref_plane_collide(ray, &tri->p1, &tri->normal, position);
+}
+
+int run_particles(ray_d * ray, void * prim, vec_d * position)
+{
+	double dist = DBL_MAX;
+	vec_d normal;
+	material * mat;
+	return cloud_closest_hit((particle_cloud *) prim, &ray->pos, &ray->dir, &dist, position, &normal, &mat,
+		&g_cloud_stats);
+}
+
+int run_ref_particles(ray_d * ray, void * prim, vec_d * position)
+{
+	//every particle on its own with the original sphere code, keeping the closest hit
+	particle_cloud * cloud = (particle_cloud *) prim;
+	int hit = 0, i;
+	double best = 0;
+	for (i = 0; i < particle_cluster_size(cloud, 0); i++)
+	{
+		sphere sph;
+		vec_d pos;
+		get_particle(cloud, 0, i, &sph.center, &sph.radius);
+		if (ref_sphere_collide(ray, &sph, &pos))
+		{
+			double dist = vec_distance(&ray->pos, &pos);
+			if (!hit || dist < best)
+			{
+				hit = 1;
+				best = dist;
+				*position = pos;
+			}
+		}
+	}
+	return hit;
+}
+
+int run_closest(ray_d * ray, void * prim, vec_d * position)
+{
+	vec_d normal;
+	material * mat;
+	return closest_hit(ray, ((bench_scene *) prim)->scn, position, &normal, &mat);
+}
+
+int run_compiled_closest(ray_d * ray, void * prim, vec_d * position)
+{
+	vec_d normal;
+	double min_dist = DBL_MAX;
+	return ((bench_scene *) prim)->kernels->closest(ray, position, &normal, &min_dist);
+}
+
+int run_ref_closest(ray_d * ray, void * prim, vec_d * position)
+{
+	//the spheres then the triangles with the original code, keeping the closest hit like check_collide
+	scene * scn = ((bench_scene *) prim)->scn;
+	int hit = 0, i;
+	double best = DBL_MAX;
+	for (i = 0; i < scn->sphere_count + scn->triangle_count; i++)
+	{
+		vec_d pos;
+		int found = i < scn->sphere_count ? ref_sphere_collide(ray, scn->spheres[i], &pos) :
+			ref_triangle_collide(ray, scn->triangles[i - scn->sphere_count], &pos);
+		double dist;
+		if (found && (dist = vec_distance(&ray->pos, &pos)) < best)
+		{
+			hit = i + 1;
+			best = dist;
+			*position = pos;
+		}
+	}
+	return hit;
+}
+
+//the searches for any hit have no position, so they all give the start of the ray, and only say whether there is one
+int run_any(ray_d * ray, void * prim, vec_d * position)
+{
+	*position = ray->pos;
+	return any_hit(ray, ((bench_scene *) prim)->scn);
+}
+
+int run_compiled_any(ray_d * ray, void * prim, vec_d * position)
+{
+	*position = ray->pos;
+	return ((bench_scene *) prim)->kernels->any(ray) != 0;
+}
+
+int run_ref_any(ray_d * ray, void * prim, vec_d * position)
+{
+	scene * scn = ((bench_scene *) prim)->scn;
+	vec_d pos;
+	int i;
+	*position = ray->pos;
+	for (i = 0; i < scn->sphere_count + scn->triangle_count; i++)
+	{
+		if (i < scn->sphere_count ? ref_sphere_collide(ray, scn->spheres[i], &pos) :
+			ref_triangle_collide(ray, scn->triangles[i - scn->sphere_count], &pos))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int ref_sphere_collide(ray_d * ray, sphere * sph, vec_d * position)
+{
+	vec_d oc = sub_vecs(&sph->center, &ray->pos);
+	double oc_mag = vec_magnitude(&oc);
+	int inside_sphere = oc_mag < sph->radius;
+	double closest_dist = dot(&ray->dir, &oc);
+	if (closest_dist < 0 && !inside_sphere)
+	{
+		return 0;
+	}
+	double dist_to_sphere_sq = sph->radius * sph->radius - oc_mag * oc_mag + closest_dist * closest_dist;
+	if (dist_to_sphere_sq < 0)
+	{
+		return 0;
+	}
+	double intersect_dist;
+	if (inside_sphere)
+	{
+		intersect_dist = closest_dist + sqrt(dist_to_sphere_sq);
+	}
+	else
+	{
+		intersect_dist = closest_dist - sqrt(dist_to_sphere_sq);
+	}
+
+	vec_d intersect_vec = vec_mult(&ray->dir, intersect_dist);
+	*position = sum_vecs(&ray->pos, &intersect_vec);
+	return 1;
+}
+
+int ref_triangle_collide(ray_d * ray, triangle * tri, vec_d * position)
+{
+	if (!ref_plane_collide(ray, &tri->p1, &tri->normal, position))
+	{
+		return 0;
+	}
+	triangle_2D * tri_2D = (triangle_2D *) malloc(sizeof(triangle_2D));
+	vec_d_2D * vec_2D = (vec_d_2D *) malloc(sizeof(vec_d_2D));
+	ref_project_2D(tri, position, tri_2D, vec_2D);
+
+	tri_2D->p1.u -= vec_2D->u;
+	tri_2D->p1.v -= vec_2D->v;
+	tri_2D->p2.u -= vec_2D->u;
+	tri_2D->p2.v -= vec_2D->v;
+	tri_2D->p3.u -= vec_2D->u;
+	tri_2D->p3.v -= vec_2D->v;
+
+	int cross_count = 0;
+	int sign = tri_2D->p1.v < 0 ? -1 : 1;
+
+	ref_check_cross(&tri_2D->p1, &tri_2D->p2, &cross_count, &sign);
+	ref_check_cross(&tri_2D->p2, &tri_2D->p3, &cross_count, &sign);
+	ref_check_cross(&tri_2D->p3, &tri_2D->p1, &cross_count, &sign);
+
+	free(tri_2D);
+	free(vec_2D);
+
+	return cross_count % 2 ? 1 : 0;
+}
+
+int ref_plane_collide(ray_d * ray, vec_d * p_point, vec_d * p_normal, vec_d * position)
+{
+	vec_d p_ray_vec = sub_vecs(p_point, &ray->pos);
+	double denominator = dot(p_normal, &ray->dir);
+	if (denominator == 0)
+	{
+		return 0;
+	}
+	double vec_param = dot(p_normal, &p_ray_vec) / denominator;
+	if (vec_param < 0)
+	{
+		return 0;
+	}
+	position->x = vec_param * ray->dir.x + ray->pos.x;
+	position->y = vec_param * ray->dir.y + ray->pos.y;
+	position->z = vec_param * ray->dir.z + ray->pos.z;
+	return 1;
+}
+
+void ref_check_cross(vec_d_2D * p1, vec_d_2D * p2, int * cross_count, int * sign)
+{
+	int next_sign = p2->v < 0 ? -1 : 1;
+	if (next_sign != *sign)
+	{
+		if (p1->u > 0 && p2->u > 0)
+		{
+			(*cross_count)++;
+		}
+		else if (p1->u > 0 || p2->u > 0)
+		{
+			if (p1->u - p1->v * (p2->u - p1->u) / (p2->v - p1->v) > 0)
+			{
+				(*cross_count)++;
+			}
+		}
+	}
+	*sign = next_sign;
+}
+
+void ref_project_2D(triangle * tri, vec_d * vec, triangle_2D * tri_proj, vec_d_2D * vec_proj)
+{
+	double x_mag = fabs(tri->normal.x);
+	double y_mag = fabs(tri->normal.y);
+	double z_mag = fabs(tri->normal.z);
+	if (x_mag > y_mag && x_mag > z_mag)
+	{
+		tri_proj->p1.u = tri->p1.y;
+		tri_proj->p1.v = tri->p1.z;
+		tri_proj->p2.u = tri->p2.y;
+		tri_proj->p2.v = tri->p2.z;
+		tri_proj->p3.u = tri->p3.y;
+		tri_proj->p3.v = tri->p3.z;
+		vec_proj->u = vec->y;
+		vec_proj->v = vec->z;
+	}
+	else if (y_mag > z_mag)
+	{
+		tri_proj->p1.u = tri->p1.x;
+		tri_proj->p1.v = tri->p1.z;
+		tri_proj->p2.u = tri->p2.x;
+		tri_proj->p2.v = tri->p2.z;
+		tri_proj->p3.u = tri->p3.x;
+		tri_proj->p3.v = tri->p3.z;
+		vec_proj->u = vec->x;
+		vec_proj->v = vec->z;
+	}
+	else
+	{
+		tri_proj->p1.u = tri->p1.x;
+		tri_proj->p1.v = tri->p1.y;
+		tri_proj->p2.u = tri->p2.x;
+		tri_proj->p2.v = tri->p2.y;
+		tri_proj->p3.u = tri->p3.x;
+		tri_proj->p3.v = tri->p3.y;
+		vec_proj->u = vec->x;
+		vec_proj->v = vec->y;
+	}
+}
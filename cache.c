@@ -0,0 +1,205 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "hash.h"
+
+#define LEN_PATH 4096
+#define CACHE_SUFFIX ".ppm"
+
+/**
+* an image in the cache directory, for eviction
+*/
+typedef struct
+{
+	char name[64];
+	long long size;
+	struct timespec used;
+} cache_entry;
+
+/**
+* Copies a file, writing to a temporary name first so a reader never sees a partial copy
+*
+* @param char * from the file to copy
+* @param char * to where to copy it
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int copy_file(char * from, char * to);
+
+/**
+* Orders cache entries from least to most recently used, for qsort
+*/
+int compare_entries(const void * a, const void * b);
+
+/**
+* Deletes the least recently used images until the cache fits
+*
+* @param char * dir the cache directory
+* @param long long max_bytes the most space the cache may use
+*/
+void evict(char * dir, long long max_bytes);
+
+unsigned long long result_cache_key(scene * scn, render_opts * opts, int variant)
+{
+	unsigned long long h = scene_hash(scn);
+	h = hash_bytes(h, &opts->res_x, sizeof(int));
+	h = hash_bytes(h, &opts->res_y, sizeof(int));
+	h = hash_bytes(h, &opts->depth, sizeof(int));
+	h = hash_bytes(h, &opts->crop_x0, sizeof(int));
+	h = hash_bytes(h, &opts->crop_y0, sizeof(int));
+	h = hash_bytes(h, &opts->crop_x1, sizeof(int));
+	h = hash_bytes(h, &opts->crop_y1, sizeof(int));
+	if (opts->aa_samples > 1)
+	{
+		h = hash_bytes(h, &opts->aa_samples, sizeof(int));
+		h = hash_double(h, opts->aa_contrast);
+	}
+	//sampled point lights give a noisy image that depends on the number of samples
+	if (scn->point_light_count)
+	{
+		h = hash_bytes(h, &opts->light_samples, sizeof(int));
+	}
+	if (scn->area_light_count)
+	{
+		h = hash_bytes(h, &opts->area_samples, sizeof(int));
+		h = hash_bytes(h, &opts->area_adaptive, sizeof(int));
+	}
+	return hash_bytes(h, &variant, sizeof(int));
+}
+
+int result_cache_fetch(char * dir, unsigned long long key, char * out_path)
+{
+	char path[LEN_PATH];
+	snprintf(path, sizeof(path), "%s/%016llx%s", dir, key, CACHE_SUFFIX);
+	if (access(path, R_OK) || !copy_file(path, out_path))
+	{
+		return 0;
+	}
+	//the modification time doubles as the last use time
+	utimensat(AT_FDCWD, path, NULL, 0);
+	return 1;
+}
+
+int result_cache_store(char * dir, unsigned long long key, char * image_path, long long max_bytes)
+{
+	char path[LEN_PATH];
+	if (mkdir(dir, 0755) && errno != EEXIST)
+	{
+		return 0;
+	}
+	snprintf(path, sizeof(path), "%s/%016llx%s", dir, key, CACHE_SUFFIX);
+	if (!copy_file(image_path, path))
+	{
+		return 0;
+	}
+	evict(dir, max_bytes);
+	return 1;
+}
+
+int copy_file(char * from, char * to)
+{
+	char tmp[LEN_PATH];
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", to, (int) getpid());
+	FILE * in = fopen(from, "rb");
+	if (!in)
+	{
+		return 0;
+	}
+	FILE * out = fopen(tmp, "wb");
+	if (!out)
+	{
+		fclose(in);
+		return 0;
+	}
+	char buf[65536];
+	size_t len;
+	int ok = 1;
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+	{
+		if (fwrite(buf, 1, len, out) != len)
+		{
+			ok = 0;
+			break;
+		}
+	}
+	ok = !ferror(in) && ok;
+	fclose(in);
+	ok = !fclose(out) && ok;
+	if (!ok || rename(tmp, to))
+	{
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+void evict(char * dir, long long max_bytes)
+{
+	DIR * d = opendir(dir);
+	if (!d)
+	{
+		return;
+	}
+	int count = 0, cap = 64;
+	cache_entry * entries = (cache_entry *) malloc(sizeof(cache_entry) * cap);
+	long long total = 0;
+	char path[LEN_PATH];
+	struct dirent * ent;
+	struct stat st;
+	while ((ent = readdir(d)))
+	{
+		size_t len = strlen(ent->d_name);
+		if (len != 16 + strlen(CACHE_SUFFIX) || strcmp(ent->d_name + 16, CACHE_SUFFIX))
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st))
+		{
+			continue;
+		}
+		if (count == cap)
+		{
+			cap *= 2;
+			entries = (cache_entry *) realloc(entries, sizeof(cache_entry) * cap);
+		}
+		strcpy(entries[count].name, ent->d_name);
+		entries[count].size = st.st_size;
+		entries[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(d);
+	qsort(entries, count, sizeof(cache_entry), compare_entries);
+	int i;
+	for (i = 0; i < count && total > max_bytes; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+		if (!unlink(path))
+		{
+			total -= entries[i].size;
+		}
+	}
+	free(entries);
+}
+
+int compare_entries(const void * a, const void * b)
+{
+	const cache_entry * e1 = (const cache_entry *) a;
+	const cache_entry * e2 = (const cache_entry *) b;
+	if (e1->used.tv_sec != e2->used.tv_sec)
+	{
+		return e1->used.tv_sec < e2->used.tv_sec ? -1 : 1;
+	}
+	if (e1->used.tv_nsec != e2->used.tv_nsec)
+	{
+		return e1->used.tv_nsec < e2->used.tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
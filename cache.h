@@ -0,0 +1,41 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "ray.h"
+
+/**
+* Calculates the key of a render in the result cache, from the scene and everything in the options that changes the image
+*
+* @param scene * scn the scene
+* @param render_opts * opts the render options
+* @param int variant any other output setting that changes the image file, such as writing a crop at full size
+*
+* @return unsigned long long the key
+*/
+unsigned long long result_cache_key(scene * scn, render_opts * opts, int variant);
+
+/**
+* Looks for a render in the result cache and copies it to the output path if it is there.
+* A hit marks the entry as recently used
+*
+* @param char * dir the cache directory
+* @param unsigned long long key the key from result_cache_key
+* @param char * out_path where to copy the cached image
+*
+* @return int 0 if the render isn't cached, positive number if out_path now holds it
+*/
+int result_cache_fetch(char * dir, unsigned long long key, char * out_path);
+
+/**
+* Adds a rendered image to the result cache, then evicts the least recently used entries until the cache fits in max_bytes
+*
+* @param char * dir the cache directory, created if it doesn't exist
+* @param unsigned long long key the key from result_cache_key
+* @param char * image_path the image that was just written
+* @param long long max_bytes the most space the cache may use
+*
+* @return int 0 if the image couldn't be added, positive number if it succeeds
+*/
+int result_cache_store(char * dir, unsigned long long key, char * image_path, long long max_bytes);
+
+#endif
@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+
+#define LEN_ERROR 256
+#define CAPTURE_MAGIC "RTRAYS02"
+//origin, direction and reach as 7 doubles, then the type and depth as one byte each
+#define RECORD_SIZE (7 * sizeof(double) + 2)
+#define BUFFER_RECORDS 2048
+
+/**
+* the start of every capture file
+*/
+typedef struct
+{
+	char magic[8];
+	unsigned long long scene_hash;
+} capture_header;
+
+struct ray_capture
+{
+	FILE * f;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+struct capture_buffer
+{
+	ray_capture * capture;
+	int count;
+	unsigned char data[BUFFER_RECORDS * RECORD_SIZE];
+};
+
+char g_capture_err[LEN_ERROR];
+
+/**
+* Appends the rays in a buffer to its file and empties it
+*
+* @param capture_buffer * buf the buffer
+*/
+void flush_buffer(capture_buffer * buf);
+
+ray_capture * capture_open(char * path, unsigned long long scn_hash)
+{
+	FILE * f = fopen(path, "wb");
+	if (!f)
+	{
+		snprintf(g_capture_err, LEN_ERROR, "Could not create ray capture file '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	capture_header header;
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.scene_hash = scn_hash;
+	ray_capture * capture = (ray_capture *) malloc(sizeof(ray_capture));
+	capture->f = f;
+	capture->failed = fwrite(&header, sizeof(header), 1, f) != 1;
+	pthread_mutex_init(&capture->lock, NULL);
+	return capture;
+}
+
+int capture_close(ray_capture * capture)
+{
+	int ok = !capture->failed;
+	if (fclose(capture->f))
+	{
+		ok = 0;
+	}
+	pthread_mutex_destroy(&capture->lock);
+	free(capture);
+	return ok;
+}
+
+capture_buffer * capture_buffer_create(ray_capture * capture)
+{
+	capture_buffer * buf = (capture_buffer *) malloc(sizeof(capture_buffer));
+	buf->capture = capture;
+	buf->count = 0;
+	return buf;
+}
+
+void capture_buffer_destroy(capture_buffer * buf)
+{
+	flush_buffer(buf);
+	free(buf);
+}
+
+void capture_ray(capture_buffer * buf, vec_d * pos, vec_d * dir, double max_dist, int type, int depth)
+{
+	if (buf->count == BUFFER_RECORDS)
+	{
+		flush_buffer(buf);
+	}
+	unsigned char * p = buf->data + buf->count * RECORD_SIZE;
+	double v[7] = {pos->x, pos->y, pos->z, dir->x, dir->y, dir->z, max_dist};
+	memcpy(p, v, sizeof(v));
+	p[sizeof(v)] = (unsigned char) type;
+	p[sizeof(v) + 1] = (unsigned char) (depth > 255 ? 255 : depth);
+	buf->count++;
+}
+
+void flush_buffer(capture_buffer * buf)
+{
+	if (!buf->count)
+	{
+		return;
+	}
+	ray_capture * capture = buf->capture;
+	pthread_mutex_lock(&capture->lock);
+	if (fwrite(buf->data, RECORD_SIZE, buf->count, capture->f) != (size_t) buf->count)
+	{
+		capture->failed = 1;
+	}
+	pthread_mutex_unlock(&capture->lock);
+	buf->count = 0;
+}
+
+captured_ray * load_capture(char * path, unsigned long long * scn_hash, long * count)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+	{
+		snprintf(g_capture_err, LEN_ERROR, "Could not open ray capture file '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	capture_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)))
+	{
+		snprintf(g_capture_err, LEN_ERROR, "'%s' is not a ray capture file\n", path);
+		fclose(f);
+		return NULL;
+	}
+	*scn_hash = header.scene_hash;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f) - (long) sizeof(header);
+	fseek(f, sizeof(header), SEEK_SET);
+	*count = size / (long) RECORD_SIZE;
+	captured_ray * rays = (captured_ray *) malloc(sizeof(captured_ray) * (*count ? *count : 1));
+	unsigned char record[RECORD_SIZE];
+	long i;
+	for (i = 0; i < *count; i++)
+	{
+		if (fread(record, RECORD_SIZE, 1, f) != 1)
+		{
+			break;
+		}
+		double v[7];
+		memcpy(v, record, sizeof(v));
+		rays[i].pos.x = v[0];
+		rays[i].pos.y = v[1];
+		rays[i].pos.z = v[2];
+		rays[i].dir.x = v[3];
+		rays[i].dir.y = v[4];
+		rays[i].dir.z = v[5];
+		rays[i].max_dist = v[6];
+		rays[i].type = record[sizeof(v)];
+		rays[i].depth = record[sizeof(v) + 1];
+	}
+	fclose(f);
+	if (i < *count)
+	{
+		snprintf(g_capture_err, LEN_ERROR, "Could not read ray capture file '%s'\n", path);
+		free(rays);
+		return NULL;
+	}
+	return rays;
+}
+
+char * get_capture_error()
+{
+	return g_capture_err;
+}
@@ -0,0 +1,99 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include "vec.h"
+
+//the kinds of ray in a capture
+#define RAY_PRIMARY 0
+#define RAY_REFLECTION 1
+#define RAY_SHADOW 2
+
+/**
+* a ray stream file being written by any number of render threads
+*/
+typedef struct ray_capture ray_capture;
+
+/**
+* the rays of one render thread waiting to be appended to a ray_capture
+*/
+typedef struct capture_buffer capture_buffer;
+
+/**
+* one query read back from a capture file
+*/
+typedef struct
+{
+	vec_d pos;
+	vec_d dir;
+	//how far a shadow ray reaches, DBL_MAX for rays that go on forever
+	double max_dist;
+	int type;
+	int depth;
+} captured_ray;
+
+/**
+* Creates a ray stream file
+*
+* @param char * path where to write the rays
+* @param unsigned long long scn_hash the hash of the scene being rendered, from scene_hash
+*
+* @return ray_capture * the open capture, NULL if it fails
+*/
+ray_capture * capture_open(char * path, unsigned long long scn_hash);
+
+/**
+* Closes a capture. Every buffer must have been destroyed first
+*
+* @param ray_capture * capture the capture
+*
+* @return int 0 if some rays could not be written, positive number otherwise
+*/
+int capture_close(ray_capture * capture);
+
+/**
+* Creates a buffer for one thread to record rays into without locking
+*
+* @param ray_capture * capture the file the rays go to
+*
+* @return capture_buffer * the buffer
+*/
+capture_buffer * capture_buffer_create(ray_capture * capture);
+
+/**
+* Appends the rays left in a buffer to its file and frees it
+*
+* @param capture_buffer * buf the buffer
+*/
+void capture_buffer_destroy(capture_buffer * buf);
+
+/**
+* Records one ray
+*
+* @param capture_buffer * buf the calling thread's buffer
+* @param vec_d * pos the ray origin
+* @param vec_d * dir the ray direction
+* @param double max_dist how far the ray reaches, DBL_MAX if it is not bounded
+* @param int type RAY_PRIMARY, RAY_REFLECTION or RAY_SHADOW
+* @param int depth the reflection depth of the ray
+*/
+void capture_ray(capture_buffer * buf, vec_d * pos, vec_d * dir, double max_dist, int type, int depth);
+
+/**
+* Reads every ray of a capture file
+*
+* @param char * path the capture file
+* @param unsigned long long * scn_hash set to the hash of the scene the rays were captured from
+* @param long * count set to the number of rays
+*
+* @return captured_ray * the rays, NULL if it fails
+*/
+captured_ray * load_capture(char * path, unsigned long long * scn_hash, long * count);
+
+/**
+* Gets a description of the last error
+*
+* @return char * the error message
+*/
+char * get_capture_error();
+
+#endif
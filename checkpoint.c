@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "hash.h"
+
+#define LEN_ERROR 256
+#define CHECKPOINT_MAGIC "RTCKPT03"
+#define RECORD_MAGIC 0x454c4954
+
+/**
+* the start of every checkpoint file. A resume is only allowed if all of it matches the current render
+*/
+typedef struct
+{
+	char magic[8];
+	unsigned long long scene_hash;
+	int res_x;
+	int res_y;
+	int tile_size;
+	int depth;
+	int crop_x0;
+	int crop_y0;
+	int crop_x1;
+	int crop_y1;
+	int aa_samples;
+	int light_samples;
+	int area_samples;
+	int area_adaptive;
+	int shadow_map_size;
+	int reserved;
+} checkpoint_header;
+
+/**
+* written in front of the pixels of every tile. The checksum covers index, pixel_count and the pixels,
+* so a record torn by a crash is detected and dropped on resume
+*/
+typedef struct
+{
+	unsigned int magic;
+	int index;
+	int pixel_count;
+	int reserved;
+	unsigned long long checksum;
+} tile_record;
+
+/**
+* a tile waiting to be written by the checkpoint thread
+*/
+struct pending_tile
+{
+	tile_record record;
+	double * data;
+	struct pending_tile * next;
+};
+
+typedef struct pending_tile pending_tile;
+
+struct checkpoint
+{
+	int fd;
+	char * path;
+	int interval;
+	int closing;
+	int failed;
+	render_opts * opts;
+	pending_tile * head;
+	pending_tile * tail;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+char g_ckpt_err[LEN_ERROR];
+
+/**
+* Reads the tiles from an existing checkpoint file into the framebuffer. Stops at the first damaged record
+* and cuts the file off there, so new tiles are appended after the last good one
+*
+* @param checkpoint * ckpt the checkpoint, with fd open for reading and writing
+* @param checkpoint_header * expected the header the file must have
+* @param color * pixels the framebuffer
+*
+* @return int 0 if the file belongs to a different render, positive number if it succeeds
+*/
+int load_checkpoint(checkpoint * ckpt, checkpoint_header * expected, color * pixels);
+
+/**
+* Calculates the checksum of a tile record and its pixels
+*
+* @param tile_record * record the record
+* @param double * data the pixels, 3 doubles each
+*
+* @return unsigned long long the checksum
+*/
+unsigned long long record_checksum(tile_record * record, double * data);
+
+/**
+* Writes a whole buffer, retrying short writes
+*
+* @param int fd the file
+* @param void * buf the data
+* @param size_t len the length of buf
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_all(int fd, void * buf, size_t len);
+
+/**
+* Checkpoint thread entry point. Appends queued tiles and syncs the file at least every interval seconds
+*
+* @param void * arg the checkpoint
+*
+* @return void * always NULL
+*/
+void * checkpoint_thread(void * arg);
+
+checkpoint * checkpoint_open(char * path, unsigned long long scn_hash, render_opts * opts, color * pixels, int resume, int interval)
+{
+	checkpoint_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.scene_hash = scn_hash;
+	header.res_x = opts->res_x;
+	header.res_y = opts->res_y;
+	header.tile_size = opts->tile_size;
+	header.depth = opts->depth;
+	header.crop_x0 = opts->crop_x0;
+	header.crop_y0 = opts->crop_y0;
+	header.crop_x1 = opts->crop_x1;
+	header.crop_y1 = opts->crop_y1;
+	header.aa_samples = opts->aa_samples > 1 ? opts->aa_samples : 1;
+	header.light_samples = opts->light_samples;
+	header.area_samples = opts->area_samples;
+	header.area_adaptive = opts->area_adaptive;
+	//shadow map answers can differ from the exact ones, so a render with them only continues one with the same maps
+	header.shadow_map_size = shadow_map_resolution(opts->shadow_maps);
+	header.reserved = 0;
+
+	checkpoint * ckpt = (checkpoint *) malloc(sizeof(checkpoint));
+	ckpt->path = path;
+	ckpt->interval = interval;
+	ckpt->closing = 0;
+	ckpt->failed = 0;
+	ckpt->opts = opts;
+	ckpt->head = NULL;
+	ckpt->tail = NULL;
+	opts->tile_done = (char *) calloc(get_tile_count(opts), sizeof(char));
+
+	ckpt->fd = resume ? open(path, O_RDWR) : -1;
+	if (ckpt->fd >= 0)
+	{
+		if (!load_checkpoint(ckpt, &header, pixels))
+		{
+			close(ckpt->fd);
+			free(opts->tile_done);
+			opts->tile_done = NULL;
+			free(ckpt);
+			return NULL;
+		}
+	}
+	else
+	{
+		ckpt->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (ckpt->fd < 0 || !write_all(ckpt->fd, &header, sizeof(header)) || fdatasync(ckpt->fd))
+		{
+			snprintf(g_ckpt_err, LEN_ERROR, "Could not create checkpoint file '%s': %s\n", path, strerror(errno));
+			if (ckpt->fd >= 0)
+			{
+				close(ckpt->fd);
+			}
+			free(opts->tile_done);
+			opts->tile_done = NULL;
+			free(ckpt);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&ckpt->lock, NULL);
+	pthread_cond_init(&ckpt->cond, NULL);
+	pthread_create(&ckpt->thread, NULL, checkpoint_thread, ckpt);
+	opts->on_tile = checkpoint_tile;
+	opts->on_tile_ctx = ckpt;
+	return ckpt;
+}
+
+int load_checkpoint(checkpoint * ckpt, checkpoint_header * expected, color * pixels)
+{
+	render_opts * opts = ckpt->opts;
+	checkpoint_header header;
+	if (read(ckpt->fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, expected->magic, sizeof(header.magic)))
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "'%s' is not a checkpoint file\n", ckpt->path);
+		return 0;
+	}
+	if (header.scene_hash != expected->scene_hash)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made from a different scene\n", ckpt->path);
+		return 0;
+	}
+	if (header.res_x != expected->res_x || header.res_y != expected->res_y ||
+		header.tile_size != expected->tile_size || header.depth != expected->depth)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made at %dx%d with depth %d, not %dx%d with depth %d\n", ckpt->path,
+			header.res_x, header.res_y, header.depth, expected->res_x, expected->res_y, expected->depth);
+		return 0;
+	}
+	if (header.crop_x0 != expected->crop_x0 || header.crop_y0 != expected->crop_y0 ||
+		header.crop_x1 != expected->crop_x1 || header.crop_y1 != expected->crop_y1)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made with a different crop window\n", ckpt->path);
+		return 0;
+	}
+	if (header.aa_samples != expected->aa_samples)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made with up to %d samples per pixel, not %d\n", ckpt->path,
+			header.aa_samples, expected->aa_samples);
+		return 0;
+	}
+	if (header.light_samples != expected->light_samples || header.area_samples != expected->area_samples ||
+		header.area_adaptive != expected->area_adaptive)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made with different light sampling settings\n", ckpt->path);
+		return 0;
+	}
+	if (header.shadow_map_size != expected->shadow_map_size)
+	{
+		char made[32], wanted[32];
+		snprintf(made, sizeof(made), header.shadow_map_size ? "shadow maps of %d texels" : "exact shadows",
+			header.shadow_map_size);
+		snprintf(wanted, sizeof(wanted), expected->shadow_map_size ? "shadow maps of %d texels" : "exact shadows",
+			expected->shadow_map_size);
+		snprintf(g_ckpt_err, LEN_ERROR, "Checkpoint '%s' was made with %s, not %s\n", ckpt->path, made, wanted);
+		return 0;
+	}
+
+	int tile_count = get_tile_count(opts);
+	double * data = (double *) malloc(sizeof(double) * 3 * opts->tile_size * opts->tile_size);
+	off_t good_end = sizeof(header);
+	int loaded = 0;
+	tile_record record;
+	tile t;
+	while (read(ckpt->fd, &record, sizeof(record)) == sizeof(record))
+	{
+		if (record.magic != RECORD_MAGIC || record.index < 0 || record.index >= tile_count)
+		{
+			break;
+		}
+		get_tile(opts, record.index, &t);
+		if (record.pixel_count != (t.x1 - t.x0) * (t.y1 - t.y0))
+		{
+			break;
+		}
+		size_t len = sizeof(double) * 3 * record.pixel_count;
+		if (read(ckpt->fd, data, len) != (ssize_t) len || record_checksum(&record, data) != record.checksum)
+		{
+			break;
+		}
+		int x, y, p = 0;
+		for (y = t.y0; y < t.y1; y++)
+		{
+			for (x = t.x0; x < t.x1; x++)
+			{
+				color * c = &pixels[y * opts->res_x + x];
+				c->r = data[p++];
+				c->g = data[p++];
+				c->b = data[p++];
+			}
+		}
+		if (!opts->tile_done[record.index])
+		{
+			opts->tile_done[record.index] = 1;
+			loaded++;
+		}
+		good_end += sizeof(record) + len;
+	}
+	free(data);
+	//anything after the last good record was torn by a crash
+	if (ftruncate(ckpt->fd, good_end) || lseek(ckpt->fd, good_end, SEEK_SET) != good_end)
+	{
+		snprintf(g_ckpt_err, LEN_ERROR, "Could not repair checkpoint '%s': %s\n", ckpt->path, strerror(errno));
+		return 0;
+	}
+	if (opts->verbose)
+	{
+		printf("Resuming with %d of %d tiles from '%s'\n", loaded, tile_count, ckpt->path);
+	}
+	return 1;
+}
+
+void checkpoint_tile(void * ctx, tile * t, color * pixels, int res_x)
+{
+	checkpoint * ckpt = (checkpoint *) ctx;
+	pending_tile * pending = (pending_tile *) malloc(sizeof(pending_tile));
+	pending->record.magic = RECORD_MAGIC;
+	pending->record.index = t->index;
+	pending->record.pixel_count = (t->x1 - t->x0) * (t->y1 - t->y0);
+	pending->record.reserved = 0;
+	pending->data = (double *) malloc(sizeof(double) * 3 * pending->record.pixel_count);
+	pending->next = NULL;
+	int x, y, p = 0;
+	for (y = t->y0; y < t->y1; y++)
+	{
+		for (x = t->x0; x < t->x1; x++)
+		{
+			color * c = &pixels[y * res_x + x];
+			pending->data[p++] = c->r;
+			pending->data[p++] = c->g;
+			pending->data[p++] = c->b;
+		}
+	}
+	pending->record.checksum = record_checksum(&pending->record, pending->data);
+
+	pthread_mutex_lock(&ckpt->lock);
+	if (ckpt->tail)
+	{
+		ckpt->tail->next = pending;
+	}
+	else
+	{
+		ckpt->head = pending;
+	}
+	ckpt->tail = pending;
+	pthread_cond_signal(&ckpt->cond);
+	pthread_mutex_unlock(&ckpt->lock);
+}
+
+void * checkpoint_thread(void * arg)
+{
+	checkpoint * ckpt = (checkpoint *) arg;
+	struct timespec last_sync, now, wake;
+	clock_gettime(CLOCK_REALTIME, &last_sync);
+	int unsynced = 0;
+	pthread_mutex_lock(&ckpt->lock);
+	while (1)
+	{
+		while (!ckpt->head && !ckpt->closing)
+		{
+			wake = last_sync;
+			wake.tv_sec += ckpt->interval;
+			if (pthread_cond_timedwait(&ckpt->cond, &ckpt->lock, &wake) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+		pending_tile * pending = ckpt->head;
+		ckpt->head = NULL;
+		ckpt->tail = NULL;
+		int closing = ckpt->closing;
+		pthread_mutex_unlock(&ckpt->lock);
+
+		while (pending)
+		{
+			pending_tile * next = pending->next;
+			size_t len = sizeof(double) * 3 * pending->record.pixel_count;
+			if (!write_all(ckpt->fd, &pending->record, sizeof(tile_record)) || !write_all(ckpt->fd, pending->data, len))
+			{
+				ckpt->failed = 1;
+			}
+			unsynced = 1;
+			free(pending->data);
+			free(pending);
+			pending = next;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (unsynced && (closing || now.tv_sec - last_sync.tv_sec >= ckpt->interval))
+		{
+			if (fdatasync(ckpt->fd))
+			{
+				ckpt->failed = 1;
+			}
+			unsynced = 0;
+			last_sync = now;
+		}
+		else if (!unsynced)
+		{
+			last_sync = now;
+		}
+
+		pthread_mutex_lock(&ckpt->lock);
+		if (closing && !ckpt->head)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ckpt->lock);
+	return NULL;
+}
+
+int checkpoint_close(checkpoint * ckpt, int remove_file)
+{
+	pthread_mutex_lock(&ckpt->lock);
+	ckpt->closing = 1;
+	pthread_cond_signal(&ckpt->cond);
+	pthread_mutex_unlock(&ckpt->lock);
+	pthread_join(ckpt->thread, NULL);
+	pthread_mutex_destroy(&ckpt->lock);
+	pthread_cond_destroy(&ckpt->cond);
+
+	int ok = !ckpt->failed;
+	close(ckpt->fd);
+	if (remove_file)
+	{
+		unlink(ckpt->path);
+	}
+	ckpt->opts->on_tile = NULL;
+	ckpt->opts->on_tile_ctx = NULL;
+	free(ckpt->opts->tile_done);
+	ckpt->opts->tile_done = NULL;
+	free(ckpt);
+	return ok;
+}
+
+unsigned long long record_checksum(tile_record * record, double * data)
+{
+	unsigned long long h = HASH_INIT;
+	h = hash_bytes(h, &record->index, sizeof(int));
+	h = hash_bytes(h, &record->pixel_count, sizeof(int));
+	return hash_bytes(h, data, sizeof(double) * 3 * record->pixel_count);
+}
+
+int write_all(int fd, void * buf, size_t len)
+{
+	char * p = (char *) buf;
+	while (len > 0)
+	{
+		ssize_t written = write(fd, p, len);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 0;
+		}
+		p += written;
+		len -= written;
+	}
+	return 1;
+}
+
+char * get_checkpoint_error()
+{
+	return g_ckpt_err;
+}
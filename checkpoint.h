@@ -0,0 +1,55 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "ray.h"
+
+/**
+* an open checkpoint file and the background thread that appends finished tiles to it
+*/
+typedef struct checkpoint checkpoint;
+
+/**
+* Opens a checkpoint file and hooks it into the render options, so every finished tile gets saved.
+* When resuming, the tiles already in the file are copied into pixels and marked done in opts->tile_done.
+* A missing file when resuming just starts a new checkpoint
+*
+* @param char * path the location of the checkpoint file
+* @param unsigned long long scn_hash the hash of the scene being rendered, from scene_hash
+* @param render_opts * opts the render options. Must not change until the checkpoint is closed
+* @param color * pixels the framebuffer
+* @param int resume 0 to start over, positive number to continue from the tiles already in the file
+* @param int interval the most seconds that finished tiles may wait before being synced to disk
+*
+* @return checkpoint * the open checkpoint, NULL if it fails
+*/
+checkpoint * checkpoint_open(char * path, unsigned long long scn_hash, render_opts * opts, color * pixels, int resume, int interval);
+
+/**
+* Queues a finished tile to be written. Matches tile_callback, so it can be called from any render thread.
+* Only copies the pixels, the writing happens on the checkpoint thread
+*
+* @param void * ctx the checkpoint
+* @param tile * t the finished tile
+* @param color * pixels the framebuffer
+* @param int res_x the width of the framebuffer
+*/
+void checkpoint_tile(void * ctx, tile * t, color * pixels, int res_x);
+
+/**
+* Writes out every queued tile, stops the checkpoint thread and frees the checkpoint
+*
+* @param checkpoint * ckpt the checkpoint
+* @param int remove_file positive number to delete the file, once the render it protects has been written
+*
+* @return int 0 if any tile failed to be written, positive number if it succeeds
+*/
+int checkpoint_close(checkpoint * ckpt, int remove_file);
+
+/**
+* Used to check what error occured when checkpoint_open fails
+*
+* @return char * a description of the error. Not malloc'd
+*/
+char * get_checkpoint_error();
+
+#endif
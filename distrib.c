@@ -0,0 +1,700 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "distrib.h"
+
+#define LEN_ERROR 256
+#define MAX_OUTSTANDING 2
+//the largest image width, height or tile size a worker accepts, so that pixel indices fit in an int
+#define MAX_JOB_SIZE 32768
+
+/**
+* message types. Coordinator to worker: SCENE once, then TILE until DONE. Worker to coordinator: RESULT for every TILE
+*/
+#define MSG_SCENE 1
+#define MSG_TILE 2
+#define MSG_RESULT 3
+#define MSG_DONE 4
+
+/**
+* sent in front of every message. len is 64 bits wide since a packed scene can be larger than 4 GB
+*/
+typedef struct
+{
+	unsigned int type;
+	unsigned long long len;
+} msg_header;
+
+/**
+* the render options a worker needs to find tile bounds and sample lights. Sent in front of the packed scene
+*/
+typedef struct
+{
+	int res_x;
+	int res_y;
+	int depth;
+	int tile_size;
+	int crop_x0;
+	int crop_y0;
+	int crop_x1;
+	int crop_y1;
+	int light_samples;
+	int area_samples;
+	int area_adaptive;
+} job_settings;
+
+/**
+* sent in front of the pixels of a finished tile
+*/
+typedef struct
+{
+	int index;
+	int pixel_count;
+} result_header;
+
+/**
+* the coordinator's view of one worker. pid is 0 for workers that connected over TCP
+*/
+typedef struct
+{
+	int fd;
+	pid_t pid;
+	int alive;
+	int tiles_done;
+	int outstanding[MAX_OUTSTANDING];
+	int outstanding_count;
+} worker;
+
+/**
+* everything the coordinator keeps track of during a distributed render
+*/
+typedef struct
+{
+	scene * scn;
+	color * pixels;
+	render_opts * opts;
+	void * packed_scene;
+	size_t packed_len;
+	worker * workers;
+	int worker_count;
+	int worker_cap;
+	int * pending;
+	int pending_count;
+	int remaining;
+	int reassigned;
+	int listen_fd;
+} coordinator;
+
+char g_distrib_err[LEN_ERROR];
+
+/**
+* Send or receive a whole buffer, retrying short transfers
+*
+* @param int fd the socket
+* @param void * buf the data
+* @param size_t len the length of buf
+*
+* @return int 0 if the connection failed, positive number if it succeeds
+*/
+int send_all(int fd, void * buf, size_t len);
+int recv_all(int fd, void * buf, size_t len);
+
+/**
+* Sends a message made of a header, a fixed part and an optional second part
+*
+* @param int fd the socket
+* @param unsigned int type the message type
+* @param void * part1 the first part of the message
+* @param size_t len1 the length of part1
+* @param void * part2 the second part of the message, may be NULL
+* @param size_t len2 the length of part2
+*
+* @return int 0 if the connection failed, positive number if it succeeds
+*/
+int send_msg(int fd, unsigned int type, void * part1, size_t len1, void * part2, size_t len2);
+
+/**
+* Checks that the settings a worker received describe an image it can render
+*
+* @param job_settings * settings the settings
+*
+* @return int 0 if a size or the crop is out of range, positive number if they are valid
+*/
+int valid_settings(job_settings * settings);
+
+/**
+* Starts a worker process connected to the coordinator by a Unix domain socket pair
+*
+* @param coordinator * co the coordinator
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int spawn_local_worker(coordinator * co);
+
+/**
+* Adds a connected worker and sends it the scene
+*
+* @param coordinator * co the coordinator
+* @param int fd the socket
+* @param pid_t pid the process id of a local worker, 0 for a remote one
+*
+* @return int 0 if the scene couldn't be sent, positive number if it succeeds
+*/
+int add_worker(coordinator * co, int fd, pid_t pid);
+
+/**
+* Closes a worker that failed and puts the tiles it held back in the queue
+*
+* @param coordinator * co the coordinator
+* @param worker * w the worker
+*/
+void drop_worker(coordinator * co, worker * w);
+
+/**
+* Reads a finished tile from a worker into the framebuffer
+*
+* @param coordinator * co the coordinator
+* @param worker * w the worker with a message waiting
+*
+* @return int 0 if the worker failed, positive number if it succeeds
+*/
+int receive_result(coordinator * co, worker * w);
+
+/**
+* Renders tiles sent by a coordinator until it says it is done
+*
+* @param int fd the socket connected to the coordinator
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int run_worker(int fd);
+
+int distributed_ray_trace(scene * scn, color * pixels, render_opts * opts, int local_workers, int listen_port)
+{
+	//a worker dying must not kill the coordinator while it is sending to it
+	signal(SIGPIPE, SIG_IGN);
+	coordinator co;
+	co.scn = scn;
+	co.pixels = pixels;
+	co.opts = opts;
+	co.packed_scene = serialize_scene(scn, &co.packed_len);
+	co.worker_count = 0;
+	co.worker_cap = local_workers > 0 ? local_workers : 4;
+	co.workers = (worker *) malloc(sizeof(worker) * co.worker_cap);
+	co.reassigned = 0;
+
+	int tile_count = get_tile_count(opts);
+	co.pending = (int *) malloc(sizeof(int) * tile_count);
+	co.pending_count = 0;
+	int i;
+	tile t;
+	//the queue is used as a stack, so push the last tile first to hand them out from the top of the image
+	for (i = tile_count - 1; i >= 0; i--)
+	{
+		get_tile(opts, i, &t);
+		if ((opts->tile_done && opts->tile_done[i]) || t.x0 == t.x1 || t.y0 == t.y1)
+		{
+			continue;
+		}
+		co.pending[co.pending_count++] = i;
+	}
+	co.remaining = co.pending_count;
+
+	int listen_fd = -1;
+	co.listen_fd = -1;
+	if (listen_port)
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(listen_port);
+		int yes = 1;
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+			bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(listen_fd, 16))
+		{
+			snprintf(g_distrib_err, LEN_ERROR, "Could not listen on port %d: %s\n", listen_port, strerror(errno));
+			if (listen_fd >= 0)
+			{
+				close(listen_fd);
+			}
+			free(co.pending);
+			free(co.workers);
+			free(co.packed_scene);
+			return 0;
+		}
+		co.listen_fd = listen_fd;
+	}
+	for (i = 0; i < local_workers; i++)
+	{
+		if (!spawn_local_worker(&co))
+		{
+			break;
+		}
+	}
+
+	struct pollfd * fds = NULL;
+	int * fd_worker = NULL;
+	while (co.remaining > 0)
+	{
+		int alive = 0;
+		for (i = 0; i < co.worker_count; i++)
+		{
+			worker * w = &co.workers[i];
+			while (w->alive && w->outstanding_count < MAX_OUTSTANDING && co.pending_count > 0)
+			{
+				int index = co.pending[--co.pending_count];
+				w->outstanding[w->outstanding_count++] = index;
+				if (!send_msg(w->fd, MSG_TILE, &index, sizeof(int), NULL, 0))
+				{
+					drop_worker(&co, w);
+				}
+			}
+			alive += w->alive;
+		}
+		if (!alive && listen_fd < 0)
+		{
+			break;
+		}
+
+		fds = (struct pollfd *) realloc(fds, sizeof(struct pollfd) * (co.worker_count + 1));
+		fd_worker = (int *) realloc(fd_worker, sizeof(int) * (co.worker_count + 1));
+		int nfds = 0;
+		for (i = 0; i < co.worker_count; i++)
+		{
+			if (co.workers[i].alive)
+			{
+				fds[nfds].fd = co.workers[i].fd;
+				fds[nfds].events = POLLIN;
+				fd_worker[nfds] = i;
+				nfds++;
+			}
+		}
+		if (listen_fd >= 0)
+		{
+			fds[nfds].fd = listen_fd;
+			fds[nfds].events = POLLIN;
+			fd_worker[nfds] = -1;
+			nfds++;
+		}
+		if (poll(fds, nfds, -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		for (i = 0; i < nfds; i++)
+		{
+			if (!fds[i].revents)
+			{
+				continue;
+			}
+			if (fd_worker[i] < 0)
+			{
+				int fd = accept(listen_fd, NULL, NULL);
+				if (fd >= 0)
+				{
+					add_worker(&co, fd, 0);
+				}
+			}
+			else if (!receive_result(&co, &co.workers[fd_worker[i]]))
+			{
+				drop_worker(&co, &co.workers[fd_worker[i]]);
+			}
+		}
+	}
+	free(fds);
+	free(fd_worker);
+
+	for (i = 0; i < co.worker_count; i++)
+	{
+		worker * w = &co.workers[i];
+		if (w->alive)
+		{
+			send_msg(w->fd, MSG_DONE, NULL, 0, NULL, 0);
+			close(w->fd);
+		}
+		if (w->pid)
+		{
+			waitpid(w->pid, NULL, 0);
+		}
+		if (opts->verbose)
+		{
+			printf("Worker %d (%s) rendered %d tiles%s\n", i, w->pid ? "local" : "remote", w->tiles_done, w->alive ? "" : " before it failed");
+		}
+	}
+	if (listen_fd >= 0)
+	{
+		close(listen_fd);
+	}
+	if (opts->verbose && co.reassigned)
+	{
+		printf("%d tiles were reassigned from failed workers\n", co.reassigned);
+	}
+
+	int ok = 1;
+	if (co.remaining > 0)
+	{
+		//every worker failed, so finish whatever is left here
+		printf("Warning: no workers left, rendering the remaining %d tiles locally\n", co.remaining);
+		char * tile_done = opts->tile_done;
+		char * left = (char *) calloc(tile_count, sizeof(char));
+		for (i = 0; i < tile_count; i++)
+		{
+			left[i] = 1;
+		}
+		for (i = 0; i < co.pending_count; i++)
+		{
+			left[co.pending[i]] = 0;
+		}
+		opts->tile_done = left;
+		ok = ray_trace(scn, pixels, opts);
+		opts->tile_done = tile_done;
+		free(left);
+	}
+	free(co.pending);
+	free(co.workers);
+	free(co.packed_scene);
+	return ok;
+}
+
+int spawn_local_worker(coordinator * co)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		return 0;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return 0;
+	}
+	if (pid == 0)
+	{
+		//the worker must not hold the other workers' sockets open, or their deaths would go unnoticed
+		int i;
+		for (i = 0; i < co->worker_count; i++)
+		{
+			if (co->workers[i].alive)
+			{
+				close(co->workers[i].fd);
+			}
+		}
+		if (co->listen_fd >= 0)
+		{
+			close(co->listen_fd);
+		}
+		close(sv[0]);
+		_exit(run_worker(sv[1]) ? 0 : 1);
+	}
+	close(sv[1]);
+	if (!add_worker(co, sv[0], pid))
+	{
+		kill(pid, SIGKILL);
+		return 0;
+	}
+	return 1;
+}
+
+int add_worker(coordinator * co, int fd, pid_t pid)
+{
+	if (co->worker_count == co->worker_cap)
+	{
+		co->worker_cap *= 2;
+		co->workers = (worker *) realloc(co->workers, sizeof(worker) * co->worker_cap);
+	}
+	worker * w = &co->workers[co->worker_count++];
+	w->fd = fd;
+	w->pid = pid;
+	w->alive = 1;
+	w->tiles_done = 0;
+	w->outstanding_count = 0;
+
+	job_settings settings;
+	settings.res_x = co->opts->res_x;
+	settings.res_y = co->opts->res_y;
+	settings.depth = co->opts->depth;
+	settings.tile_size = co->opts->tile_size;
+	settings.crop_x0 = co->opts->crop_x0;
+	settings.crop_y0 = co->opts->crop_y0;
+	settings.crop_x1 = co->opts->crop_x1;
+	settings.crop_y1 = co->opts->crop_y1;
+	settings.light_samples = co->opts->light_samples;
+	settings.area_samples = co->opts->area_samples;
+	settings.area_adaptive = co->opts->area_adaptive;
+	if (!send_msg(fd, MSG_SCENE, &settings, sizeof(settings), co->packed_scene, co->packed_len))
+	{
+		drop_worker(co, w);
+		return 0;
+	}
+	return 1;
+}
+
+void drop_worker(coordinator * co, worker * w)
+{
+	if (!w->alive)
+	{
+		return;
+	}
+	int i;
+	for (i = 0; i < w->outstanding_count; i++)
+	{
+		co->pending[co->pending_count++] = w->outstanding[i];
+		co->reassigned++;
+	}
+	w->outstanding_count = 0;
+	w->alive = 0;
+	close(w->fd);
+}
+
+int receive_result(coordinator * co, worker * w)
+{
+	msg_header header;
+	result_header result;
+	if (!recv_all(w->fd, &header, sizeof(header)) || header.type != MSG_RESULT || header.len < sizeof(result) ||
+		!recv_all(w->fd, &result, sizeof(result)))
+	{
+		return 0;
+	}
+	int i, slot = -1;
+	for (i = 0; i < w->outstanding_count; i++)
+	{
+		if (w->outstanding[i] == result.index)
+		{
+			slot = i;
+		}
+	}
+	tile t;
+	if (slot < 0)
+	{
+		return 0;
+	}
+	get_tile(co->opts, result.index, &t);
+	if (result.pixel_count != (t.x1 - t.x0) * (t.y1 - t.y0) || header.len != sizeof(result) + sizeof(color) * result.pixel_count)
+	{
+		return 0;
+	}
+	int y;
+	for (y = t.y0; y < t.y1; y++)
+	{
+		if (!recv_all(w->fd, &co->pixels[y * co->opts->res_x + t.x0], sizeof(color) * (t.x1 - t.x0)))
+		{
+			return 0;
+		}
+	}
+	w->outstanding[slot] = w->outstanding[--w->outstanding_count];
+	w->tiles_done++;
+	co->remaining--;
+	if (co->opts->on_tile)
+	{
+		co->opts->on_tile(co->opts->on_tile_ctx, &t, co->pixels, co->opts->res_x);
+	}
+	return 1;
+}
+
+int run_worker(int fd)
+{
+	msg_header header;
+	job_settings settings;
+	if (!recv_all(fd, &header, sizeof(header)) || header.type != MSG_SCENE || header.len < sizeof(settings) ||
+		!recv_all(fd, &settings, sizeof(settings)) || !valid_settings(&settings))
+	{
+		close(fd);
+		return 0;
+	}
+	size_t packed_len = header.len - sizeof(settings);
+	void * packed = malloc(packed_len);
+	scene * scn = (scene *) malloc(sizeof(scene));
+	if (!packed || !recv_all(fd, packed, packed_len) || !deserialize_scene(packed, packed_len, scn))
+	{
+		free(packed);
+		free(scn);
+		close(fd);
+		return 0;
+	}
+	free(packed);
+
+	render_opts opts;
+	init_render_opts(&opts, settings.res_x, settings.res_y);
+	opts.depth = settings.depth;
+	opts.tile_size = settings.tile_size;
+	opts.crop_x0 = settings.crop_x0;
+	opts.crop_y0 = settings.crop_y0;
+	opts.crop_x1 = settings.crop_x1;
+	opts.crop_y1 = settings.crop_y1;
+	opts.light_samples = settings.light_samples;
+	opts.area_samples = settings.area_samples;
+	opts.area_adaptive = settings.area_adaptive;
+	//one tree for every tile of the job, like ray_trace builds for a whole image
+	opts.light_tree = opts.light_samples ? build_light_tree(scn) : NULL;
+	color * pixels = (color *) malloc(sizeof(color) * (size_t) opts.res_x * opts.res_y);
+	color * tile_pixels = (color *) malloc(sizeof(color) * (size_t) opts.tile_size * opts.tile_size);
+
+	int ok = 0;
+	int index;
+	int tile_count = get_tile_count(&opts);
+	tile t;
+	while (pixels && tile_pixels && recv_all(fd, &header, sizeof(header)))
+	{
+		if (header.type == MSG_DONE)
+		{
+			ok = 1;
+			break;
+		}
+		if (header.type != MSG_TILE || header.len != sizeof(int) || !recv_all(fd, &index, sizeof(int)) ||
+			index < 0 || index >= tile_count)
+		{
+			break;
+		}
+		get_tile(&opts, index, &t);
+		trace_tile(scn, &opts, &t, pixels, NULL);
+		int x, y, p = 0;
+		for (y = t.y0; y < t.y1; y++)
+		{
+			for (x = t.x0; x < t.x1; x++)
+			{
+				tile_pixels[p++] = pixels[y * opts.res_x + x];
+			}
+		}
+		result_header result;
+		result.index = index;
+		result.pixel_count = p;
+		if (!send_msg(fd, MSG_RESULT, &result, sizeof(result), tile_pixels, sizeof(color) * p))
+		{
+			break;
+		}
+	}
+	free(tile_pixels);
+	free(pixels);
+	destroy_light_tree(opts.light_tree);
+	destroy_scene(scn);
+	close(fd);
+	return ok;
+}
+
+int run_remote_worker(char * address)
+{
+	char host[256];
+	char * colon = strrchr(address, ':');
+	if (!colon || colon == address || colon - address >= (int) sizeof(host))
+	{
+		snprintf(g_distrib_err, LEN_ERROR, "Coordinator address must be host:port, was '%s'\n", address);
+		return 0;
+	}
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+
+	struct addrinfo hints, * res, * ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &res))
+	{
+		snprintf(g_distrib_err, LEN_ERROR, "Could not resolve coordinator '%s'\n", address);
+		return 0;
+	}
+	int fd = -1;
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd >= 0 && !connect(fd, ai->ai_addr, ai->ai_addrlen))
+		{
+			break;
+		}
+		if (fd >= 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+	{
+		snprintf(g_distrib_err, LEN_ERROR, "Could not connect to coordinator '%s'\n", address);
+		return 0;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (!run_worker(fd))
+	{
+		snprintf(g_distrib_err, LEN_ERROR, "Lost connection to coordinator '%s'\n", address);
+		return 0;
+	}
+	return 1;
+}
+
+int valid_settings(job_settings * settings)
+{
+	return settings->res_x > 0 && settings->res_y > 0 && settings->res_x <= MAX_JOB_SIZE && settings->res_y <= MAX_JOB_SIZE &&
+		settings->tile_size > 0 && settings->tile_size <= MAX_JOB_SIZE && settings->depth >= 0 &&
+		settings->crop_x0 >= 0 && settings->crop_y0 >= 0 && settings->crop_x0 <= settings->crop_x1 &&
+		settings->crop_y0 <= settings->crop_y1 && settings->crop_x1 <= settings->res_x && settings->crop_y1 <= settings->res_y &&
+		settings->light_samples >= 0 && settings->area_samples >= 0;
+}
+
+int send_msg(int fd, unsigned int type, void * part1, size_t len1, void * part2, size_t len2)
+{
+	msg_header header;
+	header.type = type;
+	header.len = len1 + len2;
+	return send_all(fd, &header, sizeof(header)) && (!len1 || send_all(fd, part1, len1)) && (!len2 || send_all(fd, part2, len2));
+}
+
+int send_all(int fd, void * buf, size_t len)
+{
+	char * p = (char *) buf;
+	while (len > 0)
+	{
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return 0;
+		}
+		p += sent;
+		len -= sent;
+	}
+	return 1;
+}
+
+int recv_all(int fd, void * buf, size_t len)
+{
+	char * p = (char *) buf;
+	while (len > 0)
+	{
+		ssize_t received = recv(fd, p, len, 0);
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (received <= 0)
+		{
+			return 0;
+		}
+		p += received;
+		len -= received;
+	}
+	return 1;
+}
+
+char * get_distrib_error()
+{
+	return g_distrib_err;
+}
@@ -0,0 +1,38 @@
+#ifndef DISTRIB_H_
+#define DISTRIB_H_
+
+#include "ray.h"
+
+/**
+* Creates a raytraced image by handing tiles out to worker processes instead of render threads.
+* The scene is sent to each worker once, then tiles are given out one or two at a time as workers finish them.
+* Tiles held by a worker that dies are given to another one, and if every worker is gone the rest of the image
+* is rendered in this process. Takes the same options as ray_trace, including tile_done and on_tile
+*
+* @param scene * scn the scene to draw
+* @param color * pixels where to insert the result, res_x * res_y colors
+* @param render_opts * opts the render options
+* @param int local_workers the number of worker processes to start on this machine
+* @param int listen_port TCP port on which to accept workers started with run_remote_worker, 0 for none
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int distributed_ray_trace(scene * scn, color * pixels, render_opts * opts, int local_workers, int listen_port);
+
+/**
+* Connects to a coordinator running distributed_ray_trace and renders the tiles it sends until it is done
+*
+* @param char * address the coordinator, as host:port
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int run_remote_worker(char * address);
+
+/**
+* Used to check what error occured when a function fails
+*
+* @return char * a description of the error. Not malloc'd
+*/
+char * get_distrib_error();
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sequence.h"
+#include "image.h"
+
+#define LEN_PATH 4096
+
+/**
+* Checks that an output pattern is safe to give printf with the frame number: exactly one conversion for an int
+* (d, i, u, o, x or X, with flags, a width and a precision) and nothing else but %% for a percent sign
+*
+* @param char * pattern the pattern
+*
+* @return int 0 if it isn't, positive number if it is
+*/
+int valid_pattern(char * pattern);
+
+int main(int argc, char * argv[])
+{
+	char * sequence_path = NULL;
+	char * out_pattern = "frame%04d.ppm";
+	int frame = -1;
+	int list = 0;
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--frame") && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+		{
+			frame = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+		{
+			out_pattern = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--list"))
+		{
+			list = 1;
+		}
+		else if (argv[i][0] != '-' && !sequence_path)
+		{
+			sequence_path = argv[i];
+		}
+		else
+		{
+			sequence_path = NULL;
+			break;
+		}
+	}
+	if (sequence_path && !valid_pattern(out_pattern))
+	{
+		printf("The output pattern '%s' needs exactly one %%d for the frame number, and %%%% for a percent sign\n",
+			out_pattern);
+		return -1;
+	}
+	if (!sequence_path)
+	{
+		printf("Usage: %s <sequence> [--frame N] [--output PATTERN] [--list]\n", argv[0]);
+		printf("Writes every frame, or frame N, to PATTERN with the frame number put in by printf, frame%%04d.ppm by default\n");
+		printf("--list prints how many tiles every frame stores instead\n");
+		return -1;
+	}
+
+	sequence_reader * reader = sequence_open(sequence_path);
+	if (!reader)
+	{
+		printf("%s", get_sequence_error());
+		return -1;
+	}
+	int width, height, frame_count, keyframe_interval;
+	sequence_info(reader, &width, &height, &frame_count, &keyframe_interval);
+	if (list)
+	{
+		printf("%d frames of %dx%d, a keyframe every %d frames\n", frame_count, width, height, keyframe_interval);
+		for (i = 0; i < frame_count; i++)
+		{
+			int tiles;
+			int stored = sequence_frame_tiles(reader, i, &tiles);
+			printf("Frame %d: %d of %d tiles\n", i, stored, tiles);
+		}
+		sequence_close(reader);
+		return 0;
+	}
+	if (frame >= frame_count)
+	{
+		printf("The sequence has no frame %d, only %d frames\n", frame, frame_count);
+		sequence_close(reader);
+		return -1;
+	}
+
+	int * channels = (int *) malloc(sizeof(int) * 3 * (size_t) width * height);
+	if (!channels)
+	{
+		printf("Not enough memory for a %dx%d frame\n", width, height);
+		sequence_close(reader);
+		return -1;
+	}
+	int first = frame < 0 ? 0 : frame;
+	int last = frame < 0 ? frame_count - 1 : frame;
+	int ok = 1;
+	for (i = first; i <= last && ok; i++)
+	{
+		char path[LEN_PATH];
+		if (snprintf(path, sizeof(path), out_pattern, i) >= (int) sizeof(path))
+		{
+			printf("The output path for frame %d is too long\n", i);
+			ok = 0;
+		}
+		else if (!sequence_read_frame(reader, i, channels))
+		{
+			printf("%s", get_sequence_error());
+			ok = 0;
+		}
+		else if (!write_ppm_channels(path, channels, width, height))
+		{
+			printf("Could not write image to '%s'\n", path);
+			ok = 0;
+		}
+	}
+	if (ok)
+	{
+		printf("Wrote %d frames\n", last - first + 1);
+	}
+	free(channels);
+	sequence_close(reader);
+	return ok ? 0 : -1;
+}
+
+int valid_pattern(char * pattern)
+{
+	int conversions = 0;
+	char * p;
+	for (p = pattern; *p; p++)
+	{
+		if (*p != '%')
+		{
+			continue;
+		}
+		if (*++p == '%')
+		{
+			continue;
+		}
+		p += strspn(p, "-+ #0");
+		p += strspn(p, "0123456789");
+		if (*p == '.')
+		{
+			p++;
+			p += strspn(p, "0123456789");
+		}
+		if (!*p || !strchr("diouxX", *p))
+		{
+			return 0;
+		}
+		conversions++;
+	}
+	return conversions == 1;
+}
@@ -2,16 +2,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "fparser.h"
 #include "strfuncs.h"
+#include "particles.h"
 
 #define LEN_ERROR 256
+#define LEN_LINE 1024
 
 char * g_parse_err;
 int g_err_line_num = 0;
-int g_light_count = 0;
-int g_sphere_count = 0;
-int g_triangle_count = 0;
+long long g_light_count = 0;
+long long g_sphere_count = 0;
+long long g_triangle_count = 0;
+long long g_point_light_count = 0;
+long long g_area_light_count = 0;
+long long g_cloud_count = 0;
+//the file being parsed, which particle files are found relative to
+char * g_parse_path = NULL;
 
 /**
 * Does a preliminary check to calculate the intial memory required for lights, spheres, and triangles
@@ -43,8 +51,11 @@ int parse_line(char * line, int line_num, scene * scn);
 */
 int parse_fov(char ** strs, int w_count, scene * scn);
 int parse_light(char ** strs, int w_count, scene * scn);
+int parse_point_light(char ** strs, int w_count, scene * scn);
+int parse_area_light(char ** strs, int w_count, scene * scn);
 int parse_sphere(char ** strs, int w_count, scene * scn);
 int parse_triangle(char ** strs, int w_count, scene * scn);
+int parse_cloud(char ** strs, int w_count, scene * scn);
 
 
 /**
@@ -77,26 +88,45 @@ int parse_file(char * file_path, scene * out_scene)
 	g_parse_err = (char *) malloc(LEN_ERROR);
 	if (!get_counts(file_path))
 	{
+		free(out_scene);
 		return 0;
 	}
 	FILE * f = fopen(file_path, "r");
 	if (!f)
 	{
 		snprintf(g_parse_err, LEN_ERROR, "Could not find ray trace file at '%s'\n", file_path);
+		free(out_scene);
 		return 0;
 	}
 	init_scene(out_scene, g_light_count, g_sphere_count, g_triangle_count);
+	if (g_point_light_count)
+	{
+		init_point_lights(out_scene, g_point_light_count);
+	}
+	if (g_area_light_count)
+	{
+		init_area_lights(out_scene, g_area_light_count);
+	}
+	if (g_cloud_count)
+	{
+		init_clouds(out_scene, g_cloud_count);
+	}
 	//now use counts to keep track of how many objects have been intialized
 	g_light_count = 0;
 	g_sphere_count = 0;
 	g_triangle_count = 0;
-	char line[128];
+	g_point_light_count = 0;
+	g_area_light_count = 0;
+	g_cloud_count = 0;
+	g_parse_path = file_path;
+	char line[LEN_LINE];
 	int line_num = 1;
 	while (fgets(line, sizeof(line), f))
 	{
 		if (!parse_line(line, line_num, out_scene))
 		{
 			g_err_line_num = line_num;
+			fclose(f);
 			destroy_scene_counts(out_scene, g_light_count, g_sphere_count, g_triangle_count);
 			return 0;
 		}
@@ -109,8 +139,15 @@ int parse_file(char * file_path, scene * out_scene)
 
 int get_counts(char * file_path)
 {
+	g_err_line_num = 0;
+	g_light_count = 0;
+	g_sphere_count = 0;
+	g_triangle_count = 0;
+	g_point_light_count = 0;
+	g_area_light_count = 0;
+	g_cloud_count = 0;
 	FILE * f = fopen(file_path, "r");
-	char line[128];
+	char line[LEN_LINE];
 	if (!f)
 	{
 		snprintf(g_parse_err, LEN_ERROR, "Could not find ray trace file at '%s'\n", file_path);
@@ -118,7 +155,12 @@ int get_counts(char * file_path)
 	}
 	while (fgets(line, sizeof(line), f))
 	{
-		char * word = substr(line, ' ');
+		char * start = line;
+		while (*start == ' ')
+		{
+			start++;
+		}
+		char * word = substr(start, ' ');
 		if (!strcmp(word, "DirectionToLight") || !strcmp(word, "LightColor"))
 		{
 			g_light_count++;
@@ -131,6 +173,18 @@ int get_counts(char * file_path)
 		{
 			g_triangle_count++;
 		}
+		else if (!strcmp(word, "PointLight"))
+		{
+			g_point_light_count++;
+		}
+		else if (!strcmp(word, "RectLight") || !strcmp(word, "DiskLight"))
+		{
+			g_area_light_count++;
+		}
+		else if (!strcmp(word, "ParticleCloud"))
+		{
+			g_cloud_count++;
+		}
 		free(word);
 	}
 	fclose(f);
@@ -161,68 +215,65 @@ int parse_line(char * line, int line_num, scene * scn)
 	}
 	int w_count;
 	char ** split_line = strsplit(line, ' ', &w_count);
-	if (!strcmp(split_line[0], "CameraLookAt"))
+	if (!w_count || split_line[0][0] == '#')
 	{
-		if (!parse_vec_d(split_line, w_count, &scn->cam->at))
+		int i;
+		for (i = 0; i < w_count; i++)
 		{
-			return 0;
+			free(split_line[i]);
 		}
+		free(split_line);
+		return 1;
+	}
+	//the words are freed whether the line parses or not
+	int ok = 1;
+	if (!strcmp(split_line[0], "CameraLookAt"))
+	{
+		ok = parse_vec_d(split_line, w_count, &scn->cam->at);
 	}
 	else if (!strcmp(split_line[0], "CameraLookFrom"))
 	{
-		if (!parse_vec_d(split_line, w_count, &scn->cam->from))
-		{
-			return 0;
-		}
+		ok = parse_vec_d(split_line, w_count, &scn->cam->from);
 	}
 	else if (!strcmp(split_line[0], "CameraLookUp"))
 	{
-		if (!parse_vec_d(split_line, w_count, &scn->cam->up))
-		{
-			return 0;
-		}
+		ok = parse_vec_d(split_line, w_count, &scn->cam->up);
 	}
 	else if (!strcmp(split_line[0], "FieldOfView"))
 	{
-		if (!parse_fov(split_line, w_count, scn))
-		{
-			return 0;
-		}
+		ok = parse_fov(split_line, w_count, scn);
 	}
 	else if (!strcmp(split_line[0], "AmbientLight"))
 	{
-		if (!parse_color(split_line, w_count, scn->amb_light))
-		{
-			return 0;
-		}
+		ok = parse_color(split_line, w_count, scn->amb_light);
 	}
 	else if (!strcmp(split_line[0], "BackgroundColor"))
 	{
-		if (!parse_color(split_line, w_count, scn->bg_color))
-		{
-			return 0;
-		}
+		ok = parse_color(split_line, w_count, scn->bg_color);
 	}
 	else if (!strcmp(split_line[0], "DirectionToLight") || !strcmp(split_line[0], "LightColor"))
 	{
-		if (!parse_light(split_line, w_count, scn))
-		{
-			return 0;
-		}
+		ok = parse_light(split_line, w_count, scn);
+	}
+	else if (!strcmp(split_line[0], "PointLight"))
+	{
+		ok = parse_point_light(split_line, w_count, scn);
+	}
+	else if (!strcmp(split_line[0], "RectLight") || !strcmp(split_line[0], "DiskLight"))
+	{
+		ok = parse_area_light(split_line, w_count, scn);
 	}
 	else if (!strcmp(split_line[0], "Sphere"))
 	{
-		if (!parse_sphere(split_line, w_count, scn))
-		{
-			return 0;
-		}
+		ok = parse_sphere(split_line, w_count, scn);
 	}
 	else if (!strcmp(split_line[0], "Triangle"))
 	{
-		if (!parse_triangle(split_line, w_count, scn))
-		{
-			return 0;
-		}
+		ok = parse_triangle(split_line, w_count, scn);
+	}
+	else if (!strcmp(split_line[0], "ParticleCloud"))
+	{
+		ok = parse_cloud(split_line, w_count, scn);
 	}
 	int i;
 	for (i = 0; i < w_count; i++)
@@ -230,7 +281,7 @@ int parse_line(char * line, int line_num, scene * scn)
 		free(split_line[i]);
 	}
 	free(split_line);
-	return 1;
+	return ok;
 }
 
 int parse_fov(char ** strs, int w_count, scene * scn)
@@ -279,6 +330,86 @@ int parse_light(char ** strs, int w_count, scene * scn)
 	g_light_count++;
 	return 1;
 }
+
+int parse_point_light(char ** strs, int w_count, scene * scn)
+{
+	if ((w_count != 8 && w_count != 10) || strcmp(strs[4], "LightColor") || (w_count == 10 && strcmp(strs[8], "Falloff")))
+	{
+		snprintf(g_parse_err, LEN_ERROR, "Point lights are given as PointLight x y z LightColor r g b [Falloff k]");
+		return 0;
+	}
+	point_light * l = (point_light *) malloc(sizeof(point_light));
+	l->falloff = 1;
+	if (!parse_vec_d(strs, 4, &l->position) || !parse_color(strs + 4, 4, &l->l_color) ||
+		(w_count == 10 && !parse_double(strs + 8, 2, &l->falloff)))
+	{
+		free(l);
+		return 0;
+	}
+	if (l->falloff < 0)
+	{
+		snprintf(g_parse_err, LEN_ERROR, "The falloff of a point light can't be negative");
+		free(l);
+		return 0;
+	}
+	scn->point_lights[g_point_light_count] = l;
+	g_point_light_count++;
+	return 1;
+}
+
+int parse_area_light(char ** strs, int w_count, scene * scn)
+{
+	//the words before LightColor: the position and the two edges of a rectangle, or the normal and radius of a disk
+	int rect = !strcmp(strs[0], "RectLight");
+	int shape_words = rect ? 12 : 10;
+	if ((w_count != shape_words + 4 && w_count != shape_words + 6) || strcmp(strs[shape_words], "LightColor") ||
+		(rect && (strcmp(strs[4], "Edge1") || strcmp(strs[8], "Edge2"))) ||
+		(!rect && (strcmp(strs[4], "Normal") || strcmp(strs[8], "Radius"))) ||
+		(w_count == shape_words + 6 && strcmp(strs[shape_words + 4], "Falloff")))
+	{
+		snprintf(g_parse_err, LEN_ERROR, rect ? "Rectangle lights are given as RectLight x y z Edge1 x y z Edge2 x y z LightColor r g b [Falloff k]" :
+			"Disk lights are given as DiskLight x y z Normal x y z Radius r LightColor r g b [Falloff k]");
+		return 0;
+	}
+	area_light * l = (area_light *) malloc(sizeof(area_light));
+	l->shape = rect ? AREA_RECT : AREA_DISK;
+	l->falloff = 1;
+	double radius = 0;
+	if (!parse_vec_d(strs, 4, &l->position) || !parse_vec_d(strs + 4, 4, &l->u) ||
+		(rect ? !parse_vec_d(strs + 8, 4, &l->v) : !parse_double(strs + 8, 2, &radius)) ||
+		!parse_color(strs + shape_words, 4, &l->l_color) ||
+		(w_count == shape_words + 6 && !parse_double(strs + shape_words + 4, 2, &l->falloff)))
+	{
+		free(l);
+		return 0;
+	}
+	if (l->falloff < 0 || (!rect && (radius <= 0 || !vec_magnitude(&l->u))))
+	{
+		snprintf(g_parse_err, LEN_ERROR, "Area lights need a falloff of at least 0, and disks a radius above 0 and a normal");
+		free(l);
+		return 0;
+	}
+	if (!rect)
+	{
+		//u was the normal, the disk is spanned by two vectors at right angles to it
+		vec_d normal = l->u;
+		vec_normalize(&normal);
+		vec_d axis = {1, 0, 0};
+		if (fabs(normal.x) > 0.9)
+		{
+			axis.x = 0;
+			axis.y = 1;
+		}
+		l->u = vec_cross(&normal, &axis);
+		vec_normalize(&l->u);
+		l->v = vec_cross(&normal, &l->u);
+		l->u = vec_mult(&l->u, radius);
+		l->v = vec_mult(&l->v, radius);
+	}
+	scn->area_lights[g_area_light_count] = l;
+	g_area_light_count++;
+	return 1;
+}
 int parse_sphere(char ** strs, int w_count, scene * scn)
 {
 	if (w_count < 7 || (w_count > 7 && strcmp(strs[7], "Material")))
@@ -382,6 +513,42 @@ int parse_triangle(char ** strs, int w_count, scene * scn)
 	return 1;
 }
 
+int parse_cloud(char ** strs, int w_count, scene * scn)
+{
+	if (w_count < 2 || (w_count > 2 && strcmp(strs[2], "Material")))
+	{
+		snprintf(g_parse_err, LEN_ERROR, "Invalid number of parameters given for ParticleCloud");
+		return 0;
+	}
+	material * mat = (material *) malloc(sizeof(material));
+	if (!parse_material(w_count > 2 ? strs + 2 : NULL, w_count - 2, mat))
+	{
+		free(mat);
+		return 0;
+	}
+	//a relative path is taken from the directory of the scene file, so scenes can be rendered from anywhere
+	char path[LEN_LINE];
+	char * slash = strrchr(g_parse_path, '/');
+	if (strs[1][0] != '/' && slash)
+	{
+		snprintf(path, LEN_LINE, "%.*s/%s", (int) (slash - g_parse_path), g_parse_path, strs[1]);
+	}
+	else
+	{
+		snprintf(path, LEN_LINE, "%s", strs[1]);
+	}
+	particle_cloud * cloud = load_particle_cloud(path, mat);
+	if (!cloud)
+	{
+		snprintf(g_parse_err, LEN_ERROR, "%s", get_particle_error());
+		free(mat);
+		return 0;
+	}
+	scn->clouds[g_cloud_count] = cloud;
+	g_cloud_count++;
+	return 1;
+}
+
 int parse_vec_d(char ** strs, int w_count, vec_d * vec)
 {
 	return parse_3vec(strs, w_count, &vec->x, &vec->y, &vec->z);
@@ -485,5 +652,6 @@ int parse_material(char ** strs, int w_count, material * mat)
 			return 0;
 		}
 	}
+	compile_material(mat);
 	return 1;
 }
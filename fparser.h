@@ -7,7 +7,8 @@
 * Creates a scene from a .rayTracing file
 *
 * @param char * file_path the location of the file
-* @param scene * the output scene as described by the rayTracing file. Should not already have memory allocated
+* @param scene * the output scene as described by the rayTracing file. Should not already have memory allocated.
+* It is freed, along with everything parsed into it, if the file can't be parsed
 *
 * @return int 0 if it fails, positive number if it succeeds
 */
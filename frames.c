@@ -0,0 +1,250 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "frames.h"
+#include "fparser.h"
+#include "sequence.h"
+
+/**
+* Parses the scene file of a frame, printing the error if it fails
+*
+* @param char * scene_path the location of the file
+*
+* @return scene * the scene, NULL if it fails
+*/
+scene * load_frame_scene(char * scene_path);
+
+/**
+* Marks in opts->tile_done the tiles the next frame can take from the frame before, and clears the others
+*
+* @param scene * scn the scene of the frame before
+* @param scene * next the scene of the next frame
+* @param render_opts * opts the render options, with the hit records and footprints of the frame before
+*
+* @return int the number of tiles left to trace, all of them when the scenes differ in more than their primitives
+*/
+int mark_frame_tiles(scene * scn, scene * next, render_opts * opts);
+
+/**
+* Gets the box around a sphere or a triangle
+*
+* @param scene * scn the scene
+* @param long long id the primitive id
+* @param vec_d * lo set to the low corner
+* @param vec_d * hi set to the high corner
+*/
+void primitive_box(scene * scn, long long id, vec_d * lo, vec_d * hi);
+
+/**
+* Traces the tiles of a frame that aren't marked in opts->tile_done and adds it to the sequence
+*
+* @param scene * scn the scene of the frame
+* @param color * pixels the framebuffer, holding the frame before
+* @param render_opts * opts the render options
+* @param sequence_writer * writer the sequence
+* @param int x0 the left edge of the part of the framebuffer stored
+* @param int y0 the top edge of the part of the framebuffer stored
+* @param int frame the frame number, for the report
+* @param int tiles the number of tiles that will be traced, for the report
+*
+* @return int 0 if the frame can't be written, positive number if it succeeds
+*/
+int render_frame(scene * scn, color * pixels, render_opts * opts, sequence_writer * writer, int x0, int y0, int frame,
+	int tiles);
+
+int run_sequence(char ** scene_paths, int frame_count, char * out_path, render_opts * opts, int crop_full,
+	int keyframe_interval)
+{
+	scene * scn = load_frame_scene(scene_paths[0]);
+	if (!scn)
+	{
+		return 0;
+	}
+	int cropped = opts->crop_x0 || opts->crop_y0 || opts->crop_x1 != opts->res_x || opts->crop_y1 != opts->res_y;
+	int x0 = 0, y0 = 0, width = opts->res_x, height = opts->res_y;
+	if (cropped && !crop_full)
+	{
+		x0 = opts->crop_x0;
+		y0 = opts->crop_y0;
+		width = opts->crop_x1 - opts->crop_x0;
+		height = opts->crop_y1 - opts->crop_y0;
+	}
+	sequence_writer * writer = sequence_create(out_path, width, height, opts->tile_size, keyframe_interval);
+	if (!writer)
+	{
+		printf("%s", get_sequence_error());
+		destroy_scene(scn);
+		return 0;
+	}
+	int tile_count = get_tile_count(opts);
+	size_t pixel_count = (size_t) opts->res_x * opts->res_y;
+	color * pixels = (color *) malloc(sizeof(color) * pixel_count);
+	opts->hit_records = (unsigned char *) calloc((size_t) tile_count * get_hit_record_size(scn), 1);
+	opts->footprints = (tile_footprint *) malloc(sizeof(tile_footprint) * tile_count);
+	opts->tile_done = (char *) calloc(tile_count, sizeof(char));
+	int ok = 1, f;
+	for (f = 0; f < frame_count && ok; f++)
+	{
+		scene * next = f ? load_frame_scene(scene_paths[f]) : scn;
+		if (!next)
+		{
+			ok = 0;
+			break;
+		}
+		int tiles = tile_count;
+		if (f)
+		{
+			tiles = mark_frame_tiles(scn, next, opts);
+			destroy_scene(scn);
+			scn = next;
+		}
+		if (tiles == tile_count)
+		{
+			//pixels outside of the crop window are never traced
+			size_t i;
+			for (i = 0; i < pixel_count; i++)
+			{
+				pixels[i] = *scn->bg_color;
+			}
+		}
+		ok = render_frame(scn, pixels, opts, writer, x0, y0, f, tiles);
+	}
+	int finished = sequence_finish(writer);
+	if (ok && !finished)
+	{
+		printf("%s", get_sequence_error());
+	}
+	struct stat st;
+	if (ok && finished && !stat(out_path, &st))
+	{
+		printf("Wrote %d frames of %dx%d to '%s', %.1f MB\n", frame_count, width, height, out_path, st.st_size / 1048576.0);
+	}
+	free(opts->hit_records);
+	opts->hit_records = NULL;
+	free(opts->footprints);
+	opts->footprints = NULL;
+	free(opts->tile_done);
+	opts->tile_done = NULL;
+	free(pixels);
+	destroy_scene(scn);
+	return ok && finished;
+}
+
+scene * load_frame_scene(char * scene_path)
+{
+	scene * scn = (scene *) malloc(sizeof(scene));
+	if (!parse_file(scene_path, scn))
+	{
+		char * error_msg = get_file_parse_error();
+		printf("%s", error_msg);
+		free(error_msg);
+		return NULL;
+	}
+	return scn;
+}
+
+int mark_frame_tiles(scene * scn, scene * next, render_opts * opts)
+{
+	int tile_count = get_tile_count(opts);
+	long long prim_count = scn->sphere_count + scn->triangle_count;
+	char * changed = (char *) malloc(prim_count + 1);
+	int diff = compare_scenes(scn, next, changed);
+	if (diff == SCENE_CHANGED)
+	{
+		free(changed);
+		free(opts->hit_records);
+		opts->hit_records = (unsigned char *) calloc((size_t) tile_count * get_hit_record_size(next), 1);
+		memset(opts->tile_done, 0, tile_count);
+		return tile_count;
+	}
+	//primitives that only changed material matter to the tiles whose rays hit them, those that moved to the tiles
+	//whose rays went near where they were or where they are now
+	int record_size = get_hit_record_size(scn);
+	unsigned char * mask = (unsigned char *) calloc(record_size, 1);
+	vec_d * boxes = (vec_d *) malloc(sizeof(vec_d) * 4 * (prim_count + 1));
+	long long i, moved = 0;
+	for (i = 0; i < prim_count; i++)
+	{
+		if (changed[i] & PRIM_GEOMETRY)
+		{
+			primitive_box(scn, i, &boxes[moved * 4], &boxes[moved * 4 + 1]);
+			primitive_box(next, i, &boxes[moved * 4 + 2], &boxes[moved * 4 + 3]);
+			moved++;
+		}
+		else if (changed[i])
+		{
+			mask[i >> 3] |= 1 << (i & 7);
+		}
+	}
+	int t, dirty = 0;
+	for (t = 0; t < tile_count; t++)
+	{
+		unsigned char * record = opts->hit_records + (size_t) t * record_size;
+		int hit = 0, b;
+		for (b = 0; b < record_size && !hit; b++)
+		{
+			hit = record[b] & mask[b];
+		}
+		for (i = 0; i < moved * 2 && !hit; i++)
+		{
+			hit = footprint_meets_box(scn, opts, t, &boxes[i * 2], &boxes[i * 2 + 1]);
+		}
+		opts->tile_done[t] = !hit;
+		dirty += hit != 0;
+	}
+	free(boxes);
+	free(mask);
+	free(changed);
+	return dirty;
+}
+
+void primitive_box(scene * scn, long long id, vec_d * lo, vec_d * hi)
+{
+	if (id < scn->sphere_count)
+	{
+		sphere * sph = scn->spheres[id];
+		vec_d r = {sph->radius, sph->radius, sph->radius};
+		*lo = sub_vecs(&sph->center, &r);
+		*hi = sum_vecs(&sph->center, &r);
+		return;
+	}
+	triangle * tri = scn->triangles[id - scn->sphere_count];
+	*lo = tri->p1;
+	*hi = tri->p1;
+	vec_d * p[2] = {&tri->p2, &tri->p3};
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		lo->x = fmin(lo->x, p[i]->x);
+		lo->y = fmin(lo->y, p[i]->y);
+		lo->z = fmin(lo->z, p[i]->z);
+		hi->x = fmax(hi->x, p[i]->x);
+		hi->y = fmax(hi->y, p[i]->y);
+		hi->z = fmax(hi->z, p[i]->z);
+	}
+}
+
+int render_frame(scene * scn, color * pixels, render_opts * opts, sequence_writer * writer, int x0, int y0, int frame,
+	int tiles)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (tiles)
+	{
+		ray_trace(scn, pixels, opts);
+	}
+	int stored;
+	if (!sequence_add_frame(writer, pixels, opts->res_x, x0, y0, &stored))
+	{
+		printf("%s", get_sequence_error());
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Frame %d: traced %d of %d tiles, stored %d tiles in %.1f ms\n", frame, tiles, get_tile_count(opts), stored,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	fflush(stdout);
+	return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef FRAMES_H_
+#define FRAMES_H_
+
+#include "ray.h"
+
+/**
+* Renders scene files as the frames of an animation into one sequence file, see sequence.h.
+* From one frame to the next, a tile is only traced again when the primitives its rays hit changed material, or when
+* a primitive that moved, where it was or where it is now, is inside the footprint of the rays the tile cast last time.
+* Frames that change the camera, the lights, the background, the clouds or the number of primitives are traced in full.
+* Every frame holds exactly the image a render of its scene file on its own gives
+*
+* @param char ** scene_paths the scene file of every frame, in order
+* @param int frame_count the number of frames
+* @param char * out_path the sequence file
+* @param render_opts * opts the render options. hit_records, footprints and tile_done are managed by this function
+* @param int crop_full positive number to store the full frame when cropping, instead of just the crop window
+* @param int keyframe_interval the frames from one keyframe to the next, 0 for the first frame only
+*
+* @return int 0 if a scene can't be loaded or the sequence file can't be written, positive number if it succeeds
+*/
+int run_sequence(char ** scene_paths, int frame_count, char * out_path, render_opts * opts, int crop_full,
+	int keyframe_interval);
+
+#endif
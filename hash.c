@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include "hash.h"
+
+#define HASH_PRIME 1099511628211ULL
+
+unsigned long long hash_bytes(unsigned long long h, const void * data, size_t len)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	size_t i;
+	for (i = 0; i < len; i++)
+	{
+		h ^= bytes[i];
+		h *= HASH_PRIME;
+	}
+	return h;
+}
+
+unsigned long long hash_double(unsigned long long h, double d)
+{
+	if (d == 0)
+	{
+		d = 0;
+	}
+	return hash_bytes(h, &d, sizeof(double));
+}
+
+int hash_file(char * file_path, unsigned long long * h)
+{
+	FILE * f = fopen(file_path, "rb");
+	if (!f)
+	{
+		return 0;
+	}
+	unsigned char buf[4096];
+	size_t len;
+	*h = HASH_INIT;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		*h = hash_bytes(*h, buf, len);
+	}
+	fclose(f);
+	return 1;
+}
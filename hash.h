@@ -0,0 +1,42 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+
+/**
+* starting value for a new hash (64 bit FNV-1a offset basis)
+*/
+#define HASH_INIT 14695981039346656037ULL
+
+/**
+* Folds a block of bytes into a running 64 bit FNV-1a hash
+*
+* @param unsigned long long h the hash so far, HASH_INIT for a new hash
+* @param const void * data the bytes to add
+* @param size_t len the number of bytes in data
+*
+* @return unsigned long long the updated hash
+*/
+unsigned long long hash_bytes(unsigned long long h, const void * data, size_t len);
+
+/**
+* Folds a double into a running hash. -0.0 and 0.0 hash the same so that equal values always give equal hashes
+*
+* @param unsigned long long h the hash so far
+* @param double d the value to add
+*
+* @return unsigned long long the updated hash
+*/
+unsigned long long hash_double(unsigned long long h, double d);
+
+/**
+* Hashes the entire contents of a file
+*
+* @param char * file_path the location of the file
+* @param unsigned long long * h where the hash is stored
+*
+* @return int 0 if the file couldn't be read, positive number if it succeeds
+*/
+int hash_file(char * file_path, unsigned long long * h);
+
+#endif
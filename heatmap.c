@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "image.h"
+#include "heatmap.h"
+
+#define LEGEND_HEIGHT 16
+#define RAMP_STOPS 6
+//the share of pixels below the top of the scale. A few pixels that were preempted mid trace would otherwise flatten the ramp
+#define SCALE_PERCENTILE 0.995
+
+#define max(a, b) (a > b ? a : b)
+
+//the colors of the ramp, evenly spaced from no cost to the maximum
+static const color ramp[RAMP_STOPS] = {
+	{0, 0, 0.3}, {0, 0, 1}, {0, 1, 1}, {1, 1, 0}, {1, 0, 0}, {1, 1, 1}
+};
+
+//3x5 pixel digits for the legend, one row per entry with the high bit on the left. The last glyph is '.'
+static const unsigned char glyphs[11][5] = {
+	{7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7}, {5, 5, 7, 1, 1},
+	{7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1}, {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7},
+	{0, 0, 0, 0, 2}
+};
+
+/**
+* qsort comparison for doubles
+*/
+int compare_costs(const void * a, const void * b);
+
+/**
+* Maps a value from 0 to 1 onto the ramp
+*
+* @param double t the value
+*
+* @return color the color
+*/
+color ramp_color(double t);
+
+/**
+* Draws a number in the legend strip
+*
+* @param color * pixels the whole image
+* @param int res_x the width of the image
+* @param int x the left edge of the text, moved left if the text does not fit
+* @param int y the top edge of the text
+* @param char * text digits and dots only
+*/
+void draw_text(color * pixels, int res_x, int x, int y, char * text);
+
+int write_heatmap(char * file_path, double * cost, int res_x, int res_y, double * max_cost)
+{
+	int height = res_y + LEGEND_HEIGHT;
+	color * pixels = (color *) malloc(sizeof(color) * res_x * height);
+	int i, x, y;
+	double * sorted = (double *) malloc(sizeof(double) * res_x * res_y);
+	memcpy(sorted, cost, sizeof(double) * res_x * res_y);
+	qsort(sorted, (size_t) res_x * res_y, sizeof(double), compare_costs);
+	double top = sorted[(int) ((res_x * res_y - 1) * SCALE_PERCENTILE)];
+	free(sorted);
+	for (i = 0; i < res_x * res_y; i++)
+	{
+		pixels[i] = ramp_color(top > 0 ? cost[i] / top : 0);
+	}
+	color black = {0, 0, 0};
+	for (i = res_x * res_y; i < res_x * height; i++)
+	{
+		pixels[i] = black;
+	}
+	//the ramp itself, then 0 under its left end and the maximum under its right end
+	for (y = res_y + 2; y < res_y + 8; y++)
+	{
+		for (x = 2; x < res_x - 2; x++)
+		{
+			pixels[y * res_x + x] = ramp_color((double) (x - 2) / max(1, res_x - 5));
+		}
+	}
+	char label[32];
+	draw_text(pixels, res_x, 2, res_y + 10, "0");
+	snprintf(label, sizeof(label), top >= 100 ? "%.0f" : "%.2f", top);
+	draw_text(pixels, res_x, res_x - 2 - 4 * (int) strlen(label) + 1, res_y + 10, label);
+
+	int written = write_ppm(file_path, pixels, res_x, 0, 0, res_x, height);
+	free(pixels);
+	*max_cost = top;
+	return written;
+}
+
+int compare_costs(const void * a, const void * b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+color ramp_color(double t)
+{
+	t = t < 0 ? 0 : (t > 1 ? 1 : t) * (RAMP_STOPS - 1);
+	int i = (int) t;
+	if (i >= RAMP_STOPS - 1)
+	{
+		return ramp[RAMP_STOPS - 1];
+	}
+	double f = t - i;
+	color c;
+	c.r = ramp[i].r + (ramp[i + 1].r - ramp[i].r) * f;
+	c.g = ramp[i].g + (ramp[i + 1].g - ramp[i].g) * f;
+	c.b = ramp[i].b + (ramp[i + 1].b - ramp[i].b) * f;
+	return c;
+}
+
+void draw_text(color * pixels, int res_x, int x, int y, char * text)
+{
+	color white = {1, 1, 1};
+	int i, row, col;
+	if (x < 0)
+	{
+		x = 0;
+	}
+	for (i = 0; text[i]; i++, x += 4)
+	{
+		int g = text[i] == '.' ? 10 : text[i] - '0';
+		for (row = 0; row < 5; row++)
+		{
+			for (col = 0; col < 3; col++)
+			{
+				if (glyphs[g][row] & (4 >> col) && x + col < res_x)
+				{
+					pixels[(y + row) * res_x + x + col] = white;
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+/**
+* Writes the cost of every pixel as a false color image with a legend strip below it.
+* Costs are mapped linearly from 0 (dark blue) to the 99.5th percentile cost of the image (white), higher costs are white too
+*
+* @param char * file_path where to write the image
+* @param double * cost the cost of every pixel, res_x * res_y values in rows starting at the top
+* @param int res_x the width of the image
+* @param int res_y the height of the image
+* @param double * max_cost set to the cost shown as white
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_heatmap(char * file_path, double * cost, int res_x, int res_y, double * max_cost);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "image.h"
+
+/**
+* Appends a number from 0 to 65535 and a separator to a buffer
+*
+* @param char * p where to write
+* @param int n the number, from quantize_channel
+*
+* @return char * the position after the separator
+*/
+char * put_channel(char * p, int n);
+
+int write_ppm(char * file_path, color * pixels, int res_x, int x0, int y0, int x1, int y1)
+{
+	FILE * f = fopen(file_path, "w");
+	if (!f)
+	{
+		return 0;
+	}
+	fprintf(f, "P3\n%d %d\n65535\n", x1 - x0, y1 - y0);
+	//formatting each pixel with fprintf takes longer than rendering a small update, so rows are formatted by hand
+	char * row = (char *) malloc((size_t) (x1 - x0) * 40 + 2);
+	int i, j;
+	for (i = y0; i < y1; i++)
+	{
+		char * p = row;
+		for (j = x0; j < x1; j++)
+		{
+			color * c = &pixels[i * res_x + j];
+			p = put_channel(p, quantize_channel(c->r));
+			p = put_channel(p, quantize_channel(c->g));
+			p = put_channel(p, quantize_channel(c->b));
+			*p++ = ' ';
+		}
+		*p++ = '\n';
+		fwrite(row, 1, p - row, f);
+	}
+	free(row);
+	return !fclose(f);
+}
+
+int write_ppm_channels(char * file_path, int * channels, int width, int height)
+{
+	FILE * f = fopen(file_path, "w");
+	if (!f)
+	{
+		return 0;
+	}
+	fprintf(f, "P3\n%d %d\n65535\n", width, height);
+	char * row = (char *) malloc((size_t) width * 40 + 2);
+	int i, j;
+	for (i = 0; i < height; i++)
+	{
+		char * p = row;
+		for (j = 0; j < width; j++)
+		{
+			int * c = &channels[((size_t) i * width + j) * 3];
+			p = put_channel(p, c[0]);
+			p = put_channel(p, c[1]);
+			p = put_channel(p, c[2]);
+			*p++ = ' ';
+		}
+		*p++ = '\n';
+		fwrite(row, 1, p - row, f);
+	}
+	free(row);
+	return !fclose(f);
+}
+
+int quantize_channel(double v)
+{
+	return (int) (v * 65535);
+}
+
+int write_pfm(char * file_path, float * values, int channels, int res_x, int x0, int y0, int x1, int y1)
+{
+	FILE * f = fopen(file_path, "wb");
+	if (!f)
+	{
+		return 0;
+	}
+	//a negative scale marks little endian floats
+	unsigned int one = 1;
+	fprintf(f, "%s\n%d %d\n%s\n", channels == 3 ? "PF" : "Pf", x1 - x0, y1 - y0, *(unsigned char *) &one ? "-1.0" : "1.0");
+	size_t row = (size_t) (x1 - x0) * channels;
+	int ok = 1, i;
+	for (i = y1 - 1; i >= y0 && ok; i--)
+	{
+		ok = fwrite(values + ((size_t) i * res_x + x0) * channels, sizeof(float), row, f) == row;
+	}
+	return !fclose(f) && ok;
+}
+
+char * put_channel(char * p, int n)
+{
+	char digits[12];
+	int len = 0;
+	if (n < 0)
+	{
+		*p++ = '-';
+		n = -n;
+	}
+	do
+	{
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (len)
+	{
+		*p++ = digits[--len];
+	}
+	*p++ = ' ';
+	return p;
+}
@@ -0,0 +1,57 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "scene.h"
+
+/**
+* Writes part of a framebuffer to a 16 bit plain PPM file
+*
+* @param char * file_path where to write the image
+* @param color * pixels the framebuffer
+* @param int res_x the width of the framebuffer
+* @param int x0 the left edge of the part to write
+* @param int y0 the top edge of the part to write
+* @param int x1 the right edge of the part to write, exclusive
+* @param int y1 the bottom edge of the part to write, exclusive
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_ppm(char * file_path, color * pixels, int res_x, int x0, int y0, int x1, int y1);
+
+/**
+* Turns a channel value into the number write_ppm writes for it, 0 to 65535 for values from 0 to 1
+*
+* @param double v the channel value
+*
+* @return int the number
+*/
+int quantize_channel(double v);
+
+/**
+* Writes numbers from quantize_channel to a 16 bit plain PPM file, exactly as write_ppm writes the colors they
+* were made from
+*
+* @param char * file_path where to write the image
+* @param int * channels 3 numbers per pixel, width * height pixels in rows starting at the top
+* @param int width the width of the image
+* @param int height the height of the image
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_ppm_channels(char * file_path, int * channels, int width, int height);
+
+/**
+* Writes part of a plane of floats to a PFM file, with 1 channel (Pf) or 3 channels (PF) per pixel in the byte order
+* of the machine. PFM rows go from the bottom up, so the part is written flipped
+*
+* @param char * file_path where to write the image
+* @param float * values the plane, channels floats per pixel
+* @param int channels 1 or 3
+* @param int res_x the width of the plane
+* @param int x0, y0, x1, y1 the part to write, as in write_ppm
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_pfm(char * file_path, float * values, int channels, int res_x, int x0, int y0, int x1, int y1);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+#include "lighttree.h"
+
+/**
+* a node of the tree. left and right are indices in the node array, light is the point light of a leaf, -1 otherwise
+*/
+typedef struct
+{
+	vec_d lo;
+	vec_d hi;
+	double energy;
+	double falloff;
+	int left;
+	int right;
+	int light;
+} light_node;
+
+struct light_tree
+{
+	int count;
+	light_node * nodes;
+};
+
+/**
+* a light with the position it is sorted by when its node is split
+*/
+typedef struct
+{
+	double key;
+	int light;
+} light_key;
+
+/**
+* Builds the node over some lights and all the nodes under it
+*
+* @param light_tree * tree the tree being built
+* @param scene * scn the scene
+* @param light_key * keys the lights of the node, reordered by the split
+* @param int count the number of lights in keys
+* @param int * next_node the next free index in tree->nodes
+*
+* @return int the index of the node
+*/
+int build_light_node(light_tree * tree, scene * scn, light_key * keys, int count, int * next_node);
+
+/**
+* Bounds how much light the lights of a node can bring to a point, from the nearest point of the node bounds
+*
+* @return double 0 if all of the node is behind the surface, otherwise the bound
+*/
+double node_importance(light_node * node, vec_d * point, vec_d * normal);
+
+int compare_light_keys(const void * a, const void * b);
+
+light_tree * build_light_tree(scene * scn)
+{
+	if (!scn->point_light_count)
+	{
+		return NULL;
+	}
+	light_tree * tree = (light_tree *) malloc(sizeof(light_tree));
+	tree->count = scn->point_light_count;
+	tree->nodes = (light_node *) malloc(sizeof(light_node) * (2 * tree->count - 1));
+	light_key * keys = (light_key *) malloc(sizeof(light_key) * tree->count);
+	int i;
+	for (i = 0; i < tree->count; i++)
+	{
+		keys[i].light = i;
+	}
+	int next_node = 0;
+	build_light_node(tree, scn, keys, tree->count, &next_node);
+	free(keys);
+	return tree;
+}
+
+void destroy_light_tree(light_tree * tree)
+{
+	if (!tree)
+	{
+		return;
+	}
+	free(tree->nodes);
+	free(tree);
+}
+
+int build_light_node(light_tree * tree, scene * scn, light_key * keys, int count, int * next_node)
+{
+	int index = (*next_node)++;
+	light_node * node = &tree->nodes[index];
+	node->lo.x = node->lo.y = node->lo.z = DBL_MAX;
+	node->hi.x = node->hi.y = node->hi.z = -DBL_MAX;
+	node->energy = 0;
+	node->falloff = DBL_MAX;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		point_light * l = scn->point_lights[keys[i].light];
+		node->lo.x = fmin(node->lo.x, l->position.x);
+		node->lo.y = fmin(node->lo.y, l->position.y);
+		node->lo.z = fmin(node->lo.z, l->position.z);
+		node->hi.x = fmax(node->hi.x, l->position.x);
+		node->hi.y = fmax(node->hi.y, l->position.y);
+		node->hi.z = fmax(node->hi.z, l->position.z);
+		node->energy += (fabs(l->l_color.r) + fabs(l->l_color.g) + fabs(l->l_color.b)) / 3;
+		node->falloff = fmin(node->falloff, l->falloff);
+	}
+	if (count == 1)
+	{
+		node->left = node->right = -1;
+		node->light = keys[0].light;
+		return index;
+	}
+	vec_d size = sub_vecs(&node->hi, &node->lo);
+	int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+	for (i = 0; i < count; i++)
+	{
+		vec_d * p = &scn->point_lights[keys[i].light]->position;
+		keys[i].key = axis == 0 ? p->x : (axis == 1 ? p->y : p->z);
+	}
+	qsort(keys, count, sizeof(light_key), compare_light_keys);
+	node->light = -1;
+	node->left = build_light_node(tree, scn, keys, count / 2, next_node);
+	node->right = build_light_node(tree, scn, keys + count / 2, count - count / 2, next_node);
+	return index;
+}
+
+int compare_light_keys(const void * a, const void * b)
+{
+	const light_key * ka = (const light_key *) a;
+	const light_key * kb = (const light_key *) b;
+	if (ka->key != kb->key)
+	{
+		return ka->key < kb->key ? -1 : 1;
+	}
+	return ka->light - kb->light;
+}
+
+double node_importance(light_node * node, vec_d * point, vec_d * normal)
+{
+	//the corner of the bounds furthest in front of the surface
+	double front = ((normal->x > 0 ? node->hi.x : node->lo.x) - point->x) * normal->x +
+		((normal->y > 0 ? node->hi.y : node->lo.y) - point->y) * normal->y +
+		((normal->z > 0 ? node->hi.z : node->lo.z) - point->z) * normal->z;
+	if (front <= 0)
+	{
+		return 0;
+	}
+	double dx = fmax(0, fmax(node->lo.x - point->x, point->x - node->hi.x));
+	double dy = fmax(0, fmax(node->lo.y - point->y, point->y - node->hi.y));
+	double dz = fmax(0, fmax(node->lo.z - point->z, point->z - node->hi.z));
+	return node->energy / (1 + node->falloff * (dx * dx + dy * dy + dz * dz));
+}
+
+int sample_light_tree(light_tree * tree, vec_d * point, vec_d * normal, double u, double * pdf)
+{
+	light_node * node = &tree->nodes[0];
+	*pdf = 1;
+	if (!(node_importance(node, point, normal) > 0))
+	{
+		return -1;
+	}
+	while (node->light < 0)
+	{
+		light_node * left = &tree->nodes[node->left];
+		light_node * right = &tree->nodes[node->right];
+		double l = node_importance(left, point, normal);
+		double r = node_importance(right, point, normal);
+		if (!(l + r > 0))
+		{
+			return -1;
+		}
+		double p = l / (l + r);
+		//u is stretched back to [0, 1) within the side taken, so one number decides every level
+		if (u < p || r <= 0)
+		{
+			u = fmin(u / p, 1 - DBL_EPSILON);
+			*pdf *= p;
+			node = left;
+		}
+		else
+		{
+			u = fmin((u - p) / (1 - p), 1 - DBL_EPSILON);
+			*pdf *= 1 - p;
+			node = right;
+		}
+	}
+	return node->light;
+}
@@ -0,0 +1,43 @@
+#ifndef LIGHTTREE_H_
+#define LIGHTTREE_H_
+
+#include "scene.h"
+
+/**
+* a binary tree over the point lights of a scene. Every node holds the bounds, the summed brightness and the
+* smallest falloff of the lights under it, which bound how much light the node can bring to a point
+*/
+typedef struct light_tree light_tree;
+
+/**
+* Builds the tree, splitting the lights in half along the longest side of their bounds at every level
+*
+* @param scene * scn the scene. Its point lights must not change while the tree is used
+*
+* @return light_tree * the tree, NULL if the scene has no point lights
+*/
+light_tree * build_light_tree(scene * scn);
+
+/**
+* Frees the tree
+*
+* @param light_tree * tree the tree, NULL does nothing
+*/
+void destroy_light_tree(light_tree * tree);
+
+/**
+* Picks one point light for a shading point by walking down the tree, going into each child with a probability
+* following how much light it can bring to the point. Nodes wholly behind the surface are never picked.
+* Only the two children of one node per level are looked at, so the cost grows with the log of the light count
+*
+* @param light_tree * tree the tree
+* @param vec_d * point the shading point
+* @param vec_d * normal the surface normal at the point
+* @param double u a uniform random number in [0, 1), the only randomness used
+* @param double * pdf set to the probability with which the returned light was picked
+*
+* @return int the index of the light in scn->point_lights, -1 if the walk ends in a node wholly behind the surface
+*/
+int sample_light_tree(light_tree * tree, vec_d * point, vec_d * normal, double u, double * pdf);
+
+#endif
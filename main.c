@@ -5,19 +5,83 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <math.h>
+#include <signal.h>
+#include <time.h>
 #include "scene.h"
 #include "fparser.h"
 #include "ray.h"
+#include "checkpoint.h"
+#include "distrib.h"
+#include "image.h"
+#include "server.h"
+#include "cache.h"
+#include "hash.h"
+#include "watch.h"
+#include "heatmap.h"
+#include "timeline.h"
+#include "particles.h"
+#include "scenecc.h"
+#include "frames.h"
+
+//the frames of a --sequence from one keyframe to the next, unless --keyframe-interval says otherwise
+#define DEFAULT_KEYFRAME_INTERVAL 30
 
 int g_res = 1080;
 char * g_file_path;
+char * g_out_path = "raytrace.ppm";
 char * g_a_parse_err;
 scene * scn;
 int g_verbose = 0;
+int g_threads = 0;
+int g_checkpoint = 0;
+int g_checkpoint_interval = 30;
+int g_resume = 0;
+int g_crop = 0;
+int g_crop_full = 0;
+int g_crop_rect[4];
+int g_workers = 0;
+int g_listen_port = 0;
+char * g_connect_addr = NULL;
+char * g_server_path = NULL;
+char * g_submit_path = NULL;
+char * g_submit_job = NULL;
+int g_scene_cache = 8;
+char * g_cache_dir = NULL;
+int g_cache_size = 1024;
+int g_watch = 0;
+int g_stats = 0;
+char * g_heatmap_path = NULL;
+int g_heatmap_time = 0;
+char * g_trace_path = NULL;
+char * g_capture_path = NULL;
+int g_aa_samples = 1;
+double g_time_budget = 0;
+int g_shadow_maps = 0;
+int g_shadow_map_size = 512;
+int g_wavefront = 0;
+int g_raster = 0;
+int g_light_samples = -1;
+int g_area_samples = 0;
+int g_uniform_area = 0;
+int g_aov = 0;
+int g_compile_scene = 0;
+char * g_sequence_path = NULL;
+int g_keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+//every scene file given, the frames of a --sequence
+char ** g_frame_paths = NULL;
+int g_frame_count = 0;
+volatile sig_atomic_t g_snapshot = 0;
 int view_dim;
 
 int parse_args(int argc, char * argv[]);
-int write_file(color ** pixels, int res_x, int res_y);
+int parse_int_arg(int argc, char * argv[], int * i, int * value);
+int parse_crop_arg(int argc, char * argv[], int * i);
+int write_file(color * pixels, int res_x, int x0, int y0, int x1, int y1);
+void request_snapshot(int sig);
+void write_snapshot(void * ctx, color * pixels, int pass);
+aov_planes * create_aovs(size_t pixel_count);
+void destroy_aovs(aov_planes * aovs);
+int write_aovs(aov_planes * aovs, int res_x, int x0, int y0, int x1, int y1);
 
 int main(int argc, char * argv[])
 {
@@ -26,6 +90,40 @@ int main(int argc, char * argv[])
 		printf("Argument error: %s\tuse '<source name> help' to see usage\n", g_a_parse_err);
 		return -1;
 	}
+	if (g_connect_addr)
+	{
+		if (!run_remote_worker(g_connect_addr))
+		{
+			printf("%s", get_distrib_error());
+			return -1;
+		}
+		return 0;
+	}
+	if (g_server_path)
+	{
+		render_opts defaults;
+		init_render_opts(&defaults, g_res, g_res);
+		if (!run_server(g_server_path, g_threads ? g_threads : defaults.threads, g_scene_cache, g_verbose))
+		{
+			printf("%s", get_server_error());
+			return -1;
+		}
+		return 0;
+	}
+	if (g_submit_path)
+	{
+		if (!submit_job(g_submit_path, g_submit_job))
+		{
+			printf("%s", get_server_error());
+			return -1;
+		}
+		return 0;
+	}
+	if (g_trace_path)
+	{
+		timeline_enable();
+	}
+	long long span_start = timeline_now();
 	scene * scn = (scene *) malloc(sizeof(scene));
 	if (!parse_file(g_file_path, scn))
 	{
@@ -35,20 +133,309 @@ int main(int argc, char * argv[])
 		free(error_msg);
 		return -1;
 	}
+	timeline_span("parse_file", span_start, -1);
+	if (g_verbose)
+	{
+		int i;
+		for (i = 0; i < scn->cloud_count; i++)
+		{
+			long long count = particle_count(scn->clouds[i]);
+			size_t bytes = particle_cloud_memory(scn->clouds[i]);
+			size_t mapped = particle_cloud_mapped(scn->clouds[i]);
+			if (mapped)
+			{
+				printf("Particle cloud %d: %lld particles in %lld clusters, %.1f MB mapped, %.1f MB kept in memory\n", i, count,
+					particle_cluster_count(scn->clouds[i]), mapped / 1048576.0, bytes / 1048576.0);
+				continue;
+			}
+			printf("Particle cloud %d: %lld particles in %.1f MB, %.1f bytes per particle\n", i, count, bytes / 1048576.0,
+				count ? (double) bytes / count : 0);
+		}
+	}
+
+	render_opts opts;
+	init_render_opts(&opts, g_res, g_res);
+	opts.verbose = g_verbose;
+	if (g_threads)
+	{
+		opts.threads = g_threads;
+	}
+	opts.aa_samples = g_aa_samples;
+	opts.wavefront = g_wavefront;
+	opts.raster = g_raster;
+	if (g_light_samples >= 0)
+	{
+		opts.light_samples = g_light_samples;
+	}
+	if (g_area_samples)
+	{
+		opts.area_samples = g_area_samples;
+	}
+	opts.area_adaptive = !g_uniform_area;
+	render_stats stats;
+	if (g_stats)
+	{
+		if (!STATS_ENABLED)
+		{
+			printf("Warning: statistics are not compiled in, rebuild with 'make STATS=1' to use --stats\n");
+		}
+		clear_stats(&stats);
+		opts.stats = &stats;
+	}
+	color * pixels = (color *) malloc(g_res * g_res * sizeof(color));
+	if (g_crop)
+	{
+		if (g_crop_rect[2] > g_res || g_crop_rect[3] > g_res)
+		{
+			printf("Argument error: crop window does not fit in a %dx%d image\n", g_res, g_res);
+			free(pixels);
+			destroy_scene(scn);
+			return -1;
+		}
+		opts.crop_x0 = g_crop_rect[0];
+		opts.crop_y0 = g_crop_rect[1];
+		opts.crop_x1 = g_crop_rect[2];
+		opts.crop_y1 = g_crop_rect[3];
+		//pixels outside of the window are never traced
+		int i;
+		for (i = 0; i < g_res * g_res; i++)
+		{
+			pixels[i] = *scn->bg_color;
+		}
+	}
+
+	if (g_watch)
+	{
+		destroy_scene(scn);
+		free(pixels);
+		return run_watch(g_file_path, g_out_path, &opts, g_crop_full) ? 0 : -1;
+	}
+
+	if (g_sequence_path)
+	{
+		destroy_scene(scn);
+		free(pixels);
+		return run_sequence(g_frame_paths, g_frame_count, g_sequence_path, &opts, g_crop_full, g_keyframe_interval) ? 0 : -1;
+	}
+
+	unsigned long long cache_key = 0;
+	if (g_cache_dir)
+	{
+		cache_key = result_cache_key(scn, &opts, g_crop && g_crop_full);
+		if (g_shadow_maps)
+		{
+			//shadow map answers can differ from the exact ones, so they make a different image
+			cache_key = hash_bytes(cache_key, &g_shadow_map_size, sizeof(int));
+		}
+		//a cached image has no heatmap, rays, planes, counters or trace, so those always need a render
+		if (!g_heatmap_path && !g_capture_path && !g_aov && !g_stats && !g_trace_path && result_cache_fetch(g_cache_dir, cache_key, g_out_path))
+		{
+			if (g_verbose)
+			{
+				printf("Result cache hit %016llx\n", cache_key);
+			}
+			free(pixels);
+			destroy_scene(scn);
+			return 0;
+		}
+	}
+
+	if (g_heatmap_path)
+	{
+		opts.pixel_cost = (double *) calloc((size_t) g_res * g_res, sizeof(double));
+		opts.cost_metric = g_heatmap_time ? COST_TIME : COST_TESTS;
+	}
+
+	if (g_aov)
+	{
+		opts.aovs = create_aovs((size_t) g_res * g_res);
+	}
+
+	if (g_capture_path && !(opts.capture = capture_open(g_capture_path, scene_hash(scn))))
+	{
+		printf("%s", get_capture_error());
+		free(pixels);
+		free(opts.pixel_cost);
+		destroy_aovs(opts.aovs);
+		unload_scene_kernels(opts.kernels);
+		destroy_scene(scn);
+		return -1;
+	}
+
+	if (g_shadow_maps)
+	{
+		struct timespec build_start, build_end;
+		clock_gettime(CLOCK_MONOTONIC, &build_start);
+		long long span_start = timeline_now();
+		opts.shadow_maps = build_shadow_maps(scn, g_shadow_map_size);
+		if (!opts.shadow_maps)
+		{
+			printf("Not enough memory for shadow maps of %dx%d texels\n", g_shadow_map_size, g_shadow_map_size);
+			if (opts.capture)
+			{
+				capture_close(opts.capture);
+			}
+			free(pixels);
+			free(opts.pixel_cost);
+			destroy_aovs(opts.aovs);
+			destroy_scene(scn);
+			return -1;
+		}
+		timeline_span("build_shadow_maps", span_start, -1);
+		clock_gettime(CLOCK_MONOTONIC, &build_end);
+		if (g_verbose)
+		{
+			printf("Built %lld shadow maps of %dx%d texels in %.3f s\n", scn->light_count, g_shadow_map_size, g_shadow_map_size,
+				(build_end.tv_sec - build_start.tv_sec) + (build_end.tv_nsec - build_start.tv_nsec) / 1e9);
+		}
+	}
+
+	if (g_compile_scene)
+	{
+		//modules go with the cached images when there is a cache, they are keyed by the scene the same way. Otherwise
+		//they go in the user's own cache directory
+		int cached;
+		struct timespec build_start, build_end;
+		clock_gettime(CLOCK_MONOTONIC, &build_start);
+		long long span_start = timeline_now();
+		opts.kernels = load_scene_kernels(scn, g_cache_dir, &cached);
+		timeline_span("compile_scene", span_start, -1);
+		clock_gettime(CLOCK_MONOTONIC, &build_end);
+		if (!opts.kernels)
+		{
+			printf("Warning: %s, tracing with the generic loops\n", get_scenecc_error());
+		}
+		else if (g_verbose)
+		{
+			printf("%s the scene module in %.3f s\n", cached ? "Loaded" : "Compiled", (build_end.tv_sec - build_start.tv_sec) +
+				(build_end.tv_nsec - build_start.tv_nsec) / 1e9);
+		}
+	}
+
+	checkpoint * ckpt = NULL;
+	char ckpt_path[1024];
+	if (g_checkpoint || g_resume)
+	{
+		snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", g_out_path);
+		ckpt = checkpoint_open(ckpt_path, scene_hash(scn), &opts, pixels, g_resume, g_checkpoint_interval);
+		if (!ckpt)
+		{
+			printf("%s", get_checkpoint_error());
+			if (opts.capture)
+			{
+				capture_close(opts.capture);
+			}
+			free(pixels);
+			destroy_shadow_maps(opts.shadow_maps);
+			free(opts.pixel_cost);
+			destroy_aovs(opts.aovs);
+			unload_scene_kernels(opts.kernels);
+			destroy_scene(scn);
+			return -1;
+		}
+	}
 
-	color ** pixels = (color **) malloc(g_res * g_res * sizeof(color *));
-	if (!ray_trace(scn, pixels, g_res, g_res, 5, g_verbose))
+	int traced;
+	if (g_workers || g_listen_port)
+	{
+		traced = distributed_ray_trace(scn, pixels, &opts, g_workers, g_listen_port);
+		if (!traced)
+		{
+			printf("%s", get_distrib_error());
+		}
+	}
+	else if (g_time_budget > 0)
+	{
+		//kill -USR1 writes the image as it is after the pass in progress
+		signal(SIGUSR1, request_snapshot);
+		traced = progressive_trace(scn, pixels, &opts, g_time_budget, write_snapshot, &opts);
+		signal(SIGUSR1, SIG_IGN);
+	}
+	else
 	{
+		traced = ray_trace(scn, pixels, &opts);
+	}
+	if (!traced)
+	{
+		if (ckpt)
+		{
+			checkpoint_close(ckpt, 0);
+		}
+		if (opts.capture)
+		{
+			capture_close(opts.capture);
+		}
 		free(pixels);
+		free(opts.pixel_cost);
+		destroy_aovs(opts.aovs);
+		unload_scene_kernels(opts.kernels);
+		destroy_shadow_maps(opts.shadow_maps);
 		destroy_scene(scn);
 		return -1;
 	}
-	write_file(pixels, g_res, g_res);
-	for (int i = 0; i < g_res * g_res; i++)
+	if (g_aa_samples > 1)
+	{
+		long long pixel_count = (long long) (opts.crop_x1 - opts.crop_x0) * (opts.crop_y1 - opts.crop_y0);
+		int grid = (int) sqrt(g_aa_samples);
+		printf("Anti-aliasing: %lld of %lld pixels supersampled with %d rays, %lld extra rays (%.1f%% of %dx supersampling)\n",
+			opts.aa_pixels, pixel_count, grid * grid, opts.aa_rays,
+			100.0 * (pixel_count + opts.aa_rays) / ((double) pixel_count * grid * grid), grid * grid);
+	}
+	if (opts.capture && !capture_close(opts.capture))
+	{
+		printf("Warning: some rays could not be written to '%s'\n", g_capture_path);
+	}
+	if (g_stats && STATS_ENABLED)
+	{
+		print_stats(stdout, &stats, g_stats == 2);
+	}
+	double max_cost;
+	if (g_heatmap_path && !write_heatmap(g_heatmap_path, opts.pixel_cost, g_res, g_res, &max_cost))
+	{
+		printf("Could not write heatmap to '%s'\n", g_heatmap_path);
+	}
+	else if (g_heatmap_path)
+	{
+		printf("Heatmap scale: 0 to %.0f %s per pixel\n", max_cost, g_heatmap_time ? "ns" : "intersection tests");
+	}
+	int written;
+	if (g_crop && !g_crop_full)
+	{
+		written = write_file(pixels, g_res, opts.crop_x0, opts.crop_y0, opts.crop_x1, opts.crop_y1);
+	}
+	else
+	{
+		written = write_file(pixels, g_res, 0, 0, g_res, g_res);
+	}
+	if (opts.aovs)
+	{
+		if (g_crop && !g_crop_full)
+		{
+			written = write_aovs(opts.aovs, g_res, opts.crop_x0, opts.crop_y0, opts.crop_x1, opts.crop_y1) && written;
+		}
+		else
+		{
+			written = write_aovs(opts.aovs, g_res, 0, 0, g_res, g_res) && written;
+		}
+	}
+	if (ckpt && !checkpoint_close(ckpt, written))
 	{
-		free(pixels[i]);
+		printf("Warning: some tiles could not be saved to the checkpoint '%s'\n", ckpt_path);
+	}
+	//an image cut short by the time budget may be only the coarse pass, so it is never cached as the full render
+	if (written && g_cache_dir && g_time_budget <= 0 && !result_cache_store(g_cache_dir, cache_key, g_out_path, (long long) g_cache_size << 20))
+	{
+		printf("Warning: could not add the image to the result cache '%s'\n", g_cache_dir);
+	}
+	if (g_trace_path && !timeline_write(g_trace_path))
+	{
+		printf("Could not write trace to '%s'\n", g_trace_path);
 	}
 	free(pixels);
+	free(opts.pixel_cost);
+	destroy_aovs(opts.aovs);
+	unload_scene_kernels(opts.kernels);
+	destroy_shadow_maps(opts.shadow_maps);
 	destroy_scene(scn);
 	return 0;
 }
@@ -59,52 +446,458 @@ int parse_args(int argc, char * argv[])
 	if (argc < 2)
 	{
 		g_a_parse_err = "No file path provided";
+		return 0;
 	}
+	g_frame_paths = (char **) malloc(sizeof(char *) * argc);
 	for (i = 1; i < argc; i++)
 	{
 		if (argv[i][0] == '-')
 		{
 			if (!strcmp(argv[i], "--dimension"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_res))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--threads"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_threads))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--checkpoint"))
+			{
+				g_checkpoint = 1;
+			}
+			else if (!strcmp(argv[i], "--checkpoint-interval"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_checkpoint_interval))
+				{
+					return 0;
+				}
+				g_checkpoint = 1;
+			}
+			else if (!strcmp(argv[i], "--resume"))
+			{
+				g_resume = 1;
+			}
+			else if (!strcmp(argv[i], "--crop"))
+			{
+				if (!parse_crop_arg(argc, argv, &i))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--crop-full"))
+			{
+				g_crop_full = 1;
+			}
+			else if (!strcmp(argv[i], "--workers"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_workers))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--listen"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_listen_port))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--connect"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --connect\n";
+					return 0;
+				}
+				g_connect_addr = argv[i];
+			}
+			else if (!strcmp(argv[i], "--server"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --server\n";
+					return 0;
+				}
+				g_server_path = argv[i];
+			}
+			else if (!strcmp(argv[i], "--scene-cache"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_scene_cache))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--submit"))
+			{
+				if (i + 2 >= argc)
+				{
+					g_a_parse_err = "--submit needs a socket path and a job\n";
+					return 0;
+				}
+				g_submit_path = argv[++i];
+				g_submit_job = argv[++i];
+			}
+			else if (!strcmp(argv[i], "--cache-dir"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --cache-dir\n";
+					return 0;
+				}
+				g_cache_dir = argv[i];
+			}
+			else if (!strcmp(argv[i], "--cache-size"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_cache_size))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--watch"))
+			{
+				g_watch = 1;
+			}
+			else if (!strcmp(argv[i], "--heatmap"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --heatmap\n";
+					return 0;
+				}
+				g_heatmap_path = argv[i];
+			}
+			else if (!strcmp(argv[i], "--heatmap-time"))
+			{
+				g_heatmap_time = 1;
+			}
+			else if (!strcmp(argv[i], "--trace"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --trace\n";
+					return 0;
+				}
+				g_trace_path = argv[i];
+			}
+			else if (!strcmp(argv[i], "--capture-rays"))
+			{
+				i++;
+				if (i >= argc)
+				{
+					g_a_parse_err = "No parameter given for argument --capture-rays\n";
+					return 0;
+				}
+				g_capture_path = argv[i];
+			}
+			else if (!strcmp(argv[i], "--aa"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_aa_samples))
+				{
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--time-budget"))
+			{
+				i++;
+				if (i >= argc || (g_time_budget = atof(argv[i])) <= 0)
+				{
+					g_a_parse_err = "--time-budget needs a number of seconds above 0\n";
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--shadow-maps"))
+			{
+				g_shadow_maps = 1;
+			}
+			else if (!strcmp(argv[i], "--shadow-map-size"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_shadow_map_size))
+				{
+					return 0;
+				}
+				if (g_shadow_map_size < 4 || g_shadow_map_size > MAX_SHADOW_MAP_SIZE)
+				{
+					g_a_parse_err = "--shadow-map-size needs at least 4 and at most 16384 texels\n";
+					return 0;
+				}
+				g_shadow_maps = 1;
+			}
+			else if (!strcmp(argv[i], "--wavefront"))
+			{
+				g_wavefront = 1;
+			}
+			else if (!strcmp(argv[i], "--raster"))
+			{
+				g_raster = 1;
+			}
+			else if (!strcmp(argv[i], "--light-samples"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_light_samples))
+				{
+					return 0;
+				}
+				if (g_light_samples < 1)
+				{
+					g_a_parse_err = "--light-samples needs at least 1 light\n";
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--exact-lights"))
+			{
+				g_light_samples = 0;
+			}
+			else if (!strcmp(argv[i], "--area-samples"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_area_samples))
+				{
+					return 0;
+				}
+				if (g_area_samples < 4)
+				{
+					g_a_parse_err = "--area-samples needs at least 4 samples\n";
+					return 0;
+				}
+			}
+			else if (!strcmp(argv[i], "--uniform-area-lights"))
+			{
+				g_uniform_area = 1;
+			}
+			else if (!strcmp(argv[i], "--compile-scene"))
+			{
+				g_compile_scene = 1;
+			}
+			else if (!strcmp(argv[i], "--sequence"))
 			{
 				i++;
 				if (i >= argc)
 				{
-					g_a_parse_err = "No parameter given for argument --dimension\n";
+					g_a_parse_err = "No parameter given for argument --sequence\n";
 					return 0;
 				}
-				if (!(g_res = atoi(argv[i])))
+				g_sequence_path = argv[i];
+			}
+			else if (!strcmp(argv[i], "--keyframe-interval"))
+			{
+				if (!parse_int_arg(argc, argv, &i, &g_keyframe_interval))
 				{
-					g_a_parse_err = "Invalid parameter given for argument --dimension\n";
 					return 0;
 				}
 			}
-			else if (strcmp(argv[i], "--verbose") || strcmp(argv[i], "-v"))
+			else if (!strcmp(argv[i], "--aov"))
+			{
+				g_aov = 1;
+			}
+			else if (!strcmp(argv[i], "--stats"))
+			{
+				g_stats = 1;
+			}
+			else if (!strcmp(argv[i], "--stats-json"))
+			{
+				g_stats = 2;
+			}
+			else if (!strcmp(argv[i], "--verbose") || !strcmp(argv[i], "-v"))
 			{
 				g_verbose = 1;
 			}
+			else
+			{
+				g_a_parse_err = "Unknown argument\n";
+				return 0;
+			}
 		}
 		else
 		{
 			g_file_path = argv[i];
+			g_frame_paths[g_frame_count++] = argv[i];
 		}
 	}
+	//the second pass of --aa reads the tiles around the one it refines, which --watch skips when they didn't change
+	if (g_aa_samples > 1 && (g_workers || g_listen_port || g_watch))
+	{
+		g_a_parse_err = "--aa can not be combined with distributed rendering or --watch\n";
+		return 0;
+	}
+	if (g_time_budget > 0 && (g_workers || g_listen_port || g_checkpoint || g_resume || g_watch || g_aa_samples > 1))
+	{
+		g_a_parse_err = "--time-budget can not be combined with distributed rendering, checkpoints, --watch or --aa\n";
+		return 0;
+	}
+	if (g_wavefront && (g_heatmap_path || g_time_budget > 0))
+	{
+		g_a_parse_err = "--wavefront can not be combined with --heatmap or --time-budget\n";
+		return 0;
+	}
+	if (g_raster && (g_heatmap_path || g_time_budget > 0 || g_wavefront))
+	{
+		g_a_parse_err = "--raster can not be combined with --heatmap, --time-budget or --wavefront\n";
+		return 0;
+	}
+	if (g_shadow_maps && (g_workers || g_listen_port || g_watch))
+	{
+		g_a_parse_err = "--shadow-maps can not be combined with distributed rendering or --watch\n";
+		return 0;
+	}
+	if (g_aov && (g_workers || g_listen_port || g_time_budget > 0 || g_watch || g_resume))
+	{
+		g_a_parse_err = "--aov can not be combined with distributed rendering, --time-budget, --watch or --resume\n";
+		return 0;
+	}
+	if (g_sequence_path && (g_workers || g_listen_port || g_time_budget > 0 || g_watch || g_checkpoint || g_resume ||
+		g_aa_samples > 1 || g_aov || g_shadow_maps || g_compile_scene || g_heatmap_path || g_capture_path))
+	{
+		g_a_parse_err = "--sequence can not be combined with distributed rendering, --time-budget, --watch, checkpoints, --aa, "
+			"--aov, --shadow-maps, --compile-scene, --heatmap or --capture\n";
+		return 0;
+	}
+	//workers never send back per-pixel costs, rays or counters, and --watch renders without them
+	if ((g_heatmap_path || g_capture_path || g_stats) && (g_workers || g_listen_port || g_watch))
+	{
+		g_a_parse_err = "--heatmap, --capture-rays and --stats can not be combined with distributed rendering or --watch\n";
+		return 0;
+	}
+	if (g_compile_scene && g_watch)
+	{
+		g_a_parse_err = "--compile-scene can not be combined with --watch\n";
+		return 0;
+	}
+	if (!g_file_path && !g_connect_addr && !g_server_path && !g_submit_path)
+	{
+		g_a_parse_err = "No file path provided";
+		return 0;
+	}
 	return 1;
 }
 
-int write_file(color ** pixels, int res_x, int res_y)
+int parse_int_arg(int argc, char * argv[], int * i, int * value)
 {
-	FILE * f = fopen("raytrace.ppm", "w");
-	fprintf(f, "P3\n%d %d\n65535\n", res_x, res_y);
-	int i, j, p_count = 0;
-	for (i = 0; i < res_y; i++)
+	static char err[128];
+	char * arg = argv[*i];
+	(*i)++;
+	if (*i >= argc)
 	{
-		for (j = 0; j < res_x; j++)
+		snprintf(err, sizeof(err), "No parameter given for argument %s\n", arg);
+		g_a_parse_err = err;
+		return 0;
+	}
+	if ((*value = atoi(argv[*i])) <= 0)
+	{
+		snprintf(err, sizeof(err), "Invalid parameter given for argument %s\n", arg);
+		g_a_parse_err = err;
+		return 0;
+	}
+	return 1;
+}
+
+int parse_crop_arg(int argc, char * argv[], int * i)
+{
+	(*i)++;
+	if (*i >= argc)
+	{
+		g_a_parse_err = "No parameter given for argument --crop\n";
+		return 0;
+	}
+	char extra;
+	if (sscanf(argv[*i], "%d,%d,%d,%d%c", &g_crop_rect[0], &g_crop_rect[1], &g_crop_rect[2], &g_crop_rect[3], &extra) != 4 ||
+		g_crop_rect[0] < 0 || g_crop_rect[1] < 0 || g_crop_rect[2] <= g_crop_rect[0] || g_crop_rect[3] <= g_crop_rect[1])
+	{
+		g_a_parse_err = "Invalid parameter given for argument --crop, expected x0,y0,x1,y1 with x0 < x1 and y0 < y1\n";
+		return 0;
+	}
+	g_crop = 1;
+	return 1;
+}
+
+int write_file(color * pixels, int res_x, int x0, int y0, int x1, int y1)
+{
+	long long span_start = timeline_now();
+	if (!write_ppm(g_out_path, pixels, res_x, x0, y0, x1, y1))
+	{
+		printf("Could not write image to '%s'\n", g_out_path);
+		return 0;
+	}
+	timeline_span("write_file", span_start, -1);
+	return 1;
+}
+
+void request_snapshot(int sig)
+{
+	g_snapshot = 1;
+}
+
+void write_snapshot(void * ctx, color * pixels, int pass)
+{
+	render_opts * opts = (render_opts *) ctx;
+	if (!g_snapshot)
+	{
+		return;
+	}
+	g_snapshot = 0;
+	if (g_crop && !g_crop_full)
+	{
+		write_file(pixels, opts->res_x, opts->crop_x0, opts->crop_y0, opts->crop_x1, opts->crop_y1);
+	}
+	else
+	{
+		write_file(pixels, opts->res_x, 0, 0, opts->res_x, opts->res_y);
+	}
+	printf("Wrote the image after %d passes to '%s'\n", pass, g_out_path);
+	fflush(stdout);
+}
+
+aov_planes * create_aovs(size_t pixel_count)
+{
+	aov_planes * aovs = (aov_planes *) malloc(sizeof(aov_planes));
+	aovs->depth = (float *) calloc(pixel_count, sizeof(float));
+	aovs->normal = (float *) calloc(pixel_count * 3, sizeof(float));
+	aovs->prim_id = (float *) calloc(pixel_count, sizeof(float));
+	aovs->albedo = (float *) calloc(pixel_count * 3, sizeof(float));
+	return aovs;
+}
+
+void destroy_aovs(aov_planes * aovs)
+{
+	if (!aovs)
+	{
+		return;
+	}
+	free(aovs->depth);
+	free(aovs->normal);
+	free(aovs->prim_id);
+	free(aovs->albedo);
+	free(aovs);
+}
+
+int write_aovs(aov_planes * aovs, int res_x, int x0, int y0, int x1, int y1)
+{
+	long long span_start = timeline_now();
+	//the planes go next to the image, raytrace.ppm giving raytrace.depth.pfm and so on
+	char * dot = strrchr(g_out_path, '.');
+	int base = dot && !strchr(dot, '/') ? (int) (dot - g_out_path) : (int) strlen(g_out_path);
+	char * names[4] = {"depth", "normal", "id", "albedo"};
+	float * planes[4] = {aovs->depth, aovs->normal, aovs->prim_id, aovs->albedo};
+	int channels[4] = {1, 3, 1, 3};
+	int i, ok = 1;
+	for (i = 0; i < 4; i++)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%.*s.%s.pfm", base, g_out_path, names[i]);
+		if (!write_pfm(path, planes[i], channels[i], res_x, x0, y0, x1, y1))
 		{
-			fprintf(f, "%d %d %d  ", (int) (pixels[p_count]->r * 65535), (int) (pixels[p_count]->g * 65535), (int) (pixels[p_count]->b * 65535));
-			p_count++;
+			printf("Could not write the %s plane to '%s'\n", names[i], path);
+			ok = 0;
 		}
-		fprintf(f, "\n");
 	}
-	fclose(f);
-	return 1;
-}
\ No newline at end of file
+	timeline_span("write_aovs", span_start, -1);
+	return ok;
+}
@@ -0,0 +1,1463 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "particles.h"
+#include "ray.h"
+#include "hash.h"
+
+#define LEN_ERROR 256
+//particles are tested this many at a time
+#define LANES 8
+//a node with more particles than this is split
+#define LEAF_SIZE 32
+#define MAX_STACK 64
+//clusters of a paged file start on a multiple of this many bytes, the page size of most machines
+#define PAGED_ALIGN 4096
+//the most clusters one ray puts off before it pages them in, beyond which it reads them as it gets to them
+#define MAX_DEFERRED 32
+
+//what is known about a cluster of a paged cloud
+#define CLUSTER_RESIDENT 1
+#define CLUSTER_CHECKED 2
+#define CLUSTER_BAD 4
+
+/**
+* LANES floats or ints, handled with one instruction per operation where the target has vector registers for them
+*/
+typedef float lane_f __attribute__((vector_size(LANES * sizeof(float))));
+typedef int lane_i __attribute__((vector_size(LANES * sizeof(int))));
+
+/**
+* a node of the hierarchy. A leaf has count particles from first on, another node has count 0 and its children
+* at first and first + 1. In the hierarchy over the clusters of a paged cloud, a leaf has the cluster in first
+*/
+typedef struct
+{
+	float lo[3];
+	float hi[3];
+	unsigned int first;
+	unsigned int count;
+} cloud_node;
+
+/**
+* some particles and the hierarchy over them, in separate arrays with LANES floats of slack at the end so that
+* the last group can be loaded whole. A paged cluster is laid out in its file the same way: nodes, x, y, z,
+* radius, then colors, and its pointers point into the mapped file
+*/
+typedef struct
+{
+	cloud_node * nodes;
+	float * x;
+	float * y;
+	float * z;
+	float * radius;
+	unsigned char * colors;
+	unsigned int count;
+	unsigned int node_count;
+} cloud_cluster;
+
+/**
+* a cluster as listed at the end of a paged file
+*/
+typedef struct
+{
+	long long offset;
+	unsigned int count;
+	unsigned int node_count;
+} cluster_entry;
+
+/**
+* the first page of a paged file
+*/
+typedef struct
+{
+	char magic[4];
+	int palette_size;
+	long long count;
+	long long cluster_count;
+	long long top_count;
+	long long top_offset;
+	long long entry_offset;
+	unsigned long long particle_hash;
+	float palette[MAX_PARTICLE_PALETTE][3];
+} paged_header;
+
+/**
+* a cloud is one cluster when it is read into memory, and many when it is paged
+*/
+struct particle_cloud
+{
+	long long count;
+	int palette_size;
+	long long cluster_count;
+	cloud_cluster * clusters;
+	//the hierarchy over the clusters, NULL when there is only one
+	cloud_node * top;
+	long long top_count;
+	char * path;
+	unsigned char * map;
+	size_t map_len;
+	size_t page_size;
+	//CLUSTER_ flags of every cluster. Render threads set them without locking: a flag lost to a race only means a
+	//cluster is checked or put off once more
+	unsigned char * flags;
+	unsigned long long particle_hash;
+	float * palette_colors;
+	material * palette;
+	material * mat;
+};
+
+struct paged_writer
+{
+	FILE * f;
+	paged_header header;
+	long long offset;
+	long long capacity;
+	cluster_entry * entries;
+	//the box of every cluster, 6 floats each
+	float * boxes;
+};
+
+/**
+* a ray in floats, with the inverse of its direction for the box tests
+*/
+typedef struct
+{
+	float o[3];
+	float d[3];
+	float inv[3];
+	//the squared distance of the origin from 0, which bounds how far off rounding the origin to floats can be
+	float o_sq;
+} float_ray;
+
+/**
+* the state of a search of a cloud
+*/
+typedef struct
+{
+	float_ray ray;
+	ray_d exact;
+	//stop at the first particle closer than best_dist rather than look for the closest
+	int any;
+	double best_dist;
+	//best_dist in floats and a little longer, so that rounding never culls a particle sphere_collide finds closer
+	float limit;
+	cloud_cluster * best_cluster;
+	int best;
+	vec_d best_position;
+	cloud_stats * stats;
+} hit_search;
+
+/**
+* an item the hierarchy is built over, a particle or a cluster, kept together so that splitting a node only moves
+* these around
+*/
+typedef struct
+{
+	float lo[3];
+	float hi[3];
+	long long index;
+} build_item;
+
+char g_particle_err[LEN_ERROR];
+
+/**
+* Loads the two kinds of particle file, once the magic at the start of f has been read
+*/
+particle_cloud * load_flat_cloud(FILE * f, char * path, material * mat);
+particle_cloud * load_paged_cloud(FILE * f, char * path, material * mat);
+
+/**
+* Allocates a cloud without any clusters
+*/
+particle_cloud * alloc_particle_cloud(int palette_size);
+
+/**
+* Builds the one cluster of a cloud that isn't paged from its particles, which are copied
+*
+* @param particle_cloud * cloud the cloud, from alloc_particle_cloud with its palette read
+* @param int count the number of particles
+* @param float * x, y, z, radius the particles
+* @param unsigned char * colors the palette entry of every particle, NULL when the cloud has no palette
+* @param material * mat the material of the cloud, which it takes ownership of
+*/
+void fill_flat_cloud(particle_cloud * cloud, int count, float * x, float * y, float * z, float * radius,
+	unsigned char * colors, material * mat);
+
+/**
+* Makes the material of every palette entry, the cloud material with the entry as its diffuse color
+*/
+void compile_palette(particle_cloud * cloud);
+
+/**
+* Builds the hierarchy of a cluster and puts copies of the particles in its order into arrays of the cluster
+*
+* @param cloud_cluster * cl the cluster, whose nodes and arrays are allocated by this function
+* @param int count the number of particles
+* @param float * x, y, z, radius the particles
+* @param unsigned char * colors their palette entries, NULL for none
+*/
+void build_cluster(cloud_cluster * cl, int count, float * x, float * y, float * z, float * radius, unsigned char * colors);
+
+/**
+* Builds a hierarchy over some items, rearranging them so that the items of every leaf are next to each other
+*
+* @param build_item * items the items
+* @param long long count the number of items
+* @param int leaf_size the most items a leaf can have
+* @param long long * node_count set to the number of nodes
+*
+* @return cloud_node * the nodes, the root first
+*/
+cloud_node * build_tree(build_item * items, long long count, int leaf_size, long long * node_count);
+
+/**
+* Builds one node over some items and the nodes under it
+*
+* @param cloud_node * nodes all of the nodes
+* @param build_item * items all of the items, rearranged by the splits
+* @param long long node the index of the node
+* @param long long first the first item of the node
+* @param long long count the number of items in the node
+* @param int leaf_size the most items a leaf can have
+* @param float * center_lo, center_hi a box around the centers of the items of the node, doubled
+* @param long long * next_node the next free node
+*/
+void build_node(cloud_node * nodes, build_item * items, long long node, long long first, long long count, int leaf_size,
+	float * center_lo, float * center_hi, long long * next_node);
+
+/**
+* Rearranges items so that the one with the k-th smallest center along an axis is at k, smaller ones before it
+* and larger ones after it
+*/
+void select_nth(build_item * items, long long count, long long k, int axis);
+
+/**
+* Gets the bytes a cluster takes in a paged file, before padding it to PAGED_ALIGN
+*/
+size_t cluster_bytes(unsigned int count, unsigned int node_count, int palette_size);
+
+/**
+* Points the arrays of a cluster at where they are in a block laid out like a paged file
+*/
+void place_cluster(cloud_cluster * cl, unsigned char * start, int palette_size);
+
+/**
+* Checks that the hierarchy and colors of a cluster stay within its arrays and the palette
+*
+* @return int positive number if they do
+*/
+int check_cluster(cloud_cluster * cl, int palette_size);
+
+void init_float_ray(float_ray * ray, vec_d * origin, vec_d * dir);
+
+/**
+* Checks whether a ray passes through a node before max_t
+*
+* @param float * t_enter set to where it enters the node
+*
+* @return int positive number if it does
+*/
+int enter_node(cloud_node * node, float_ray * ray, float max_t, float * t_enter);
+
+/**
+* Pushes the children of a node a ray passes through, the nearer one last so that it is searched first and can
+* rule out the other
+*/
+void push_children(cloud_node * nodes, cloud_node * node, hit_search * s, unsigned int * stack, float * stack_t, int * top);
+
+/**
+* Tests up to LANES particles from first on at once, in floats and with some slack, so that every particle
+* sphere_collide would find is among the ones returned, along with a few it would just miss
+*
+* @param float * t set for every particle returned to a distance the hit can't be closer than
+*
+* @return int a bit for every particle that may be hit before max_t
+*/
+int test_particles(cloud_cluster * cl, unsigned int first, int count, float_ray * ray, float max_t, float * t);
+
+/**
+* Checks a particle found by test_particles with sphere_collide
+*
+* @param ray_d * ray the ray in doubles
+* @param double * dist set to the distance of the hit
+* @param vec_d * position set to where the ray hits the particle
+*
+* @return int positive number if it is hit
+*/
+int confirm_particle(cloud_cluster * cl, unsigned int i, ray_d * ray, double * dist, vec_d * position);
+
+/**
+* Searches the particles of one cluster, the clusters of a whole cloud, or one cluster of a paged cloud,
+* checking it first if it hasn't been
+*
+* @return int positive number if the search is for any hit and found one
+*/
+int search_cluster(cloud_cluster * cl, hit_search * s);
+int search_cloud(particle_cloud * cloud, hit_search * s);
+int visit_cluster(particle_cloud * cloud, long long c, hit_search * s);
+
+/**
+* Asks for a cluster of a paged cloud to be read in, without waiting for it
+*/
+void prefetch_cluster(particle_cloud * cloud, long long c);
+
+/**
+* Sets up a search of a cloud
+*/
+void init_search(hit_search * s, vec_d * origin, vec_d * dir, double best_dist, int any, cloud_stats * stats);
+
+particle_cloud * load_particle_cloud(char * path, material * mat)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Could not open particle file '%s'", path);
+		return NULL;
+	}
+	char magic[4];
+	particle_cloud * cloud = NULL;
+	if (fread(magic, 1, 4, f) == 4 && !memcmp(magic, "PCLD", 4))
+	{
+		cloud = load_flat_cloud(f, path, mat);
+	}
+	else if (!memcmp(magic, "PCPG", 4))
+	{
+		cloud = load_paged_cloud(f, path, mat);
+	}
+	else
+	{
+		snprintf(g_particle_err, LEN_ERROR, "'%s' is not a particle file", path);
+	}
+	fclose(f);
+	return cloud;
+}
+
+char * get_particle_error()
+{
+	return g_particle_err;
+}
+
+particle_cloud * load_flat_cloud(FILE * f, char * path, material * mat)
+{
+	int header[2];
+	if (fread(header, sizeof(int), 2, f) != 2 || header[0] < 0 || header[1] < 0 || header[1] > MAX_PARTICLE_PALETTE)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "'%s' is not a particle file", path);
+		return NULL;
+	}
+	size_t n = header[0];
+	particle_cloud * cloud = alloc_particle_cloud(header[1]);
+	float * values = (float *) malloc(sizeof(float) * 4 * (n ? n : 1));
+	unsigned char * colors = cloud->palette_size ? (unsigned char *) malloc(n ? n : 1) : NULL;
+	int ok = fread(cloud->palette_colors, sizeof(float), 3 * cloud->palette_size, f) == 3 * (size_t) cloud->palette_size &&
+		fread(values, sizeof(float), 4 * n, f) == 4 * n && (!colors || fread(colors, 1, n, f) == n);
+	size_t i;
+	for (i = 0; ok && i < n; i++)
+	{
+		ok = isfinite(values[i]) && isfinite(values[n + i]) && isfinite(values[2 * n + i]) && values[3 * n + i] >= 0 &&
+			isfinite(values[3 * n + i]) && (!colors || colors[i] < cloud->palette_size);
+	}
+	if (!ok)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Particle file '%s' is cut short or holds invalid particles", path);
+		free(values);
+		free(colors);
+		destroy_particle_cloud(cloud);
+		return NULL;
+	}
+	fill_flat_cloud(cloud, n, values, values + n, values + 2 * n, values + 3 * n, colors, mat);
+	free(values);
+	free(colors);
+	return cloud;
+}
+
+particle_cloud * make_particle_cloud(int count, float * x, float * y, float * z, float * radius, material * mat)
+{
+	particle_cloud * cloud = alloc_particle_cloud(0);
+	fill_flat_cloud(cloud, count, x, y, z, radius, NULL, mat);
+	return cloud;
+}
+
+void fill_flat_cloud(particle_cloud * cloud, int count, float * x, float * y, float * z, float * radius,
+	unsigned char * colors, material * mat)
+{
+	cloud->count = count;
+	cloud->cluster_count = 1;
+	cloud->clusters = (cloud_cluster *) calloc(1, sizeof(cloud_cluster));
+	build_cluster(&cloud->clusters[0], count, x, y, z, radius, colors);
+	cloud->mat = mat;
+	compile_palette(cloud);
+}
+
+particle_cloud * load_paged_cloud(FILE * f, char * path, material * mat)
+{
+	paged_header header;
+	struct stat st;
+	if (fseeko(f, 0, SEEK_SET) || fread(&header, sizeof(header), 1, f) != 1 || fstat(fileno(f), &st))
+	{
+		snprintf(g_particle_err, LEN_ERROR, "'%s' is not a particle file", path);
+		return NULL;
+	}
+	long long size = st.st_size;
+	//the lists at the end must fit in the file, which also keeps the sizes below from overflowing
+	if (header.palette_size < 0 || header.palette_size > MAX_PARTICLE_PALETTE || header.count < 0 ||
+		header.cluster_count < 1 || header.top_count < 1 || header.top_count > 2 * header.cluster_count ||
+		header.top_offset < 0 || header.entry_offset < 0 || header.top_offset > size || header.entry_offset > size ||
+		header.cluster_count > (size - header.entry_offset) / (long long) sizeof(cluster_entry) ||
+		header.top_count > (size - header.top_offset) / (long long) sizeof(cloud_node))
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Paged particle file '%s' is cut short or invalid", path);
+		return NULL;
+	}
+	particle_cloud * cloud = alloc_particle_cloud(header.palette_size);
+	memcpy(cloud->palette_colors, header.palette, sizeof(float) * 3 * header.palette_size);
+	cloud->cluster_count = header.cluster_count;
+	cloud->top_count = header.top_count;
+	cloud->particle_hash = header.particle_hash;
+	cloud->top = (cloud_node *) malloc(sizeof(cloud_node) * cloud->top_count);
+	cloud->clusters = (cloud_cluster *) calloc(cloud->cluster_count, sizeof(cloud_cluster));
+	cloud->flags = (unsigned char *) calloc(cloud->cluster_count, 1);
+	cluster_entry * entries = (cluster_entry *) malloc(sizeof(cluster_entry) * cloud->cluster_count);
+	int ok = !fseeko(f, header.top_offset, SEEK_SET) && fread(cloud->top, sizeof(cloud_node), cloud->top_count, f) ==
+		(size_t) cloud->top_count && !fseeko(f, header.entry_offset, SEEK_SET) &&
+		fread(entries, sizeof(cluster_entry), cloud->cluster_count, f) == (size_t) cloud->cluster_count;
+	long long i;
+	for (i = 0; ok && i < cloud->top_count; i++)
+	{
+		cloud_node * node = &cloud->top[i];
+		//compared without adding to first, which could wrap around
+		ok = node->count ? node->count == 1 && node->first < cloud->cluster_count :
+			node->first > i && node->first < cloud->top_count - 1;
+	}
+	long long count = 0;
+	for (i = 0; ok && i < cloud->cluster_count; i++)
+	{
+		ok = entries[i].offset >= 0 && entries[i].offset % PAGED_ALIGN == 0 && entries[i].node_count > 0 &&
+			entries[i].offset <= size && cluster_bytes(entries[i].count, entries[i].node_count, header.palette_size) <=
+			(size_t) (size - entries[i].offset);
+		count += entries[i].count;
+	}
+	if (!ok || count != header.count)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Paged particle file '%s' is cut short or invalid", path);
+		free(entries);
+		destroy_particle_cloud(cloud);
+		return NULL;
+	}
+	void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (map == MAP_FAILED)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Could not map paged particle file '%s'", path);
+		free(entries);
+		destroy_particle_cloud(cloud);
+		return NULL;
+	}
+	//clusters are read in whole when they are asked for, so reading ahead of a fault would only read unneeded ones
+	madvise(map, size, MADV_RANDOM);
+	cloud->map = (unsigned char *) map;
+	cloud->map_len = size;
+	cloud->page_size = sysconf(_SC_PAGESIZE);
+	cloud->count = count;
+	for (i = 0; i < cloud->cluster_count; i++)
+	{
+		cloud->clusters[i].count = entries[i].count;
+		cloud->clusters[i].node_count = entries[i].node_count;
+		place_cluster(&cloud->clusters[i], cloud->map + entries[i].offset, cloud->palette_size);
+	}
+	free(entries);
+	cloud->path = strdup(path);
+	cloud->mat = mat;
+	compile_palette(cloud);
+	return cloud;
+}
+
+particle_cloud * alloc_particle_cloud(int palette_size)
+{
+	particle_cloud * cloud = (particle_cloud *) calloc(1, sizeof(particle_cloud));
+	cloud->palette_size = palette_size;
+	cloud->palette_colors = (float *) malloc(sizeof(float) * 3 * (palette_size ? palette_size : 1));
+	cloud->palette = (material *) malloc(sizeof(material) * (palette_size ? palette_size : 1));
+	return cloud;
+}
+
+void destroy_particle_cloud(particle_cloud * cloud)
+{
+	if (cloud->map)
+	{
+		munmap(cloud->map, cloud->map_len);
+	}
+	else if (cloud->clusters)
+	{
+		free(cloud->clusters[0].nodes);
+		free(cloud->clusters[0].x);
+		free(cloud->clusters[0].y);
+		free(cloud->clusters[0].z);
+		free(cloud->clusters[0].radius);
+		free(cloud->clusters[0].colors);
+	}
+	free(cloud->clusters);
+	free(cloud->top);
+	free(cloud->flags);
+	free(cloud->path);
+	free(cloud->palette_colors);
+	free(cloud->palette);
+	free(cloud->mat);
+	free(cloud);
+}
+
+void compile_palette(particle_cloud * cloud)
+{
+	int i;
+	for (i = 0; i < cloud->palette_size; i++)
+	{
+		cloud->palette[i] = *cloud->mat;
+		cloud->palette[i].diff.r = cloud->palette_colors[3 * i];
+		cloud->palette[i].diff.g = cloud->palette_colors[3 * i + 1];
+		cloud->palette[i].diff.b = cloud->palette_colors[3 * i + 2];
+		compile_material(&cloud->palette[i]);
+	}
+}
+
+void build_cluster(cloud_cluster * cl, int count, float * x, float * y, float * z, float * radius, unsigned char * colors)
+{
+	build_item * items = (build_item *) malloc(sizeof(build_item) * (count ? count : 1));
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		items[i].lo[0] = x[i] - radius[i];
+		items[i].lo[1] = y[i] - radius[i];
+		items[i].lo[2] = z[i] - radius[i];
+		items[i].hi[0] = x[i] + radius[i];
+		items[i].hi[1] = y[i] + radius[i];
+		items[i].hi[2] = z[i] + radius[i];
+		items[i].index = i;
+	}
+	long long node_count;
+	cl->nodes = build_tree(items, count, LEAF_SIZE, &node_count);
+	cl->node_count = node_count;
+	cl->count = count;
+	cl->x = (float *) calloc(count + LANES, sizeof(float));
+	cl->y = (float *) calloc(count + LANES, sizeof(float));
+	cl->z = (float *) calloc(count + LANES, sizeof(float));
+	cl->radius = (float *) calloc(count + LANES, sizeof(float));
+	cl->colors = colors ? (unsigned char *) malloc(count ? count : 1) : NULL;
+	//the particles of every leaf are made contiguous
+	for (i = 0; i < count; i++)
+	{
+		long long p = items[i].index;
+		cl->x[i] = x[p];
+		cl->y[i] = y[p];
+		cl->z[i] = z[p];
+		cl->radius[i] = radius[p];
+		if (colors)
+		{
+			cl->colors[i] = colors[p];
+		}
+	}
+	free(items);
+}
+
+cloud_node * build_tree(build_item * items, long long count, int leaf_size, long long * node_count)
+{
+	//leaves hold more than leaf_size / 2 items, which bounds the number of nodes
+	long long max_nodes = leaf_size > 1 ? 2 * (count / (leaf_size / 2) + 1) : 2 * count + 1;
+	cloud_node * nodes = (cloud_node *) malloc(sizeof(cloud_node) * max_nodes);
+	float center_lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, center_hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	long long i;
+	int a;
+	for (i = 0; i < count; i++)
+	{
+		for (a = 0; a < 3; a++)
+		{
+			float c = items[i].lo[a] + items[i].hi[a];
+			center_lo[a] = c < center_lo[a] ? c : center_lo[a];
+			center_hi[a] = c > center_hi[a] ? c : center_hi[a];
+		}
+	}
+	long long next_node = 1;
+	build_node(nodes, items, 0, 0, count, leaf_size, center_lo, center_hi, &next_node);
+	*node_count = next_node;
+	return (cloud_node *) realloc(nodes, sizeof(cloud_node) * next_node);
+}
+
+void build_node(cloud_node * nodes, build_item * items, long long node, long long first, long long count, int leaf_size,
+	float * center_lo, float * center_hi, long long * next_node)
+{
+	cloud_node * nd = &nodes[node];
+	long long i;
+	int a;
+	if (count <= leaf_size)
+	{
+		for (a = 0; a < 3; a++)
+		{
+			nd->lo[a] = FLT_MAX;
+			nd->hi[a] = -FLT_MAX;
+			for (i = first; i < first + count; i++)
+			{
+				nd->lo[a] = items[i].lo[a] < nd->lo[a] ? items[i].lo[a] : nd->lo[a];
+				nd->hi[a] = items[i].hi[a] > nd->hi[a] ? items[i].hi[a] : nd->hi[a];
+			}
+			//the boxes are grown a little so that testing rays against them in floats never misses a particle
+			float pad = (fabsf(nd->lo[a]) + fabsf(nd->hi[a])) * 1e-5f;
+			nd->lo[a] -= pad;
+			nd->hi[a] += pad;
+		}
+		nd->first = first;
+		nd->count = count;
+		return;
+	}
+	int axis = 0;
+	for (a = 1; a < 3; a++)
+	{
+		if (center_hi[a] - center_lo[a] > center_hi[axis] - center_lo[axis])
+		{
+			axis = a;
+		}
+	}
+	select_nth(items + first, count, count / 2, axis);
+	//the box of the centers is cut at the median rather than measured again, so a level costs no more than the split
+	float split = items[first + count / 2].lo[axis] + items[first + count / 2].hi[axis];
+	float left_hi[3] = {center_hi[0], center_hi[1], center_hi[2]};
+	float right_lo[3] = {center_lo[0], center_lo[1], center_lo[2]};
+	left_hi[axis] = split;
+	right_lo[axis] = split;
+	long long children = *next_node;
+	*next_node += 2;
+	build_node(nodes, items, children, first, count / 2, leaf_size, center_lo, left_hi, next_node);
+	build_node(nodes, items, children + 1, first + count / 2, count - count / 2, leaf_size, right_lo, center_hi, next_node);
+	//the box of a node is the union of those of its children
+	for (a = 0; a < 3; a++)
+	{
+		nd->lo[a] = fminf(nodes[children].lo[a], nodes[children + 1].lo[a]);
+		nd->hi[a] = fmaxf(nodes[children].hi[a], nodes[children + 1].hi[a]);
+	}
+	nd->first = children;
+	nd->count = 0;
+}
+
+void select_nth(build_item * items, long long count, long long k, int axis)
+{
+	long long lo = 0, hi = count - 1;
+	while (lo < hi)
+	{
+		//median of three as the pivot keeps sorted input from going quadratic
+		long long mid = lo + (hi - lo) / 2;
+		float a = items[lo].lo[axis] + items[lo].hi[axis];
+		float b = items[mid].lo[axis] + items[mid].hi[axis];
+		float c = items[hi].lo[axis] + items[hi].hi[axis];
+		float pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+		long long i = lo, j = hi;
+		while (i <= j)
+		{
+			while (items[i].lo[axis] + items[i].hi[axis] < pivot)
+			{
+				i++;
+			}
+			while (items[j].lo[axis] + items[j].hi[axis] > pivot)
+			{
+				j--;
+			}
+			if (i <= j)
+			{
+				build_item tmp = items[i];
+				items[i] = items[j];
+				items[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if (k <= j)
+		{
+			hi = j;
+		}
+		else if (k >= i)
+		{
+			lo = i;
+		}
+		else
+		{
+			return;
+		}
+	}
+}
+
+size_t cluster_bytes(unsigned int count, unsigned int node_count, int palette_size)
+{
+	return sizeof(cloud_node) * node_count + sizeof(float) * 4 * ((size_t) count + LANES) + (palette_size ? count : 0);
+}
+
+void place_cluster(cloud_cluster * cl, unsigned char * start, int palette_size)
+{
+	size_t floats = (size_t) cl->count + LANES;
+	cl->nodes = (cloud_node *) start;
+	cl->x = (float *) (start + sizeof(cloud_node) * cl->node_count);
+	cl->y = cl->x + floats;
+	cl->z = cl->y + floats;
+	cl->radius = cl->z + floats;
+	cl->colors = palette_size ? (unsigned char *) (cl->radius + floats) : NULL;
+}
+
+int check_cluster(cloud_cluster * cl, int palette_size)
+{
+	if (!cl->node_count)
+	{
+		return 0;
+	}
+	unsigned int i;
+	for (i = 0; i < cl->node_count; i++)
+	{
+		//compared without adding to first, which could wrap around
+		cloud_node * node = &cl->nodes[i];
+		if (node->count ? node->count > LEAF_SIZE || node->first > cl->count || node->count > cl->count - node->first :
+			node->first <= i || node->first >= cl->node_count - 1)
+		{
+			return 0;
+		}
+	}
+	for (i = 0; cl->colors && i < cl->count; i++)
+	{
+		if (cl->colors[i] >= palette_size)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+paged_writer * begin_paged_cloud(char * path, int palette_size, float * palette)
+{
+	if (palette_size < 0 || palette_size > MAX_PARTICLE_PALETTE)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "A particle palette holds up to %d colors", MAX_PARTICLE_PALETTE);
+		return NULL;
+	}
+	FILE * f = fopen(path, "wb");
+	if (!f)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Could not create paged particle file '%s'", path);
+		return NULL;
+	}
+	paged_writer * writer = (paged_writer *) calloc(1, sizeof(paged_writer));
+	writer->f = f;
+	memcpy(writer->header.magic, "PCPG", 4);
+	writer->header.palette_size = palette_size;
+	memcpy(writer->header.palette, palette, sizeof(float) * 3 * palette_size);
+	writer->offset = (sizeof(paged_header) + PAGED_ALIGN - 1) / PAGED_ALIGN * PAGED_ALIGN;
+	return writer;
+}
+
+int add_paged_cluster(paged_writer * writer, int count, float * x, float * y, float * z, float * radius, unsigned char * colors)
+{
+	int palette_size = writer->header.palette_size;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (!isfinite(x[i]) || !isfinite(y[i]) || !isfinite(z[i]) || !isfinite(radius[i]) || radius[i] < 0 ||
+			(palette_size && colors[i] >= palette_size))
+		{
+			snprintf(g_particle_err, LEN_ERROR, "Particle %d of a cluster is invalid", i);
+			return 0;
+		}
+	}
+	if (count <= 0)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "A cluster needs at least one particle");
+		return 0;
+	}
+	cloud_cluster cl;
+	build_cluster(&cl, count, x, y, z, radius, palette_size ? colors : NULL);
+	unsigned char * block = (unsigned char *) calloc(cluster_bytes(count, cl.node_count, palette_size), 1);
+	cloud_cluster placed = cl;
+	place_cluster(&placed, block, palette_size);
+	size_t floats = sizeof(float) * ((size_t) count + LANES);
+	memcpy(placed.nodes, cl.nodes, sizeof(cloud_node) * cl.node_count);
+	memcpy(placed.x, cl.x, floats);
+	memcpy(placed.y, cl.y, floats);
+	memcpy(placed.z, cl.z, floats);
+	memcpy(placed.radius, cl.radius, floats);
+	if (palette_size)
+	{
+		memcpy(placed.colors, cl.colors, count);
+	}
+	size_t bytes = cluster_bytes(count, cl.node_count, palette_size);
+	//the hash covers the particles as stored, not the hierarchy, which only decides the order they are tested in
+	unsigned long long h = writer->header.particle_hash;
+	h = hash_bytes(h, placed.x, sizeof(float) * 4 * ((size_t) count + LANES));
+	writer->header.particle_hash = palette_size ? hash_bytes(h, placed.colors, count) : h;
+	int ok = !fseeko(writer->f, writer->offset, SEEK_SET) && fwrite(block, 1, bytes, writer->f) == bytes;
+	if (ok)
+	{
+		if (writer->header.cluster_count == writer->capacity)
+		{
+			writer->capacity = writer->capacity ? 2 * writer->capacity : 64;
+			writer->entries = (cluster_entry *) realloc(writer->entries, sizeof(cluster_entry) * writer->capacity);
+			writer->boxes = (float *) realloc(writer->boxes, sizeof(float) * 6 * writer->capacity);
+		}
+		long long c = writer->header.cluster_count++;
+		writer->entries[c].offset = writer->offset;
+		writer->entries[c].count = count;
+		writer->entries[c].node_count = cl.node_count;
+		memcpy(writer->boxes + 6 * c, cl.nodes[0].lo, sizeof(float) * 3);
+		memcpy(writer->boxes + 6 * c + 3, cl.nodes[0].hi, sizeof(float) * 3);
+		writer->header.count += count;
+		writer->offset += (bytes + PAGED_ALIGN - 1) / PAGED_ALIGN * PAGED_ALIGN;
+	}
+	else
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Could not write a cluster to the paged particle file");
+	}
+	free(block);
+	free(cl.nodes);
+	free(cl.x);
+	free(cl.y);
+	free(cl.z);
+	free(cl.radius);
+	free(cl.colors);
+	return ok;
+}
+
+int finish_paged_cloud(paged_writer * writer)
+{
+	long long n = writer->header.cluster_count;
+	int ok = n > 0;
+	if (ok)
+	{
+		build_item * items = (build_item *) malloc(sizeof(build_item) * n);
+		long long i;
+		for (i = 0; i < n; i++)
+		{
+			memcpy(items[i].lo, writer->boxes + 6 * i, sizeof(float) * 3);
+			memcpy(items[i].hi, writer->boxes + 6 * i + 3, sizeof(float) * 3);
+			items[i].index = i;
+		}
+		cloud_node * top = build_tree(items, n, 1, &writer->header.top_count);
+		//the list of clusters follows the order of the leaves, whose first is their place in it
+		cluster_entry * entries = (cluster_entry *) malloc(sizeof(cluster_entry) * n);
+		for (i = 0; i < n; i++)
+		{
+			entries[i] = writer->entries[items[i].index];
+		}
+		writer->header.top_offset = writer->offset;
+		writer->header.entry_offset = writer->offset + sizeof(cloud_node) * writer->header.top_count;
+		ok = !fseeko(writer->f, writer->offset, SEEK_SET) &&
+			fwrite(top, sizeof(cloud_node), writer->header.top_count, writer->f) == (size_t) writer->header.top_count &&
+			fwrite(entries, sizeof(cluster_entry), n, writer->f) == (size_t) n && !fseeko(writer->f, 0, SEEK_SET) &&
+			fwrite(&writer->header, sizeof(paged_header), 1, writer->f) == 1;
+		free(items);
+		free(top);
+		free(entries);
+	}
+	ok = !fclose(writer->f) && ok;
+	if (!ok)
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Could not finish the paged particle file");
+	}
+	free(writer->entries);
+	free(writer->boxes);
+	free(writer);
+	return ok;
+}
+
+void init_float_ray(float_ray * ray, vec_d * origin, vec_d * dir)
+{
+	double o[3] = {origin->x, origin->y, origin->z}, d[3] = {dir->x, dir->y, dir->z};
+	int a;
+	for (a = 0; a < 3; a++)
+	{
+		ray->o[a] = (float) o[a];
+		ray->d[a] = (float) d[a];
+		ray->inv[a] = 1.0f / (float) d[a];
+	}
+	ray->o_sq = ray->o[0] * ray->o[0] + ray->o[1] * ray->o[1] + ray->o[2] * ray->o[2];
+}
+
+int enter_node(cloud_node * node, float_ray * ray, float max_t, float * t_enter)
+{
+	float t0 = 0, t1 = max_t;
+	int a;
+	for (a = 0; a < 3; a++)
+	{
+		float ta = (node->lo[a] - ray->o[a]) * ray->inv[a];
+		float tb = (node->hi[a] - ray->o[a]) * ray->inv[a];
+		if (ta > tb)
+		{
+			float tmp = ta;
+			ta = tb;
+			tb = tmp;
+		}
+		t0 = ta > t0 ? ta : t0;
+		t1 = tb < t1 ? tb : t1;
+	}
+	*t_enter = t0;
+	return t0 <= t1;
+}
+
+void push_children(cloud_node * nodes, cloud_node * node, hit_search * s, unsigned int * stack, float * stack_t, int * top)
+{
+	float t_a, t_b;
+	int a = enter_node(&nodes[node->first], &s->ray, s->limit, &t_a);
+	int b = enter_node(&nodes[node->first + 1], &s->ray, s->limit, &t_b);
+	if (a && b && t_a < t_b && *top + 2 <= MAX_STACK)
+	{
+		stack[*top] = node->first + 1;
+		stack_t[(*top)++] = t_b;
+		stack[*top] = node->first;
+		stack_t[(*top)++] = t_a;
+		return;
+	}
+	if (a && *top < MAX_STACK)
+	{
+		stack[*top] = node->first;
+		stack_t[(*top)++] = t_a;
+	}
+	if (b && *top < MAX_STACK)
+	{
+		stack[*top] = node->first + 1;
+		stack_t[(*top)++] = t_b;
+	}
+}
+
+int test_particles(cloud_cluster * cl, unsigned int first, int count, float_ray * ray, float max_t, float * t)
+{
+	lane_f cx, cy, cz, r;
+	memcpy(&cx, cl->x + first, sizeof(lane_f));
+	memcpy(&cy, cl->y + first, sizeof(lane_f));
+	memcpy(&cz, cl->z + first, sizeof(lane_f));
+	memcpy(&r, cl->radius + first, sizeof(lane_f));
+	lane_f ocx = cx - ray->o[0];
+	lane_f ocy = cy - ray->o[1];
+	lane_f ocz = cz - ray->o[2];
+	lane_f along = ocx * ray->d[0] + ocy * ray->d[1] + ocz * ray->d[2];
+	//the distance of the center from the ray is taken from the offset at right angles to it rather than as
+	//|oc|^2 - along^2 like sphere_collide does, which loses all precision in floats for small far away particles
+	lane_f px = ocx - along * ray->d[0];
+	lane_f py = ocy - along * ray->d[1];
+	lane_f pz = ocz - along * ray->d[2];
+	lane_f perp_sq = px * px + py * py + pz * pz;
+	lane_f oc_sq = ocx * ocx + ocy * ocy + ocz * ocz;
+	//rounding the origin and the products to floats is off by a few float epsilons of the distances involved,
+	//which the slack covers with room to spare
+	lane_f slack = (oc_sq + ray->o_sq) * 1e-11f;
+	lane_f r_sq = r * r * 1.01f + slack;
+	lane_i lane = {0, 1, 2, 3, 4, 5, 6, 7};
+	lane_i candidate = (perp_sq <= r_sq) & ((along >= 0) | (along * along <= slack) | (oc_sq <= r_sq)) &
+		(along - r * 1.01f <= max_t) & (lane < count);
+	int hits = 0, l;
+	for (l = 0; l < LANES; l++)
+	{
+		if (candidate[l])
+		{
+			t[l] = along[l] - r[l] * 1.01f;
+			hits |= 1 << l;
+		}
+	}
+	return hits;
+}
+
+int confirm_particle(cloud_cluster * cl, unsigned int i, ray_d * ray, double * dist, vec_d * position)
+{
+	sphere sph;
+	sph.center.x = cl->x[i];
+	sph.center.y = cl->y[i];
+	sph.center.z = cl->z[i];
+	sph.radius = cl->radius[i];
+	if (!sphere_collide(ray, &sph, position))
+	{
+		return 0;
+	}
+	*dist = vec_distance(&ray->pos, position);
+	return 1;
+}
+
+void init_search(hit_search * s, vec_d * origin, vec_d * dir, double best_dist, int any, cloud_stats * stats)
+{
+	init_float_ray(&s->ray, origin, dir);
+	s->exact.pos = *origin;
+	s->exact.dir = *dir;
+	s->any = any;
+	s->best_dist = best_dist;
+	s->limit = best_dist < FLT_MAX / 2 ? (float) best_dist * 1.0001f : FLT_MAX;
+	s->best_cluster = NULL;
+	s->best = -1;
+	s->stats = stats;
+}
+
+int search_cluster(cloud_cluster * cl, hit_search * s)
+{
+	unsigned int stack[MAX_STACK];
+	float stack_t[MAX_STACK];
+	int top = 0;
+	if (enter_node(&cl->nodes[0], &s->ray, s->limit, &stack_t[0]))
+	{
+		stack[top++] = 0;
+	}
+	float t[LANES];
+	while (top)
+	{
+		top--;
+		if (stack_t[top] > s->limit)
+		{
+			continue;
+		}
+		cloud_node * node = &cl->nodes[stack[top]];
+		s->stats->visits++;
+		if (!node->count)
+		{
+			push_children(cl->nodes, node, s, stack, stack_t, &top);
+			continue;
+		}
+		unsigned int g, l;
+		for (g = 0; g < node->count; g += LANES)
+		{
+			int group = node->count - g < LANES ? node->count - g : LANES;
+			int hits = test_particles(cl, node->first + g, group, &s->ray, s->limit, t);
+			s->stats->tests += group;
+			for (l = 0; hits; l++, hits >>= 1)
+			{
+				double hit_dist;
+				vec_d hit;
+				if (!(hits & 1) || t[l] > s->limit || !confirm_particle(cl, node->first + g + l, &s->exact, &hit_dist, &hit) ||
+					hit_dist >= s->best_dist)
+				{
+					continue;
+				}
+				if (s->any)
+				{
+					return 1;
+				}
+				s->best_dist = hit_dist;
+				s->limit = (float) hit_dist * 1.0001f;
+				s->best_position = hit;
+				s->best_cluster = cl;
+				s->best = node->first + g + l;
+			}
+		}
+	}
+	return 0;
+}
+
+int search_cloud(particle_cloud * cloud, hit_search * s)
+{
+	if (!cloud->count)
+	{
+		return 0;
+	}
+	if (!cloud->top)
+	{
+		return search_cluster(&cloud->clusters[0], s);
+	}
+	//clusters not in memory yet are put off, so that the ones that are can find the hit first
+	long long deferred[MAX_DEFERRED];
+	float deferred_t[MAX_DEFERRED];
+	int waiting = 0;
+	unsigned int stack[MAX_STACK];
+	float stack_t[MAX_STACK];
+	int top = 0;
+	if (enter_node(&cloud->top[0], &s->ray, s->limit, &stack_t[0]))
+	{
+		stack[top++] = 0;
+	}
+	while (top)
+	{
+		top--;
+		if (stack_t[top] > s->limit)
+		{
+			continue;
+		}
+		cloud_node * node = &cloud->top[stack[top]];
+		if (!node->count)
+		{
+			push_children(cloud->top, node, s, stack, stack_t, &top);
+			continue;
+		}
+		if (!(cloud->flags[node->first] & CLUSTER_RESIDENT) && waiting < MAX_DEFERRED)
+		{
+			deferred[waiting] = node->first;
+			deferred_t[waiting++] = stack_t[top];
+			s->stats->deferred++;
+			continue;
+		}
+		if (visit_cluster(cloud, node->first, s))
+		{
+			s->stats->skipped += waiting;
+			return 1;
+		}
+	}
+	//the rest nearest first, all asked for at once so that reading them from disk overlaps
+	int i, j;
+	for (i = 1; i < waiting; i++)
+	{
+		for (j = i; j > 0 && deferred_t[j - 1] > deferred_t[j]; j--)
+		{
+			float t = deferred_t[j];
+			long long c = deferred[j];
+			deferred_t[j] = deferred_t[j - 1];
+			deferred[j] = deferred[j - 1];
+			deferred_t[j - 1] = t;
+			deferred[j - 1] = c;
+		}
+	}
+	for (i = 0; i < waiting && deferred_t[i] <= s->limit; i++)
+	{
+		prefetch_cluster(cloud, deferred[i]);
+	}
+	for (i = 0; i < waiting; i++)
+	{
+		if (deferred_t[i] > s->limit)
+		{
+			s->stats->skipped += waiting - i;
+			break;
+		}
+		if (visit_cluster(cloud, deferred[i], s))
+		{
+			s->stats->skipped += waiting - i - 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int visit_cluster(particle_cloud * cloud, long long c, hit_search * s)
+{
+	unsigned char flags = cloud->flags[c];
+	if (!(flags & CLUSTER_CHECKED))
+	{
+		flags |= CLUSTER_CHECKED | (check_cluster(&cloud->clusters[c], cloud->palette_size) ? 0 : CLUSTER_BAD);
+		if (flags & CLUSTER_BAD)
+		{
+			fprintf(stderr, "Skipping invalid cluster %lld of paged particle file '%s'\n", c, cloud->path);
+		}
+	}
+	cloud->flags[c] = flags | CLUSTER_RESIDENT;
+	return flags & CLUSTER_BAD ? 0 : search_cluster(&cloud->clusters[c], s);
+}
+
+void prefetch_cluster(particle_cloud * cloud, long long c)
+{
+	cloud_cluster * cl = &cloud->clusters[c];
+	unsigned char * start = (unsigned char *) cl->nodes;
+	unsigned char * page = cloud->map + (start - cloud->map) / cloud->page_size * cloud->page_size;
+	madvise(page, start - page + cluster_bytes(cl->count, cl->node_count, cloud->palette_size), MADV_WILLNEED);
+}
+
+void refresh_particle_residency(particle_cloud * cloud)
+{
+	if (!cloud->map)
+	{
+		return;
+	}
+	size_t pages = (cloud->map_len + cloud->page_size - 1) / cloud->page_size;
+	unsigned char * in_memory = (unsigned char *) malloc(pages);
+	if (mincore(cloud->map, cloud->map_len, in_memory))
+	{
+		free(in_memory);
+		return;
+	}
+	long long c;
+	for (c = 0; c < cloud->cluster_count; c++)
+	{
+		cloud_cluster * cl = &cloud->clusters[c];
+		size_t start = ((unsigned char *) cl->nodes - cloud->map) / cloud->page_size;
+		size_t end = ((unsigned char *) cl->nodes - cloud->map + cluster_bytes(cl->count, cl->node_count, cloud->palette_size) +
+			cloud->page_size - 1) / cloud->page_size;
+		size_t p;
+		for (p = start; p < end && (in_memory[p] & 1); p++)
+		{
+		}
+		cloud->flags[c] = p == end ? cloud->flags[c] | CLUSTER_RESIDENT : cloud->flags[c] & ~CLUSTER_RESIDENT;
+	}
+	free(in_memory);
+}
+
+int cloud_closest_hit(particle_cloud * cloud, vec_d * origin, vec_d * dir, double * dist, vec_d * position, vec_d * normal,
+	material ** mat, cloud_stats * stats)
+{
+	hit_search s;
+	init_search(&s, origin, dir, *dist, 0, stats);
+	search_cloud(cloud, &s);
+	if (!s.best_cluster)
+	{
+		return 0;
+	}
+	sphere sph;
+	sph.center.x = s.best_cluster->x[s.best];
+	sph.center.y = s.best_cluster->y[s.best];
+	sph.center.z = s.best_cluster->z[s.best];
+	sph.radius = s.best_cluster->radius[s.best];
+	*dist = s.best_dist;
+	*position = s.best_position;
+	*normal = get_sphere_normal(&sph, &s.best_position);
+	*mat = s.best_cluster->colors ? &cloud->palette[s.best_cluster->colors[s.best]] : cloud->mat;
+	return 1;
+}
+
+int cloud_any_hit(particle_cloud * cloud, vec_d * origin, vec_d * dir, double max_dist, cloud_stats * stats)
+{
+	hit_search s;
+	init_search(&s, origin, dir, max_dist, 1, stats);
+	return search_cloud(cloud, &s);
+}
+
+long long particle_count(particle_cloud * cloud)
+{
+	return cloud->count;
+}
+
+long long particle_cluster_count(particle_cloud * cloud)
+{
+	return cloud->cluster_count;
+}
+
+int particle_cluster_size(particle_cloud * cloud, long long cluster)
+{
+	return cloud->clusters[cluster].count;
+}
+
+void get_particle(particle_cloud * cloud, long long cluster, int i, vec_d * center, double * radius)
+{
+	cloud_cluster * cl = &cloud->clusters[cluster];
+	center->x = cl->x[i];
+	center->y = cl->y[i];
+	center->z = cl->z[i];
+	*radius = cl->radius[i];
+}
+
+void particle_cloud_bounds(particle_cloud * cloud, vec_d * lo, vec_d * hi)
+{
+	if (!cloud->count)
+	{
+		lo->x = lo->y = lo->z = hi->x = hi->y = hi->z = 0;
+		return;
+	}
+	cloud_node * root = cloud->top ? &cloud->top[0] : &cloud->clusters[0].nodes[0];
+	lo->x = root->lo[0];
+	lo->y = root->lo[1];
+	lo->z = root->lo[2];
+	hi->x = root->hi[0];
+	hi->y = root->hi[1];
+	hi->z = root->hi[2];
+}
+
+unsigned long long particle_cloud_hash(unsigned long long h, particle_cloud * cloud)
+{
+	h = hash_bytes(h, &cloud->count, sizeof(long long));
+	h = hash_bytes(h, &cloud->palette_size, sizeof(int));
+	h = hash_bytes(h, cloud->palette_colors, sizeof(float) * 3 * cloud->palette_size);
+	if (cloud->map)
+	{
+		h = hash_bytes(h, &cloud->particle_hash, sizeof(unsigned long long));
+	}
+	else
+	{
+		cloud_cluster * cl = &cloud->clusters[0];
+		h = hash_bytes(h, cl->x, sizeof(float) * cl->count);
+		h = hash_bytes(h, cl->y, sizeof(float) * cl->count);
+		h = hash_bytes(h, cl->z, sizeof(float) * cl->count);
+		h = hash_bytes(h, cl->radius, sizeof(float) * cl->count);
+		if (cl->colors)
+		{
+			h = hash_bytes(h, cl->colors, cl->count);
+		}
+	}
+	material * m = cloud->mat;
+	double values[10] = {m->refl.r, m->refl.g, m->refl.b, m->diff.r, m->diff.g, m->diff.b, m->spec.r, m->spec.g, m->spec.b, m->p_const};
+	int i;
+	for (i = 0; i < 10; i++)
+	{
+		h = hash_double(h, values[i]);
+	}
+	return h;
+}
+
+int same_particle_cloud(particle_cloud * a, particle_cloud * b)
+{
+	if (a->count != b->count || a->palette_size != b->palette_size || !a->map != !b->map ||
+		particle_cloud_hash(0, a) != particle_cloud_hash(0, b))
+	{
+		return 0;
+	}
+	if (a->map)
+	{
+		return a->particle_hash == b->particle_hash;
+	}
+	cloud_cluster * ca = &a->clusters[0], * cb = &b->clusters[0];
+	size_t n = ca->count;
+	return !memcmp(a->palette_colors, b->palette_colors, sizeof(float) * 3 * a->palette_size) &&
+		!memcmp(ca->x, cb->x, sizeof(float) * n) && !memcmp(ca->y, cb->y, sizeof(float) * n) &&
+		!memcmp(ca->z, cb->z, sizeof(float) * n) && !memcmp(ca->radius, cb->radius, sizeof(float) * n) &&
+		(!ca->colors || !memcmp(ca->colors, cb->colors, n));
+}
+
+size_t pack_particle_cloud(particle_cloud * cloud, void * buf)
+{
+	cloud_cluster * cl = &cloud->clusters[0];
+	size_t n = cloud->map ? 0 : cl->count;
+	//the hierarchy is sent along, so that the receiver tests the particles in exactly the same order. A paged
+	//cloud sends its path and the hash of its particles instead, for the receiver to map the same file
+	size_t sizes[9] = {sizeof(long long) * 4, sizeof(double) * 10, sizeof(float) * 3 * cloud->palette_size,
+		cloud->map ? strlen(cloud->path) + 1 : sizeof(float) * n, sizeof(float) * n, sizeof(float) * n, sizeof(float) * n,
+		cloud->map || !cl->colors ? 0 : n, cloud->map ? 0 : sizeof(cloud_node) * cl->node_count};
+	size_t total = 0;
+	int i;
+	for (i = 0; i < 9; i++)
+	{
+		total += sizes[i];
+	}
+	total = (total + 7) & ~(size_t) 7;
+	if (!buf)
+	{
+		return total;
+	}
+	material * m = cloud->mat;
+	long long header[4] = {cloud->map ? -1 : (long long) n, cloud->palette_size, cloud->map ? 0 : cl->node_count,
+		(long long) cloud->particle_hash};
+	double values[10] = {m->refl.r, m->refl.g, m->refl.b, m->diff.r, m->diff.g, m->diff.b, m->spec.r, m->spec.g, m->spec.b, m->p_const};
+	void * parts[9] = {header, values, cloud->palette_colors, cloud->map ? (void *) cloud->path : (void *) cl->x, cl->y, cl->z,
+		cl->radius, cl->colors, cl->nodes};
+	char * p = (char *) buf;
+	memset(buf, 0, total);
+	for (i = 0; i < 9; i++)
+	{
+		if (sizes[i])
+		{
+			memcpy(p, parts[i], sizes[i]);
+		}
+		p += sizes[i];
+	}
+	return total;
+}
+
+particle_cloud * unpack_particle_cloud(void * buf, size_t len, size_t * used)
+{
+	long long header[4];
+	double values[10];
+	if (len < sizeof(header) + sizeof(values))
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Packed particle cloud is cut short");
+		return NULL;
+	}
+	memcpy(header, buf, sizeof(header));
+	memcpy(values, (char *) buf + sizeof(header), sizeof(values));
+	material * mat = (material *) malloc(sizeof(material));
+	init_material(mat);
+	mat->refl.r = values[0];
+	mat->refl.g = values[1];
+	mat->refl.b = values[2];
+	mat->diff.r = values[3];
+	mat->diff.g = values[4];
+	mat->diff.b = values[5];
+	mat->spec.r = values[6];
+	mat->spec.g = values[7];
+	mat->spec.b = values[8];
+	mat->p_const = values[9];
+	compile_material(mat);
+	char * p = (char *) buf + sizeof(header) + sizeof(values);
+	size_t left = len - sizeof(header) - sizeof(values);
+	if (header[1] < 0 || header[1] > MAX_PARTICLE_PALETTE || left < sizeof(float) * 3 * header[1])
+	{
+		snprintf(g_particle_err, LEN_ERROR, "Packed particle cloud is cut short");
+		free(mat);
+		return NULL;
+	}
+	//the palette is sent for flat clouds only to be compared here, a paged one reads its own
+	p += sizeof(float) * 3 * header[1];
+	left -= sizeof(float) * 3 * header[1];
+	particle_cloud * cloud;
+	if (header[0] < 0)
+	{
+		char * path = p;
+		size_t path_len = strnlen(path, left);
+		if (path_len == left)
+		{
+			snprintf(g_particle_err, LEN_ERROR, "Packed particle cloud is cut short");
+			free(mat);
+			return NULL;
+		}
+		cloud = load_particle_cloud(path, mat);
+		if (!cloud)
+		{
+			free(mat);
+			return NULL;
+		}
+		if (!cloud->map || cloud->particle_hash != (unsigned long long) header[3] || cloud->palette_size != header[1])
+		{
+			snprintf(g_particle_err, LEN_ERROR, "Paged particle file '%s' differs from the one packed", path);
+			destroy_particle_cloud(cloud);
+			return NULL;
+		}
+		p += path_len + 1;
+	}
+	else
+	{
+		size_t n = header[0];
+		if (header[0] > INT_MAX || header[2] < 1 || header[2] > 2 * header[0] + 1 ||
+			left < sizeof(float) * 4 * n + (header[1] ? n : 0) + sizeof(cloud_node) * header[2])
+		{
+			snprintf(g_particle_err, LEN_ERROR, "Packed particle cloud is cut short");
+			free(mat);
+			return NULL;
+		}
+		cloud = alloc_particle_cloud(header[1]);
+		memcpy(cloud->palette_colors, p - sizeof(float) * 3 * header[1], sizeof(float) * 3 * header[1]);
+		cloud->count = n;
+		cloud->cluster_count = 1;
+		cloud->clusters = (cloud_cluster *) calloc(1, sizeof(cloud_cluster));
+		cloud_cluster * cl = &cloud->clusters[0];
+		cl->count = n;
+		cl->node_count = header[2];
+		cl->nodes = (cloud_node *) malloc(sizeof(cloud_node) * cl->node_count);
+		cl->x = (float *) calloc(n + LANES, sizeof(float));
+		cl->y = (float *) calloc(n + LANES, sizeof(float));
+		cl->z = (float *) calloc(n + LANES, sizeof(float));
+		cl->radius = (float *) calloc(n + LANES, sizeof(float));
+		cl->colors = header[1] ? (unsigned char *) malloc(n ? n : 1) : NULL;
+		size_t sizes[6] = {sizeof(float) * n, sizeof(float) * n, sizeof(float) * n, sizeof(float) * n, cl->colors ? n : 0,
+			sizeof(cloud_node) * cl->node_count};
+		void * parts[6] = {cl->x, cl->y, cl->z, cl->radius, cl->colors, cl->nodes};
+		int i;
+		for (i = 0; i < 6; i++)
+		{
+			if (sizes[i])
+			{
+				memcpy(parts[i], p, sizes[i]);
+			}
+			p += sizes[i];
+		}
+		cloud->mat = mat;
+		//a hierarchy that points outside of its arrays would make the traversal read past them
+		if (!check_cluster(cl, cloud->palette_size))
+		{
+			snprintf(g_particle_err, LEN_ERROR, "Packed particle cloud has an invalid hierarchy or color");
+			destroy_particle_cloud(cloud);
+			return NULL;
+		}
+		compile_palette(cloud);
+	}
+	*used = ((size_t) (p - (char *) buf) + 7) & ~(size_t) 7;
+	return cloud;
+}
+
+size_t particle_cloud_memory(particle_cloud * cloud)
+{
+	size_t bytes = sizeof(particle_cloud) + sizeof(material) * (cloud->palette_size + 1) +
+		sizeof(float) * 3 * cloud->palette_size;
+	if (cloud->map)
+	{
+		return bytes + (sizeof(cloud_cluster) + 1) * cloud->cluster_count + sizeof(cloud_node) * cloud->top_count;
+	}
+	cloud_cluster * cl = &cloud->clusters[0];
+	return bytes + sizeof(cloud_cluster) + sizeof(float) * 4 * ((size_t) cl->count + LANES) + (cl->colors ? cl->count : 0) +
+		sizeof(cloud_node) * cl->node_count;
+}
+
+size_t particle_cloud_mapped(particle_cloud * cloud)
+{
+	return cloud->map_len;
+}
@@ -0,0 +1,220 @@
+#ifndef PARTICLES_H_
+#define PARTICLES_H_
+
+#include <stddef.h>
+#include "scene.h"
+
+//the largest palette a particle file can have, so that a color index fits in a byte
+#define MAX_PARTICLE_PALETTE 256
+//the particles per cluster paged files are best written with: a few pages, read from disk as one
+#define PAGED_CLUSTER_SIZE 1024
+
+/**
+* Particle files hold, in the byte order of the machine:
+*   the 4 characters PCLD
+*   int count, the number of particles
+*   int palette_size, 0 when every particle has the material of the cloud
+*   float palette[palette_size][3], the diffuse colors particles can have
+*   float x[count], float y[count], float z[count], float radius[count]
+*   unsigned char color[count], the palette entry of every particle, only when palette_size is above 0
+*
+* A loaded cloud keeps the particles in the same arrays, reordered along a bounding volume hierarchy whose leaves
+* hold a few particles each, and tests them in groups with vector instructions.
+*
+* Paged particle files, starting with the 4 characters PCPG, hold clouds larger than memory. They are written by
+* begin_paged_cloud and friends, in clusters of particles that each have their own hierarchy and start on a page
+* of their own. Only the hierarchy over the clusters is read into memory; the file is mapped and a cluster is only
+* read from disk when a ray gets to it. Rays put off the clusters that are not in memory yet until they are done
+* with the ones that are, then ask for all of them at once, and never read those beyond the hit they found
+*/
+
+/**
+* the work done by searches of a cloud, added to by every search
+*/
+typedef struct
+{
+	unsigned long long tests;
+	unsigned long long visits;
+	//clusters of paged clouds put off because they were not in memory, and those of them never read in the end
+	unsigned long long deferred;
+	unsigned long long skipped;
+} cloud_stats;
+
+/**
+* Reads a particle file or maps a paged one, and builds the hierarchy over its particles for the first
+*
+* @param char * path the file
+* @param material * mat the material of every particle, whose diffuse color is replaced by the palette entry
+* when the file has a palette. The cloud takes ownership of it, unless loading fails
+*
+* @return particle_cloud * the cloud, NULL if the file can't be read or is not a valid particle file, see
+* get_particle_error
+*/
+particle_cloud * load_particle_cloud(char * path, material * mat);
+
+/**
+* Builds a cloud from particles in memory, with no palette
+*
+* @param int count the number of particles
+* @param float * x, y, z, radius the particles, which are copied
+* @param material * mat the material of every particle. The cloud takes ownership of it
+*
+* @return particle_cloud * the cloud
+*/
+particle_cloud * make_particle_cloud(int count, float * x, float * y, float * z, float * radius, material * mat);
+
+/**
+* Gets the reason the last load_particle_cloud, unpack_particle_cloud or paged file write failed
+*
+* @return char * the message
+*/
+char * get_particle_error();
+
+/**
+* Frees a cloud and its material, unmapping the file of a paged one
+*
+* @param particle_cloud * cloud the cloud
+*/
+void destroy_particle_cloud(particle_cloud * cloud);
+
+/**
+* Writes a paged particle file one cluster at a time, so that the whole cloud never has to be in memory.
+* Clusters should be spatially compact, like the cells of a grid, for rays to need few of them
+*/
+typedef struct paged_writer paged_writer;
+
+/**
+* Starts a paged particle file
+*
+* @param char * path the file
+* @param int palette_size the number of palette colors, 0 for none
+* @param float * palette palette_size colors of 3 floats
+*
+* @return paged_writer * the writer, NULL if the file can't be created, see get_particle_error
+*/
+paged_writer * begin_paged_cloud(char * path, int palette_size, float * palette);
+
+/**
+* Adds a cluster of particles to a paged particle file
+*
+* @param paged_writer * writer the writer
+* @param int count the number of particles, best PAGED_CLUSTER_SIZE or a little fewer
+* @param float * x, y, z, radius the particles
+* @param unsigned char * colors the palette entry of every particle, NULL when the file has no palette
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int add_paged_cluster(paged_writer * writer, int count, float * x, float * y, float * z, float * radius, unsigned char * colors);
+
+/**
+* Writes the hierarchy over the clusters and finishes the file. The writer is freed either way
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int finish_paged_cloud(paged_writer * writer);
+
+/**
+* Finds the particle a ray hits first, treating every particle like sphere_collide treats a sphere
+*
+* @param particle_cloud * cloud the cloud
+* @param vec_d * origin the start of the ray
+* @param vec_d * dir the direction of the ray, normalized
+* @param double * dist the distance to beat, set to the distance of the hit when a particle is closer
+* @param vec_d * position set to where the ray hits the particle
+* @param vec_d * normal set to the normal of the particle there
+* @param material ** mat set to the material of the particle
+* @param cloud_stats * stats added to
+*
+* @return int 0 if no particle is hit closer than dist, positive number if one is
+*/
+int cloud_closest_hit(particle_cloud * cloud, vec_d * origin, vec_d * dir, double * dist, vec_d * position, vec_d * normal,
+	material ** mat, cloud_stats * stats);
+
+/**
+* Checks whether a ray hits any particle closer than a distance
+*
+* @param double max_dist how far along the ray particles count, DBL_MAX for the whole ray
+*
+* @return int 0 if it hits none, positive number if it does. The other parameters are those of cloud_closest_hit
+*/
+int cloud_any_hit(particle_cloud * cloud, vec_d * origin, vec_d * dir, double max_dist, cloud_stats * stats);
+
+/**
+* Finds out again which clusters of a paged cloud are in memory, as pages read earlier may have been dropped.
+* Does nothing for other clouds
+*
+* @param particle_cloud * cloud the cloud
+*/
+void refresh_particle_residency(particle_cloud * cloud);
+
+/**
+* Gets the number of particles of a cloud
+*/
+long long particle_count(particle_cloud * cloud);
+
+/**
+* Gets the number of clusters of a cloud, 1 unless it is paged, and the number of particles in one of them
+*/
+long long particle_cluster_count(particle_cloud * cloud);
+int particle_cluster_size(particle_cloud * cloud, long long cluster);
+
+/**
+* Gets one particle of a cloud, in the order of the hierarchy
+*
+* @param particle_cloud * cloud the cloud
+* @param long long cluster the cluster of the particle
+* @param int i the particle in the cluster
+* @param vec_d * center set to its center
+* @param double * radius set to its radius
+*/
+void get_particle(particle_cloud * cloud, long long cluster, int i, vec_d * center, double * radius);
+
+/**
+* Gets the box around every particle of a cloud
+*/
+void particle_cloud_bounds(particle_cloud * cloud, vec_d * lo, vec_d * hi);
+
+/**
+* Hashes and compares clouds by their particles, palette and material. Paged clouds are hashed by the hash of their
+* particles stored in the file, so that this doesn't read all of it
+*/
+unsigned long long particle_cloud_hash(unsigned long long h, particle_cloud * cloud);
+int same_particle_cloud(particle_cloud * a, particle_cloud * b);
+
+/**
+* Packs a cloud for serialize_scene. A paged cloud is packed as the path of its file, which the receiver has to
+* be able to open as well
+*
+* @param particle_cloud * cloud the cloud
+* @param void * buf where to pack it, NULL to only get the size
+*
+* @return size_t the number of bytes packed, always a multiple of 8
+*/
+size_t pack_particle_cloud(particle_cloud * cloud, void * buf);
+
+/**
+* Rebuilds a cloud packed by pack_particle_cloud
+*
+* @param void * buf the packed cloud
+* @param size_t len the bytes left in the buffer
+* @param size_t * used set to the bytes the cloud took
+*
+* @return particle_cloud * the cloud, NULL if buf does not hold a valid cloud
+*/
+particle_cloud * unpack_particle_cloud(void * buf, size_t len, size_t * used);
+
+/**
+* Gets the memory a cloud keeps allocated: particles and hierarchy, only the hierarchy over the clusters when paged
+*
+* @return size_t the bytes
+*/
+size_t particle_cloud_memory(particle_cloud * cloud);
+
+/**
+* Gets the size of the file a paged cloud maps
+*
+* @return size_t the bytes, 0 when the cloud is not paged
+*/
+size_t particle_cloud_mapped(particle_cloud * cloud);
+
+#endif
@@ -1,8 +1,29 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <float.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "ray.h"
+#include "particles.h"
+#include "timeline.h"
+
+#define DEFAULT_TILE_SIZE 32
+#define DEFAULT_AA_CONTRAST 0.1
+//how many lights one occlusion query tests at once, one bit each
+#define LIGHT_BATCH 64
+//how many point lights are picked from the light tree at every hit
+#define DEFAULT_LIGHT_SAMPLES 8
+//the shadow rays to every area light, as a grid of strata
+#define DEFAULT_AREA_SAMPLES 16
+#define MAX_AREA_GRID 16
+//the strata every area light is probed at before the others
+#define AREA_PROBES 5
+
+//how far from the points hit the rays leaving them start, and then some, for footprint_meets_box
+#define FOOTPRINT_MARGIN 0.01
 
 #define max(a, b) (a > b ? a : b)
 #define min(a, b) (a < b ? a : b)
@@ -21,6 +42,472 @@ typedef struct
 	vec_d_2D p3;
 } triangle_2D;
 
+/**
+* size of a pixel on the view plane, shared by every primary ray of an image
+*/
+typedef struct
+{
+	double x_step;
+	double y_step;
+	int res_x;
+	int res_y;
+} view_plane;
+
+/**
+* state carried down a ray tree while tracing it. hit_prims, when not NULL, is a bitset in which
+* every primitive hit by a primary or reflection ray is marked. stats are the counters of the tracing thread.
+* tests counts the intersection tests done for the ray tree. capture, when not NULL, records every ray cast.
+* primary_hit is set to 1 + the primitive id the root ray hits, 0 if it hits nothing.
+* last_occluder holds for every light 1 + the id of the primitive that last blocked it, 0 for none.
+* shadow_maps, when not NULL, answer light visibility wherever they can.
+* When light_tree is set, every hit shades light_samples point lights picked from it with random numbers from rng.
+* Area lights are sampled on an area_grid x area_grid grid, probed at its corners first when area_adaptive is set.
+* When aovs is set, the first hit of the root ray is stored in its planes at aov_pixel.
+* kernels, when not NULL, search the spheres and triangles instead of the generic loops.
+* footprint, when not NULL, is grown by every ray of the tile being traced, see record_footprint
+*/
+typedef struct
+{
+	unsigned char * hit_prims;
+	render_stats * stats;
+	unsigned long long tests;
+	capture_buffer * capture;
+	int primary_hit;
+	int * last_occluder;
+	shadow_maps * shadow_maps;
+	light_tree * light_tree;
+	int light_samples;
+	unsigned long long rng;
+	int area_grid;
+	int area_adaptive;
+	aov_planes * aovs;
+	int aov_pixel;
+	scene_kernels * kernels;
+	tile_footprint * footprint;
+} trace_ctx;
+
+//the passes over the tiles of an image. Only adaptive anti-aliasing makes a second pass,
+//progressive rendering makes PASS_PROGRESSIVE passes until its deadline
+#define PASS_TRACE 0
+#define PASS_REFINE 1
+#define PASS_PROGRESSIVE 2
+
+//the pixel spacing of the first progressive pass. Each following pass halves it until every pixel is traced
+#define COARSE_STEP 8
+//after its center, the samples of a pixel go through the cells of a STRATA x STRATA grid, jittered after the first round
+#define STRATA 4
+
+/**
+* the pixels whose primary rays can hit a primitive, x1 and y1 exclusive
+*/
+typedef struct
+{
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} screen_bounds;
+
+/**
+* the work shared between all render threads. next_tile is protected by lock, or by the pool lock when rendering on a pool.
+* With adaptive anti-aliasing the first pass stores the primitive hit through every pixel center in prim_ids,
+* and the refining pass compares neighbors in first_pass, a copy of the first pass image.
+* A progressive render sums the samples of every pixel in accum and counts them in samples; step is the pixel spacing
+* of a coarse pass, 0 once every pixel has its first sample and each pass adds one more. Once the clock passes deadline, expired is set and the
+* remaining pixels of the pass are left as they are. Render threads set and read expired with atomic operations.
+* When the first hits come from a visibility buffer, bounds holds the pixels every primitive can cover and
+* raster_tests counts the primary ray tests it took
+*/
+struct tile_queue
+{
+	scene * scn;
+	color * pixels;
+	render_opts * opts;
+	int tile_count;
+	int next_tile;
+	int finished;
+	render_stats * thread_stats;
+	int next_slot;
+	int pass;
+	int adaptive;
+	int * prim_ids;
+	color * first_pass;
+	long long aa_rays;
+	long long aa_pixels;
+	color * accum;
+	int * samples;
+	int step;
+	long long deadline;
+	int expired;
+	screen_bounds * bounds;
+	long long raster_tests;
+	pthread_mutex_t lock;
+	struct tile_queue * next;
+};
+
+typedef struct tile_queue tile_queue;
+
+/**
+* adds the light of one unblocked light to a hit, for one feature set of materials, see g_light_kernels
+*/
+typedef void (* light_kernel)(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt);
+
+//a wavefront tile shades its hits in bins by these features of their material and primitive, misses come last
+#define SHADE_DIFFUSE MAT_DIFFUSE
+#define SHADE_SPECULAR MAT_SPECULAR
+#define SHADE_REFLECTIVE MAT_REFLECTIVE
+#define SHADE_TRIANGLE 8
+#define SHADE_MISS 16
+
+//the hits of a bin are lit this many at a time, one to a lane
+#define SHADE_LANES 4
+
+/**
+* SHADE_LANES doubles, or as many masks of all ones or all zeros, handled with one instruction per operation where the
+* target has vector registers for them
+*/
+typedef double lane_d __attribute__((vector_size(SHADE_LANES * sizeof(double))));
+typedef long long lane_m __attribute__((vector_size(SHADE_LANES * sizeof(long long))));
+
+/**
+* a ray of a wavefront tile and what it hits. For a hit, position, normal and mat are those check_collide gives
+* and origin is where its shadow and reflection rays start. child is the index in the next wave of its reflection,
+* -1 if it has none. pixel is only used in the first wave
+*/
+typedef struct
+{
+	ray_d ray;
+	int pixel;
+	int hit;
+	int child;
+	vec_d position;
+	vec_d normal;
+	vec_d origin;
+	vec_d to_camera;
+	material * mat;
+	color c;
+} wave_ray;
+
+/**
+* a shadow ray waiting in the queue of a wave. index is the ray's index in the wave times the light count plus the light
+*/
+typedef struct
+{
+	ray_d ray;
+	int index;
+} shadow_query;
+
+/**
+* long lived render threads that take tiles from every image queued on the pool, oldest image first
+*/
+struct render_pool
+{
+	pthread_t * threads;
+	int thread_count;
+	int next_index;
+	int stopping;
+	tile_queue * jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+/**
+* Calculates the size of a pixel on the view plane
+*
+* @param view_plane * view the view plane to set up
+* @param scene * scn the scene, for its field of view
+* @param int res_x the width in pixels of the output
+* @param int res_y the height in pixels of the output
+*/
+void init_view(view_plane * view, scene * scn, int res_x, int res_y);
+
+/**
+* Builds the ray from the camera through a point on a pixel
+*
+* @param scene * scn the scene, for its camera
+* @param view_plane * view the view plane
+* @param int x the pixel column
+* @param int y the pixel row, 0 is the top
+* @param double sub_x where in the pixel the ray passes, 0 is the left edge and 1 the right edge
+* @param double sub_y where in the pixel the ray passes, 0 is the top edge and 1 the bottom edge
+* @param ray_d * ray where the ray is stored
+*/
+void primary_ray(scene * scn, view_plane * view, int x, int y, double sub_x, double sub_y, ray_d * ray);
+
+/**
+* Render thread entry point. Keeps taking tiles from the queue until there are none left
+*
+* @param void * arg the tile_queue
+*
+* @return void * always NULL
+*/
+void * render_thread(void * arg);
+
+/**
+* Renders one tile of a queue unless it is already done or outside of the crop window
+*
+* @param tile_queue * queue the image being rendered
+* @param int index the tile number
+* @param int slot which of the queue's thread_stats the calling thread counts in
+*/
+void render_queued_tile(tile_queue * queue, int index, int slot);
+
+/**
+* Pool thread entry point. Renders tiles from the queued images until the pool is destroyed
+*
+* @param void * arg the render_pool
+*
+* @return void * always NULL
+*/
+void * pool_thread(void * arg);
+
+/**
+* Renders an image on a pool, returning once all of its tiles are finished
+*
+* @param render_pool * pool the pool
+* @param tile_queue * queue the image to render
+*/
+void pool_trace(render_pool * pool, tile_queue * queue);
+
+/**
+* Sets up a queue for one pass over the tiles of an image
+*
+* @param tile_queue * queue the queue
+* @param scene * scn the scene to draw
+* @param color * pixels the framebuffer
+* @param render_opts * opts the render options
+* @param int pass PASS_TRACE, PASS_REFINE or PASS_PROGRESSIVE
+*/
+void init_queue(tile_queue * queue, scene * scn, color * pixels, render_opts * opts, int pass);
+
+/**
+* Renders every tile of a queue on the pool or on new render threads, returning once all of them are finished
+*
+* @param tile_queue * queue the image to render
+*
+* @return int the number of threads that rendered
+*/
+int run_queue(tile_queue * queue);
+
+/**
+* Traces every pixel of one tile through its center
+*
+* @param scene * scn the scene to draw
+* @param render_opts * opts the render options
+* @param tile * t the tile
+* @param color * pixels the framebuffer
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+* @param int * prim_ids when not NULL, set to 1 + the primitive id seen through each pixel center, 0 for the background
+*/
+void render_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats, int * prim_ids);
+
+/**
+* Supersamples the pixels of a tile that lie on an edge of the first pass image: where the primitive seen through
+* a neighbor differs, or where a neighbor's color differs by more than opts->aa_contrast in any channel
+*
+* @param tile_queue * queue the image being rendered, after its first pass
+* @param tile * t the tile
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+*/
+void refine_tile(tile_queue * queue, tile * t, render_stats * stats);
+
+/**
+* Adds one progressive sample to every pixel of a tile, or during a coarse pass, traces the pixels on the pass's
+* grid that no earlier pass traced and fills the blocks they stand for. Stops early once the deadline passes
+*
+* @param tile_queue * queue the image being rendered
+* @param tile * t the tile
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+*/
+void progressive_tile(tile_queue * queue, tile * t, render_stats * stats);
+
+/**
+* Finds the pixels every primitive can cover on screen, by projecting the corners of its bounding box onto the
+* view plane the primary rays go through. A primitive reaching behind the camera may cover any pixel
+*
+* @param scene * scn the scene
+* @param render_opts * opts the render options
+*
+* @return screen_bounds * the bounds of every primitive, by primitive id
+*/
+screen_bounds * get_screen_bounds(scene * scn, render_opts * opts);
+
+/**
+* Finds the pixels the projection of a convex shape can cover, the way get_screen_bounds does for a primitive
+*
+* @param scene * scn the scene
+* @param render_opts * opts the render options
+* @param view_plane * view the view plane
+* @param vec_d * corners the corners of the shape
+* @param int corner_count the number of corners
+* @param screen_bounds * b where the bounds are stored, the whole image when a corner is not in front of the camera
+*/
+void project_bounds(scene * scn, render_opts * opts, view_plane * view, vec_d * corners, int corner_count, screen_bounds * b);
+
+/**
+* Empties a footprint, before the tile it belongs to is traced
+*/
+void clear_footprint(tile_footprint * f);
+
+/**
+* Adds a ray to the footprint of its tile: the point it hit, or that it left the scene when it is not a primary ray,
+* as primary rays are bounded by the view of the tile already
+*
+* @param tile_footprint * f the footprint
+* @param int depth the depth of the ray, 0 for a primary ray
+* @param int hit 1 + the primitive id hit, 0 if it hit nothing
+* @param vec_d * position where it hit
+*/
+void record_footprint(tile_footprint * f, int depth, int hit, vec_d * position);
+
+/**
+* Checks whether a ray from the origin meets a box
+*
+* @param vec_d * dir the direction of the ray
+* @param vec_d * lo the low corner of the box
+* @param vec_d * hi the high corner of the box
+*
+* @return int 0 if it misses the box, positive number if it meets it
+*/
+int ray_meets_box(vec_d * dir, vec_d * lo, vec_d * hi);
+
+/**
+* Checks whether a box meets the box around another box and a point
+*
+* @param vec_d * lo, hi the first box
+* @param vec_d * f_lo, f_hi the second box
+* @param vec_d * point the point, NULL for none
+*
+* @return int 0 if they are apart, positive number if they meet
+*/
+int boxes_meet(vec_d * lo, vec_d * hi, vec_d * f_lo, vec_d * f_hi, vec_d * point);
+
+/**
+* Projects a point onto the view plane the primary rays go through
+*
+* @param scene * scn the scene
+* @param view_plane * view the view plane
+* @param vec_d * point the point
+* @param double * x set to the pixel column the point is seen in, in fractions of a pixel
+* @param double * y set to the pixel row
+*
+* @return int 0 if no primary ray can reach the point, positive number if it is projected
+*/
+int project_point(scene * scn, view_plane * view, vec_d * point, double * x, double * y);
+
+/**
+* Traces every pixel of one tile through its center, taking the first hits from a visibility buffer of the tile.
+* The buffer is filled primitive by primitive, each one tested only against the pixels of its screen bounds and
+* kept where it is nearer than the hit so far, so every pixel gets the same hit as check_collide would give
+*
+* @param tile_queue * queue the image being rendered, with its bounds set
+* @param tile * t the tile
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+*/
+void raster_tile(tile_queue * queue, tile * t, render_stats * stats);
+
+/**
+* Traces every pixel of one tile through its center in waves. The primary rays of the whole tile are the first wave,
+* and the reflections of a wave's hits make up the next one. Each wave goes through an intersection stage, then
+* all of its shadow rays are resolved from one queue. Once the last wave is done, the waves are shaded from the
+* deepest up, each in bins of hits with the same shading features. Gives the same pixels as render_tile
+*
+* @param scene * scn the scene to draw
+* @param render_opts * opts the render options
+* @param tile * t the tile
+* @param color * pixels the framebuffer
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+* @param int * prim_ids when not NULL, set to 1 + the primitive id seen through each pixel center, 0 for the background
+*/
+void wavefront_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats, int * prim_ids);
+
+/**
+* Finds the closest hit of every ray of a wave, testing each primitive against the whole wave before moving on
+* to the next one. Sets hit, position, normal, mat and origin of every ray, with the same results as check_collide
+*
+* @param wave_ray * wave the rays
+* @param int count the number of rays
+* @param scene * scn the scene
+* @param trace_ctx * ctx state of the tile
+*/
+void intersect_wave(wave_ray * wave, int count, scene * scn, trace_ctx * ctx);
+
+/**
+* Resolves the shadow rays of every hit of a wave towards every light from one queue. Each query is first tested
+* against the primitive that last blocked its light, then the primitives are swept once over the queries left,
+* dropping each query as soon as it is blocked. Gives the same answers as check_lights_occluded
+*
+* @param wave_ray * wave the rays, after intersect_wave
+* @param int count the number of rays
+* @param scene * scn the scene
+* @param unsigned char * occluded set to 1 for every blocked light, scn->light_count entries per ray
+* @param int depth the recursion level of the wave
+* @param trace_ctx * ctx state of the tile
+*/
+void occlude_wave(wave_ray * wave, int count, scene * scn, unsigned char * occluded, int depth, trace_ctx * ctx);
+
+/**
+* Shades the rays of a wave the way trace_ray does, sorted by their SHADE_ features so that every bin runs one
+* kernel over many hits, light by light. The reflections of the wave must be shaded already
+*
+* @param wave_ray * wave the rays, after intersect_wave
+* @param int count the number of rays
+* @param wave_ray * next the next wave, holding the shaded reflections
+* @param scene * scn the scene
+* @param unsigned char * occluded the blocked lights, from occlude_wave
+*/
+void shade_wave(wave_ray * wave, int count, wave_ray * next, scene * scn, unsigned char * occluded);
+
+/**
+* Adds the lights and reflections of up to SHADE_LANES hits of one bin at once, with their normals, directions to the
+* camera, material colors and sums laid out one lane per hit. Every lane does the operations of the light kernels
+* in the same order, so the sums are the ones a hit shaded on its own gets
+*
+* @param wave_ray * wave the rays of the wave
+* @param int * order the indices in the wave of the hits
+* @param int count the number of hits, at most SHADE_LANES
+* @param int bin the SHADE_ features of the bin
+* @param wave_ray * next the next wave, holding the shaded reflections
+* @param scene * scn the scene
+* @param unsigned char * occluded the blocked lights, from occlude_wave
+*/
+void shade_lanes(wave_ray * wave, int * order, int count, int bin, wave_ray * next, scene * scn,
+	unsigned char * occluded);
+
+/**
+* Gets the SHADE_ features of a ray of a wave, after its reflections are known
+*
+* @param wave_ray * ray the ray
+* @param scene * scn the scene
+*
+* @return int the features, SHADE_MISS for a ray that hits nothing
+*/
+int get_shade_bin(wave_ray * ray, scene * scn);
+
+/**
+* Gets the time on a monotonic clock
+*
+* @return long long nanoseconds
+*/
+long long monotonic_ns(void);
+
+/**
+* Gives a queue one set of counters per render thread when statistics are wanted and they can be allocated
+*
+* @param tile_queue * queue the image to render
+* @param int slots the number of render threads
+*/
+void init_thread_stats(tile_queue * queue, int slots);
+
+/**
+* Adds the counters of every render thread to opts->stats and frees them
+*
+* @param tile_queue * queue the rendered image
+* @param int slots the number of render threads
+*/
+void merge_thread_stats(tile_queue * queue, int slots);
+
 /**
 * Recursively traces a single ray
 *
@@ -28,10 +515,40 @@ typedef struct
 * @param scene trace_scene the scene to draw
 * @param int max_depth recursion depth
 * @param int depth current recursion level
+* @param trace_ctx * ctx state for the whole ray tree
 *
 * @return int 0 if it fails, positive number if it succeeds
 */
-int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth);
+int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth, trace_ctx * ctx);
+
+/**
+* Colors a ray whose first hit is already known, tracing its shadow and reflection rays
+*
+* @param ray_node * ray A node on a ray tree
+* @param scene * scn the scene to draw
+* @param int max_depth recursion depth
+* @param int depth current recursion level
+* @param int hit 0 if the ray hits nothing, otherwise 1 + the primitive id of the object hit
+* @param vec_d * position where the ray hits
+* @param vec_d * normal the normal of the object where the ray hits
+* @param material * mat the material of the object hit
+* @param trace_ctx * ctx state for the whole ray tree
+*/
+void shade_hit(ray_node * ray, scene * scn, int max_depth, int depth, int hit, vec_d * position, vec_d * normal,
+	material * mat, trace_ctx * ctx);
+
+/**
+* Stores the first hit of the ray through a pixel center in the planes of an image
+*
+* @param aov_planes * aovs the planes
+* @param int pixel the index of the pixel
+* @param ray_d * ray the ray through its center
+* @param int hit 1 + the primitive id hit, 0 for none
+* @param vec_d * position where the ray hits, unused for none
+* @param vec_d * normal the normal there
+* @param material * mat the material hit
+*/
+void record_aovs(aov_planes * aovs, int pixel, ray_d * ray, int hit, vec_d * position, vec_d * normal, material * mat);
 
 /**
 * Checks for ray intersections with all objects in the scene.
@@ -41,36 +558,139 @@ int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth);
 * @param vec_d ** position The closest intersection with an object. Set by this function
 * @param vec_d ** normal The normal vector of the intersected object at *position. Set by this function
 * @param material ** mat The material of the intersected object. Set by this function
+* @param trace_ctx * ctx state for the whole ray tree
 *
-* @return int 0 if no collisions are detected, positive number if ray intersects an object
+* @return int 0 if no collisions are detected, otherwise 1 + the primitive id of the object the ray intersects
 */
-int check_collide(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat);
+int check_collide(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat, trace_ctx * ctx);
 
-int check_shadow_collide(ray_d * s_ray, scene * scn);
+int check_shadow_collide(ray_d * s_ray, scene * scn, trace_ctx * ctx);
 
 /**
-* Two similar functions, check if a ray intersects with a sphere/triangle
+* Checks which of a batch of lights are blocked from a point, in one pass over the primitives. The primitive that
+* last blocked a light is tested first, since neighboring pixels are usually shadowed by the same object.
+* Gives the same answers as a check_shadow_collide per light, except where ctx->shadow_maps answer instead
 *
-* @param ray_d * ray The ray
-* @param sphere/triangle * The object to compare the ray against
-* @param vec_d * position Where, if the ray intersects, the intersection happens
+* @param vec_d * origin where the shadow rays start
+* @param vec_d * normal the normal of the surface the rays start from
+* @param scene * scn the scene
+* @param int first the index of the first light of the batch
+* @param int count the number of lights in the batch, up to LIGHT_BATCH
+* @param trace_ctx * ctx state for the whole ray tree
 *
-* @return int 0 if the ray doesn't intersects the object, positive number if it does
+* @return unsigned long long a mask with bit i set if light first + i is blocked
 */
-int sphere_collide(ray_d * ray, sphere * sph, vec_d * position);
-int triangle_collide(ray_d * ray, triangle * tri, vec_d * position);
+unsigned long long check_lights_occluded(vec_d * origin, vec_d * normal, scene * scn, int first, int count, trace_ctx * ctx);
 
 /**
-* Calculates if a ray intersects with a plane defined by a point and a normal
-* 
-* @param ray_d * ray
-* @param vec_d * p_point an arbitrary point on a plane
-* @param vec_d * normal the normal vector of that plane
-* @param vec_d * position where the ray intersects the plane
+* Sets up the tracing state for the rays of one tile
+*
+* @param trace_ctx * ctx the state to set up
+* @param scene * scn the scene
+* @param render_opts * opts the render options
+* @param render_stats * stats counters owned by the calling thread, NULL to not count
+*/
+void init_trace_ctx(trace_ctx * ctx, scene * scn, render_opts * opts, render_stats * stats);
+
+/**
+* Starts the random numbers of one sample of a pixel from its coordinates
+*
+* @param trace_ctx * ctx the context whose generator is set
+* @param int x the pixel column
+* @param int y the pixel row
+* @param int sample which sample of the pixel is traced, 0 for the one through its center
+*/
+void seed_pixel(trace_ctx * ctx, int x, int y, int sample);
+
+/**
+* Gets the next number of the xorshift generator of a context
+*
+* @param trace_ctx * ctx the context
+*
+* @return double a number in [0, 1)
+*/
+double next_random(trace_ctx * ctx);
+
+/**
+* Adds the light of the point lights to a hit: all of them, or ctx->light_samples picked from ctx->light_tree, each
+* weighted by the inverse of the probability it was picked with. Lights behind the surface are left out
+*
+* @param color * c the color of the hit, added to
+* @param scene * scn the scene
+* @param vec_d * position the hit position
+* @param vec_d * origin the start of the shadow rays, just off the surface
+* @param vec_d * normal the normal at the hit
+* @param vec_d * to_camera the direction to the camera, only used for specular materials
+* @param material * mat the material hit
+* @param light_kernel kernel the light kernel of the material
+* @param int depth the depth of the ray that hit, for the captured shadow rays
+* @param trace_ctx * ctx the tracing state
+*/
+void shade_point_lights(color * c, scene * scn, vec_d * position, vec_d * origin, vec_d * normal, vec_d * to_camera,
+	material * mat, light_kernel kernel, int depth, trace_ctx * ctx);
+
+/**
+* Checks whether any object lies between a point and a point light, recording the shadow ray when rays are captured
+*
+* @param vec_d * origin the start of the shadow ray
+* @param vec_d * target the position of the light
+* @param scene * scn the scene
+* @param int depth the reflection depth of the shadow ray
+* @param trace_ctx * ctx the tracing state
+*
+* @return int 0 if nothing is in between, positive number if something is
+*/
+int check_point_occluded(vec_d * origin, vec_d * target, scene * scn, int depth, trace_ctx * ctx);
+
+/**
+* Checks whether a shadow ray hits any object closer than max_dist
+*
+* @param ray_d * s_ray the shadow ray, its direction normalized
+* @param double max_dist how far the ray reaches
+* @param scene * scn the scene
+* @param trace_ctx * ctx the tracing state
+*
+* @return int 0 if nothing is that close, positive number if something is
+*/
+int check_occluded_within(ray_d * s_ray, double max_dist, scene * scn, trace_ctx * ctx);
+
+/**
+* Checks whether a shadow ray hits a particle of a cloud closer than max_dist, counting the tests in ctx
+*
+* @return int positive number if it does
+*/
+int cloud_hit_by(ray_d * ray, particle_cloud * cloud, double max_dist, trace_ctx * ctx);
+
+/**
+* Adds the work of searches of a cloud to the counters of ctx
+*/
+void add_cloud_stats(trace_ctx * ctx, cloud_stats * stats);
+
+/**
+* Adds the light of the area lights to a hit. Every area light is split into a grid of strata with one jittered point
+* each, and every stratum facing the surface brings its share of the light where it is visible. The parameters are
+* those of shade_point_lights
+*/
+void shade_area_lights(color * c, scene * scn, vec_d * position, vec_d * origin, vec_d * normal, vec_d * to_camera,
+	material * mat, light_kernel kernel, int depth, trace_ctx * ctx);
+
+/**
+* Gets a point on an area light
+*
+* @param area_light * al the light
+* @param double s where along the first edge of a rectangle, or the square of the distance from the center of a disk
+* @param double t where along the second edge of a rectangle, or the angle around a disk in turns
 *
-* @return int 0 if the ray doesn't intersect, positive number if it does
+* @return vec_d the point
 */
-int plane_collide(ray_d * ray, vec_d * p_point, vec_d * p_normal, vec_d * position);
+vec_d area_light_point(area_light * al, double s, double t);
+
+/**
+* Frees what init_trace_ctx allocated
+*
+* @param trace_ctx * ctx the state
+*/
+void free_trace_ctx(trace_ctx * ctx);
 
 /***/
 void check_cross(vec_d_2D * p1, vec_d_2D * p2, int * cross_count, int * sign);
@@ -95,66 +715,1675 @@ void destroy_node(ray_node * node);
 void project_2D(triangle * tri, vec_d * vec, triangle_2D * tri_proj, vec_d_2D * vec_proj);
 
 
-void calculateAmbient(color * c, material * mat, color * amb_light);
-void calculateDiffuse(color * c, material * mat, vec_d * normal, light * lights);
-void calculateSpecular(vec_d * position, color * c, material * mat, vec_d * normal, light * lgt, camera * cam);
-void clamp_color(color * c);
+void calculateAmbient(color * c, material * mat, color * amb_light);
+void calculateDiffuse(color * c, material * mat, vec_d * normal, light * lights);
+void calculateSpecular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt);
+void clamp_color(color * c);
+
+/**
+* Raises a number to a material's Phong constant, by repeated squaring when the constant is a whole number
+*
+* @param double x the base
+* @param material * mat the material
+*
+* @return double x to the power of mat->p_const
+*/
+double phong_power(double x, material * mat);
+
+/**
+* The light kernels of the material feature sets, adding what one unblocked light gives a hit on a diffuse,
+* a specular, or a diffuse and specular material
+*
+* @param color * c the color of the hit
+* @param material * mat the material
+* @param vec_d * normal the normal at the hit
+* @param vec_d * to_camera the unit vector from the hit to the camera, only used by specular materials
+* @param light * lgt the light
+*/
+void light_diffuse(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt);
+void light_specular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt);
+void light_diffuse_specular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt);
+
+//the light kernel of every combination of MAT_DIFFUSE and MAT_SPECULAR, none for a material with neither
+light_kernel g_light_kernels[4] = {NULL, light_diffuse, light_specular, light_diffuse_specular};
+
+void init_render_opts(render_opts * opts, int res_x, int res_y)
+{
+	opts->res_x = res_x;
+	opts->res_y = res_y;
+	opts->depth = 5;
+	opts->verbose = 0;
+	opts->threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (opts->threads < 1)
+	{
+		opts->threads = 1;
+	}
+	opts->tile_size = DEFAULT_TILE_SIZE;
+	opts->crop_x0 = 0;
+	opts->crop_y0 = 0;
+	opts->crop_x1 = res_x;
+	opts->crop_y1 = res_y;
+	opts->tile_done = NULL;
+	opts->on_tile = NULL;
+	opts->on_tile_ctx = NULL;
+	opts->pool = NULL;
+	opts->hit_records = NULL;
+	opts->stats = NULL;
+	opts->pixel_cost = NULL;
+	opts->cost_metric = COST_TESTS;
+	opts->capture = NULL;
+	opts->aa_samples = 1;
+	opts->aa_contrast = DEFAULT_AA_CONTRAST;
+	opts->aa_rays = 0;
+	opts->aa_pixels = 0;
+	opts->shadow_maps = NULL;
+	opts->wavefront = 0;
+	opts->raster = 0;
+	opts->light_samples = DEFAULT_LIGHT_SAMPLES;
+	opts->light_tree = NULL;
+	opts->area_samples = DEFAULT_AREA_SAMPLES;
+	opts->area_adaptive = 1;
+	opts->aovs = NULL;
+	opts->kernels = NULL;
+	opts->footprints = NULL;
+}
+
+int get_hit_record_size(scene * scn)
+{
+	return (scn->sphere_count + scn->triangle_count + scn->cloud_count + 7) / 8;
+}
+
+int footprint_meets_box(scene * scn, render_opts * opts, int index, vec_d * lo, vec_d * hi)
+{
+	tile t;
+	get_tile(opts, index, &t);
+	tile_footprint * f = &opts->footprints[index];
+	if (t.x0 >= t.x1 || t.y0 >= t.y1)
+	{
+		return 0;
+	}
+	if (f->escaped)
+	{
+		return 1;
+	}
+	//primary rays, which go wherever the view of the tile goes
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	vec_d corners[8];
+	int c;
+	for (c = 0; c < 8; c++)
+	{
+		corners[c].x = c & 1 ? hi->x : lo->x;
+		corners[c].y = c & 2 ? hi->y : lo->y;
+		corners[c].z = c & 4 ? hi->z : lo->z;
+	}
+	screen_bounds b;
+	project_bounds(scn, opts, &view, corners, 8, &b);
+	if (b.x0 < t.x1 && t.x0 < b.x1 && b.y0 < t.y1 && t.y0 < b.y1)
+	{
+		return 1;
+	}
+	if (f->lo.x > f->hi.x)
+	{
+		//nothing was hit, so no other ray was cast
+		return 0;
+	}
+	vec_d margin = {FOOTPRINT_MARGIN, FOOTPRINT_MARGIN, FOOTPRINT_MARGIN};
+	vec_d f_lo = sub_vecs(&f->lo, &margin);
+	vec_d f_hi = sum_vecs(&f->hi, &margin);
+	//reflection rays from one point hit to the next
+	if (boxes_meet(lo, hi, &f_lo, &f_hi, NULL))
+	{
+		return 1;
+	}
+	//shadow rays to a directional light sweep the points hit along its direction, which meets the box where a ray
+	//from the origin meets the box of the differences between its points and the points hit
+	vec_d d_lo = sub_vecs(lo, &f_hi);
+	vec_d d_hi = sub_vecs(hi, &f_lo);
+	long long i;
+	for (i = 0; i < scn->light_count; i++)
+	{
+		if (ray_meets_box(&scn->lights[i]->to_dir, &d_lo, &d_hi))
+		{
+			return 1;
+		}
+	}
+	//shadow rays to the other lights end on them
+	for (i = 0; i < scn->point_light_count; i++)
+	{
+		if (boxes_meet(lo, hi, &f_lo, &f_hi, &scn->point_lights[i]->position))
+		{
+			return 1;
+		}
+	}
+	for (i = 0; i < scn->area_light_count; i++)
+	{
+		area_light * a = scn->area_lights[i];
+		//a rectangle has its corners at position, + u, + v and + u + v, a disk fits in position +- u +- v
+		double low = a->shape == AREA_RECT ? 0 : -1;
+		vec_d a_lo = f_lo, a_hi = f_hi;
+		for (c = 0; c < 4; c++)
+		{
+			double s = c & 1 ? 1 : low, r = c & 2 ? 1 : low;
+			vec_d corner = {a->position.x + a->u.x * s + a->v.x * r, a->position.y + a->u.y * s + a->v.y * r,
+				a->position.z + a->u.z * s + a->v.z * r};
+			a_lo.x = fmin(a_lo.x, corner.x);
+			a_lo.y = fmin(a_lo.y, corner.y);
+			a_lo.z = fmin(a_lo.z, corner.z);
+			a_hi.x = fmax(a_hi.x, corner.x);
+			a_hi.y = fmax(a_hi.y, corner.y);
+			a_hi.z = fmax(a_hi.z, corner.z);
+		}
+		if (boxes_meet(lo, hi, &a_lo, &a_hi, NULL))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void clear_footprint(tile_footprint * f)
+{
+	f->lo.x = f->lo.y = f->lo.z = DBL_MAX;
+	f->hi.x = f->hi.y = f->hi.z = -DBL_MAX;
+	f->escaped = 0;
+}
+
+void record_footprint(tile_footprint * f, int depth, int hit, vec_d * position)
+{
+	if (!hit)
+	{
+		f->escaped |= depth > 0;
+		return;
+	}
+	f->lo.x = fmin(f->lo.x, position->x);
+	f->lo.y = fmin(f->lo.y, position->y);
+	f->lo.z = fmin(f->lo.z, position->z);
+	f->hi.x = fmax(f->hi.x, position->x);
+	f->hi.y = fmax(f->hi.y, position->y);
+	f->hi.z = fmax(f->hi.z, position->z);
+}
+
+int ray_meets_box(vec_d * dir, vec_d * lo, vec_d * hi)
+{
+	double near = 0, far = DBL_MAX;
+	double d[3] = {dir->x, dir->y, dir->z}, l[3] = {lo->x, lo->y, lo->z}, h[3] = {hi->x, hi->y, hi->z};
+	int a;
+	for (a = 0; a < 3; a++)
+	{
+		if (d[a] == 0)
+		{
+			if (l[a] > 0 || h[a] < 0)
+			{
+				return 0;
+			}
+			continue;
+		}
+		double t1 = l[a] / d[a], t2 = h[a] / d[a];
+		near = fmax(near, fmin(t1, t2));
+		far = fmin(far, fmax(t1, t2));
+	}
+	return near <= far;
+}
+
+int boxes_meet(vec_d * lo, vec_d * hi, vec_d * f_lo, vec_d * f_hi, vec_d * point)
+{
+	vec_d b_lo = *f_lo, b_hi = *f_hi;
+	if (point)
+	{
+		b_lo.x = fmin(b_lo.x, point->x);
+		b_lo.y = fmin(b_lo.y, point->y);
+		b_lo.z = fmin(b_lo.z, point->z);
+		b_hi.x = fmax(b_hi.x, point->x);
+		b_hi.y = fmax(b_hi.y, point->y);
+		b_hi.z = fmax(b_hi.z, point->z);
+	}
+	return lo->x <= b_hi.x && b_lo.x <= hi->x && lo->y <= b_hi.y && b_lo.y <= hi->y && lo->z <= b_hi.z && b_lo.z <= hi->z;
+}
+
+int get_tile_count(render_opts * opts)
+{
+	int tiles_x = (opts->res_x + opts->tile_size - 1) / opts->tile_size;
+	int tiles_y = (opts->res_y + opts->tile_size - 1) / opts->tile_size;
+	return tiles_x * tiles_y;
+}
+
+void get_tile(render_opts * opts, int index, tile * t)
+{
+	int tiles_x = (opts->res_x + opts->tile_size - 1) / opts->tile_size;
+	t->index = index;
+	t->x0 = (index % tiles_x) * opts->tile_size;
+	t->y0 = (index / tiles_x) * opts->tile_size;
+	t->x1 = min(t->x0 + opts->tile_size, opts->crop_x1);
+	t->y1 = min(t->y0 + opts->tile_size, opts->crop_y1);
+	t->x0 = max(t->x0, opts->crop_x0);
+	t->y0 = max(t->y0, opts->crop_y0);
+	if (t->x1 < t->x0)
+	{
+		t->x1 = t->x0;
+	}
+	if (t->y1 < t->y0)
+	{
+		t->y1 = t->y0;
+	}
+}
+
+void init_queue(tile_queue * queue, scene * scn, color * pixels, render_opts * opts, int pass)
+{
+	queue->scn = scn;
+	queue->pixels = pixels;
+	queue->opts = opts;
+	queue->tile_count = get_tile_count(opts);
+	queue->next_tile = 0;
+	queue->finished = 0;
+	queue->thread_stats = NULL;
+	queue->next_slot = 0;
+	queue->pass = pass;
+	queue->adaptive = pass == PASS_TRACE && opts->aa_samples > 1;
+	queue->prim_ids = NULL;
+	queue->first_pass = NULL;
+	queue->aa_rays = 0;
+	queue->aa_pixels = 0;
+	queue->accum = NULL;
+	queue->samples = NULL;
+	queue->step = 0;
+	queue->deadline = 0;
+	queue->bounds = NULL;
+	queue->raster_tests = 0;
+	queue->expired = 0;
+	queue->next = NULL;
+	pthread_mutex_init(&queue->lock, NULL);
+	//pages of paged clouds read by earlier renders may have been dropped since
+	long long i;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		refresh_particle_residency(scn->clouds[i]);
+	}
+}
+
+int ray_trace(scene * scn, color * pixels, render_opts * opts)
+{
+	tile_queue queue;
+	init_queue(&queue, scn, pixels, opts, PASS_TRACE);
+	if (queue.adaptive)
+	{
+		size_t pixel_count = (size_t) opts->res_x * opts->res_y;
+		queue.prim_ids = (int *) malloc(sizeof(int) * pixel_count);
+		size_t i;
+		for (i = 0; i < pixel_count; i++)
+		{
+			queue.prim_ids[i] = -1;
+		}
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long long span_start = timeline_now();
+	//particles have no screen bounds of their own, so scenes with clouds are traced the usual way
+	if (opts->raster && !scn->cloud_count)
+	{
+		queue.bounds = get_screen_bounds(scn, opts);
+	}
+	light_tree * own_tree = NULL;
+	if (scn->point_light_count && opts->light_samples && !opts->light_tree)
+	{
+		own_tree = opts->light_tree = build_light_tree(scn);
+	}
+	int threads = run_queue(&queue);
+	if (queue.adaptive)
+	{
+		//edges are found from the first pass image, which stays untouched while the second pass refines pixels
+		queue.first_pass = (color *) malloc(sizeof(color) * opts->res_x * opts->res_y);
+		memcpy(queue.first_pass, pixels, sizeof(color) * opts->res_x * opts->res_y);
+		queue.pass = PASS_REFINE;
+		queue.next_tile = 0;
+		queue.finished = 0;
+		queue.next_slot = 0;
+		run_queue(&queue);
+		opts->aa_rays = queue.aa_rays;
+		opts->aa_pixels = queue.aa_pixels;
+		free(queue.first_pass);
+		free(queue.prim_ids);
+	}
+	if (own_tree)
+	{
+		opts->light_tree = NULL;
+		destroy_light_tree(own_tree);
+	}
+	pthread_mutex_destroy(&queue.lock);
+	timeline_span("ray_trace", span_start, -1);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (opts->verbose)
+	{
+		printf("Rendered %d tiles on %s%d threads in %.3f s\n", queue.tile_count, opts->pool ? "a pool of " : "", threads,
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	}
+	if (opts->verbose && queue.bounds)
+	{
+		long long full = (long long) (opts->crop_x1 - opts->crop_x0) * (opts->crop_y1 - opts->crop_y0) *
+			(scn->sphere_count + scn->triangle_count);
+		printf("Visibility buffer: %lld primary ray tests instead of %lld (%.1f%%)\n", queue.raster_tests, full,
+			full ? 100.0 * queue.raster_tests / full : 0);
+	}
+	free(queue.bounds);
+	return 1;
+}
+
+int run_queue(tile_queue * queue)
+{
+	render_opts * opts = queue->opts;
+	if (opts->pool)
+	{
+		init_thread_stats(queue, opts->pool->thread_count);
+		pool_trace(opts->pool, queue);
+		merge_thread_stats(queue, opts->pool->thread_count);
+		return opts->pool->thread_count;
+	}
+	int thread_count = max(1, opts->threads);
+	pthread_t * threads = (pthread_t *) malloc(sizeof(pthread_t) * thread_count);
+	init_thread_stats(queue, thread_count);
+	int i, started = 0;
+	for (i = 1; i < thread_count; i++)
+	{
+		if (pthread_create(&threads[started], NULL, render_thread, queue))
+		{
+			break;
+		}
+		started++;
+	}
+	//the calling thread renders too, so a single threaded render never starts a thread
+	render_thread(queue);
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	merge_thread_stats(queue, thread_count);
+	return started + 1;
+}
+
+void init_view(view_plane * view, scene * scn, int res_x, int res_y)
+{
+	double view_w = tan(scn->fov * (atan(1) * 4 / 180.0)) * 2;
+	view->x_step = view_w / res_x;
+	view->y_step = view_w / res_y;
+	view->res_x = res_x;
+	view->res_y = res_y;
+}
+
+void primary_ray(scene * scn, view_plane * view, int x, int y, double sub_x, double sub_y, ray_d * ray)
+{
+	double j = x - view->res_x * 0.5;
+	double i = view->res_y * 0.5 - y;
+	ray->pos = scn->cam->from;
+	vec_d ray_to;
+	ray_to.x = j * view->x_step + view->x_step * sub_x;
+	ray_to.y = i * view->y_step - view->y_step * sub_y;
+	ray_to.z = -0.0f;
+	ray->dir = sub_vecs(&ray_to, &ray->pos);
+	vec_normalize(&ray->dir);
+}
+
+void trace_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats)
+{
+	render_tile(scn, opts, t, pixels, stats, NULL);
+}
+
+void render_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats, int * prim_ids)
+{
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	trace_ctx ctx;
+	init_trace_ctx(&ctx, scn, opts, stats);
+	ctx.capture = opts->capture ? capture_buffer_create(opts->capture) : NULL;
+	ctx.aovs = opts->aovs;
+	struct timespec start, end;
+	if (opts->hit_records)
+	{
+		ctx.hit_prims = opts->hit_records + (size_t) t->index * get_hit_record_size(scn);
+		memset(ctx.hit_prims, 0, get_hit_record_size(scn));
+	}
+	if (opts->footprints)
+	{
+		ctx.footprint = &opts->footprints[t->index];
+		clear_footprint(ctx.footprint);
+	}
+	int x, y;
+	for (y = t->y0; y < t->y1; y++)
+	{
+		for (x = t->x0; x < t->x1; x++)
+		{
+			if (opts->pixel_cost && opts->cost_metric == COST_TIME)
+			{
+				clock_gettime(CLOCK_MONOTONIC, &start);
+			}
+			ray_node * node = (ray_node *) malloc(sizeof(ray_node));
+			primary_ray(scn, &view, x, y, 0.5, 0.5, &node->ray);
+			STAT_ADD(&ctx, primary_rays, 1);
+			seed_pixel(&ctx, x, y, 0);
+			ctx.aov_pixel = y * opts->res_x + x;
+			trace_ray(node, scn, opts->depth, 0, &ctx);
+			pixels[y * opts->res_x + x] = node->c;
+			destroy_node(node);
+			if (prim_ids)
+			{
+				prim_ids[y * opts->res_x + x] = ctx.primary_hit;
+			}
+			if (opts->pixel_cost)
+			{
+				double * cost = &opts->pixel_cost[y * opts->res_x + x];
+				if (opts->cost_metric == COST_TIME)
+				{
+					clock_gettime(CLOCK_MONOTONIC, &end);
+					*cost = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+				}
+				else
+				{
+					*cost = ctx.tests;
+				}
+				ctx.tests = 0;
+			}
+		}
+	}
+	if (ctx.capture)
+	{
+		capture_buffer_destroy(ctx.capture);
+	}
+	free_trace_ctx(&ctx);
+}
+
+screen_bounds * get_screen_bounds(scene * scn, render_opts * opts)
+{
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	int count = scn->sphere_count + scn->triangle_count;
+	screen_bounds * bounds = (screen_bounds *) malloc(sizeof(screen_bounds) * max(1, count));
+	int i, c;
+	for (i = 0; i < count; i++)
+	{
+		//the projection of a primitive lies within the projection of the corners of any convex shape around it
+		vec_d corners[8];
+		int corner_count;
+		if (i < scn->sphere_count)
+		{
+			sphere * sph = scn->spheres[i];
+			for (c = 0; c < 8; c++)
+			{
+				corners[c].x = sph->center.x + (c & 1 ? sph->radius : -sph->radius);
+				corners[c].y = sph->center.y + (c & 2 ? sph->radius : -sph->radius);
+				corners[c].z = sph->center.z + (c & 4 ? sph->radius : -sph->radius);
+			}
+			corner_count = 8;
+		}
+		else
+		{
+			triangle * tri = scn->triangles[i - scn->sphere_count];
+			corners[0] = tri->p1;
+			corners[1] = tri->p2;
+			corners[2] = tri->p3;
+			corner_count = 3;
+		}
+		project_bounds(scn, opts, &view, corners, corner_count, &bounds[i]);
+	}
+	return bounds;
+}
+
+void project_bounds(scene * scn, render_opts * opts, view_plane * view, vec_d * corners, int corner_count, screen_bounds * b)
+{
+	int c;
+	double lo_x = DBL_MAX, lo_y = DBL_MAX, hi_x = -DBL_MAX, hi_y = -DBL_MAX, x, y;
+	for (c = 0; c < corner_count; c++)
+	{
+		if (!project_point(scn, view, &corners[c], &x, &y))
+		{
+			break;
+		}
+		lo_x = fmin(lo_x, x);
+		lo_y = fmin(lo_y, y);
+		hi_x = fmax(hi_x, x);
+		hi_y = fmax(hi_y, y);
+	}
+	if (c < corner_count)
+	{
+		b->x0 = 0;
+		b->y0 = 0;
+		b->x1 = opts->res_x;
+		b->y1 = opts->res_y;
+		return;
+	}
+	//a pixel of margin for the rounding of the kernels
+	b->x0 = (int) fmax(0, floor(lo_x) - 1);
+	b->y0 = (int) fmax(0, floor(lo_y) - 1);
+	b->x1 = (int) fmin(opts->res_x, ceil(hi_x) + 2);
+	b->y1 = (int) fmin(opts->res_y, ceil(hi_y) + 2);
+}
+
+int project_point(scene * scn, view_plane * view, vec_d * point, double * x, double * y)
+{
+	//primary rays start at the camera and go through the plane z = 0, so they only reach points beyond the camera
+	vec_d * from = &scn->cam->from;
+	double depth = point->z - from->z;
+	if (from->z == 0 || depth * -from->z <= 0)
+	{
+		return 0;
+	}
+	double t = -from->z / depth;
+	double plane_x = from->x + (point->x - from->x) * t;
+	double plane_y = from->y + (point->y - from->y) * t;
+	//the inverse of primary_ray through a pixel center
+	*x = plane_x / view->x_step + view->res_x * 0.5 - 0.5;
+	*y = view->res_y * 0.5 - 0.5 - plane_y / view->y_step;
+	return 1;
+}
+
+void raster_tile(tile_queue * queue, tile * t, render_stats * stats)
+{
+	scene * scn = queue->scn;
+	render_opts * opts = queue->opts;
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	trace_ctx ctx;
+	init_trace_ctx(&ctx, scn, opts, stats);
+	ctx.capture = opts->capture ? capture_buffer_create(opts->capture) : NULL;
+	ctx.aovs = opts->aovs;
+	if (opts->hit_records)
+	{
+		ctx.hit_prims = opts->hit_records + (size_t) t->index * get_hit_record_size(scn);
+		memset(ctx.hit_prims, 0, get_hit_record_size(scn));
+	}
+	if (opts->footprints)
+	{
+		ctx.footprint = &opts->footprints[t->index];
+		clear_footprint(ctx.footprint);
+	}
+	int width = t->x1 - t->x0;
+	int count = width * (t->y1 - t->y0);
+	ray_d * rays = (ray_d *) malloc(sizeof(ray_d) * count);
+	int * ids = (int *) malloc(sizeof(int) * count);
+	double * depths = (double *) malloc(sizeof(double) * count);
+	int r, i, x, y;
+	for (r = 0; r < count; r++)
+	{
+		primary_ray(scn, &view, t->x0 + r % width, t->y0 + r / width, 0.5, 0.5, &rays[r]);
+		ids[r] = 0;
+		depths[r] = DBL_MAX;
+	}
+
+	//primitives go in id order and only replace strictly nearer hits, the same choice check_collide makes
+	long long tests = 0;
+	vec_d intersection;
+	for (i = 0; i < scn->sphere_count + scn->triangle_count; i++)
+	{
+		screen_bounds * b = &queue->bounds[i];
+		int x0 = max(b->x0, t->x0), y0 = max(b->y0, t->y0);
+		int x1 = min(b->x1, t->x1), y1 = min(b->y1, t->y1);
+		if (x0 >= x1 || y0 >= y1)
+		{
+			continue;
+		}
+		sphere * sph = i < scn->sphere_count ? scn->spheres[i] : NULL;
+		triangle * tri = sph ? NULL : scn->triangles[i - scn->sphere_count];
+		tests += (long long) (x1 - x0) * (y1 - y0);
+		if (sph)
+		{
+			STAT_ADD(&ctx, sphere_tests, (x1 - x0) * (y1 - y0));
+		}
+		else
+		{
+			STAT_ADD(&ctx, triangle_tests, (x1 - x0) * (y1 - y0));
+		}
+		for (y = y0; y < y1; y++)
+		{
+			for (x = x0; x < x1; x++)
+			{
+				r = (y - t->y0) * width + x - t->x0;
+				if (!(sph ? sphere_collide(&rays[r], sph, &intersection) : triangle_collide(&rays[r], tri, &intersection)))
+				{
+					continue;
+				}
+				if (sph)
+				{
+					STAT_ADD(&ctx, sphere_hits, 1);
+				}
+				else
+				{
+					STAT_ADD(&ctx, triangle_hits, 1);
+				}
+				double dist = vec_distance(&rays[r].pos, &intersection);
+				if (dist < depths[r])
+				{
+					depths[r] = dist;
+					ids[r] = i + 1;
+				}
+			}
+		}
+	}
+
+	for (r = 0; r < count; r++)
+	{
+		int p = (t->y0 + r / width) * opts->res_x + t->x0 + r % width;
+		ray_node * node = (ray_node *) malloc(sizeof(ray_node));
+		node->ray = rays[r];
+		STAT_ADD(&ctx, primary_rays, 1);
+		STAT_ADD(&ctx, depth_hist[0], 1);
+		if (ctx.capture)
+		{
+			capture_ray(ctx.capture, &node->ray.pos, &node->ray.dir, DBL_MAX, RAY_PRIMARY, 0);
+		}
+		vec_d position, normal;
+		material * mat = NULL;
+		int id = ids[r] - 1;
+		//the kernel of the primitive hit gives back the exact point the buffer kept the depth of
+		if (id >= 0 && id < scn->sphere_count)
+		{
+			sphere_collide(&node->ray, scn->spheres[id], &position);
+			normal = get_sphere_normal(scn->spheres[id], &position);
+			mat = scn->spheres[id]->mat;
+		}
+		else if (id >= 0)
+		{
+			triangle * tri = scn->triangles[id - scn->sphere_count];
+			triangle_collide(&node->ray, tri, &position);
+			normal = get_triangle_normal(tri, &position, &node->ray.pos);
+			mat = tri->mat;
+		}
+		seed_pixel(&ctx, t->x0 + r % width, t->y0 + r / width, 0);
+		ctx.aov_pixel = p;
+		shade_hit(node, scn, opts->depth, 0, ids[r], &position, &normal, mat, &ctx);
+		queue->pixels[p] = node->c;
+		destroy_node(node);
+		if (queue->prim_ids)
+		{
+			queue->prim_ids[p] = ids[r];
+		}
+	}
+	pthread_mutex_lock(&queue->lock);
+	queue->raster_tests += tests;
+	pthread_mutex_unlock(&queue->lock);
+	free(rays);
+	free(ids);
+	free(depths);
+	if (ctx.capture)
+	{
+		capture_buffer_destroy(ctx.capture);
+	}
+	free_trace_ctx(&ctx);
+}
+
+void wavefront_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats, int * prim_ids)
+{
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	trace_ctx ctx;
+	init_trace_ctx(&ctx, scn, opts, stats);
+	ctx.capture = opts->capture ? capture_buffer_create(opts->capture) : NULL;
+	if (opts->hit_records)
+	{
+		ctx.hit_prims = opts->hit_records + (size_t) t->index * get_hit_record_size(scn);
+		memset(ctx.hit_prims, 0, get_hit_record_size(scn));
+	}
+	if (opts->footprints)
+	{
+		ctx.footprint = &opts->footprints[t->index];
+		clear_footprint(ctx.footprint);
+	}
+	//a hit makes at most one reflection, so no wave is larger than the first
+	int width = t->x1 - t->x0;
+	int count = width * (t->y1 - t->y0);
+	wave_ray ** waves = (wave_ray **) malloc(sizeof(wave_ray *) * (opts->depth + 1));
+	unsigned char ** occluded = (unsigned char **) malloc(sizeof(unsigned char *) * (opts->depth + 1));
+	int * sizes = (int *) malloc(sizeof(int) * (opts->depth + 1));
+	int r, d;
+	waves[0] = (wave_ray *) malloc(sizeof(wave_ray) * count);
+	sizes[0] = count;
+	for (r = 0; r < count; r++)
+	{
+		int x = t->x0 + r % width, y = t->y0 + r / width;
+		primary_ray(scn, &view, x, y, 0.5, 0.5, &waves[0][r].ray);
+		waves[0][r].pixel = y * opts->res_x + x;
+	}
+	STAT_ADD(&ctx, primary_rays, count);
+
+	//a reflection is only traced for a hit lit by at least one light, just as trace_ray does it inside the light loop
+	int last = 0;
+	for (d = 0; d <= opts->depth; d++)
+	{
+		wave_ray * wave = waves[d];
+		STAT_ADD(&ctx, depth_hist[min(d, STATS_MAX_DEPTH - 1)], sizes[d]);
+		if (ctx.capture)
+		{
+			for (r = 0; r < sizes[d]; r++)
+			{
+				capture_ray(ctx.capture, &wave[r].ray.pos, &wave[r].ray.dir, DBL_MAX, d ? RAY_REFLECTION : RAY_PRIMARY, d);
+			}
+		}
+		intersect_wave(wave, sizes[d], scn, &ctx);
+		for (r = 0; r < sizes[d] && ctx.footprint; r++)
+		{
+			record_footprint(ctx.footprint, d, wave[r].hit, &wave[r].position);
+		}
+		occluded[d] = (unsigned char *) malloc((size_t) sizes[d] * max(1, scn->light_count));
+		occlude_wave(wave, sizes[d], scn, occluded[d], d, &ctx);
+		last = d;
+		if (d == opts->depth)
+		{
+			break;
+		}
+		int next = 0;
+		waves[d + 1] = (wave_ray *) malloc(sizeof(wave_ray) * sizes[d]);
+		for (r = 0; r < sizes[d]; r++)
+		{
+			material * mat = wave[r].mat;
+			if (!wave[r].hit || !scn->light_count || !(mat->features & MAT_REFLECTIVE))
+			{
+				continue;
+			}
+			wave_ray * refl = &waves[d + 1][next];
+			refl->ray.pos = wave[r].origin;
+			vec_d v = vec_neg(&wave[r].ray.dir);
+			refl->ray.dir = vec_reflect(&v, &wave[r].normal);
+			wave[r].child = next++;
+		}
+		STAT_ADD(&ctx, reflection_rays, next);
+		sizes[d + 1] = next;
+		if (!next)
+		{
+			free(waves[d + 1]);
+			break;
+		}
+	}
+	for (d = last; d >= 0; d--)
+	{
+		shade_wave(waves[d], sizes[d], d < last ? waves[d + 1] : NULL, scn, occluded[d]);
+	}
+	for (r = 0; r < count; r++)
+	{
+		wave_ray * primary = &waves[0][r];
+		pixels[primary->pixel] = primary->c;
+		if (prim_ids)
+		{
+			prim_ids[primary->pixel] = primary->hit;
+		}
+		if (opts->aovs)
+		{
+			record_aovs(opts->aovs, primary->pixel, &primary->ray, primary->hit, &primary->position, &primary->normal,
+				primary->mat);
+		}
+	}
+	for (d = 0; d <= last; d++)
+	{
+		free(waves[d]);
+		free(occluded[d]);
+	}
+	free(waves);
+	free(occluded);
+	free(sizes);
+	if (ctx.capture)
+	{
+		capture_buffer_destroy(ctx.capture);
+	}
+	free_trace_ctx(&ctx);
+}
+
+void intersect_wave(wave_ray * wave, int count, scene * scn, trace_ctx * ctx)
+{
+	//the kernels sweep the rays once per primitive, so they get them packed together
+	ray_d * rays = (ray_d *) malloc(sizeof(ray_d) * max(1, count));
+	double * min_dist = (double *) malloc(sizeof(double) * max(1, count));
+	int * hits = (int *) malloc(sizeof(int) * max(1, count));
+	vec_d * positions = (vec_d *) malloc(sizeof(vec_d) * max(1, count));
+	vec_d intersection;
+	int i, r;
+	for (r = 0; r < count; r++)
+	{
+		rays[r] = wave[r].ray;
+		hits[r] = 0;
+		min_dist[r] = DBL_MAX;
+	}
+	for (i = 0; i < scn->sphere_count; i++)
+	{
+		sphere * sph = scn->spheres[i];
+		for (r = 0; r < count; r++)
+		{
+			if (!sphere_collide(&rays[r], sph, &intersection))
+			{
+				continue;
+			}
+			STAT_ADD(ctx, sphere_hits, 1);
+			double dist = vec_distance(&rays[r].pos, &intersection);
+			if (dist < min_dist[r])
+			{
+				min_dist[r] = dist;
+				positions[r] = intersection;
+				hits[r] = i + 1;
+			}
+		}
+	}
+	for (i = 0; i < scn->triangle_count; i++)
+	{
+		triangle * tri = scn->triangles[i];
+		for (r = 0; r < count; r++)
+		{
+			if (!triangle_collide(&rays[r], tri, &intersection))
+			{
+				continue;
+			}
+			STAT_ADD(ctx, triangle_hits, 1);
+			double dist = vec_distance(&rays[r].pos, &intersection);
+			if (dist < min_dist[r])
+			{
+				min_dist[r] = dist;
+				positions[r] = intersection;
+				hits[r] = scn->sphere_count + i + 1;
+			}
+		}
+	}
+	for (r = 0; r < count; r++)
+	{
+		wave[r].hit = hits[r];
+		wave[r].child = -1;
+		wave[r].position = positions[r];
+	}
+	free(rays);
+	free(min_dist);
+	free(hits);
+	free(positions);
+	STAT_ADD(ctx, sphere_tests, (unsigned long long) count * scn->sphere_count);
+	STAT_ADD(ctx, triangle_tests, (unsigned long long) count * scn->triangle_count);
+	ctx->tests += (unsigned long long) count * (scn->sphere_count + scn->triangle_count);
+	for (r = 0; r < count; r++)
+	{
+		int id = wave[r].hit - 1;
+		if (id < 0)
+		{
+			continue;
+		}
+		if (id < scn->sphere_count)
+		{
+			wave[r].normal = get_sphere_normal(scn->spheres[id], &wave[r].position);
+			wave[r].mat = scn->spheres[id]->mat;
+		}
+		else
+		{
+			triangle * tri = scn->triangles[id - scn->sphere_count];
+			wave[r].normal = get_triangle_normal(tri, &wave[r].position, &wave[r].ray.pos);
+			wave[r].mat = tri->mat;
+		}
+		vec_d offset = vec_mult(&wave[r].normal, .001);
+		wave[r].origin = sum_vecs(&wave[r].position, &offset);
+		if (ctx->hit_prims)
+		{
+			ctx->hit_prims[id >> 3] |= 1 << (id & 7);
+		}
+	}
+}
+
+void occlude_wave(wave_ray * wave, int count, scene * scn, unsigned char * occluded, int depth, trace_ctx * ctx)
+{
+	int lights = scn->light_count;
+	shadow_query * queue = (shadow_query *) malloc(sizeof(shadow_query) * max(1, count * lights));
+	int pending = 0, blocked = 0;
+	vec_d position;
+	int r, l, i, q;
+	memset(occluded, 0, (size_t) count * lights);
+	for (r = 0; r < count; r++)
+	{
+		if (!wave[r].hit)
+		{
+			continue;
+		}
+		STAT_ADD(ctx, shadow_rays, lights);
+		for (l = 0; l < lights; l++)
+		{
+			shadow_query * query = &queue[pending];
+			query->ray.pos = wave[r].origin;
+			query->ray.dir = scn->lights[l]->to_dir;
+			query->index = r * lights + l;
+			if (ctx->capture)
+			{
+				capture_ray(ctx->capture, &query->ray.pos, &query->ray.dir, DBL_MAX, RAY_SHADOW, depth);
+			}
+			if (ctx->shadow_maps)
+			{
+				int answer = shadow_map_lookup(ctx->shadow_maps, l, &wave[r].origin, &wave[r].normal);
+				if (answer != SHADOW_UNKNOWN)
+				{
+					STAT_ADD(ctx, shadow_map_answers, 1);
+					occluded[query->index] = answer == SHADOW_OCCLUDED;
+					blocked += answer == SHADOW_OCCLUDED;
+					continue;
+				}
+				STAT_ADD(ctx, shadow_map_fallbacks, 1);
+			}
+			int last = ctx->last_occluder[l] - 1;
+			if (last >= 0)
+			{
+				ctx->tests++;
+				if (last < scn->sphere_count ? sphere_collide(&query->ray, scn->spheres[last], &position) :
+					triangle_collide(&query->ray, scn->triangles[last - scn->sphere_count], &position))
+				{
+					occluded[query->index] = 1;
+					blocked++;
+					continue;
+				}
+			}
+			pending++;
+		}
+	}
+	for (i = 0; i < scn->sphere_count + scn->triangle_count && pending; i++)
+	{
+		sphere * sph = i < scn->sphere_count ? scn->spheres[i] : NULL;
+		triangle * tri = sph ? NULL : scn->triangles[i - scn->sphere_count];
+		ctx->tests += pending;
+		if (sph)
+		{
+			STAT_ADD(ctx, sphere_tests, pending);
+		}
+		else
+		{
+			STAT_ADD(ctx, triangle_tests, pending);
+		}
+		for (q = 0; q < pending; q++)
+		{
+			if (!(sph ? sphere_collide(&queue[q].ray, sph, &position) : triangle_collide(&queue[q].ray, tri, &position)))
+			{
+				continue;
+			}
+			occluded[queue[q].index] = 1;
+			blocked++;
+			ctx->last_occluder[queue[q].index % lights] = i + 1;
+			//the order of the queue does not matter, so the last query takes the place of the blocked one
+			queue[q--] = queue[--pending];
+		}
+	}
+	STAT_ADD(ctx, shadow_occluded, blocked);
+	free(queue);
+}
+
+int get_shade_bin(wave_ray * ray, scene * scn)
+{
+	if (!ray->hit)
+	{
+		return SHADE_MISS;
+	}
+	int bin = ray->mat->features & (SHADE_DIFFUSE | SHADE_SPECULAR);
+	if (ray->child >= 0)
+	{
+		bin |= SHADE_REFLECTIVE;
+	}
+	if (ray->hit > scn->sphere_count)
+	{
+		bin |= SHADE_TRIANGLE;
+	}
+	return bin;
+}
+
+void shade_wave(wave_ray * wave, int count, wave_ray * next, scene * scn, unsigned char * occluded)
+{
+	//a counting sort of the rays by bin
+	int starts[SHADE_MISS + 2];
+	int * order = (int *) malloc(sizeof(int) * max(1, count));
+	int r, b, k;
+	memset(starts, 0, sizeof(starts));
+	for (r = 0; r < count; r++)
+	{
+		starts[get_shade_bin(&wave[r], scn) + 1]++;
+	}
+	for (b = 0; b <= SHADE_MISS; b++)
+	{
+		starts[b + 1] += starts[b];
+	}
+	int fill[SHADE_MISS + 1];
+	memcpy(fill, starts, sizeof(fill));
+	for (r = 0; r < count; r++)
+	{
+		order[fill[get_shade_bin(&wave[r], scn)]++] = r;
+	}
+
+	int ambient = scn->amb_light->r || scn->amb_light->g || scn->amb_light->b;
+	for (k = starts[SHADE_MISS]; k < count; k++)
+	{
+		wave[order[k]].c = *scn->bg_color;
+	}
+	for (b = 0; b < SHADE_MISS; b++)
+	{
+		int first = starts[b], end = starts[b + 1];
+		for (k = first; k < end; k++)
+		{
+			color * c = &wave[order[k]].c;
+			c->r = 0;
+			c->g = 0;
+			c->b = 0;
+			if (ambient)
+			{
+				calculateAmbient(c, wave[order[k]].mat, scn->amb_light);
+			}
+			if (b & SHADE_SPECULAR)
+			{
+				wave_ray * ray = &wave[order[k]];
+				ray->to_camera = sub_vecs(&scn->cam->from, &ray->position);
+				vec_normalize(&ray->to_camera);
+			}
+		}
+		for (k = first; k < end; k += SHADE_LANES)
+		{
+			shade_lanes(wave, order + k, min(SHADE_LANES, end - k), b, next, scn, occluded);
+		}
+		for (k = first; k < end; k++)
+		{
+			clamp_color(&wave[order[k]].c);
+		}
+	}
+	free(order);
+}
+
+void shade_lanes(wave_ray * wave, int * order, int count, int bin, wave_ray * next, scene * scn,
+	unsigned char * occluded)
+{
+	//lanes past count stay zero, and only ever add zero
+	lane_d nx = {0}, ny = {0}, nz = {0}, vx = {0}, vy = {0}, vz = {0};
+	lane_d diff[3] = {{0}}, spec[3] = {{0}}, refl[3] = {{0}}, child[3] = {{0}}, sum[3] = {{0}};
+	int i, c, l;
+	for (i = 0; i < count; i++)
+	{
+		wave_ray * ray = &wave[order[i]];
+		material * mat = ray->mat;
+		nx[i] = ray->normal.x;
+		ny[i] = ray->normal.y;
+		nz[i] = ray->normal.z;
+		vx[i] = ray->to_camera.x;
+		vy[i] = ray->to_camera.y;
+		vz[i] = ray->to_camera.z;
+		color * from[5] = {&mat->diff, &mat->spec, &mat->refl, &ray->c, &ray->c};
+		if (bin & SHADE_REFLECTIVE)
+		{
+			from[4] = &next[ray->child].c;
+		}
+		lane_d * to[5] = {diff, spec, refl, sum, child};
+		int j;
+		for (j = 0; j < 5; j++)
+		{
+			to[j][0][i] = from[j]->r;
+			to[j][1][i] = from[j]->g;
+			to[j][2][i] = from[j]->b;
+		}
+	}
+	lane_d zero = {0};
+	//light by light, adding up every hit's terms in the same order as trace_ray
+	for (l = 0; l < scn->light_count; l++)
+	{
+		light * lgt = scn->lights[l];
+		lane_m lit = {0};
+		for (i = 0; i < count; i++)
+		{
+			lit[i] = occluded[order[i] * scn->light_count + l] ? 0 : -1;
+		}
+		double to_color[3] = {lgt->l_color.r, lgt->l_color.g, lgt->l_color.b};
+		lane_d along = nx * lgt->to_dir.x + ny * lgt->to_dir.y + nz * lgt->to_dir.z;
+		if (bin & SHADE_DIFFUSE)
+		{
+			//max(0, along), keeping a NaN as calculateDiffuse does, then only where it isn't 0
+			lane_d strength = (lane_d) ((lane_m) along & ~(along < zero));
+			lane_m add = lit & (strength != zero);
+			for (c = 0; c < 3; c++)
+			{
+				sum[c] += (lane_d) ((lane_m) (diff[c] * strength * to_color[c]) & add);
+			}
+		}
+		if (bin & SHADE_SPECULAR)
+		{
+			lane_d twice = 2 * along;
+			lane_d rx = nx * twice - lgt->to_dir.x;
+			lane_d ry = ny * twice - lgt->to_dir.y;
+			lane_d rz = nz * twice - lgt->to_dir.z;
+			lane_d seen = vx * rx + vy * ry + vz * rz;
+			seen = (lane_d) ((lane_m) seen & ~(seen < zero));
+			//the Phong constant differs from material to material, and pow has no lane form
+			lane_d strength;
+			for (i = 0; i < SHADE_LANES; i++)
+			{
+				strength[i] = i < count && lit[i] ? phong_power(seen[i], wave[order[i]].mat) : 0;
+			}
+			lane_m add = lit & (strength != zero);
+			for (c = 0; c < 3; c++)
+			{
+				sum[c] += (lane_d) ((lane_m) (spec[c] * strength * to_color[c]) & add);
+			}
+		}
+		if (bin & SHADE_REFLECTIVE)
+		{
+			for (c = 0; c < 3; c++)
+			{
+				sum[c] += refl[c] * child[c];
+			}
+		}
+	}
+	for (i = 0; i < count; i++)
+	{
+		color * out = &wave[order[i]].c;
+		out->r = sum[0][i];
+		out->g = sum[1][i];
+		out->b = sum[2][i];
+	}
+}
+
+void init_trace_ctx(trace_ctx * ctx, scene * scn, render_opts * opts, render_stats * stats)
+{
+	memset(ctx, 0, sizeof(trace_ctx));
+	ctx->stats = stats;
+	ctx->shadow_maps = opts->shadow_maps;
+	ctx->light_tree = opts->light_samples ? opts->light_tree : NULL;
+	ctx->light_samples = opts->light_samples;
+	ctx->rng = 1;
+	ctx->area_grid = min(MAX_AREA_GRID, max(2, (int) sqrt(opts->area_samples)));
+	ctx->area_adaptive = opts->area_adaptive;
+	ctx->kernels = opts->kernels;
+	ctx->last_occluder = (int *) calloc(max(1, scn->light_count), sizeof(int));
+}
+
+void free_trace_ctx(trace_ctx * ctx)
+{
+	free(ctx->last_occluder);
+}
+
+void seed_pixel(trace_ctx * ctx, int x, int y, int sample)
+{
+	//splitmix64 of the coordinates, so that neighboring pixels start far apart
+	unsigned long long z = ((unsigned long long) y << 40 ^ (unsigned long long) x << 16 ^ (unsigned long long) sample) +
+		0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	ctx->rng = z ? z : 1;
+}
+
+double next_random(trace_ctx * ctx)
+{
+	ctx->rng ^= ctx->rng << 13;
+	ctx->rng ^= ctx->rng >> 7;
+	ctx->rng ^= ctx->rng << 17;
+	return (ctx->rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void refine_tile(tile_queue * queue, tile * t, render_stats * stats)
+{
+	scene * scn = queue->scn;
+	render_opts * opts = queue->opts;
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	trace_ctx ctx;
+	init_trace_ctx(&ctx, scn, opts, stats);
+	//the extra rays add to what the first pass of the tile recorded
+	if (opts->hit_records)
+	{
+		ctx.hit_prims = opts->hit_records + (size_t) t->index * get_hit_record_size(scn);
+	}
+	if (opts->footprints)
+	{
+		ctx.footprint = &opts->footprints[t->index];
+	}
+	int grid = (int) sqrt(opts->aa_samples);
+	long long rays = 0, refined = 0;
+	int x, y, n, sx, sy;
+	int dx[4] = {-1, 1, 0, 0};
+	int dy[4] = {0, 0, -1, 1};
+	for (y = t->y0; y < t->y1; y++)
+	{
+		for (x = t->x0; x < t->x1; x++)
+		{
+			int p = y * opts->res_x + x;
+			int edge = 0;
+			for (n = 0; n < 4 && !edge; n++)
+			{
+				int nx = x + dx[n];
+				int ny = y + dy[n];
+				int q = ny * opts->res_x + nx;
+				//neighbors outside of the crop window or in skipped tiles were not traced in the first pass
+				if (nx < opts->crop_x0 || nx >= opts->crop_x1 || ny < opts->crop_y0 || ny >= opts->crop_y1 || queue->prim_ids[q] < 0)
+				{
+					continue;
+				}
+				color * a = &queue->first_pass[p];
+				color * b = &queue->first_pass[q];
+				edge = queue->prim_ids[q] != queue->prim_ids[p] || fabs(a->r - b->r) > opts->aa_contrast ||
+					fabs(a->g - b->g) > opts->aa_contrast || fabs(a->b - b->b) > opts->aa_contrast;
+			}
+			if (!edge)
+			{
+				continue;
+			}
+			color sum = {0, 0, 0};
+			for (sy = 0; sy < grid; sy++)
+			{
+				for (sx = 0; sx < grid; sx++)
+				{
+					ray_node * node = (ray_node *) malloc(sizeof(ray_node));
+					primary_ray(scn, &view, x, y, (sx + 0.5) / grid, (sy + 0.5) / grid, &node->ray);
+					STAT_ADD(&ctx, primary_rays, 1);
+					seed_pixel(&ctx, x, y, 1 + sy * grid + sx);
+					trace_ray(node, scn, opts->depth, 0, &ctx);
+					sum.r += node->c.r;
+					sum.g += node->c.g;
+					sum.b += node->c.b;
+					destroy_node(node);
+				}
+			}
+			queue->pixels[p].r = sum.r / (grid * grid);
+			queue->pixels[p].g = sum.g / (grid * grid);
+			queue->pixels[p].b = sum.b / (grid * grid);
+			rays += grid * grid;
+			refined++;
+		}
+	}
+	pthread_mutex_lock(&queue->lock);
+	queue->aa_rays += rays;
+	queue->aa_pixels += refined;
+	pthread_mutex_unlock(&queue->lock);
+	free_trace_ctx(&ctx);
+}
+
+int progressive_trace(scene * scn, color * pixels, render_opts * opts, double seconds, pass_callback on_pass, void * on_pass_ctx)
+{
+	tile_queue queue;
+	init_queue(&queue, scn, pixels, opts, PASS_PROGRESSIVE);
+	size_t pixel_count = (size_t) opts->res_x * opts->res_y;
+	queue.accum = (color *) calloc(pixel_count, sizeof(color));
+	queue.samples = (int *) calloc(pixel_count, sizeof(int));
+	long long start = monotonic_ns();
+	queue.deadline = start + (long long) (seconds * 1e9);
+	long long span_start = timeline_now();
+	int passes = 0;
+	queue.step = COARSE_STEP;
+	light_tree * own_tree = NULL;
+	if (scn->point_light_count && opts->light_samples && !opts->light_tree)
+	{
+		own_tree = opts->light_tree = build_light_tree(scn);
+	}
+	while (1)
+	{
+		queue.next_tile = 0;
+		queue.finished = 0;
+		queue.next_slot = 0;
+		run_queue(&queue);
+		passes++;
+		if (on_pass)
+		{
+			on_pass(on_pass_ctx, pixels, passes);
+		}
+		if (queue.expired || monotonic_ns() >= queue.deadline)
+		{
+			break;
+		}
+		//8, 4, 2, 1, then 0 for every pass that adds a sample to each pixel
+		queue.step /= 2;
+	}
+	long long samples = 0;
+	size_t i;
+	for (i = 0; i < pixel_count; i++)
+	{
+		samples += queue.samples[i];
+	}
+	long long traced = (long long) (opts->crop_x1 - opts->crop_x0) * (opts->crop_y1 - opts->crop_y0);
+	free(queue.accum);
+	free(queue.samples);
+	if (own_tree)
+	{
+		opts->light_tree = NULL;
+		destroy_light_tree(own_tree);
+	}
+	pthread_mutex_destroy(&queue.lock);
+	timeline_span("progressive_trace", span_start, -1);
+	if (opts->verbose)
+	{
+		printf("Rendered %d progressive passes, %.2f samples per pixel in %.3f s\n", passes,
+			(double) samples / traced, (monotonic_ns() - start) / 1e9);
+	}
+	return passes;
+}
+
+void progressive_tile(tile_queue * queue, tile * t, render_stats * stats)
+{
+	if (__atomic_load_n(&queue->expired, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	scene * scn = queue->scn;
+	render_opts * opts = queue->opts;
+	view_plane view;
+	init_view(&view, scn, opts->res_x, opts->res_y);
+	trace_ctx ctx;
+	init_trace_ctx(&ctx, scn, opts, stats);
+	int step = queue->step;
+	int x, y, fx, fy;
+	for (y = t->y0; y < t->y1; y++)
+	{
+		for (x = t->x0; x < t->x1; x++)
+		{
+			int p = y * opts->res_x + x;
+			//a coarse pass traces the pixels on its grid that the coarser passes skipped. The grid starts at the tile origin,
+			//which a crop can move off the multiples of step, so the first pass covers every pixel of the tile
+			int gx = x - t->x0, gy = y - t->y0;
+			if (step && (gx % step || gy % step || (step < COARSE_STEP && !(gx % (step * 2)) && !(gy % (step * 2)))))
+			{
+				continue;
+			}
+			//the first pass always finishes, so that there is an image to show however short the budget is
+			if (step != COARSE_STEP && (__atomic_load_n(&queue->expired, __ATOMIC_RELAXED) || monotonic_ns() >= queue->deadline))
+			{
+				__atomic_store_n(&queue->expired, 1, __ATOMIC_RELAXED);
+				free_trace_ctx(&ctx);
+				return;
+			}
+			//the first sample goes through the pixel center, exactly like ray_trace, then the samples walk a stratified grid
+			double sub_x = 0.5, sub_y = 0.5;
+			int n = queue->samples[p];
+			if (n)
+			{
+				int stratum = (n - 1) * 5 % (STRATA * STRATA);
+				double jitter_x = 0.5, jitter_y = 0.5;
+				if (n > STRATA * STRATA)
+				{
+					unsigned int h = ((unsigned int) p * 2654435761u) ^ ((unsigned int) n * 40503u);
+					h ^= h >> 15;
+					h *= 2246822519u;
+					jitter_x = (h & 0xffff) / 65536.0;
+					jitter_y = (h >> 16) / 65536.0;
+				}
+				sub_x = (stratum % STRATA + jitter_x) / STRATA;
+				sub_y = (stratum / STRATA + jitter_y) / STRATA;
+			}
+			ray_node * node = (ray_node *) malloc(sizeof(ray_node));
+			primary_ray(scn, &view, x, y, sub_x, sub_y, &node->ray);
+			STAT_ADD(&ctx, primary_rays, 1);
+			seed_pixel(&ctx, x, y, n);
+			trace_ray(node, scn, opts->depth, 0, &ctx);
+			queue->accum[p].r += node->c.r;
+			queue->accum[p].g += node->c.g;
+			queue->accum[p].b += node->c.b;
+			n = ++queue->samples[p];
+			destroy_node(node);
+			color c;
+			c.r = queue->accum[p].r / n;
+			c.g = queue->accum[p].g / n;
+			c.b = queue->accum[p].b / n;
+			//a coarse sample stands in for the block of pixels up to the next one on its grid, within the tile
+			int block = max(step, 1);
+			for (fy = y; fy < min(y + block, t->y1); fy++)
+			{
+				for (fx = x; fx < min(x + block, t->x1); fx++)
+				{
+					queue->pixels[fy * opts->res_x + fx] = c;
+				}
+			}
+		}
+	}
+	free_trace_ctx(&ctx);
+}
+
+long long monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void init_thread_stats(tile_queue * queue, int slots)
+{
+	if (STATS_ENABLED && queue->opts->stats)
+	{
+		//the size of render_stats is a multiple of its alignment, as aligned_alloc wants
+		queue->thread_stats = (render_stats *) aligned_alloc(64, sizeof(render_stats) * slots);
+		if (!queue->thread_stats)
+		{
+			//the render goes on without counters
+			return;
+		}
+		int i;
+		for (i = 0; i < slots; i++)
+		{
+			clear_stats(&queue->thread_stats[i]);
+		}
+	}
+}
+
+void merge_thread_stats(tile_queue * queue, int slots)
+{
+	if (!queue->thread_stats)
+	{
+		return;
+	}
+	int i;
+	for (i = 0; i < slots; i++)
+	{
+		merge_stats(queue->opts->stats, &queue->thread_stats[i]);
+	}
+	free(queue->thread_stats);
+	queue->thread_stats = NULL;
+}
+
+void * render_thread(void * arg)
+{
+	tile_queue * queue = (tile_queue *) arg;
+	pthread_mutex_lock(&queue->lock);
+	int slot = queue->next_slot++;
+	pthread_mutex_unlock(&queue->lock);
+	while (1)
+	{
+		pthread_mutex_lock(&queue->lock);
+		int index = queue->next_tile++;
+		pthread_mutex_unlock(&queue->lock);
+		if (index >= queue->tile_count)
+		{
+			break;
+		}
+		render_queued_tile(queue, index, slot);
+	}
+	return NULL;
+}
+
+void render_queued_tile(tile_queue * queue, int index, int slot)
+{
+	render_opts * opts = queue->opts;
+	tile t;
+	if (opts->tile_done && opts->tile_done[index])
+	{
+		return;
+	}
+	get_tile(opts, index, &t);
+	if (t.x0 == t.x1 || t.y0 == t.y1)
+	{
+		return;
+	}
+	render_stats * stats = queue->thread_stats ? &queue->thread_stats[slot] : NULL;
+	long long span_start = timeline_now();
+	if (queue->pass == PASS_PROGRESSIVE)
+	{
+		progressive_tile(queue, &t, stats);
+		timeline_span("progressive tile", span_start, index);
+		return;
+	}
+	if (queue->pass == PASS_REFINE)
+	{
+		refine_tile(queue, &t, stats);
+		timeline_span("refine tile", span_start, index);
+	}
+	else if (queue->bounds)
+	{
+		raster_tile(queue, &t, stats);
+		timeline_span("raster tile", span_start, index);
+	}
+	else if (opts->wavefront && !queue->scn->point_light_count && !queue->scn->area_light_count && !queue->scn->cloud_count)
+	{
+		wavefront_tile(queue->scn, opts, &t, queue->pixels, stats, queue->prim_ids);
+		timeline_span("wavefront tile", span_start, index);
+	}
+	else
+	{
+		render_tile(queue->scn, opts, &t, queue->pixels, stats, queue->prim_ids);
+		timeline_span("tile", span_start, index);
+	}
+	//a tile is only finished once its last pass is done
+	if (queue->adaptive && queue->pass != PASS_REFINE)
+	{
+		return;
+	}
+	if (opts->on_tile)
+	{
+		opts->on_tile(opts->on_tile_ctx, &t, queue->pixels, opts->res_x);
+	}
+}
+
+render_pool * create_pool(int threads)
+{
+	render_pool * pool = (render_pool *) malloc(sizeof(render_pool));
+	pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * max(1, threads));
+	pool->thread_count = 0;
+	pool->next_index = 0;
+	pool->stopping = 0;
+	pool->jobs = NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	int i;
+	for (i = 0; i < max(1, threads); i++)
+	{
+		if (pthread_create(&pool->threads[pool->thread_count], NULL, pool_thread, pool))
+		{
+			break;
+		}
+		pool->thread_count++;
+	}
+	if (!pool->thread_count)
+	{
+		destroy_pool(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void destroy_pool(render_pool * pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	int i;
+	for (i = 0; i < pool->thread_count; i++)
+	{
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
 
-int ray_trace(scene * scn, color ** pixels, int res_x, int res_y, int depth, int verbose)
+void * pool_thread(void * arg)
 {
-	double view_w = tan(scn->fov * (atan(1) * 4 / 180.0)) * 2;
-	double i, j;
-	int pixel_count = 0;
-	double x_step = view_w / res_x, y_step = view_w / res_y;
-	srand(time(NULL));
-	for (i = res_y * 0.5; i > res_y * -0.5; i--)
+	render_pool * pool = (render_pool *) arg;
+	pthread_mutex_lock(&pool->lock);
+	int slot = pool->next_index++;
+	while (1)
 	{
-		for (j = res_x * -0.5; j < res_x * 0.5; j++)
+		tile_queue * queue = pool->jobs;
+		while (queue && queue->next_tile >= queue->tile_count)
+		{
+			queue = queue->next;
+		}
+		if (!queue)
 		{
-			if (i == 0 && j == 0)
+			if (pool->stopping)
 			{
-				abs(1);
+				break;
 			}
-			ray_node * node = (ray_node *) malloc(sizeof(ray_node));
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		int index = queue->next_tile++;
+		pthread_mutex_unlock(&pool->lock);
 
-			node->ray.pos.x = scn->cam->from.x;
-			node->ray.pos.y = scn->cam->from.y;
-			node->ray.pos.z = scn->cam->from.z;
-			vec_d ray_to;
-			ray_to.x = j * x_step + x_step / 2;
-			ray_to.y = i * y_step - y_step / 2;
-			ray_to.z = -0.0f;
-			node->ray.dir = sub_vecs(&ray_to, &node->ray.pos);
-			vec_normalize(&node->ray.dir);
-
-			trace_ray(node, scn, depth, 0);
-
-			color * pixel = (color *) malloc(sizeof(color));
-			*pixel = node->c;
-			pixels[pixel_count] = pixel;
-			pixel_count++;
-			destroy_node(node);
+		render_queued_tile(queue, index, slot);
+
+		pthread_mutex_lock(&pool->lock);
+		queue->finished++;
+		if (queue->finished == queue->tile_count)
+		{
+			pthread_cond_broadcast(&pool->done);
 		}
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+void pool_trace(render_pool * pool, tile_queue * queue)
+{
+	pthread_mutex_lock(&pool->lock);
+	tile_queue ** last = &pool->jobs;
+	while (*last)
+	{
+		last = &(*last)->next;
+	}
+	*last = queue;
+	pthread_cond_broadcast(&pool->work);
+	while (queue->finished < queue->tile_count)
+	{
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	last = &pool->jobs;
+	while (*last != queue)
+	{
+		last = &(*last)->next;
+	}
+	*last = queue->next;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth, trace_ctx * ctx)
+{
+	STAT_ADD(ctx, depth_hist[min(depth, STATS_MAX_DEPTH - 1)], 1);
+	material * mat = NULL;
+	vec_d * normal = (vec_d *) malloc(sizeof(vec_d));
+	vec_d * position = (vec_d *) malloc(sizeof(vec_d));
+	if (ctx->capture)
+	{
+		capture_ray(ctx->capture, &ray->ray.pos, &ray->ray.dir, DBL_MAX, depth ? RAY_REFLECTION : RAY_PRIMARY, depth);
+	}
+	int hit = check_collide(&ray->ray, scn, position, normal, &mat, ctx);
+	shade_hit(ray, scn, max_depth, depth, hit, position, normal, mat, ctx);
+	free(position);
+	free(normal);
 	return 1;
 }
 
-int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth)
+void shade_hit(ray_node * ray, scene * scn, int max_depth, int depth, int hit, vec_d * position, vec_d * normal,
+	material * mat, trace_ctx * ctx)
 {
 	ray->c.r = 0;
 	ray->c.g = 0;
 	ray->c.b = 0;
 	ray->refl_ray = NULL;
 	ray->shad_ray = NULL;
-	material * mat;
-	vec_d * normal = (vec_d *) malloc(sizeof(vec_d));
-	vec_d * position = (vec_d *) malloc(sizeof(vec_d));
-	if (!check_collide(&ray->ray, scn, position, normal, &mat))
+	if (!depth)
+	{
+		ctx->primary_hit = hit;
+		if (ctx->aovs)
+		{
+			record_aovs(ctx->aovs, ctx->aov_pixel, &ray->ray, hit, position, normal, mat);
+		}
+	}
+	if (ctx->footprint)
+	{
+		record_footprint(ctx->footprint, depth, hit, position);
+	}
+	if (!hit)
 	{
 		ray->c = *scn->bg_color;
-		free(normal);
-		free(position);
-		return 1;
+		return;
+	}
+	if (ctx->hit_prims)
+	{
+		ctx->hit_prims[(hit - 1) >> 3] |= 1 << ((hit - 1) & 7);
 	}
 	int i;
 	if (scn->amb_light->r || scn->amb_light->g || scn->amb_light->b)
@@ -163,40 +2392,130 @@ int trace_ray(ray_node * ray, scene * scn, int max_depth, int depth)
 	}
 	vec_d offset = vec_mult(normal, .001);
 	vec_d origin = sum_vecs(position, &offset);
+	light_kernel kernel = g_light_kernels[mat->features & (MAT_DIFFUSE | MAT_SPECULAR)];
+	vec_d to_camera;
+	if (mat->features & MAT_SPECULAR)
+	{
+		to_camera = sub_vecs(&scn->cam->from, position);
+		vec_normalize(&to_camera);
+	}
+	//the reflection is the same under every light, so it is traced once and added after each directional light as it
+	//always was, or once when only point and area lights light the scene
+	int reflect = (mat->features & MAT_REFLECTIVE) && depth < max_depth &&
+		(scn->light_count || scn->point_light_count || scn->area_light_count);
+	if (reflect)
+	{
+		ray->refl_ray = (ray_node *) malloc(sizeof(ray_node));
+		ray->refl_ray->ray.pos = origin;
+		vec_d v = vec_neg(&ray->ray.dir);
+		ray->refl_ray->ray.dir = vec_reflect(&v, normal);
+		STAT_ADD(ctx, reflection_rays, 1);
+		trace_ray(ray->refl_ray, scn, max_depth, depth + 1, ctx);
+	}
+	unsigned long long occluded = 0;
 	for (i = 0; i < scn->light_count; i++)
 	{
+		if (i % LIGHT_BATCH == 0)
+		{
+			occluded = check_lights_occluded(&origin, normal, scn, i, min(LIGHT_BATCH, scn->light_count - i), ctx);
+		}
 		light * lgt = scn->lights[i];
 		ray->shad_ray = (ray_d *) malloc(sizeof(ray_d));
 		ray->shad_ray->pos = origin;
 		ray->shad_ray->dir = lgt->to_dir;
-		if (!check_shadow_collide(ray->shad_ray, scn))
+		STAT_ADD(ctx, shadow_rays, 1);
+		if (ctx->capture)
 		{
-			if (mat->diff.r || mat->diff.g || mat->diff.b)
-			{
-				calculateDiffuse(&ray->c, mat, normal, lgt);
-			}
-			if (mat->spec.r || mat->spec.g || mat->spec.b)
-			{
-				calculateSpecular(position, &ray->c, mat, normal, lgt, scn->cam);
-			}
+			capture_ray(ctx->capture, &ray->shad_ray->pos, &ray->shad_ray->dir, DBL_MAX, RAY_SHADOW, depth);
+		}
+		if (kernel && !(occluded >> (i % LIGHT_BATCH) & 1))
+		{
+			kernel(&ray->c, mat, normal, &to_camera, lgt);
 		}
-		if ((mat->refl.r || mat->refl.g || mat->refl.b) && depth < max_depth)
+		if (reflect)
 		{
-			ray->refl_ray = (ray_node *) malloc(sizeof(ray_node));
-			ray->refl_ray->ray.pos = origin;
-			vec_d v = vec_neg(&ray->ray.dir);
-			ray->refl_ray->ray.dir = vec_reflect(&v, normal);
-			trace_ray(ray->refl_ray, scn, max_depth, depth + 1);
 			ray->c.r += mat->refl.r * ray->refl_ray->c.r;
 			ray->c.g += mat->refl.g * ray->refl_ray->c.g;
 			ray->c.b += mat->refl.b * ray->refl_ray->c.b;
 		}
 	}
-	free(position);
-	free(normal);
+	if (kernel && scn->point_light_count)
+	{
+		shade_point_lights(&ray->c, scn, position, &origin, normal, &to_camera, mat, kernel, depth, ctx);
+	}
+	if (kernel && scn->area_light_count)
+	{
+		shade_area_lights(&ray->c, scn, position, &origin, normal, &to_camera, mat, kernel, depth, ctx);
+	}
+	if (reflect && !scn->light_count)
+	{
+		ray->c.r += mat->refl.r * ray->refl_ray->c.r;
+		ray->c.g += mat->refl.g * ray->refl_ray->c.g;
+		ray->c.b += mat->refl.b * ray->refl_ray->c.b;
+	}
 	clamp_color(&ray->c);
-	
-	return 1;
+}
+
+void record_aovs(aov_planes * aovs, int pixel, ray_d * ray, int hit, vec_d * position, vec_d * normal, material * mat)
+{
+	if (!hit)
+	{
+		aovs->depth[pixel] = INFINITY;
+		aovs->prim_id[pixel] = 0;
+		memset(&aovs->normal[3 * pixel], 0, sizeof(float) * 3);
+		memset(&aovs->albedo[3 * pixel], 0, sizeof(float) * 3);
+		return;
+	}
+	aovs->depth[pixel] = (float) vec_distance(&ray->pos, position);
+	aovs->prim_id[pixel] = (float) hit;
+	aovs->normal[3 * pixel] = (float) normal->x;
+	aovs->normal[3 * pixel + 1] = (float) normal->y;
+	aovs->normal[3 * pixel + 2] = (float) normal->z;
+	aovs->albedo[3 * pixel] = (float) mat->diff.r;
+	aovs->albedo[3 * pixel + 1] = (float) mat->diff.g;
+	aovs->albedo[3 * pixel + 2] = (float) mat->diff.b;
+}
+
+void shade_point_lights(color * c, scene * scn, vec_d * position, vec_d * origin, vec_d * normal, vec_d * to_camera,
+	material * mat, light_kernel kernel, int depth, trace_ctx * ctx)
+{
+	int count = ctx->light_tree ? ctx->light_samples : scn->point_light_count;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		int index = i;
+		double weight = 1;
+		if (ctx->light_tree)
+		{
+			double pdf;
+			index = sample_light_tree(ctx->light_tree, position, normal, next_random(ctx), &pdf);
+			if (index < 0)
+			{
+				//the walk ended in a part of the tree that is all behind the surface
+				continue;
+			}
+			weight = 1 / (pdf * count);
+		}
+		point_light * pl = scn->point_lights[index];
+		light lgt;
+		lgt.to_dir = sub_vecs(&pl->position, position);
+		double dist_sq = dot(&lgt.to_dir, &lgt.to_dir);
+		if (dot(normal, &lgt.to_dir) <= 0)
+		{
+			continue;
+		}
+		vec_normalize(&lgt.to_dir);
+		STAT_ADD(ctx, shadow_rays, 1);
+		if (check_point_occluded(origin, &pl->position, scn, depth, ctx))
+		{
+			continue;
+		}
+		double strength = weight / (1 + pl->falloff * dist_sq);
+		lgt.l_color.r = pl->l_color.r * strength;
+		lgt.l_color.g = pl->l_color.g * strength;
+		lgt.l_color.b = pl->l_color.b * strength;
+		kernel(c, mat, normal, to_camera, &lgt);
+	}
 }
 
 void destroy_node(ray_node * node)
@@ -212,67 +2531,438 @@ void destroy_node(ray_node * node)
 	free(node);
 }
 
-int check_collide(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat)
+int closest_hit(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat)
+{
+	trace_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	return check_collide(ray, scn, position, normal, mat, &ctx);
+}
+
+int any_hit(ray_d * ray, scene * scn)
+{
+	trace_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	return check_shadow_collide(ray, scn, &ctx);
+}
+
+int any_hit_within(ray_d * ray, scene * scn, double max_dist)
+{
+	trace_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	return check_occluded_within(ray, max_dist, scn, &ctx);
+}
+
+unsigned long long check_lights_occluded(vec_d * origin, vec_d * normal, scene * scn, int first, int count, trace_ctx * ctx)
+{
+	ray_d rays[LIGHT_BATCH];
+	vec_d position;
+	unsigned long long pending = count == LIGHT_BATCH ? ~0ULL : (1ULL << count) - 1;
+	unsigned long long occluded = 0;
+	int i, l;
+	for (l = 0; l < count; l++)
+	{
+		rays[l].pos = *origin;
+		rays[l].dir = scn->lights[first + l]->to_dir;
+		if (ctx->shadow_maps)
+		{
+			int answer = shadow_map_lookup(ctx->shadow_maps, first + l, origin, normal);
+			if (answer != SHADOW_UNKNOWN)
+			{
+				STAT_ADD(ctx, shadow_map_answers, 1);
+				occluded |= (unsigned long long) (answer == SHADOW_OCCLUDED) << l;
+				pending &= ~(1ULL << l);
+				continue;
+			}
+			STAT_ADD(ctx, shadow_map_fallbacks, 1);
+		}
+		int last = ctx->last_occluder ? ctx->last_occluder[first + l] - 1 : -1;
+		if (last < 0)
+		{
+			continue;
+		}
+		int cloud = last - scn->sphere_count - scn->triangle_count;
+		ctx->tests++;
+		if (cloud >= 0 ? cloud_hit_by(&rays[l], scn->clouds[cloud], DBL_MAX, ctx) :
+			last < scn->sphere_count ? sphere_collide(&rays[l], scn->spheres[last], &position) :
+			triangle_collide(&rays[l], scn->triangles[last - scn->sphere_count], &position))
+		{
+			occluded |= 1ULL << l;
+			pending &= ~(1ULL << l);
+		}
+	}
+	long long prims = ctx->kernels ? 0 : scn->sphere_count + scn->triangle_count;
+	for (l = 0; l < count && ctx->kernels; l++)
+	{
+		if (!(pending >> l & 1))
+		{
+			continue;
+		}
+		//the module has a function for every light unless that made it too large
+		int hit = ctx->kernels->light_any ? ctx->kernels->light_any[first + l](origin) : ctx->kernels->any(&rays[l]);
+		ctx->tests += hit ? hit : scn->sphere_count + scn->triangle_count;
+		if (!hit)
+		{
+			continue;
+		}
+		occluded |= 1ULL << l;
+		pending &= ~(1ULL << l);
+		if (ctx->last_occluder)
+		{
+			ctx->last_occluder[first + l] = hit;
+		}
+	}
+	for (i = 0; i < prims && pending; i++)
+	{
+		sphere * sph = i < scn->sphere_count ? scn->spheres[i] : NULL;
+		triangle * tri = sph ? NULL : scn->triangles[i - scn->sphere_count];
+		for (l = 0; l < count; l++)
+		{
+			if (!(pending >> l & 1))
+			{
+				continue;
+			}
+			ctx->tests++;
+			if (sph)
+			{
+				STAT_ADD(ctx, sphere_tests, 1);
+				if (!sphere_collide(&rays[l], sph, &position))
+				{
+					continue;
+				}
+				STAT_ADD(ctx, sphere_hits, 1);
+			}
+			else
+			{
+				STAT_ADD(ctx, triangle_tests, 1);
+				if (!triangle_collide(&rays[l], tri, &position))
+				{
+					continue;
+				}
+				STAT_ADD(ctx, triangle_hits, 1);
+			}
+			occluded |= 1ULL << l;
+			pending &= ~(1ULL << l);
+			if (ctx->last_occluder)
+			{
+				ctx->last_occluder[first + l] = i + 1;
+			}
+		}
+	}
+	for (i = 0; i < scn->cloud_count && pending; i++)
+	{
+		for (l = 0; l < count; l++)
+		{
+			if ((pending >> l & 1) && cloud_hit_by(&rays[l], scn->clouds[i], DBL_MAX, ctx))
+			{
+				occluded |= 1ULL << l;
+				pending &= ~(1ULL << l);
+				if (ctx->last_occluder)
+				{
+					ctx->last_occluder[first + l] = scn->sphere_count + scn->triangle_count + i + 1;
+				}
+			}
+		}
+	}
+	STAT_ADD(ctx, shadow_occluded, __builtin_popcountll(occluded));
+	return occluded;
+}
+
+int check_collide(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat, trace_ctx * ctx)
 {
 	int i;
 	double min_dist = DBL_MAX;
 	vec_d * intersection = (vec_d *) malloc(sizeof(vec_d));
 	double dist_to_intersection;
-	for (i = 0; i < scn->sphere_count; i++)
+	int hit = 0;
+	long long spheres = scn->sphere_count, triangles = scn->triangle_count;
+	if (ctx->kernels)
+	{
+		hit = ctx->kernels->closest(ray, position, normal, &min_dist);
+		if (hit)
+		{
+			*mat = hit <= spheres ? scn->spheres[hit - 1]->mat : scn->triangles[hit - 1 - spheres]->mat;
+		}
+		STAT_ADD(ctx, sphere_tests, spheres);
+		STAT_ADD(ctx, triangle_tests, triangles);
+		//the loops below are left to the clouds
+		spheres = triangles = 0;
+	}
+	for (i = 0; i < spheres; i++)
 	{
 		sphere * sph = scn->spheres[i];
-		if (sphere_collide(ray, scn->spheres[i], intersection) && 
-			(dist_to_intersection = vec_distance(&ray->pos, intersection)) < min_dist)
+		STAT_ADD(ctx, sphere_tests, 1);
+		if (!sphere_collide(ray, scn->spheres[i], intersection))
+		{
+			continue;
+		}
+		STAT_ADD(ctx, sphere_hits, 1);
+		if ((dist_to_intersection = vec_distance(&ray->pos, intersection)) < min_dist)
 		{
 			*position = *intersection;
 			*normal = get_sphere_normal(sph, intersection);
 			min_dist = dist_to_intersection;
 			*mat = sph->mat;
+			hit = i + 1;
 		}
 	}
-	for (i = 0; i < scn->triangle_count; i++)
+	for (i = 0; i < triangles; i++)
 	{
 		triangle * tri = scn->triangles[i];
-		if (triangle_collide(ray, scn->triangles[i], intersection) && 
-			(dist_to_intersection = vec_distance(&ray->pos, intersection)) < min_dist)
+		STAT_ADD(ctx, triangle_tests, 1);
+		if (!triangle_collide(ray, scn->triangles[i], intersection))
+		{
+			continue;
+		}
+		STAT_ADD(ctx, triangle_hits, 1);
+		if ((dist_to_intersection = vec_distance(&ray->pos, intersection)) < min_dist)
 		{
 			*position = *intersection;
 			*normal = get_triangle_normal(tri, intersection, &ray->pos);
 			min_dist = dist_to_intersection;
 			*mat = tri->mat;
+			hit = scn->sphere_count + i + 1;
 		}
 	}
+	ctx->tests += scn->sphere_count + scn->triangle_count;
 	free(intersection);
-	if (min_dist == DBL_MAX)
+	for (i = 0; i < scn->cloud_count; i++)
 	{
-		return 0;
+		cloud_stats stats = {0, 0, 0, 0};
+		if (cloud_closest_hit(scn->clouds[i], &ray->pos, &ray->dir, &min_dist, position, normal, mat, &stats))
+		{
+			STAT_ADD(ctx, sphere_hits, 1);
+			hit = scn->sphere_count + scn->triangle_count + i + 1;
+		}
+		add_cloud_stats(ctx, &stats);
 	}
-	return 1;
+	return hit;
 }
 
-int check_shadow_collide(ray_d * s_ray, scene * scn)
+int check_shadow_collide(ray_d * s_ray, scene * scn, trace_ctx * ctx)
 {
 	vec_d position;
 	int i;
-	for (i = 0; i < scn->sphere_count; i++)
+	long long spheres = scn->sphere_count, triangles = scn->triangle_count;
+	if (ctx->kernels)
+	{
+		if ((i = ctx->kernels->any(s_ray)))
+		{
+			ctx->tests += i;
+			STAT_ADD(ctx, shadow_occluded, 1);
+			return 1;
+		}
+		spheres = triangles = 0;
+	}
+	for (i = 0; i < spheres; i++)
 	{
 		sphere * sph = scn->spheres[i];
+		STAT_ADD(ctx, sphere_tests, 1);
 		if (sphere_collide(s_ray, sph, &position))
 		{
+			ctx->tests += i + 1;
+			STAT_ADD(ctx, sphere_hits, 1);
+			STAT_ADD(ctx, shadow_occluded, 1);
 			return 1;
 		}
 	}
-	for (i = 0; i < scn->triangle_count; i++)
+	for (i = 0; i < triangles; i++)
 	{
 		triangle * tri = scn->triangles[i];
+		STAT_ADD(ctx, triangle_tests, 1);
 		if (triangle_collide(s_ray, tri, &position))
 		{
+			ctx->tests += scn->sphere_count + i + 1;
+			STAT_ADD(ctx, triangle_hits, 1);
+			STAT_ADD(ctx, shadow_occluded, 1);
+			return 1;
+		}
+	}
+	ctx->tests += scn->sphere_count + scn->triangle_count;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		if (cloud_hit_by(s_ray, scn->clouds[i], DBL_MAX, ctx))
+		{
+			STAT_ADD(ctx, shadow_occluded, 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void shade_area_lights(color * c, scene * scn, vec_d * position, vec_d * origin, vec_d * normal, vec_d * to_camera,
+	material * mat, light_kernel kernel, int depth, trace_ctx * ctx)
+{
+	int grid = ctx->area_grid;
+	int count = grid * grid;
+	light strata[MAX_AREA_GRID * MAX_AREA_GRID];
+	vec_d points[MAX_AREA_GRID * MAX_AREA_GRID];
+	//for every stratum: 0 if it faces away from the surface, 1 if not traced yet, 2 if visible, 3 if occluded
+	unsigned char state[MAX_AREA_GRID * MAX_AREA_GRID];
+	//the corners and the middle of the grid
+	int probes[AREA_PROBES] = {0, grid - 1, count - grid, count - 1, grid / 2 * grid + grid / 2};
+	int a, k;
+	for (a = 0; a < scn->area_light_count; a++)
+	{
+		area_light * al = scn->area_lights[a];
+		int facing = 0;
+		for (k = 0; k < count; k++)
+		{
+			points[k] = area_light_point(al, (k % grid + next_random(ctx)) / grid, (k / grid + next_random(ctx)) / grid);
+			strata[k].to_dir = sub_vecs(&points[k], position);
+			double dist_sq = dot(&strata[k].to_dir, &strata[k].to_dir);
+			state[k] = dot(normal, &strata[k].to_dir) > 0;
+			if (!state[k])
+			{
+				continue;
+			}
+			facing++;
+			vec_normalize(&strata[k].to_dir);
+			double strength = 1 / (count * (1 + al->falloff * dist_sq));
+			strata[k].l_color.r = al->l_color.r * strength;
+			strata[k].l_color.g = al->l_color.g * strength;
+			strata[k].l_color.b = al->l_color.b * strength;
+		}
+		int traced = 0;
+		//the answer of the probes when they all agree, 0 when they don't or there are none
+		int agreed = 0;
+		if (ctx->area_adaptive)
+		{
+			int p;
+			for (p = 0; p < AREA_PROBES; p++)
+			{
+				k = probes[p];
+				if (state[k] != 1)
+				{
+					continue;
+				}
+				state[k] = check_point_occluded(origin, &points[k], scn, depth, ctx) ? 3 : 2;
+				traced++;
+				agreed = !agreed || agreed == state[k] ? state[k] : -1;
+			}
+			agreed = max(agreed, 0);
+		}
+		for (k = 0; k < count; k++)
+		{
+			if (state[k] == 1)
+			{
+				if (agreed)
+				{
+					state[k] = agreed;
+					continue;
+				}
+				state[k] = check_point_occluded(origin, &points[k], scn, depth, ctx) ? 3 : 2;
+				traced++;
+			}
+		}
+		STAT_ADD(ctx, shadow_rays, traced);
+		STAT_ADD(ctx, area_shadow_rays, traced);
+		STAT_ADD(ctx, area_rays_saved, facing - traced);
+		for (k = 0; k < count; k++)
+		{
+			if (state[k] == 2)
+			{
+				kernel(c, mat, normal, to_camera, &strata[k]);
+			}
+		}
+	}
+}
+
+vec_d area_light_point(area_light * al, double s, double t)
+{
+	if (al->shape == AREA_DISK)
+	{
+		//the square root keeps equal strata of s at equal areas of the disk
+		double r = sqrt(s);
+		vec_d along_u = vec_mult(&al->u, r * cos(2 * M_PI * t));
+		vec_d along_v = vec_mult(&al->v, r * sin(2 * M_PI * t));
+		vec_d offset = sum_vecs(&along_u, &along_v);
+		return sum_vecs(&al->position, &offset);
+	}
+	vec_d along_u = vec_mult(&al->u, s);
+	vec_d along_v = vec_mult(&al->v, t);
+	vec_d offset = sum_vecs(&along_u, &along_v);
+	return sum_vecs(&al->position, &offset);
+}
+
+int check_point_occluded(vec_d * origin, vec_d * target, scene * scn, int depth, trace_ctx * ctx)
+{
+	ray_d s_ray;
+	s_ray.pos = *origin;
+	s_ray.dir = sub_vecs(target, origin);
+	double dist = vec_magnitude(&s_ray.dir);
+	vec_normalize(&s_ray.dir);
+	if (ctx->capture)
+	{
+		capture_ray(ctx->capture, &s_ray.pos, &s_ray.dir, dist, RAY_SHADOW, depth);
+	}
+	return check_occluded_within(&s_ray, dist, scn, ctx);
+}
+
+int check_occluded_within(ray_d * s_ray, double max_dist, scene * scn, trace_ctx * ctx)
+{
+	vec_d position;
+	int i;
+	long long prims = scn->sphere_count + scn->triangle_count;
+	if (ctx->kernels)
+	{
+		if ((i = ctx->kernels->any_within(s_ray, max_dist)))
+		{
+			ctx->tests += i;
+			STAT_ADD(ctx, shadow_occluded, 1);
+			return 1;
+		}
+		prims = 0;
+	}
+	for (i = 0; i < prims; i++)
+	{
+		int hit;
+		if (i < scn->sphere_count)
+		{
+			STAT_ADD(ctx, sphere_tests, 1);
+			hit = sphere_collide(s_ray, scn->spheres[i], &position);
+		}
+		else
+		{
+			STAT_ADD(ctx, triangle_tests, 1);
+			hit = triangle_collide(s_ray, scn->triangles[i - scn->sphere_count], &position);
+		}
+		if (hit && vec_distance(&s_ray->pos, &position) < max_dist)
+		{
+			ctx->tests += i + 1;
+			STAT_ADD(ctx, shadow_occluded, 1);
+			return 1;
+		}
+	}
+	ctx->tests += scn->sphere_count + scn->triangle_count;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		if (cloud_hit_by(s_ray, scn->clouds[i], max_dist, ctx))
+		{
+			STAT_ADD(ctx, shadow_occluded, 1);
 			return 1;
 		}
 	}
 	return 0;
 }
 
+int cloud_hit_by(ray_d * ray, particle_cloud * cloud, double max_dist, trace_ctx * ctx)
+{
+	cloud_stats stats = {0, 0, 0, 0};
+	int hit = cloud_any_hit(cloud, &ray->pos, &ray->dir, max_dist, &stats);
+	STAT_ADD(ctx, sphere_hits, hit);
+	add_cloud_stats(ctx, &stats);
+	return hit;
+}
+
+void add_cloud_stats(trace_ctx * ctx, cloud_stats * stats)
+{
+	STAT_ADD(ctx, sphere_tests, stats->tests);
+	STAT_ADD(ctx, node_visits, stats->visits);
+	STAT_ADD(ctx, clusters_deferred, stats->deferred);
+	STAT_ADD(ctx, clusters_skipped, stats->skipped);
+	ctx->tests += stats->tests;
+}
+
 int sphere_collide(ray_d * ray, sphere * sph, vec_d * position)
 {
 	vec_d oc = sub_vecs(&sph->center, &ray->pos);
@@ -309,8 +2999,10 @@ int triangle_collide(ray_d * ray, triangle * tri, vec_d * position)
 	{
 		return 0;
 	}
-	triangle_2D * tri_2D = (triangle_2D *) malloc(sizeof(triangle_2D));
-	vec_d_2D * vec_2D = (vec_d_2D *) malloc(sizeof(vec_d_2D));
+	triangle_2D tri_proj;
+	vec_d_2D vec_proj;
+	triangle_2D * tri_2D = &tri_proj;
+	vec_d_2D * vec_2D = &vec_proj;
 	project_2D(tri, position, tri_2D, vec_2D);
 
 	tri_2D->p1.u -= vec_2D->u;
@@ -327,9 +3019,6 @@ int triangle_collide(ray_d * ray, triangle * tri, vec_d * position)
 	check_cross(&tri_2D->p2, &tri_2D->p3, &cross_count, &sign);
 	check_cross(&tri_2D->p3, &tri_2D->p1, &cross_count, &sign);
 
-	free(tri_2D);
-	free(vec_2D);
-
 	return cross_count % 2 ? 1 : 0;
 }
 
@@ -430,12 +3119,10 @@ void calculateDiffuse(color * c, material * mat, vec_d * normal, light * lgt)
 	}
 }
 
-void calculateSpecular(vec_d * position, color * c, material * mat, vec_d * normal, light * lgt, camera * cam)
+void calculateSpecular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt)
 {
 	vec_d reflection = vec_reflect(&lgt->to_dir, normal);
-	vec_d pos_to_camera = sub_vecs(&cam->from, position);
-	vec_normalize(&pos_to_camera);
-	double spec_strength = pow(max(0, dot(&pos_to_camera, &reflection)), mat->p_const);
+	double spec_strength = phong_power(max(0, dot(to_camera, &reflection)), mat);
 	if (spec_strength)
 	{
 		c->r += mat->spec.r * spec_strength * lgt->l_color.r;
@@ -450,3 +3137,38 @@ void clamp_color(color * c)
 	c->g = min(1, max(0, c->g));
 	c->b = min(1, max(0, c->b));
 }
+
+double phong_power(double x, material * mat)
+{
+	if (mat->exponent < 0)
+	{
+		return pow(x, mat->p_const);
+	}
+	double result = 1;
+	int n;
+	for (n = mat->exponent; n; n >>= 1)
+	{
+		if (n & 1)
+		{
+			result *= x;
+		}
+		x *= x;
+	}
+	return result;
+}
+
+void light_diffuse(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt)
+{
+	calculateDiffuse(c, mat, normal, lgt);
+}
+
+void light_specular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt)
+{
+	calculateSpecular(c, mat, normal, to_camera, lgt);
+}
+
+void light_diffuse_specular(color * c, material * mat, vec_d * normal, vec_d * to_camera, light * lgt)
+{
+	calculateDiffuse(c, mat, normal, lgt);
+	calculateSpecular(c, mat, normal, to_camera, lgt);
+}
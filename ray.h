@@ -2,6 +2,10 @@
 #define RAY_H_
 
 #include "scene.h"
+#include "stats.h"
+#include "capture.h"
+#include "shadowmap.h"
+#include "lighttree.h"
 
 /**
 * describes the position of the ray origin and its direction
@@ -27,17 +31,326 @@ struct ray_node
 typedef struct ray_node ray_node;
 
 /**
-* Creates a raytraced image of the scene, casting one ray per pixel
-* Allocates colors for pixels dynamically, but will free them if it fails
+* a rectangle of pixels rendered as one unit of work. x1 and y1 are exclusive
+*/
+typedef struct
+{
+	int index;
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} tile;
+
+/**
+* Called from a render thread each time a tile is finished
 *
-* @param scene trace_scene the scene to draw
-* @param color ** pixels where to insert the result
+* @param void * ctx the on_tile_ctx given in the render options
+* @param tile * t the finished tile
+* @param color * pixels the whole framebuffer, res_x pixels wide
+* @param int res_x the width of the framebuffer
+*/
+typedef void (* tile_callback)(void * ctx, tile * t, color * pixels, int res_x);
+
+/**
+* Called by progressive_trace each time a pass over the whole image is finished, while no render thread runs
+*
+* @param void * ctx the on_pass_ctx given to progressive_trace
+* @param color * pixels the framebuffer, complete at the quality reached so far
+* @param int pass the number of passes done
+*/
+typedef void (* pass_callback)(void * ctx, color * pixels, int pass);
+
+/**
+* a set of render threads shared by many images, see create_pool
+*/
+typedef struct render_pool render_pool;
+
+/**
+* the extra planes a render can fill for compositing, res_x * res_y values each in rows starting at the top, taken
+* from the ray through every pixel center: the distance to its first hit, the normal there, 1 + the primitive id hit
+* and the diffuse color of the material hit. Pixels showing the background get an infinite depth and 0 for the rest
+*/
+typedef struct
+{
+	float * depth;
+	//3 floats per pixel
+	float * normal;
+	//stored as floats so that it can be written like the other planes, exact up to 16777216 primitives
+	float * prim_id;
+	//3 floats per pixel
+	float * albedo;
+} aov_planes;
+
+/**
+* the intersection searches of one scene compiled to native code, see scenecc.h. Each gives exactly what the generic
+* search over the spheres and triangles of the scene gives, clouds left out: closest the 1 + primitive id of the
+* closest hit nearer than *min_dist along with its position and normal, lowering *min_dist to it; any and any_within
+* the 1 + primitive id of the first primitive in scene order a shadow ray hits, anywhere or closer than dist; and
+* light_any, when not NULL, the same as any for a ray towards each directional light
+*/
+typedef struct
+{
+	int (* closest)(ray_d * ray, vec_d * position, vec_d * normal, double * min_dist);
+	int (* any)(ray_d * ray);
+	int (* any_within)(ray_d * ray, double dist);
+	int (* const * light_any)(vec_d * origin);
+	void * handle;
+} scene_kernels;
+
+/**
+* where the rays of a tile went when it was last rendered: the box around every point they hit, and whether a ray
+* other than a primary one left the scene without hitting anything. Primary rays stay inside the tile's part of the
+* view, and shadow rays go from the points hit towards the lights, so together these bound every ray of the tile
+*/
+typedef struct
+{
+	vec_d lo;
+	vec_d hi;
+	int escaped;
+} tile_footprint;
+
+//what render_opts.pixel_cost measures
+#define COST_TESTS 0
+#define COST_TIME 1
+
+/**
+* everything that controls how a scene is turned into pixels
+*/
+typedef struct
+{
+	int res_x;
+	int res_y;
+	int depth;
+	int verbose;
+	int threads;
+	int tile_size;
+	//pixels outside of the crop window are left as they are, x1 and y1 exclusive
+	int crop_x0;
+	int crop_y0;
+	int crop_x1;
+	int crop_y1;
+	//one flag per tile, tiles marked are skipped and their pixels left as they are
+	char * tile_done;
+	tile_callback on_tile;
+	void * on_tile_ctx;
+	//when set, its threads render the image instead of threads started for it
+	render_pool * pool;
+	//see get_hit_record_size
+	unsigned char * hit_records;
+	//when set and statistics are compiled in, receives the counters of all render threads
+	render_stats * stats;
+	//res_x * res_y values, receives for every traced pixel what its whole ray tree cost, as chosen by cost_metric
+	double * pixel_cost;
+	//COST_TESTS for the intersection tests, COST_TIME for the nanoseconds
+	int cost_metric;
+	//when set, every ray whose intersections are searched for is recorded in it
+	ray_capture * capture;
+	//above 1, pixels on edges of the one ray per pixel image are traced again with up to this many stratified rays
+	int aa_samples;
+	double aa_contrast;
+	//set to the extra rays of the anti-aliasing pass and the pixels they were spent on
+	long long aa_rays;
+	long long aa_pixels;
+	//when set, light visibility comes from the maps wherever they can tell
+	shadow_maps * shadow_maps;
+	//traces the first pass of each tile in waves of rays, giving the same image. Not for scenes with point lights,
+	//area lights or particle clouds, whose tiles are traced one ray tree at a time. Their pixel_cost is not measured
+	int wavefront;
+	//takes the first hit of every pixel from a visibility buffer, giving the same image. Not for scenes with particle
+	//clouds, and the pixel_cost is not measured
+	int raster;
+	//the point lights shaded per hit, picked at random from light_tree, which is built for the render when not given.
+	//0 shades every point light at every hit
+	int light_samples;
+	light_tree * light_tree;
+	//area lights are sampled on a stratified grid of about this many points
+	int area_samples;
+	//probe rays to the corner and middle strata go first, and the other strata are only traced where the probes disagree
+	int area_adaptive;
+	//when set, the first pass fills its planes for every traced pixel
+	aov_planes * aovs;
+	//when set, rays traced one at a time search the spheres and triangles with them, giving the same image
+	scene_kernels * kernels;
+	//see footprint_meets_box
+	tile_footprint * footprints;
+} render_opts;
+
+/**
+* Primitives are numbered with the spheres first, then the triangles: a sphere's id is its index in scn->spheres,
+* a triangle's id is scn->sphere_count plus its index in scn->triangles.
+*
+* When opts->hit_records is set, every rendered tile records which primitives its primary and reflection rays hit,
+* as a bitset of get_hit_record_size bytes at hit_records + tile index * get_hit_record_size
+*
+* @param scene * scn the scene
+*
+* @return int the number of bytes in one tile's hit record
+*/
+int get_hit_record_size(scene * scn);
+
+/**
+* When opts->footprints is set, every rendered tile stores where its rays went at footprints + tile index, see
+* tile_footprint. Checks whether any ray a tile cast then could have met a box, so that a primitive anywhere outside
+* of the footprints of some tiles, before and after it moves, leaves those tiles exactly as they were.
+* The answer errs on the side of yes
+*
+* @param scene * scn the scene the tile was rendered with
+* @param render_opts * opts the render options, with the footprints
+* @param int index the tile
+* @param vec_d * lo the low corner of the box
+* @param vec_d * hi the high corner of the box
+*
+* @return int 0 if no ray of the tile can have come near the box, positive number if one may have
+*/
+int footprint_meets_box(scene * scn, render_opts * opts, int index, vec_d * lo, vec_d * hi);
+
+/**
+* Sets every render option to its default
+*
+* @param render_opts * opts the options to initialize
 * @param int res_x the width in pixels of the output
 * @param int res_y the height in pixels of the output
-* @param int the number of recursions to perform on each ray
+*/
+void init_render_opts(render_opts * opts, int res_x, int res_y);
+
+/**
+* Counts the tiles that make up the image
+*
+* @param render_opts * opts the render options
+*
+* @return int the number of tiles
+*/
+int get_tile_count(render_opts * opts);
+
+/**
+* Calculates the pixel bounds of a tile. Tiles are numbered in rows, starting at the top left.
+* The tile grid always covers the full frame, but the bounds are clipped to the crop window, so a tile outside of it is empty
+*
+* @param render_opts * opts the render options
+* @param int index the tile number
+* @param tile * t where the bounds are stored
+*/
+void get_tile(render_opts * opts, int index, tile * t);
+
+/**
+* Traces every pixel of one tile on the calling thread
+*
+* @param scene * scn the scene to draw
+* @param render_opts * opts the render options
+* @param tile * t the tile, from get_tile
+* @param color * pixels the framebuffer, res_x * res_y colors
+* @param render_stats * stats counters owned by the calling thread, NULL to not count.
+* Point lights are only sampled when opts->light_tree is set, see render_opts.light_samples, and all shaded otherwise
+*/
+void trace_tile(scene * scn, render_opts * opts, tile * t, color * pixels, render_stats * stats);
+
+/**
+* Starts render threads that stay alive between images. An image rendered with opts->pool set
+* uses these threads instead of starting its own, and several images can share the pool at once
+*
+* @param int threads the number of render threads
+*
+* @return render_pool * the pool, NULL if no thread could be started
+*/
+render_pool * create_pool(int threads);
+
+/**
+* Stops the threads of a pool and frees it. No image may still be rendering on it
+*
+* @param render_pool * pool the pool
+*/
+void destroy_pool(render_pool * pool);
+
+/**
+* Two similar functions, check if a ray intersects with a sphere/triangle
+*
+* @param ray_d * ray The ray
+* @param sphere/triangle * The object to compare the ray against
+* @param vec_d * position Where, if the ray intersects, the intersection happens
+*
+* @return int 0 if the ray doesn't intersects the object, positive number if it does
+*/
+int sphere_collide(ray_d * ray, sphere * sph, vec_d * position);
+int triangle_collide(ray_d * ray, triangle * tri, vec_d * position);
+
+/**
+* Calculates if a ray intersects with a plane defined by a point and a normal
+* 
+* @param ray_d * ray
+* @param vec_d * p_point an arbitrary point on a plane
+* @param vec_d * normal the normal vector of that plane
+* @param vec_d * position where the ray intersects the plane
+*
+* @return int 0 if the ray doesn't intersect, positive number if it does
+*/
+int plane_collide(ray_d * ray, vec_d * p_point, vec_d * p_normal, vec_d * position);
+
+/**
+* Finds the closest object a ray hits, the same way the renderer does
+*
+* @param ray_d * ray the ray
+* @param scene * scn the scene
+* @param vec_d * position set to where the ray hits
+* @param vec_d * normal set to the normal of the object where the ray hits
+* @param material ** mat set to the material of the object hit
+*
+* @return int 0 if the ray hits nothing, otherwise 1 + the primitive id of the object hit
+*/
+int closest_hit(ray_d * ray, scene * scn, vec_d * position, vec_d * normal, material ** mat);
+
+/**
+* Checks whether a shadow ray hits any object, the same way the renderer does
+*
+* @param ray_d * ray the shadow ray
+* @param scene * scn the scene
+*
+* @return int 0 if the ray hits nothing, positive number if it does
+*/
+int any_hit(ray_d * ray, scene * scn);
+
+/**
+* Checks whether a shadow ray hits any object closer than a distance, the same way the renderer tests the rays to point and area lights
+*
+* @param ray_d * ray the shadow ray
+* @param scene * scn the scene
+* @param double max_dist how far the ray reaches
+*
+* @return int 0 if the ray hits nothing that close, positive number if it does
+*/
+int any_hit_within(ray_d * ray, scene * scn, double max_dist);
+
+/**
+* Creates a raytraced image of the scene, casting one ray per pixel
+* The image is split into tiles which are handed out to opts->threads render threads, or to the threads of opts->pool.
+* The rays inside the crop window are exactly the ones a full frame render would cast, and the random numbers of every
+* pixel sample start from the pixel, so the image does not depend on the threads or tiles
+*
+* @param scene trace_scene the scene to draw
+* @param color * pixels where to insert the result, res_x * res_y colors in rows starting at the top
+* @param render_opts * opts the resolution, recursion depth and the rest of the render settings
 *
 * @return int 0 if it fails, positive number if it succeeds
 */
-int ray_trace(scene * scn, color ** pixels, int res_x, int res_y, int depth, int verbose);
+int ray_trace(scene * scn, color * pixels, render_opts * opts);
+
+/**
+* Renders the best image it can within a time budget. A pass tracing every 8th pixel of every 8th row comes first
+* and always finishes; passes at 4, 2 and 1 pixel spacing fill in the rest, giving the same image as ray_trace,
+* and every following pass adds one more stratified sample to each pixel. Passes are split into tiles like ray_trace.
+* The render threads stop as soon as the deadline passes, so the last pass is usually partial, but every pixel
+* always holds the average of its own samples or of the nearest coarse sample
+*
+* @param scene * scn the scene to draw
+* @param color * pixels where to insert the result, res_x * res_y colors in rows starting at the top
+* @param render_opts * opts the render settings. Tiles done, hit records, adaptive anti-aliasing and the other
+* per tile outputs are not used
+* @param double seconds the time budget
+* @param pass_callback on_pass called after every pass, NULL for none
+* @param void * on_pass_ctx passed to on_pass
+*
+* @return int the number of passes rendered
+*/
+int progressive_trace(scene * scn, color * pixels, render_opts * opts, double seconds, pass_callback on_pass, void * on_pass_ctx);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <time.h>
+#include "scene.h"
+#include "fparser.h"
+#include "ray.h"
+#include "capture.h"
+#include "particles.h"
+
+/**
+* a captured ray with its place in the capture, so that results can be compared after reordering
+*/
+typedef struct
+{
+	captured_ray * ray;
+	long index;
+	unsigned long long key;
+} replay_query;
+
+/**
+* Runs every query one at a time through closest_hit, or any_hit and any_hit_within for shadow rays
+*
+* @param scene * scn the scene
+* @param replay_query * queries the rays in the order to run them
+* @param long count the number of rays
+* @param int * results set to the result of every ray, by its index in the capture
+*/
+void replay_single(scene * scn, replay_query * queries, long count, int * results);
+
+/**
+* Runs the queries in batches of rays of the same kind, testing every ray of a batch against one primitive
+* before moving on to the next primitive. Gives the same results as replay_single
+*
+* @param scene * scn the scene
+* @param replay_query * queries the rays in the order to run them
+* @param long count the number of rays
+* @param int batch the most rays in a batch
+* @param int * results set to the result of every ray, by its index in the capture
+*/
+void replay_batched(scene * scn, replay_query * queries, long count, int batch, int * results);
+
+/**
+* Calculates the sort key of a ray: shadow rays after the others, then by direction octant, then by direction
+*
+* @param captured_ray * ray the ray
+*
+* @return unsigned long long the key
+*/
+unsigned long long coherence_key(captured_ray * ray);
+
+/**
+* qsort comparison of replay_query keys, ties keep capture order
+*/
+int compare_queries(const void * a, const void * b);
+
+/**
+* Gets the seconds elapsed on a monotonic clock
+*/
+double now(void);
+
+int main(int argc, char * argv[])
+{
+	char * scene_path = NULL;
+	char * capture_path = NULL;
+	int sort = 0;
+	int batch = 0;
+	int repeat = 1;
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--sort"))
+		{
+			sort = 1;
+		}
+		else if (!strcmp(argv[i], "--batch") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			batch = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--repeat") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			repeat = atoi(argv[++i]);
+		}
+		else if (argv[i][0] != '-' && !scene_path)
+		{
+			scene_path = argv[i];
+		}
+		else if (argv[i][0] != '-' && !capture_path)
+		{
+			capture_path = argv[i];
+		}
+		else
+		{
+			scene_path = NULL;
+			break;
+		}
+	}
+	if (!scene_path || !capture_path)
+	{
+		printf("Usage: %s <scene> <capture> [--sort] [--batch N] [--repeat N]\n", argv[0]);
+		return -1;
+	}
+
+	scene * scn = (scene *) malloc(sizeof(scene));
+	if (!parse_file(scene_path, scn))
+	{
+		char * error_msg = get_file_parse_error();
+		printf("%s", error_msg);
+		free(error_msg);
+		return -1;
+	}
+	unsigned long long capture_hash;
+	long count;
+	captured_ray * rays = load_capture(capture_path, &capture_hash, &count);
+	if (!rays)
+	{
+		printf("%s", get_capture_error());
+		destroy_scene(scn);
+		return -1;
+	}
+	if (capture_hash != scene_hash(scn))
+	{
+		printf("Warning: the rays were captured from a different scene\n");
+	}
+	long kinds[3] = {0, 0, 0};
+	replay_query * queries = (replay_query *) malloc(sizeof(replay_query) * (count ? count : 1));
+	long q;
+	for (q = 0; q < count; q++)
+	{
+		queries[q].ray = &rays[q];
+		queries[q].index = q;
+		queries[q].key = q;
+		kinds[rays[q].type <= RAY_SHADOW ? rays[q].type : RAY_SHADOW]++;
+	}
+	printf("Loaded %ld rays (%ld primary, %ld reflection, %ld shadow)\n", count,
+		kinds[RAY_PRIMARY], kinds[RAY_REFLECTION], kinds[RAY_SHADOW]);
+
+	int * expected = (int *) malloc(sizeof(int) * (count ? count : 1));
+	int * results = (int *) malloc(sizeof(int) * (count ? count : 1));
+	double best = DBL_MAX;
+	int r;
+	for (r = 0; r < repeat; r++)
+	{
+		double start = now();
+		replay_single(scn, queries, count, expected);
+		double elapsed = now() - start;
+		best = elapsed < best ? elapsed : best;
+	}
+	printf("%-18s %10.3f ms %10.3f Mrays/s\n", "capture order", best * 1e3, count / best / 1e6);
+
+	if (sort || batch)
+	{
+		double sort_time = 0;
+		if (sort)
+		{
+			double start = now();
+			for (q = 0; q < count; q++)
+			{
+				queries[q].key = coherence_key(queries[q].ray);
+			}
+			qsort(queries, count, sizeof(replay_query), compare_queries);
+			sort_time = now() - start;
+		}
+		best = DBL_MAX;
+		for (r = 0; r < repeat; r++)
+		{
+			double start = now();
+			if (batch)
+			{
+				replay_batched(scn, queries, count, batch, results);
+			}
+			else
+			{
+				replay_single(scn, queries, count, results);
+			}
+			double elapsed = now() - start;
+			best = elapsed < best ? elapsed : best;
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "%s%s%s", sort ? "sorted" : "", sort && batch ? ", " : "", batch ? "batched" : "");
+		printf("%-18s %10.3f ms %10.3f Mrays/s", label, best * 1e3, count / best / 1e6);
+		if (sort)
+		{
+			printf(" (+%.3f ms sorting)", sort_time * 1e3);
+		}
+		printf("\n");
+		long mismatches = 0;
+		for (q = 0; q < count; q++)
+		{
+			if (results[q] != expected[q])
+			{
+				mismatches++;
+			}
+		}
+		if (mismatches)
+		{
+			printf("%ld rays gave different results than in capture order\n", mismatches);
+		}
+	}
+	free(expected);
+	free(results);
+	free(queries);
+	free(rays);
+	destroy_scene(scn);
+	return 0;
+}
+
+void replay_single(scene * scn, replay_query * queries, long count, int * results)
+{
+	long q;
+	vec_d position, normal;
+	material * mat;
+	for (q = 0; q < count; q++)
+	{
+		ray_d ray;
+		ray.pos = queries[q].ray->pos;
+		ray.dir = queries[q].ray->dir;
+		if (queries[q].ray->type == RAY_SHADOW)
+		{
+			double max_dist = queries[q].ray->max_dist;
+			results[queries[q].index] = max_dist < DBL_MAX ? any_hit_within(&ray, scn, max_dist) : any_hit(&ray, scn);
+		}
+		else
+		{
+			results[queries[q].index] = closest_hit(&ray, scn, &position, &normal, &mat);
+		}
+	}
+}
+
+void replay_batched(scene * scn, replay_query * queries, long count, int batch, int * results)
+{
+	ray_d * rays = (ray_d *) malloc(sizeof(ray_d) * batch);
+	double * min_dist = (double *) malloc(sizeof(double) * batch);
+	double * max_dist = (double *) malloc(sizeof(double) * batch);
+	int * hits = (int *) malloc(sizeof(int) * batch);
+	vec_d position;
+	long start = 0;
+	while (start < count)
+	{
+		//a batch only holds rays of one kind, so a run of shadow rays is never mixed with closest hit rays
+		int shadow = queries[start].ray->type == RAY_SHADOW;
+		int n = 0;
+		while (n < batch && start + n < count && (queries[start + n].ray->type == RAY_SHADOW) == shadow)
+		{
+			rays[n].pos = queries[start + n].ray->pos;
+			rays[n].dir = queries[start + n].ray->dir;
+			min_dist[n] = DBL_MAX;
+			max_dist[n] = queries[start + n].ray->max_dist;
+			hits[n] = 0;
+			n++;
+		}
+		int i, j, live = n;
+		for (i = 0; i < scn->sphere_count + scn->triangle_count && live; i++)
+		{
+			sphere * sph = i < scn->sphere_count ? scn->spheres[i] : NULL;
+			triangle * tri = sph ? NULL : scn->triangles[i - scn->sphere_count];
+			for (j = 0; j < n; j++)
+			{
+				if (shadow && hits[j])
+				{
+					continue;
+				}
+				if (!(sph ? sphere_collide(&rays[j], sph, &position) : triangle_collide(&rays[j], tri, &position)))
+				{
+					continue;
+				}
+				if (shadow)
+				{
+					//a shadow ray to a light only counts what is in front of the light
+					if (vec_distance(&rays[j].pos, &position) >= max_dist[j])
+					{
+						continue;
+					}
+					hits[j] = 1;
+					live--;
+					continue;
+				}
+				double dist = vec_distance(&rays[j].pos, &position);
+				if (dist < min_dist[j])
+				{
+					min_dist[j] = dist;
+					hits[j] = i + 1;
+				}
+			}
+		}
+		for (i = 0; i < scn->cloud_count && live; i++)
+		{
+			for (j = 0; j < n; j++)
+			{
+				cloud_stats stats = {0, 0, 0, 0};
+				vec_d normal;
+				material * mat;
+				if (shadow ? !hits[j] && cloud_any_hit(scn->clouds[i], &rays[j].pos, &rays[j].dir, max_dist[j], &stats) :
+					cloud_closest_hit(scn->clouds[i], &rays[j].pos, &rays[j].dir, &min_dist[j], &position, &normal, &mat, &stats))
+				{
+					hits[j] = shadow ? 1 : scn->sphere_count + scn->triangle_count + i + 1;
+				}
+			}
+		}
+		for (j = 0; j < n; j++)
+		{
+			results[queries[start + j].index] = hits[j];
+		}
+		start += n;
+	}
+	free(rays);
+	free(min_dist);
+	free(max_dist);
+	free(hits);
+}
+
+unsigned long long coherence_key(captured_ray * ray)
+{
+	unsigned long long key = ray->type == RAY_SHADOW;
+	key = key << 3 | (ray->dir.x < 0) << 2 | (ray->dir.y < 0) << 1 | (ray->dir.z < 0);
+	//10 bits of each direction component, interleaved so that nearby directions get nearby keys
+	unsigned int d[3];
+	d[0] = (unsigned int) ((ray->dir.x + 1) * 511.5);
+	d[1] = (unsigned int) ((ray->dir.y + 1) * 511.5);
+	d[2] = (unsigned int) ((ray->dir.z + 1) * 511.5);
+	int bit, axis;
+	for (bit = 9; bit >= 0; bit--)
+	{
+		for (axis = 0; axis < 3; axis++)
+		{
+			key = key << 1 | ((d[axis] >> bit) & 1);
+		}
+	}
+	return key;
+}
+
+int compare_queries(const void * a, const void * b)
+{
+	const replay_query * qa = (const replay_query *) a;
+	const replay_query * qb = (const replay_query *) b;
+	if (qa->key != qb->key)
+	{
+		return qa->key < qb->key ? -1 : 1;
+	}
+	return qa->index < qb->index ? -1 : qa->index > qb->index;
+}
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -1,7 +1,45 @@
 #include <stdlib.h>
+#include <string.h>
 #include "scene.h"
+#include "hash.h"
+#include "particles.h"
 
-void init_scene(scene * scn, int light_count, int sphere_count, int triangle_count)
+unsigned long long hash_vec(unsigned long long h, vec_d * v);
+unsigned long long hash_color(unsigned long long h, color * c);
+unsigned long long hash_material(unsigned long long h, material * mat);
+
+/**
+* Compare two values of a scene, treating -0.0 and 0.0 as equal
+*
+* @return int positive number if they are equal
+*/
+int same_vec(vec_d * a, vec_d * b);
+int same_color(color * a, color * b);
+int same_material(material * a, material * b);
+
+/**
+* Copy values in and out of a packed scene, advancing the position in the buffer
+*
+* @param double ** p the position in the buffer
+* @param vec_d/color/material * the value to copy
+*/
+void pack_vec(double ** p, vec_d * v);
+void pack_color(double ** p, color * c);
+void pack_material(double ** p, material * mat);
+void unpack_vec(double ** p, vec_d * v);
+void unpack_color(double ** p, color * c);
+void unpack_material(double ** p, material * mat);
+
+#define PACKED_HEADER_COUNTS 6
+#define PACKED_SCENE_DOUBLES 19
+#define PACKED_LIGHT_DOUBLES 6
+#define PACKED_POINT_LIGHT_DOUBLES 7
+#define PACKED_AREA_LIGHT_DOUBLES 14
+#define PACKED_MATERIAL_DOUBLES 10
+#define PACKED_SPHERE_DOUBLES (4 + PACKED_MATERIAL_DOUBLES)
+#define PACKED_TRIANGLE_DOUBLES (9 + PACKED_MATERIAL_DOUBLES)
+
+void init_scene(scene * scn, long long light_count, long long sphere_count, long long triangle_count)
 {
 	scn->cam = (camera *) malloc(sizeof(camera));
 	scn->amb_light = (color *) malloc(sizeof(vec_d));
@@ -12,19 +50,61 @@ void init_scene(scene * scn, int light_count, int sphere_count, int triangle_cou
 	scn->light_count = light_count;
 	scn->sphere_count = sphere_count;
 	scn->triangle_count = triangle_count;
+	scn->point_lights = NULL;
+	scn->point_light_count = 0;
+	scn->area_lights = NULL;
+	scn->area_light_count = 0;
+	scn->clouds = NULL;
+	scn->cloud_count = 0;
+}
+
+void init_point_lights(scene * scn, long long count)
+{
+	scn->point_lights = (point_light **) calloc(count ? count : 1, sizeof(point_light *));
+	scn->point_light_count = count;
+}
+
+void init_area_lights(scene * scn, long long count)
+{
+	scn->area_lights = (area_light **) calloc(count ? count : 1, sizeof(area_light *));
+	scn->area_light_count = count;
 }
 
-void destroy_scene_counts(scene * scn, int light_count, int sphere_count, int triangle_count)
+void init_clouds(scene * scn, long long count)
+{
+	scn->clouds = (particle_cloud **) calloc(count ? count : 1, sizeof(particle_cloud *));
+	scn->cloud_count = count;
+}
+
+void destroy_scene_counts(scene * scn, long long light_count, long long sphere_count, long long triangle_count)
 {
 	free(scn->cam);
 	free(scn->amb_light);
 	free(scn->bg_color);
-	int i;
+	long long i;
 	for (i = 0; i < light_count; i++)
 	{
 		free(scn->lights[i]);
 	}
 	free(scn->lights);
+	for (i = 0; i < scn->point_light_count; i++)
+	{
+		free(scn->point_lights[i]);
+	}
+	free(scn->point_lights);
+	for (i = 0; i < scn->area_light_count; i++)
+	{
+		free(scn->area_lights[i]);
+	}
+	free(scn->area_lights);
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		if (scn->clouds[i])
+		{
+			destroy_particle_cloud(scn->clouds[i]);
+		}
+	}
+	free(scn->clouds);
 	for (i = 0; i < sphere_count; i++)
 	{
 		free(scn->spheres[i]->mat);
@@ -45,12 +125,30 @@ void destroy_scene(scene * scn)
 	free(scn->cam);
 	free(scn->amb_light);
 	free(scn->bg_color);
-	int i;
+	long long i;
 	for (i = 0; i < scn->light_count; i++)
 	{
 		free(scn->lights[i]);
 	}
 	free(scn->lights);
+	for (i = 0; i < scn->point_light_count; i++)
+	{
+		free(scn->point_lights[i]);
+	}
+	free(scn->point_lights);
+	for (i = 0; i < scn->area_light_count; i++)
+	{
+		free(scn->area_lights[i]);
+	}
+	free(scn->area_lights);
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		if (scn->clouds[i])
+		{
+			destroy_particle_cloud(scn->clouds[i]);
+		}
+	}
+	free(scn->clouds);
 	for (i = 0; i < scn->sphere_count; i++)
 	{
 		free(scn->spheres[i]->mat);
@@ -78,6 +176,29 @@ void init_material(material * mat)
 	mat->spec.g = 0;
 	mat->spec.b = 0;
 	mat->p_const = 0;
+	compile_material(mat);
+}
+
+void compile_material(material * mat)
+{
+	mat->features = 0;
+	if (mat->diff.r || mat->diff.g || mat->diff.b)
+	{
+		mat->features |= MAT_DIFFUSE;
+	}
+	if (mat->spec.r || mat->spec.g || mat->spec.b)
+	{
+		mat->features |= MAT_SPECULAR;
+	}
+	if (mat->refl.r || mat->refl.g || mat->refl.b)
+	{
+		mat->features |= MAT_REFLECTIVE;
+	}
+	mat->exponent = -1;
+	if (mat->p_const >= 0 && mat->p_const <= MAX_INT_EXPONENT && mat->p_const == (int) mat->p_const)
+	{
+		mat->exponent = (int) mat->p_const;
+	}
 }
 
 vec_d get_sphere_normal(sphere * sph, vec_d * position)
@@ -106,3 +227,423 @@ void calculate_triangle_normal(triangle * tri)
 	tri->normal = vec_cross(&v1, &v2);
 	vec_normalize(&tri->normal);
 }
+
+unsigned long long scene_hash(scene * scn)
+{
+	unsigned long long h = HASH_INIT;
+	long long i;
+	h = hash_double(h, scn->fov);
+	h = hash_color(h, scn->amb_light);
+	h = hash_color(h, scn->bg_color);
+	h = hash_vec(h, &scn->cam->at);
+	h = hash_vec(h, &scn->cam->up);
+	h = hash_vec(h, &scn->cam->from);
+	h = hash_bytes(h, &scn->light_count, sizeof(long long));
+	for (i = 0; i < scn->light_count; i++)
+	{
+		h = hash_vec(h, &scn->lights[i]->to_dir);
+		h = hash_color(h, &scn->lights[i]->l_color);
+	}
+	//point lights, area lights and particle clouds only go into the hash when the scene has some
+	if (scn->point_light_count)
+	{
+		h = hash_bytes(h, &scn->point_light_count, sizeof(long long));
+		for (i = 0; i < scn->point_light_count; i++)
+		{
+			h = hash_vec(h, &scn->point_lights[i]->position);
+			h = hash_color(h, &scn->point_lights[i]->l_color);
+			h = hash_double(h, scn->point_lights[i]->falloff);
+		}
+	}
+	if (scn->area_light_count)
+	{
+		h = hash_bytes(h, &scn->area_light_count, sizeof(long long));
+		for (i = 0; i < scn->area_light_count; i++)
+		{
+			area_light * l = scn->area_lights[i];
+			h = hash_bytes(h, &l->shape, sizeof(int));
+			h = hash_vec(h, &l->position);
+			h = hash_vec(h, &l->u);
+			h = hash_vec(h, &l->v);
+			h = hash_color(h, &l->l_color);
+			h = hash_double(h, l->falloff);
+		}
+	}
+	h = hash_bytes(h, &scn->sphere_count, sizeof(long long));
+	for (i = 0; i < scn->sphere_count; i++)
+	{
+		h = hash_vec(h, &scn->spheres[i]->center);
+		h = hash_double(h, scn->spheres[i]->radius);
+		h = hash_material(h, scn->spheres[i]->mat);
+	}
+	h = hash_bytes(h, &scn->triangle_count, sizeof(long long));
+	for (i = 0; i < scn->triangle_count; i++)
+	{
+		h = hash_vec(h, &scn->triangles[i]->p1);
+		h = hash_vec(h, &scn->triangles[i]->p2);
+		h = hash_vec(h, &scn->triangles[i]->p3);
+		h = hash_material(h, scn->triangles[i]->mat);
+	}
+	if (scn->cloud_count)
+	{
+		h = hash_bytes(h, &scn->cloud_count, sizeof(long long));
+		for (i = 0; i < scn->cloud_count; i++)
+		{
+			h = particle_cloud_hash(h, scn->clouds[i]);
+		}
+	}
+	return h;
+}
+
+unsigned long long hash_vec(unsigned long long h, vec_d * v)
+{
+	h = hash_double(h, v->x);
+	h = hash_double(h, v->y);
+	return hash_double(h, v->z);
+}
+
+unsigned long long hash_color(unsigned long long h, color * c)
+{
+	h = hash_double(h, c->r);
+	h = hash_double(h, c->g);
+	return hash_double(h, c->b);
+}
+
+unsigned long long hash_material(unsigned long long h, material * mat)
+{
+	h = hash_color(h, &mat->refl);
+	h = hash_color(h, &mat->diff);
+	h = hash_color(h, &mat->spec);
+	return hash_double(h, mat->p_const);
+}
+
+int compare_scenes(scene * old_scn, scene * new_scn, char * changed)
+{
+	if (old_scn->fov != new_scn->fov || !same_color(old_scn->amb_light, new_scn->amb_light) ||
+		!same_color(old_scn->bg_color, new_scn->bg_color) || !same_vec(&old_scn->cam->at, &new_scn->cam->at) ||
+		!same_vec(&old_scn->cam->up, &new_scn->cam->up) || !same_vec(&old_scn->cam->from, &new_scn->cam->from) ||
+		old_scn->light_count != new_scn->light_count || old_scn->sphere_count != new_scn->sphere_count ||
+		old_scn->triangle_count != new_scn->triangle_count || old_scn->point_light_count != new_scn->point_light_count ||
+		old_scn->area_light_count != new_scn->area_light_count || old_scn->cloud_count != new_scn->cloud_count)
+	{
+		return SCENE_CHANGED;
+	}
+	long long i;
+	for (i = 0; i < old_scn->light_count; i++)
+	{
+		if (!same_vec(&old_scn->lights[i]->to_dir, &new_scn->lights[i]->to_dir) ||
+			!same_color(&old_scn->lights[i]->l_color, &new_scn->lights[i]->l_color))
+		{
+			return SCENE_CHANGED;
+		}
+	}
+	for (i = 0; i < old_scn->point_light_count; i++)
+	{
+		point_light * a = old_scn->point_lights[i];
+		point_light * b = new_scn->point_lights[i];
+		if (!same_vec(&a->position, &b->position) || !same_color(&a->l_color, &b->l_color) || a->falloff != b->falloff)
+		{
+			return SCENE_CHANGED;
+		}
+	}
+	for (i = 0; i < old_scn->area_light_count; i++)
+	{
+		area_light * a = old_scn->area_lights[i];
+		area_light * b = new_scn->area_lights[i];
+		if (a->shape != b->shape || !same_vec(&a->position, &b->position) || !same_vec(&a->u, &b->u) ||
+			!same_vec(&a->v, &b->v) || !same_color(&a->l_color, &b->l_color) || a->falloff != b->falloff)
+		{
+			return SCENE_CHANGED;
+		}
+	}
+	//particles have no primitive ids of their own to flag, so any change to a cloud redoes the whole image
+	for (i = 0; i < old_scn->cloud_count; i++)
+	{
+		if (!same_particle_cloud(old_scn->clouds[i], new_scn->clouds[i]))
+		{
+			return SCENE_CHANGED;
+		}
+	}
+	int result = SCENE_SAME;
+	for (i = 0; i < old_scn->sphere_count; i++)
+	{
+		sphere * a = old_scn->spheres[i];
+		sphere * b = new_scn->spheres[i];
+		changed[i] = 0;
+		if (!same_vec(&a->center, &b->center) || a->radius != b->radius)
+		{
+			changed[i] |= PRIM_GEOMETRY;
+		}
+		if (!same_material(a->mat, b->mat))
+		{
+			changed[i] |= PRIM_MATERIAL;
+		}
+		if (changed[i])
+		{
+			result = SCENE_PRIMS_CHANGED;
+		}
+	}
+	for (i = 0; i < old_scn->triangle_count; i++)
+	{
+		triangle * a = old_scn->triangles[i];
+		triangle * b = new_scn->triangles[i];
+		long long id = old_scn->sphere_count + i;
+		changed[id] = 0;
+		if (!same_vec(&a->p1, &b->p1) || !same_vec(&a->p2, &b->p2) || !same_vec(&a->p3, &b->p3))
+		{
+			changed[id] |= PRIM_GEOMETRY;
+		}
+		if (!same_material(a->mat, b->mat))
+		{
+			changed[id] |= PRIM_MATERIAL;
+		}
+		if (changed[id])
+		{
+			result = SCENE_PRIMS_CHANGED;
+		}
+	}
+	return result;
+}
+
+int same_vec(vec_d * a, vec_d * b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+int same_color(color * a, color * b)
+{
+	return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+int same_material(material * a, material * b)
+{
+	return same_color(&a->refl, &b->refl) && same_color(&a->diff, &b->diff) && same_color(&a->spec, &b->spec) && a->p_const == b->p_const;
+}
+
+void * serialize_scene(scene * scn, size_t * len)
+{
+	size_t doubles = PACKED_SCENE_DOUBLES + (size_t) scn->light_count * PACKED_LIGHT_DOUBLES +
+		(size_t) scn->point_light_count * PACKED_POINT_LIGHT_DOUBLES + (size_t) scn->area_light_count * PACKED_AREA_LIGHT_DOUBLES +
+		(size_t) scn->sphere_count * PACKED_SPHERE_DOUBLES + (size_t) scn->triangle_count * PACKED_TRIANGLE_DOUBLES;
+	size_t cloud_bytes = 0;
+	long long i;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		cloud_bytes += pack_particle_cloud(scn->clouds[i], NULL);
+	}
+	*len = sizeof(long long) * PACKED_HEADER_COUNTS + sizeof(double) * doubles + cloud_bytes;
+	long long * header = (long long *) malloc(*len);
+	header[0] = scn->light_count;
+	header[1] = scn->sphere_count;
+	header[2] = scn->triangle_count;
+	header[3] = scn->point_light_count;
+	header[4] = scn->area_light_count;
+	header[5] = scn->cloud_count;
+	double * p = (double *) (header + PACKED_HEADER_COUNTS);
+	*p++ = scn->fov;
+	pack_color(&p, scn->amb_light);
+	pack_color(&p, scn->bg_color);
+	pack_vec(&p, &scn->cam->at);
+	pack_vec(&p, &scn->cam->up);
+	pack_vec(&p, &scn->cam->from);
+	for (i = 0; i < scn->light_count; i++)
+	{
+		pack_vec(&p, &scn->lights[i]->to_dir);
+		pack_color(&p, &scn->lights[i]->l_color);
+	}
+	for (i = 0; i < scn->point_light_count; i++)
+	{
+		pack_vec(&p, &scn->point_lights[i]->position);
+		pack_color(&p, &scn->point_lights[i]->l_color);
+		*p++ = scn->point_lights[i]->falloff;
+	}
+	for (i = 0; i < scn->area_light_count; i++)
+	{
+		area_light * l = scn->area_lights[i];
+		*p++ = l->shape;
+		pack_vec(&p, &l->position);
+		pack_vec(&p, &l->u);
+		pack_vec(&p, &l->v);
+		pack_color(&p, &l->l_color);
+		*p++ = l->falloff;
+	}
+	for (i = 0; i < scn->sphere_count; i++)
+	{
+		pack_vec(&p, &scn->spheres[i]->center);
+		*p++ = scn->spheres[i]->radius;
+		pack_material(&p, scn->spheres[i]->mat);
+	}
+	for (i = 0; i < scn->triangle_count; i++)
+	{
+		pack_vec(&p, &scn->triangles[i]->p1);
+		pack_vec(&p, &scn->triangles[i]->p2);
+		pack_vec(&p, &scn->triangles[i]->p3);
+		pack_material(&p, scn->triangles[i]->mat);
+	}
+	char * packed_cloud = (char *) p;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		packed_cloud += pack_particle_cloud(scn->clouds[i], packed_cloud);
+	}
+	return header;
+}
+
+int deserialize_scene(void * buf, size_t len, scene * scn)
+{
+	if (len < sizeof(long long) * PACKED_HEADER_COUNTS)
+	{
+		return 0;
+	}
+	long long * header = (long long *) buf;
+	long long light_count = header[0], sphere_count = header[1], triangle_count = header[2], point_light_count = header[3];
+	long long area_light_count = header[4], cloud_count = header[5];
+	//every object takes at least 8 bytes, so counts beyond the length are bad and would overflow the sizes below
+	int c;
+	for (c = 0; c < PACKED_HEADER_COUNTS; c++)
+	{
+		if (header[c] < 0 || (size_t) header[c] > len)
+		{
+			return 0;
+		}
+	}
+	//the clouds come last and vary in size, so only the part before them has a size known from the header
+	size_t fixed = sizeof(long long) * PACKED_HEADER_COUNTS + sizeof(double) * (PACKED_SCENE_DOUBLES + (size_t) light_count * PACKED_LIGHT_DOUBLES +
+		(size_t) point_light_count * PACKED_POINT_LIGHT_DOUBLES + (size_t) area_light_count * PACKED_AREA_LIGHT_DOUBLES +
+		(size_t) sphere_count * PACKED_SPHERE_DOUBLES + (size_t) triangle_count * PACKED_TRIANGLE_DOUBLES);
+	if (cloud_count ? len < fixed : len != fixed)
+	{
+		return 0;
+	}
+	//the clouds are checked before anything else is allocated, so that a bad one leaves nothing to free
+	particle_cloud ** clouds = (particle_cloud **) calloc(cloud_count ? cloud_count : 1, sizeof(particle_cloud *));
+	char * packed_cloud = (char *) buf + fixed;
+	size_t left = len - fixed;
+	long long i;
+	for (i = 0; i < cloud_count; i++)
+	{
+		size_t used;
+		clouds[i] = unpack_particle_cloud(packed_cloud, left, &used);
+		if (!clouds[i] || used > left)
+		{
+			break;
+		}
+		packed_cloud += used;
+		left -= used;
+	}
+	if (i < cloud_count || left)
+	{
+		long long j;
+		for (j = 0; j < cloud_count && clouds[j]; j++)
+		{
+			destroy_particle_cloud(clouds[j]);
+		}
+		free(clouds);
+		return 0;
+	}
+	init_scene(scn, light_count, sphere_count, triangle_count);
+	if (point_light_count)
+	{
+		init_point_lights(scn, point_light_count);
+	}
+	if (area_light_count)
+	{
+		init_area_lights(scn, area_light_count);
+	}
+	scn->clouds = clouds;
+	scn->cloud_count = cloud_count;
+	double * p = (double *) (header + PACKED_HEADER_COUNTS);
+	scn->fov = *p++;
+	unpack_color(&p, scn->amb_light);
+	unpack_color(&p, scn->bg_color);
+	unpack_vec(&p, &scn->cam->at);
+	unpack_vec(&p, &scn->cam->up);
+	unpack_vec(&p, &scn->cam->from);
+	for (i = 0; i < light_count; i++)
+	{
+		light * l = (light *) malloc(sizeof(light));
+		unpack_vec(&p, &l->to_dir);
+		unpack_color(&p, &l->l_color);
+		scn->lights[i] = l;
+	}
+	for (i = 0; i < point_light_count; i++)
+	{
+		point_light * l = (point_light *) malloc(sizeof(point_light));
+		unpack_vec(&p, &l->position);
+		unpack_color(&p, &l->l_color);
+		l->falloff = *p++;
+		scn->point_lights[i] = l;
+	}
+	for (i = 0; i < area_light_count; i++)
+	{
+		area_light * l = (area_light *) malloc(sizeof(area_light));
+		l->shape = (int) *p++;
+		unpack_vec(&p, &l->position);
+		unpack_vec(&p, &l->u);
+		unpack_vec(&p, &l->v);
+		unpack_color(&p, &l->l_color);
+		l->falloff = *p++;
+		scn->area_lights[i] = l;
+	}
+	for (i = 0; i < sphere_count; i++)
+	{
+		sphere * s = (sphere *) malloc(sizeof(sphere));
+		s->mat = (material *) malloc(sizeof(material));
+		unpack_vec(&p, &s->center);
+		s->radius = *p++;
+		unpack_material(&p, s->mat);
+		scn->spheres[i] = s;
+	}
+	for (i = 0; i < triangle_count; i++)
+	{
+		triangle * t = (triangle *) malloc(sizeof(triangle));
+		t->mat = (material *) malloc(sizeof(material));
+		unpack_vec(&p, &t->p1);
+		unpack_vec(&p, &t->p2);
+		unpack_vec(&p, &t->p3);
+		unpack_material(&p, t->mat);
+		calculate_triangle_normal(t);
+		scn->triangles[i] = t;
+	}
+	return 1;
+}
+
+void pack_vec(double ** p, vec_d * v)
+{
+	memcpy(*p, v, sizeof(vec_d));
+	*p += 3;
+}
+
+void pack_color(double ** p, color * c)
+{
+	memcpy(*p, c, sizeof(color));
+	*p += 3;
+}
+
+void pack_material(double ** p, material * mat)
+{
+	pack_color(p, &mat->refl);
+	pack_color(p, &mat->diff);
+	pack_color(p, &mat->spec);
+	*(*p)++ = mat->p_const;
+}
+
+void unpack_vec(double ** p, vec_d * v)
+{
+	memcpy(v, *p, sizeof(vec_d));
+	*p += 3;
+}
+
+void unpack_color(double ** p, color * c)
+{
+	memcpy(c, *p, sizeof(color));
+	*p += 3;
+}
+
+void unpack_material(double ** p, material * mat)
+{
+	unpack_color(p, &mat->refl);
+	unpack_color(p, &mat->diff);
+	unpack_color(p, &mat->spec);
+	mat->p_const = *(*p)++;
+	compile_material(mat);
+}
@@ -33,7 +33,45 @@ typedef struct
 } light;
 
 /**
-* describes reflectivity, specularity and diffuse properties of an object
+* a light at a point, whose color is divided by 1 + falloff * distance^2 where it arrives
+*/
+typedef struct
+{
+	vec_d position;
+	color l_color;
+	double falloff;
+} point_light;
+
+//the shapes of an area light
+#define AREA_RECT 0
+#define AREA_DISK 1
+
+/**
+* a light spread evenly over a rectangle or a disk, every point of which lights like a point light with its share of
+* l_color. A rectangle covers position + s * u + t * v for s and t in [0, 1]. A disk is centered on position,
+* and u and v are at right angles to each other and as long as its radius
+*/
+typedef struct
+{
+	int shape;
+	vec_d position;
+	vec_d u;
+	vec_d v;
+	color l_color;
+	double falloff;
+} area_light;
+
+//the shading a material needs, see compile_material
+#define MAT_DIFFUSE 1
+#define MAT_SPECULAR 2
+#define MAT_REFLECTIVE 4
+
+//the largest Phong constant raised to by repeated squaring, larger ones go through pow
+#define MAX_INT_EXPONENT 4096
+
+/**
+* describes reflectivity, specularity and diffuse properties of an object.
+* features and exponent are derived from the colors and p_const by compile_material
 */
 typedef struct
 {
@@ -41,6 +79,8 @@ typedef struct
 	color diff;
 	color spec;
 	double p_const;
+	int features;
+	int exponent;
 } material;
 
 
@@ -66,6 +106,11 @@ typedef struct
 	material * mat;
 } triangle;
 
+/**
+* a large number of small spheres stored apart from the scene spheres, see particles.h
+*/
+typedef struct particle_cloud particle_cloud;
+
 /**
 * all of the data needed to render the scene in the raytracer
 */
@@ -78,31 +123,62 @@ typedef struct
 	light ** lights;
 	sphere ** spheres;
 	triangle ** triangles;
-	int light_count;
-	int sphere_count;
-	int triangle_count;
+	point_light ** point_lights;
+	area_light ** area_lights;
+	particle_cloud ** clouds;
+	long long light_count;
+	long long sphere_count;
+	long long triangle_count;
+	long long point_light_count;
+	long long area_light_count;
+	long long cloud_count;
 } scene;
 
 /**
 * Alocates memory for a new scene and for each object in the scene.
 *
-* @param int light_count the number of lights in the scene
-* @param int sphere_count the number of spheres in the scene
-* @param int triangle_count the number of triangles in the scene
+* @param long long light_count the number of lights in the scene
+* @param long long sphere_count the number of spheres in the scene
+* @param long long triangle_count the number of triangles in the scene
 *
 * @return scene * a blank scene with the correct number of objects to accomadate the counts supplied. NULL if it fails (it shouldn't, thought)
 */
-void init_scene(scene * scn, int light_count, int sphere_count, int triangle_count);
+void init_scene(scene * scn, long long light_count, long long sphere_count, long long triangle_count);
+
+/**
+* Allocates the point lights of a scene made by init_scene, which has none until this is called.
+* The slots start out NULL, so a scene freed before they are all filled in only frees the ones that are
+*
+* @param scene * scn the scene
+* @param long long count the number of point lights
+*/
+void init_point_lights(scene * scn, long long count);
+
+/**
+* Allocates the area lights of a scene made by init_scene the same way as init_point_lights
+*
+* @param scene * scn the scene
+* @param long long count the number of area lights
+*/
+void init_area_lights(scene * scn, long long count);
+
+/**
+* Allocates the particle clouds of a scene made by init_scene the same way as init_point_lights
+*
+* @param scene * scn the scene
+* @param long long count the number of clouds
+*/
+void init_clouds(scene * scn, long long count);
 
 /**
 * frees the memory allocated for the scene. Only used if not all of the scene objects have been intialized yet, so that the correct number will be freed
 *
 * @param scene * scn the scene to deallocate
-* @param int light_count the number of lights to free
-* @param int sphere_count the number of spheres to free
-* @param int triangle_count the number of triangles to free
+* @param long long light_count the number of lights to free
+* @param long long sphere_count the number of spheres to free
+* @param long long triangle_count the number of triangles to free
 */
-void destroy_scene_counts(scene * scn, int light_count, int sphere_count, int triangle_count);
+void destroy_scene_counts(scene * scn, long long light_count, long long sphere_count, long long triangle_count);
 
 /**
 * frees the memory allocated for the scene. This should be used if all objects have been allocated
@@ -118,6 +194,14 @@ void destroy_scene(scene * scn);
 */
 void init_material(material * mat);
 
+/**
+* Works out which shading a material needs, as MAT_ flags for its non-zero colors, and whether its Phong constant
+* is a whole number up to MAX_INT_EXPONENT. Has to be called again whenever the colors or p_const change
+*
+* @param material * mat the material
+*/
+void compile_material(material * mat);
+
 
 /**
 * Calculates the normal of the sphere surface at a given position
@@ -146,4 +230,54 @@ vec_d get_triangle_normal(triangle * tri, vec_d * position, vec_d * origin);
 */
 void calculate_triangle_normal(triangle * tri);
 
+/**
+* Calculates a hash of everything in the scene that affects the rendered image.
+* Two scenes that would render identically hash the same, regardless of how their files were formatted
+*
+* @param scene * scn the scene
+*
+* @return unsigned long long the hash
+*/
+unsigned long long scene_hash(scene * scn);
+
+#define SCENE_SAME 0
+#define SCENE_PRIMS_CHANGED 1
+#define SCENE_CHANGED 2
+
+#define PRIM_MATERIAL 1
+#define PRIM_GEOMETRY 2
+
+/**
+* Compares two versions of a scene. When only spheres and triangles differ, changed is filled in for each primitive id
+* (spheres first, then triangles) with PRIM_MATERIAL and/or PRIM_GEOMETRY
+*
+* @param scene * old_scn the previous version
+* @param scene * new_scn the new version
+* @param char * changed one flag per primitive, set by this function
+*
+* @return int SCENE_SAME, SCENE_PRIMS_CHANGED, or SCENE_CHANGED if the camera, lights, background or object counts differ
+*/
+int compare_scenes(scene * old_scn, scene * new_scn, char * changed);
+
+/**
+* Packs a scene into a single buffer so it can be sent to another process. Both ends must have the same byte order
+*
+* @param scene * scn the scene
+* @param size_t * len the size of the buffer is stored here
+*
+* @return void * the packed scene; it is malloc'd
+*/
+void * serialize_scene(scene * scn, size_t * len);
+
+/**
+* Rebuilds a scene packed by serialize_scene
+*
+* @param void * buf the packed scene
+* @param size_t len the size of buf
+* @param scene * scn the output scene. Should not already have memory allocated
+*
+* @return int 0 if buf is not a valid scene, positive number if it succeeds
+*/
+int deserialize_scene(void * buf, size_t len, scene * scn);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,493 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "scenecc.h"
+#include "hash.h"
+
+#define LEN_ERROR 256
+#define LEN_PATH 4096
+//the most primitive tests unrolled into one module, over all of its functions. Every test is a few hundred bytes of
+//code that a ray runs through once, so past a couple of megabytes the module waits on instruction fetches and is
+//slower than the generic loops, which also spares the compiler its few milliseconds per test
+#define MAX_UNROLLED_TESTS 3000
+//the most tests the functions for single lights may add. They only save a few products per test, which larger
+//scenes lose again to the size of the code
+#define MAX_LIGHT_TESTS 1500
+//changed whenever the generated source or the table it exports changes, so old modules are never loaded
+#define MODULE_VERSION 1
+//the primitives each function of a module tests
+#define CHUNK_PRIMITIVES 32
+//no option that could change a result, so that the module does exactly what ray.c does: -fno-math-errno only lets
+//sqrt be a single instruction. -O1 builds modules twice as fast as -O2 and they run about as fast
+#define MODULE_CFLAGS "-O1 -fno-math-errno -fPIC -shared -ffp-contract=off"
+
+char g_scenecc_err[LEN_ERROR];
+
+/**
+* the start of every module: the types it shares with ray.h and the intersection tests of ray.c written for
+* constant primitives, in the same order of operations so that every result is bit for bit the same. Every kernel
+* expands the list of primitives the module defines with the tests it needs
+*/
+static const char * prelude[] = {
+	"#include <math.h>",
+	"typedef struct { double x; double y; double z; } vec_d;",
+	"typedef struct { vec_d pos; vec_d dir; } ray_d;",
+	"typedef struct",
+	"{",
+	"	int version;",
+	"	int (* closest)(ray_d * ray, vec_d * position, vec_d * normal, double * min_dist);",
+	"	int (* any)(ray_d * ray);",
+	"	int (* any_within)(ray_d * ray, double dist);",
+	"	int (* const * light_any)(vec_d * origin);",
+	"} module_table;",
+	"#define INLINE static inline __attribute__((always_inline))",
+	"#define NOINLINE static __attribute__((noinline))",
+	"INLINE double distance(const vec_d * a, const vec_d * b)",
+	"{",
+	"	double x = a->x - b->x, y = a->y - b->y, z = a->z - b->z;",
+	"	return sqrt(x * x + y * y + z * z);",
+	"}",
+	"INLINE int hit_sphere(const ray_d * ray, double cx, double cy, double cz, double r, vec_d * p)",
+	"{",
+	"	double ox = cx - ray->pos.x, oy = cy - ray->pos.y, oz = cz - ray->pos.z;",
+	"	double oc_mag = sqrt(ox * ox + oy * oy + oz * oz);",
+	"	int inside = oc_mag < r;",
+	"	double closest = ray->dir.x * ox + ray->dir.y * oy + ray->dir.z * oz;",
+	"	if (closest < 0 && !inside)",
+	"		return 0;",
+	"	double sq = r * r - oc_mag * oc_mag + closest * closest;",
+	"	if (sq < 0)",
+	"		return 0;",
+	"	double t = inside ? closest + sqrt(sq) : closest - sqrt(sq);",
+	"	p->x = ray->pos.x + ray->dir.x * t;",
+	"	p->y = ray->pos.y + ray->dir.y * t;",
+	"	p->z = ray->pos.z + ray->dir.z * t;",
+	"	return 1;",
+	"}",
+	"INLINE void cross(double u1, double v1, double u2, double v2, int * count, int * sign)",
+	"{",
+	"	int next = v2 < 0 ? -1 : 1;",
+	"	if (next != *sign)",
+	"	{",
+	"		if (u1 > 0 && u2 > 0)",
+	"			(*count)++;",
+	"		else if ((u1 > 0 || u2 > 0) && u1 - v1 * (u2 - u1) / (v2 - v1) > 0)",
+	"			(*count)++;",
+	"	}",
+	"	*sign = next;",
+	"}",
+	"INLINE int hit_triangle(const ray_d * ray, int axis, double ax, double ay, double az, double bx, double by, double bz,",
+	"	double cx, double cy, double cz, double nx, double ny, double nz, vec_d * p)",
+	"{",
+	"	double den = nx * ray->dir.x + ny * ray->dir.y + nz * ray->dir.z;",
+	"	if (den == 0)",
+	"		return 0;",
+	"	double t = (nx * (ax - ray->pos.x) + ny * (ay - ray->pos.y) + nz * (az - ray->pos.z)) / den;",
+	"	if (t < 0)",
+	"		return 0;",
+	"	p->x = t * ray->dir.x + ray->pos.x;",
+	"	p->y = t * ray->dir.y + ray->pos.y;",
+	"	p->z = t * ray->dir.z + ray->pos.z;",
+	"	double u1 = axis ? ax : ay, v1 = axis == 2 ? ay : az, u2 = axis ? bx : by, v2 = axis == 2 ? by : bz;",
+	"	double u3 = axis ? cx : cy, v3 = axis == 2 ? cy : cz, pu = axis ? p->x : p->y, pv = axis == 2 ? p->y : p->z;",
+	"	u1 -= pu;",
+	"	v1 -= pv;",
+	"	u2 -= pu;",
+	"	v2 -= pv;",
+	"	u3 -= pu;",
+	"	v3 -= pv;",
+	"	int count = 0, sign = v1 < 0 ? -1 : 1;",
+	"	cross(u1, v1, u2, v2, &count, &sign);",
+	"	cross(u2, v2, u3, v3, &count, &sign);",
+	"	cross(u3, v3, u1, v1, &count, &sign);",
+	"	return count % 2;",
+	"}",
+	"#define CLOSEST_SPHERE(id, cx, cy, cz, r) \\",
+	"	if (hit_sphere(ray, cx, cy, cz, r, &p) && (d = distance(&ray->pos, &p)) < *min_dist) \\",
+	"	{ \\",
+	"		*position = p; \\",
+	"		normal->x = (p.x - cx) / r; \\",
+	"		normal->y = (p.y - cy) / r; \\",
+	"		normal->z = (p.z - cz) / r; \\",
+	"		*min_dist = d; \\",
+	"		hit = id; \\",
+	"	}",
+	"#define CLOSEST_TRIANGLE(id, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz) \\",
+	"	if (hit_triangle(ray, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz, &p) && \\",
+	"		(d = distance(&ray->pos, &p)) < *min_dist) \\",
+	"	{ \\",
+	"		*position = p; \\",
+	"		int front = nx * (p.x - ray->pos.x) + ny * (p.y - ray->pos.y) + nz * (p.z - ray->pos.z) < 0; \\",
+	"		normal->x = front ? nx : nx * -1; \\",
+	"		normal->y = front ? ny : ny * -1; \\",
+	"		normal->z = front ? nz : nz * -1; \\",
+	"		*min_dist = d; \\",
+	"		hit = id; \\",
+	"	}",
+	"#define ANY_SPHERE(id, cx, cy, cz, r) if (hit_sphere(ray, cx, cy, cz, r, &p)) return id;",
+	"#define ANY_TRIANGLE(id, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz) \\",
+	"	if (hit_triangle(ray, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz, &p)) return id;",
+	"#define WITHIN_SPHERE(id, cx, cy, cz, r) if (hit_sphere(ray, cx, cy, cz, r, &p) && distance(&ray->pos, &p) < dist) return id;",
+	"#define WITHIN_TRIANGLE(id, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz) \\",
+	"	if (hit_triangle(ray, axis, ax, ay, az, bx, by, bz, cx, cy, cz, nx, ny, nz, &p) && distance(&ray->pos, &p) < dist) \\",
+	"		return id;",
+	NULL
+};
+
+/**
+* Writes the source of the module of a scene
+*
+* @param FILE * f where to write
+* @param scene * scn the scene
+* @param int lights the number of directional lights to write a function for, 0 for none
+*/
+void write_module(FILE * f, scene * scn, int lights);
+
+/**
+* Writes a double as a C constant that reads back as exactly the same value
+*/
+void write_double(FILE * f, double v);
+
+/**
+* Writes a kernel that looks for any hit by calling the function of every list of primitives in turn
+*
+* @param FILE * f where to write
+* @param char * signature the declaration of the kernel
+* @param char * call the call of the function of a list, with %lld where its number goes
+* @param long long chunks the number of lists
+*/
+void write_any_kernel(FILE * f, char * signature, char * call, long long chunks);
+
+/**
+* Runs the compiler on a module source, writing the shared object to a temporary name first so that a render
+* started at the same time never loads a partial one
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int build_module(char * source, char * module);
+
+/**
+* Checks that a directory is a real directory, not a link, owned by the user running the renderer and that no one
+* else can write to
+*
+* @param char * dir the directory
+*
+* @return int 0 if it isn't, see get_scenecc_error, positive number if it is
+*/
+int private_dir(char * dir);
+
+scene_kernels * load_scene_kernels(scene * scn, char * dir, int * cached)
+{
+	long long prims = scn->sphere_count + scn->triangle_count;
+	if (3 * prims > MAX_UNROLLED_TESTS)
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "The scene has too many primitives to compile, %lld at most", MAX_UNROLLED_TESTS / 3LL);
+		return NULL;
+	}
+	//a function per light only while the module stays small enough, rays to the others use the any kernel
+	int lights = scn->light_count * prims <= MAX_LIGHT_TESTS ? scn->light_count : 0;
+	char * text = NULL;
+	size_t len = 0;
+	FILE * f = open_memstream(&text, &len);
+	write_module(f, scn, lights);
+	fclose(f);
+	char cc_flags[LEN_PATH];
+	snprintf(cc_flags, sizeof(cc_flags), "%s %s", getenv("CC") ? getenv("CC") : "cc", MODULE_CFLAGS);
+	unsigned long long h = hash_bytes(HASH_INIT, text, len);
+	h = hash_bytes(h, cc_flags, strlen(cc_flags));
+	char default_dir[LEN_PATH], source[LEN_PATH], module[LEN_PATH];
+	if (!dir && !(dir = get_default_module_dir(default_dir, sizeof(default_dir))))
+	{
+		free(text);
+		return NULL;
+	}
+	if (snprintf(source, sizeof(source), "%s/scene-%016llx.c", dir, h) >= (int) sizeof(source) ||
+		snprintf(module, sizeof(module), "%s/scene-%016llx.so", dir, h) >= (int) sizeof(module))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "The module directory '%.200s' has too long a path", dir);
+		free(text);
+		return NULL;
+	}
+	if (mkdir(dir, 0700) && errno != EEXIST)
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Could not create the module directory '%.200s'", dir);
+		free(text);
+		return NULL;
+	}
+	//modules are loaded into the process, so only from a directory no one else can put files in
+	if (!private_dir(dir))
+	{
+		free(text);
+		return NULL;
+	}
+	*cached = !access(module, R_OK);
+	if (!*cached)
+	{
+		f = fopen(source, "w");
+		int written = f && fwrite(text, 1, len, f) == len;
+		written = f && !fclose(f) && written;
+		if (!written || !build_module(source, module))
+		{
+			if (!written)
+			{
+				snprintf(g_scenecc_err, LEN_ERROR, "Could not write '%.200s'", source);
+			}
+			free(text);
+			return NULL;
+		}
+		unlink(source);
+	}
+	free(text);
+	void * handle = dlopen(module, RTLD_NOW | RTLD_LOCAL);
+	int * table = handle ? (int *) dlsym(handle, "scene_module") : NULL;
+	//the hash of the source is in the name, so a module only ever differs from what is expected when it is from an
+	//older version or damaged
+	if (!table || *table != MODULE_VERSION)
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Could not load the scene module '%.180s'%s", module,
+			handle ? "" : ", delete it to rebuild it");
+		if (handle)
+		{
+			dlclose(handle);
+		}
+		return NULL;
+	}
+	struct
+	{
+		int version;
+		int (* closest)(ray_d * ray, vec_d * position, vec_d * normal, double * min_dist);
+		int (* any)(ray_d * ray);
+		int (* any_within)(ray_d * ray, double dist);
+		int (* const * light_any)(vec_d * origin);
+	} * exported = (void *) table;
+	scene_kernels * kernels = (scene_kernels *) malloc(sizeof(scene_kernels));
+	kernels->closest = exported->closest;
+	kernels->any = exported->any;
+	kernels->any_within = exported->any_within;
+	kernels->light_any = exported->light_any;
+	kernels->handle = handle;
+	return kernels;
+}
+
+void unload_scene_kernels(scene_kernels * kernels)
+{
+	if (!kernels)
+	{
+		return;
+	}
+	dlclose(kernels->handle);
+	free(kernels);
+}
+
+char * get_default_module_dir(char * path, size_t size)
+{
+	//the XDG base directory spec has relative paths ignored
+	char * cache = getenv("XDG_CACHE_HOME");
+	int written;
+	if (cache && cache[0] == '/')
+	{
+		written = snprintf(path, size, "%s", cache);
+	}
+	else if (getenv("HOME") && getenv("HOME")[0] == '/')
+	{
+		written = snprintf(path, size, "%s/.cache", getenv("HOME"));
+	}
+	else
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "There is no home directory to keep scene modules in, use --cache-dir");
+		return NULL;
+	}
+	if (written < 0 || (size_t) written >= size || (mkdir(path, 0700) && errno != EEXIST) ||
+		(size_t) snprintf(path + written, size - written, "/raytracer-modules") >= size - written)
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Could not use the cache directory '%.200s' for scene modules", path);
+		return NULL;
+	}
+	return path;
+}
+
+int private_dir(char * dir)
+{
+	struct stat st;
+	if (lstat(dir, &st))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Could not read the module directory '%.200s'", dir);
+		return 0;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Not loading scene modules from '%.150s', it must be a directory of this user "
+			"that no one else can write to", dir);
+		return 0;
+	}
+	return 1;
+}
+
+char * get_scenecc_error()
+{
+	return g_scenecc_err;
+}
+
+void write_module(FILE * f, scene * scn, int lights)
+{
+	int i;
+	long long k;
+	for (i = 0; prelude[i]; i++)
+	{
+		fprintf(f, "%s\n", prelude[i]);
+	}
+	//every primitive once, in the order the generic loops test them, as lists of CHUNK_PRIMITIVES each kernel expands
+	//its own way. Compilers take far longer than linear on large functions, so every kernel is a function per list
+	//called one after the other
+	long long prims = scn->sphere_count + scn->triangle_count;
+	long long chunks = (prims + CHUNK_PRIMITIVES - 1) / CHUNK_PRIMITIVES;
+	for (k = 0; k < prims; k++)
+	{
+		if (k % CHUNK_PRIMITIVES == 0)
+		{
+			fprintf(f, "%s#define PRIMITIVES_%lld(SPHERE, TRIANGLE)", k ? "\n" : "", k / CHUNK_PRIMITIVES);
+		}
+		if (k < scn->sphere_count)
+		{
+			sphere * sph = scn->spheres[k];
+			fprintf(f, " \\\n\tSPHERE(%lld", k + 1);
+			double values[4] = {sph->center.x, sph->center.y, sph->center.z, sph->radius};
+			for (i = 0; i < 4; i++)
+			{
+				write_double(f, values[i]);
+			}
+		}
+		else
+		{
+			triangle * tri = scn->triangles[k - scn->sphere_count];
+			//the plane the triangle is projected on is known now, so the test never chooses it
+			double x_mag = fabs(tri->normal.x), y_mag = fabs(tri->normal.y), z_mag = fabs(tri->normal.z);
+			int axis = x_mag > y_mag && x_mag > z_mag ? 0 : y_mag > z_mag ? 1 : 2;
+			fprintf(f, " \\\n\tTRIANGLE(%lld, %d", k + 1, axis);
+			double values[12] = {tri->p1.x, tri->p1.y, tri->p1.z, tri->p2.x, tri->p2.y, tri->p2.z, tri->p3.x, tri->p3.y,
+				tri->p3.z, tri->normal.x, tri->normal.y, tri->normal.z};
+			for (i = 0; i < 12; i++)
+			{
+				write_double(f, values[i]);
+			}
+		}
+		fprintf(f, ")");
+	}
+	fprintf(f, "\n");
+	for (k = 0; k < chunks; k++)
+	{
+		fprintf(f, "NOINLINE int closest_%lld(ray_d * ray, vec_d * position, vec_d * normal, double * min_dist, int hit)\n{\n"
+			"\tvec_d p;\n\tdouble d;\n\tPRIMITIVES_%lld(CLOSEST_SPHERE, CLOSEST_TRIANGLE)\n\treturn hit;\n}\n", k, k);
+		fprintf(f, "NOINLINE int any_%lld(ray_d * ray)\n{\n\tvec_d p;\n\tPRIMITIVES_%lld(ANY_SPHERE, ANY_TRIANGLE)\n\treturn 0;\n}\n",
+			k, k);
+		fprintf(f, "NOINLINE int any_within_%lld(ray_d * ray, double dist)\n{\n\tvec_d p;\n"
+			"\tPRIMITIVES_%lld(WITHIN_SPHERE, WITHIN_TRIANGLE)\n\treturn 0;\n}\n", k, k);
+		//the direction of a shadow ray towards a directional light is a constant as well, which leaves the compiler
+		//whole products of every test to work out once
+		for (i = 0; i < lights; i++)
+		{
+			vec_d * dir = &scn->lights[i]->to_dir;
+			fprintf(f, "NOINLINE int light_%d_%lld(vec_d * origin)\n{\n\tray_d r = {*origin, {(%a), (%a), (%a)}};\n", i, k,
+				dir->x, dir->y, dir->z);
+			fprintf(f, "\tray_d * ray = &r;\n\tvec_d p;\n\tPRIMITIVES_%lld(ANY_SPHERE, ANY_TRIANGLE)\n\treturn 0;\n}\n", k);
+		}
+	}
+	fprintf(f, "static int closest(ray_d * ray, vec_d * position, vec_d * normal, double * min_dist)\n{\n\tint hit = 0;\n");
+	for (k = 0; k < chunks; k++)
+	{
+		fprintf(f, "\thit = closest_%lld(ray, position, normal, min_dist, hit);\n", k);
+	}
+	fprintf(f, "\treturn hit;\n}\n");
+	write_any_kernel(f, "static int any(ray_d * ray)", "any_%lld(ray)", chunks);
+	write_any_kernel(f, "static int any_within(ray_d * ray, double dist)", "any_within_%lld(ray, dist)", chunks);
+	for (i = 0; i < lights; i++)
+	{
+		char name[64], call[64];
+		snprintf(name, sizeof(name), "static int light_%d(vec_d * origin)", i);
+		snprintf(call, sizeof(call), "light_%d_%%lld(origin)", i);
+		write_any_kernel(f, name, call, chunks);
+	}
+	fprintf(f, "static int (* const lights[])(vec_d * origin) = {");
+	for (i = 0; i < lights; i++)
+	{
+		fprintf(f, "%slight_%d", i ? ", " : "", i);
+	}
+	fprintf(f, "%s};\n", lights ? "" : "0");
+	fprintf(f, "const module_table scene_module = {%d, closest, any, any_within, %s};\n", MODULE_VERSION, lights ? "lights" : "0");
+}
+
+void write_any_kernel(FILE * f, char * signature, char * call, long long chunks)
+{
+	long long k;
+	fprintf(f, "%s\n{\n\tint id;\n", signature);
+	for (k = 0; k < chunks; k++)
+	{
+		fprintf(f, "\tif ((id = ");
+		fprintf(f, call, k);
+		fprintf(f, "))\n\t\treturn id;\n");
+	}
+	fprintf(f, "\treturn 0;\n}\n");
+}
+
+void write_double(FILE * f, double v)
+{
+	//hexadecimal floats are exact, the parentheses keep a negative constant whole inside the expressions of the tests
+	fprintf(f, ", (%a)", v);
+}
+
+int build_module(char * source, char * module)
+{
+	char tmp[LEN_PATH], command[3 * LEN_PATH];
+	//a path or command cut short would build from or to the wrong file, so anything that doesn't fit fails
+	if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", module, (int) getpid()) >= (int) sizeof(tmp))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "The module path '%.200s' is too long", module);
+		return 0;
+	}
+	//the paths are quoted for the shell, which needs every quote in them closed and reopened around it
+	char quoted[2][2 * LEN_PATH];
+	char * paths[2] = {source, tmp};
+	int i;
+	for (i = 0; i < 2; i++)
+	{
+		char * q = quoted[i], * p;
+		*q++ = '\'';
+		for (p = paths[i]; *p && q - quoted[i] < 2 * LEN_PATH - 6; p++)
+		{
+			if (*p == '\'')
+			{
+				memcpy(q, "'\\''", 4);
+				q += 4;
+			}
+			else
+			{
+				*q++ = *p;
+			}
+		}
+		if (*p)
+		{
+			snprintf(g_scenecc_err, LEN_ERROR, "The module path '%.200s' is too long", paths[i]);
+			return 0;
+		}
+		*q++ = '\'';
+		*q = 0;
+	}
+	if (snprintf(command, sizeof(command), "%s %s -o %s %s", getenv("CC") ? getenv("CC") : "cc", MODULE_CFLAGS, quoted[1],
+		quoted[0]) >= (int) sizeof(command))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "The command to compile '%.200s' is too long", source);
+		return 0;
+	}
+	if (system(command) || rename(tmp, module))
+	{
+		snprintf(g_scenecc_err, LEN_ERROR, "Could not compile '%.200s', the source is left there", source);
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
+}
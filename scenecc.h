@@ -0,0 +1,50 @@
+#ifndef SCENECC_H_
+#define SCENECC_H_
+
+#include "ray.h"
+
+/**
+* Turns the spheres, triangles and directional lights of a scene into C source with every primitive unrolled and its
+* numbers written in as constants, compiles it into a shared object with the system compiler ($CC, cc when unset) and
+* loads it. Modules are kept in a directory under the hash of their source, so a scene whose geometry and lights are
+* unchanged, whatever its camera, loads the module built before instead of compiling again
+*
+* Modules are only loaded from a directory owned by the user and that no one else can write to, as anyone who can put a
+* file there could have it run by the renderer
+*
+* @param scene * scn the scene
+* @param char * dir the directory modules are kept in, created if it doesn't exist. NULL for the one from
+* get_default_module_dir
+* @param int * cached set to 1 when the module was already built, 0 when it was compiled now
+*
+* @return scene_kernels * the kernels, NULL if the scene is too large to unroll or the module can't be built or
+* loaded, see get_scenecc_error
+*/
+scene_kernels * load_scene_kernels(scene * scn, char * dir, int * cached);
+
+/**
+* Gets the directory of the user's cache that modules are kept in when no other is given: raytracer-modules in
+* $XDG_CACHE_HOME, or in ~/.cache when that isn't set. The cache directory is created if it doesn't exist
+*
+* @param char * path where to write it
+* @param size_t size the size of path
+*
+* @return char * path, NULL if there is no home directory or the path doesn't fit, see get_scenecc_error
+*/
+char * get_default_module_dir(char * path, size_t size);
+
+/**
+* Unloads the module of some kernels and frees them
+*
+* @param scene_kernels * kernels the kernels, NULL for none
+*/
+void unload_scene_kernels(scene_kernels * kernels);
+
+/**
+* Gets the reason the last load_scene_kernels failed
+*
+* @return char * the message
+*/
+char * get_scenecc_error();
+
+#endif
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "particles.h"
+
+//the generated objects fill this box in front of the default camera
+#define BOX_HALF_WIDTH 0.45
+#define BOX_NEAR -0.2
+#define BOX_FAR -1.6
+
+/**
+* Gets the next number of a xorshift generator, so that a seed gives the same scene on every platform
+*
+* @param unsigned long long * state the generator state, never 0
+*
+* @return double a number in [0, 1)
+*/
+double next_uniform(unsigned long long * state);
+
+/**
+* Writes a random material: diffuse only, diffuse with a highlight, or reflective with a highlight
+*
+* @param FILE * f where to write
+* @param unsigned long long * state the random generator
+*/
+void write_material(FILE * f, unsigned long long * state);
+
+/**
+* Writes a particle file, see particles.h, of count particles spread through the box with a palette of 8 colors
+*
+* @param char * path the file
+* @param long count the number of particles
+* @param unsigned long long * state the random generator
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int write_particles(char * path, long count, unsigned long long * state);
+
+/**
+* Writes a paged particle file, see particles.h, of count particles spread through the box like write_particles
+* does. The box is cut into a grid of cells of up to PAGED_CLUSTER_SIZE particles each, and every cell is made and
+* written as a cluster of its own, so that files far larger than memory can be made
+*
+* @return int 0 if it fails, positive number if it succeeds. The parameters are those of write_particles
+*/
+int write_paged_particles(char * path, long long count, unsigned long long * state);
+
+int main(int argc, char * argv[])
+{
+	long spheres = -1;
+	long triangles = -1;
+	int lights = -1;
+	int point_lights = 0;
+	int area_lights = 0;
+	long long particles = 0;
+	char * particle_path = NULL;
+	int paged = 0;
+	unsigned long long seed = 1;
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--lights") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			lights = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--point-lights") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			point_lights = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--area-lights") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+		{
+			area_lights = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--particles") && i + 2 < argc && atol(argv[i + 1]) > 0 && atol(argv[i + 1]) <= INT_MAX)
+		{
+			particles = atol(argv[++i]);
+			particle_path = argv[++i];
+			paged = 0;
+		}
+		else if (!strcmp(argv[i], "--paged-particles") && i + 2 < argc && atoll(argv[i + 1]) > 0)
+		{
+			particles = atoll(argv[++i]);
+			particle_path = argv[++i];
+			paged = 1;
+		}
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+		{
+			seed = strtoull(argv[++i], NULL, 10);
+		}
+		else if (argv[i][0] != '-' && spheres < 0)
+		{
+			spheres = atol(argv[i]);
+		}
+		else if (argv[i][0] != '-' && triangles < 0)
+		{
+			triangles = atol(argv[i]);
+		}
+		else
+		{
+			spheres = -1;
+			break;
+		}
+	}
+	if (spheres < 0 || triangles < 0)
+	{
+		printf("Usage: %s <spheres> <triangles> [--lights N] [--point-lights N] [--area-lights N] [--particles N FILE] [--paged-particles N FILE] [--seed N] > scene.rayTracing\n", argv[0]);
+		printf("--particles writes N particles to FILE, which the scene refers to as given, relative to where the scene is written\n");
+		printf("--paged-particles does the same in the paged format, which is rendered without reading the whole file into memory\n");
+		return -1;
+	}
+	//point and area lights take the place of the two default directional lights
+	if (lights < 0)
+	{
+		lights = point_lights || area_lights ? 0 : 2;
+	}
+	unsigned long long state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	FILE * f = stdout;
+	fprintf(f, "# %ld random spheres and %ld random triangles, seed %llu\n", spheres, triangles, seed);
+	fprintf(f, "CameraLookAt 0 0 0\nCameraLookFrom 0 0 1\nCameraLookUp 0 1 0\nFieldOfView 28\n");
+	for (i = 0; i < lights; i++)
+	{
+		double angle = 2 * M_PI * i / lights;
+		fprintf(f, "DirectionToLight %.3f %.3f .6 LightColor %.2f %.2f %.2f\n", cos(angle), sin(angle),
+			0.9 / lights + 0.2, 0.9 / lights + 0.2, 0.9 / lights + 0.15);
+	}
+	//the falloff shrinks the reach of every point light as they get denser, so the scene stays about as bright
+	double falloff = 60 * pow(point_lights > 0 ? point_lights : 1, 2.0 / 3);
+	for (i = 0; i < point_lights; i++)
+	{
+		double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * next_uniform(&state);
+		double spread = BOX_HALF_WIDTH * (1 - z) / (1 - BOX_NEAR);
+		fprintf(f, "PointLight %.5f %.5f %.5f LightColor %.2f %.2f %.2f Falloff %.3f\n", spread * (2 * next_uniform(&state) - 1),
+			spread * (2 * next_uniform(&state) - 1), z, 0.4 + 0.6 * next_uniform(&state), 0.4 + 0.6 * next_uniform(&state),
+			0.4 + 0.6 * next_uniform(&state), falloff);
+	}
+	//area lights hang above the box, rectangles and disks in turn, all facing down into it
+	for (i = 0; i < area_lights; i++)
+	{
+		double x = BOX_HALF_WIDTH * (2 * next_uniform(&state) - 1);
+		double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * next_uniform(&state);
+		double size = 0.1 + 0.2 * next_uniform(&state);
+		double bright = 1.5 / area_lights + 0.3;
+		if (i % 2)
+		{
+			fprintf(f, "DiskLight %.5f 0.8 %.5f Normal 0 -1 0 Radius %.5f LightColor %.2f %.2f %.2f Falloff 0.5\n", x, z, size / 2,
+				bright, bright, bright);
+		}
+		else
+		{
+			fprintf(f, "RectLight %.5f 0.8 %.5f Edge1 %.5f 0 0 Edge2 0 0 %.5f LightColor %.2f %.2f %.2f Falloff 0.5\n",
+				x - size / 2, z - size / 2, size, size, bright, bright, bright);
+		}
+	}
+	fprintf(f, "AmbientLight .1 .1 .1\nBackgroundColor .2 .2 .25\n");
+
+	//objects shrink as they get more numerous, so the box stays about as full
+	long count = spheres + triangles;
+	double size = 0.25 / cbrt(count > 0 ? count : 1);
+	long n;
+	for (n = 0; n < spheres; n++)
+	{
+		double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * next_uniform(&state);
+		//spread x and y with the view, so that far objects are not all hidden behind near ones
+		double spread = BOX_HALF_WIDTH * (1 - z) / (1 - BOX_NEAR);
+		fprintf(f, "Sphere Center %.5f %.5f %.5f Radius %.5f ", spread * (2 * next_uniform(&state) - 1),
+			spread * (2 * next_uniform(&state) - 1), z, size * (0.5 + next_uniform(&state)));
+		write_material(f, &state);
+	}
+	for (n = 0; n < triangles; n++)
+	{
+		double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * next_uniform(&state);
+		double spread = BOX_HALF_WIDTH * (1 - z) / (1 - BOX_NEAR);
+		double cx = spread * (2 * next_uniform(&state) - 1);
+		double cy = spread * (2 * next_uniform(&state) - 1);
+		fprintf(f, "Triangle");
+		int k;
+		for (k = 0; k < 3; k++)
+		{
+			fprintf(f, " %.5f %.5f %.5f", cx + 2 * size * (2 * next_uniform(&state) - 1),
+				cy + 2 * size * (2 * next_uniform(&state) - 1), z + 2 * size * (2 * next_uniform(&state) - 1));
+		}
+		fprintf(f, " ");
+		write_material(f, &state);
+	}
+	if (particles)
+	{
+		if (!(paged ? write_paged_particles(particle_path, particles, &state) : write_particles(particle_path, particles, &state)))
+		{
+			fprintf(stderr, "Could not write particle file '%s': %s\n", particle_path, paged ? get_particle_error() : "");
+			return -1;
+		}
+		fprintf(f, "ParticleCloud %s Material Diffuse 1 1 1 SpecularHighlight .3 .3 .3 PhongConstant 16\n", particle_path);
+	}
+	return 0;
+}
+
+int write_particles(char * path, long count, unsigned long long * state)
+{
+	FILE * f = fopen(path, "wb");
+	if (!f)
+	{
+		return 0;
+	}
+	int header[2] = {(int) count, 8};
+	float palette[8][3];
+	int i;
+	for (i = 0; i < 8; i++)
+	{
+		palette[i][0] = 0.3f + 0.7f * (float) next_uniform(state);
+		palette[i][1] = 0.3f + 0.7f * (float) next_uniform(state);
+		palette[i][2] = 0.3f + 0.7f * (float) next_uniform(state);
+	}
+	float * values = (float *) malloc(sizeof(float) * 4 * count);
+	unsigned char * colors = (unsigned char *) malloc(count);
+	//particles are much smaller than the other objects, but so many that they still make up a visible cloud
+	double size = 0.1 / cbrt(count);
+	long n;
+	for (n = 0; n < count; n++)
+	{
+		double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * next_uniform(state);
+		double spread = BOX_HALF_WIDTH * (1 - z) / (1 - BOX_NEAR);
+		values[n] = (float) (spread * (2 * next_uniform(state) - 1));
+		values[count + n] = (float) (spread * (2 * next_uniform(state) - 1));
+		values[2 * count + n] = (float) z;
+		values[3 * count + n] = (float) (size * (0.5 + next_uniform(state)));
+		colors[n] = (unsigned char) (8 * next_uniform(state));
+	}
+	int ok = fwrite("PCLD", 1, 4, f) == 4 && fwrite(header, sizeof(int), 2, f) == 2 && fwrite(palette, sizeof(float), 24, f) == 24 &&
+		fwrite(values, sizeof(float), 4 * count, f) == (size_t) (4 * count) && fwrite(colors, 1, count, f) == (size_t) count;
+	free(values);
+	free(colors);
+	return fclose(f) == 0 && ok;
+}
+
+int write_paged_particles(char * path, long long count, unsigned long long * state)
+{
+	float palette[8][3];
+	int i;
+	for (i = 0; i < 8; i++)
+	{
+		palette[i][0] = 0.3f + 0.7f * (float) next_uniform(state);
+		palette[i][1] = 0.3f + 0.7f * (float) next_uniform(state);
+		palette[i][2] = 0.3f + 0.7f * (float) next_uniform(state);
+	}
+	paged_writer * writer = begin_paged_cloud(path, 8, &palette[0][0]);
+	if (!writer)
+	{
+		return 0;
+	}
+	long long cells_needed = (count + PAGED_CLUSTER_SIZE - 1) / PAGED_CLUSTER_SIZE;
+	long long grid = (long long) ceil(cbrt((double) cells_needed));
+	while (grid * grid * grid < cells_needed)
+	{
+		grid++;
+	}
+	long long cells = grid * grid * grid;
+	//with at least count / PAGED_CLUSTER_SIZE cells, spreading the particles evenly never puts more than that in one
+	float * values = (float *) malloc(sizeof(float) * 4 * PAGED_CLUSTER_SIZE);
+	unsigned char * colors = (unsigned char *) malloc(PAGED_CLUSTER_SIZE);
+	double size = 0.1 / cbrt((double) count);
+	int ok = 1;
+	long long c;
+	for (c = 0; c < cells && ok; c++)
+	{
+		int n = (int) (count / cells + (c < count % cells));
+		double cell[3] = {(double) (c % grid), (double) (c / grid % grid), (double) (c / grid / grid)};
+		int k;
+		for (k = 0; k < n; k++)
+		{
+			double z = BOX_NEAR + (BOX_FAR - BOX_NEAR) * (cell[2] + next_uniform(state)) / grid;
+			double spread = BOX_HALF_WIDTH * (1 - z) / (1 - BOX_NEAR);
+			values[k] = (float) (spread * (2 * (cell[0] + next_uniform(state)) / grid - 1));
+			values[PAGED_CLUSTER_SIZE + k] = (float) (spread * (2 * (cell[1] + next_uniform(state)) / grid - 1));
+			values[2 * PAGED_CLUSTER_SIZE + k] = (float) z;
+			values[3 * PAGED_CLUSTER_SIZE + k] = (float) (size * (0.5 + next_uniform(state)));
+			colors[k] = (unsigned char) (8 * next_uniform(state));
+		}
+		ok = !n || add_paged_cluster(writer, n, values, values + PAGED_CLUSTER_SIZE, values + 2 * PAGED_CLUSTER_SIZE,
+			values + 3 * PAGED_CLUSTER_SIZE, colors);
+	}
+	free(values);
+	free(colors);
+	return finish_paged_cloud(writer) && ok;
+}
+
+double next_uniform(unsigned long long * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void write_material(FILE * f, unsigned long long * state)
+{
+	double kind = next_uniform(state);
+	double r = next_uniform(state), g = next_uniform(state), b = next_uniform(state);
+	if (kind < 0.4)
+	{
+		fprintf(f, "Material Diffuse %.2f %.2f %.2f\n", r, g, b);
+	}
+	else if (kind < 0.8)
+	{
+		fprintf(f, "Material Diffuse %.2f %.2f %.2f SpecularHighlight 1 1 1 PhongConstant %d\n", r, g, b,
+			4 << (int) (4 * next_uniform(state)));
+	}
+	else
+	{
+		fprintf(f, "Material Reflective %.2f %.2f %.2f SpecularHighlight 1 1 1 PhongConstant 64\n",
+			0.3 + 0.5 * r, 0.3 + 0.5 * g, 0.3 + 0.5 * b);
+	}
+}
@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sequence.h"
+#include "image.h"
+#include "hash.h"
+
+#define LEN_ERROR 256
+#define SEQUENCE_MAGIC "RTSEQ001"
+#define FRAME_MAGIC 0x4d415246
+//the largest width or height a sequence file may claim, so a damaged header can't ask for absurd buffers
+#define SEQUENCE_MAX_SIZE 65536
+
+/**
+* the start of every sequence file. frame_count and index_offset are only written once the sequence is finished
+*/
+typedef struct
+{
+	char magic[8];
+	int width;
+	int height;
+	int tile_size;
+	int keyframe_interval;
+	int frame_count;
+	int reserved;
+	long long index_offset;
+} sequence_header;
+
+/**
+* written in front of the tiles of every frame
+*/
+typedef struct
+{
+	unsigned int magic;
+	int frame;
+	int tile_count;
+	int keyframe;
+} frame_record;
+
+/**
+* written in front of the channels of every stored tile. wide is 1 when they are 32 bit numbers
+*/
+typedef struct
+{
+	int index;
+	int wide;
+} tile_entry;
+
+struct sequence_writer
+{
+	FILE * f;
+	sequence_header header;
+	int tiles_x;
+	int tile_count;
+	//the hash of every tile as the frame before left it
+	unsigned long long * hashes;
+	long long * offsets;
+	int offsets_size;
+	int * channels;
+	unsigned short * narrow;
+};
+
+struct sequence_reader
+{
+	FILE * f;
+	sequence_header header;
+	int tiles_x;
+	long long * offsets;
+	//the frame the buffer of the caller holds, -1 for none
+	int current;
+	int * tile_buf;
+	unsigned short * narrow;
+};
+
+char g_sequence_err[LEN_ERROR];
+
+/**
+* Gets the pixel bounds of a tile of a sequence, clipped to the image
+*
+* @param sequence_header * header the header of the sequence
+* @param int tiles_x the number of tiles in a row
+* @param int index the tile
+* @param int * x0, y0, x1, y1 set to the bounds, x1 and y1 exclusive
+*/
+void get_sequence_tile(sequence_header * header, int tiles_x, int index, int * x0, int * y0, int * x1, int * y1);
+
+/**
+* Reads the tiles of a frame into a buffer holding the frame before it, or anything for a keyframe
+*
+* @param sequence_reader * reader the reader
+* @param int frame the frame
+* @param int * channels the buffer
+*
+* @return int 0 if the frame record is damaged, positive number if it succeeds
+*/
+int apply_frame(sequence_reader * reader, int frame, int * channels);
+
+sequence_writer * sequence_create(char * path, int width, int height, int tile_size, int keyframe_interval)
+{
+	FILE * f = fopen(path, "wb");
+	if (!f)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Could not create sequence file '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	sequence_writer * writer = (sequence_writer *) calloc(1, sizeof(sequence_writer));
+	writer->f = f;
+	memcpy(writer->header.magic, SEQUENCE_MAGIC, 8);
+	writer->header.width = width;
+	writer->header.height = height;
+	writer->header.tile_size = tile_size;
+	writer->header.keyframe_interval = keyframe_interval;
+	writer->tiles_x = (width + tile_size - 1) / tile_size;
+	writer->tile_count = writer->tiles_x * ((height + tile_size - 1) / tile_size);
+	writer->hashes = (unsigned long long *) calloc(writer->tile_count, sizeof(unsigned long long));
+	writer->channels = (int *) malloc(sizeof(int) * 3 * tile_size * tile_size);
+	writer->narrow = (unsigned short *) malloc(sizeof(unsigned short) * 3 * tile_size * tile_size);
+	//the header is written again with the frame count when the sequence is finished
+	if (fwrite(&writer->header, sizeof(sequence_header), 1, f) != 1)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Could not write to sequence file '%s'\n", path);
+		fclose(f);
+		free(writer->hashes);
+		free(writer->channels);
+		free(writer->narrow);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+int sequence_add_frame(sequence_writer * writer, color * pixels, int res_x, int x0, int y0, int * stored)
+{
+	sequence_header * header = &writer->header;
+	int frame = header->frame_count;
+	if (frame == writer->offsets_size)
+	{
+		writer->offsets_size = writer->offsets_size ? writer->offsets_size * 2 : 64;
+		writer->offsets = (long long *) realloc(writer->offsets, sizeof(long long) * writer->offsets_size);
+	}
+	writer->offsets[frame] = ftello(writer->f);
+	frame_record record;
+	record.magic = FRAME_MAGIC;
+	record.frame = frame;
+	record.tile_count = 0;
+	record.keyframe = !frame || (header->keyframe_interval && frame % header->keyframe_interval == 0);
+	int ok = fwrite(&record, sizeof(frame_record), 1, writer->f) == 1;
+	int t;
+	for (t = 0; t < writer->tile_count && ok; t++)
+	{
+		int tx0, ty0, tx1, ty1, x, y;
+		get_sequence_tile(header, writer->tiles_x, t, &tx0, &ty0, &tx1, &ty1);
+		int count = 0, wide = 0;
+		for (y = ty0; y < ty1; y++)
+		{
+			for (x = tx0; x < tx1; x++)
+			{
+				color * c = &pixels[(size_t) (y0 + y) * res_x + x0 + x];
+				writer->channels[count++] = quantize_channel(c->r);
+				writer->channels[count++] = quantize_channel(c->g);
+				writer->channels[count++] = quantize_channel(c->b);
+			}
+		}
+		unsigned long long h = hash_bytes(HASH_INIT, writer->channels, sizeof(int) * count);
+		if (!record.keyframe && h == writer->hashes[t])
+		{
+			continue;
+		}
+		writer->hashes[t] = h;
+		int i;
+		for (i = 0; i < count && !wide; i++)
+		{
+			wide = writer->channels[i] < 0 || writer->channels[i] > 65535;
+			writer->narrow[i] = (unsigned short) writer->channels[i];
+		}
+		tile_entry entry = {t, wide};
+		ok = fwrite(&entry, sizeof(tile_entry), 1, writer->f) == 1;
+		if (wide)
+		{
+			ok = ok && fwrite(writer->channels, sizeof(int), count, writer->f) == (size_t) count;
+		}
+		else
+		{
+			ok = ok && fwrite(writer->narrow, sizeof(unsigned short), count, writer->f) == (size_t) count;
+		}
+		record.tile_count++;
+	}
+	//the count is only known now, so the record goes in again
+	long long end = ftello(writer->f);
+	ok = ok && !fseeko(writer->f, writer->offsets[frame], SEEK_SET) && fwrite(&record, sizeof(frame_record), 1, writer->f) == 1 &&
+		!fseeko(writer->f, end, SEEK_SET);
+	if (!ok)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Could not write frame %d to the sequence file\n", frame);
+		return 0;
+	}
+	header->frame_count++;
+	*stored = record.tile_count;
+	return 1;
+}
+
+int sequence_finish(sequence_writer * writer)
+{
+	sequence_header * header = &writer->header;
+	header->index_offset = ftello(writer->f);
+	int ok = fwrite(writer->offsets, sizeof(long long), header->frame_count, writer->f) == (size_t) header->frame_count;
+	ok = ok && !fseeko(writer->f, 0, SEEK_SET) && fwrite(header, sizeof(sequence_header), 1, writer->f) == 1;
+	ok = !fclose(writer->f) && ok;
+	if (!ok)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Could not finish the sequence file\n");
+	}
+	free(writer->hashes);
+	free(writer->offsets);
+	free(writer->channels);
+	free(writer->narrow);
+	free(writer);
+	return ok;
+}
+
+sequence_reader * sequence_open(char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Could not open sequence file '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	sequence_reader * reader = (sequence_reader *) calloc(1, sizeof(sequence_reader));
+	reader->f = f;
+	reader->current = -1;
+	sequence_header * header = &reader->header;
+	if (fread(header, sizeof(sequence_header), 1, f) != 1 || memcmp(header->magic, SEQUENCE_MAGIC, 8) ||
+		header->width <= 0 || header->height <= 0 || header->width > SEQUENCE_MAX_SIZE || header->height > SEQUENCE_MAX_SIZE ||
+		header->tile_size <= 0 || (header->tile_size > header->width && header->tile_size > header->height) || header->frame_count < 0)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "'%s' is not a sequence file\n", path);
+		sequence_close(reader);
+		return NULL;
+	}
+	//a render that never finished leaves the index out
+	if (!header->index_offset)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Sequence file '%s' was never finished\n", path);
+		sequence_close(reader);
+		return NULL;
+	}
+	reader->offsets = (long long *) malloc(sizeof(long long) * (header->frame_count ? header->frame_count : 1));
+	if (!reader->offsets || fseeko(f, header->index_offset, SEEK_SET) ||
+		fread(reader->offsets, sizeof(long long), header->frame_count, f) != (size_t) header->frame_count)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "The frame index of sequence file '%s' is damaged\n", path);
+		sequence_close(reader);
+		return NULL;
+	}
+	reader->tiles_x = (header->width + header->tile_size - 1) / header->tile_size;
+	reader->tile_buf = (int *) malloc(sizeof(int) * 3 * (size_t) header->tile_size * header->tile_size);
+	reader->narrow = (unsigned short *) malloc(sizeof(unsigned short) * 3 * (size_t) header->tile_size * header->tile_size);
+	if (!reader->tile_buf || !reader->narrow)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "Not enough memory to read the tiles of sequence file '%s'\n", path);
+		sequence_close(reader);
+		return NULL;
+	}
+	return reader;
+}
+
+void sequence_info(sequence_reader * reader, int * width, int * height, int * frame_count, int * keyframe_interval)
+{
+	*width = reader->header.width;
+	*height = reader->header.height;
+	*frame_count = reader->header.frame_count;
+	*keyframe_interval = reader->header.keyframe_interval;
+}
+
+int sequence_frame_tiles(sequence_reader * reader, int frame, int * tiles)
+{
+	sequence_header * header = &reader->header;
+	*tiles = reader->tiles_x * ((header->height + header->tile_size - 1) / header->tile_size);
+	frame_record record;
+	if (frame < 0 || frame >= header->frame_count || fseeko(reader->f, reader->offsets[frame], SEEK_SET) ||
+		fread(&record, sizeof(frame_record), 1, reader->f) != 1 || record.magic != FRAME_MAGIC)
+	{
+		return -1;
+	}
+	return record.tile_count;
+}
+
+int sequence_read_frame(sequence_reader * reader, int frame, int * channels)
+{
+	sequence_header * header = &reader->header;
+	if (frame < 0 || frame >= header->frame_count)
+	{
+		snprintf(g_sequence_err, LEN_ERROR, "The sequence has no frame %d, only %d frames\n", frame, header->frame_count);
+		return 0;
+	}
+	//start from the keyframe before the frame, or carry on from the frame read last when it is on the way
+	int start = header->keyframe_interval ? frame - frame % header->keyframe_interval : 0;
+	if (reader->current >= start && reader->current <= frame)
+	{
+		start = reader->current + 1;
+	}
+	reader->current = -1;
+	int f;
+	for (f = start; f <= frame; f++)
+	{
+		if (!apply_frame(reader, f, channels))
+		{
+			snprintf(g_sequence_err, LEN_ERROR, "Frame %d of the sequence is damaged\n", f);
+			return 0;
+		}
+	}
+	reader->current = frame;
+	return 1;
+}
+
+void sequence_close(sequence_reader * reader)
+{
+	fclose(reader->f);
+	free(reader->offsets);
+	free(reader->tile_buf);
+	free(reader->narrow);
+	free(reader);
+}
+
+char * get_sequence_error()
+{
+	return g_sequence_err;
+}
+
+void get_sequence_tile(sequence_header * header, int tiles_x, int index, int * x0, int * y0, int * x1, int * y1)
+{
+	*x0 = index % tiles_x * header->tile_size;
+	*y0 = index / tiles_x * header->tile_size;
+	*x1 = *x0 + header->tile_size < header->width ? *x0 + header->tile_size : header->width;
+	*y1 = *y0 + header->tile_size < header->height ? *y0 + header->tile_size : header->height;
+}
+
+int apply_frame(sequence_reader * reader, int frame, int * channels)
+{
+	sequence_header * header = &reader->header;
+	int tile_count = reader->tiles_x * ((header->height + header->tile_size - 1) / header->tile_size);
+	frame_record record;
+	if (fseeko(reader->f, reader->offsets[frame], SEEK_SET) || fread(&record, sizeof(frame_record), 1, reader->f) != 1 ||
+		record.magic != FRAME_MAGIC || record.frame != frame || record.tile_count < 0 || record.tile_count > tile_count)
+	{
+		return 0;
+	}
+	int t;
+	for (t = 0; t < record.tile_count; t++)
+	{
+		tile_entry entry;
+		if (fread(&entry, sizeof(tile_entry), 1, reader->f) != 1 || entry.index < 0 || entry.index >= tile_count)
+		{
+			return 0;
+		}
+		int x0, y0, x1, y1, x, y, i;
+		get_sequence_tile(header, reader->tiles_x, entry.index, &x0, &y0, &x1, &y1);
+		size_t count = (size_t) (x1 - x0) * (y1 - y0) * 3;
+		if (entry.wide)
+		{
+			if (fread(reader->tile_buf, sizeof(int), count, reader->f) != count)
+			{
+				return 0;
+			}
+		}
+		else
+		{
+			if (fread(reader->narrow, sizeof(unsigned short), count, reader->f) != count)
+			{
+				return 0;
+			}
+			for (i = 0; i < (int) count; i++)
+			{
+				reader->tile_buf[i] = reader->narrow[i];
+			}
+		}
+		i = 0;
+		for (y = y0; y < y1; y++)
+		{
+			for (x = x0; x < x1; x++)
+			{
+				int * c = &channels[((size_t) y * header->width + x) * 3];
+				c[0] = reader->tile_buf[i++];
+				c[1] = reader->tile_buf[i++];
+				c[2] = reader->tile_buf[i++];
+			}
+		}
+	}
+	return 1;
+}
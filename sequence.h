@@ -0,0 +1,110 @@
+#ifndef SEQUENCE_H_
+#define SEQUENCE_H_
+
+#include "scene.h"
+
+/**
+* Sequence files hold the frames of an animation, all of the same size, in the byte order of the machine:
+*   a sequence_header, starting with the 8 characters RTSEQ001
+*   every frame: a frame record, then the tiles stored for it, each an index and a flag followed by the channel
+*   numbers of its pixels from quantize_channel, as 16 bit numbers, or 32 bit ones when a number doesn't fit in 16
+*   the offset of every frame record in the file, where the header says
+*
+* The image is cut into square tiles. Keyframes store every tile; the frames between them only store the tiles
+* whose numbers changed since the frame before, found by comparing hashes of them, so a frame where nothing moved
+* takes a few bytes. A frame is read back from the keyframe before it
+*/
+typedef struct sequence_writer sequence_writer;
+
+/**
+* Creates a sequence file
+*
+* @param char * path the file
+* @param int width the width of every frame
+* @param int height the height of every frame
+* @param int tile_size the width and height of the tiles compared between frames
+* @param int keyframe_interval the frames from one keyframe to the next, 0 for the first frame only
+*
+* @return sequence_writer * the writer, NULL if the file can't be created, see get_sequence_error
+*/
+sequence_writer * sequence_create(char * path, int width, int height, int tile_size, int keyframe_interval);
+
+/**
+* Adds a frame to a sequence file
+*
+* @param sequence_writer * writer the writer
+* @param color * pixels the framebuffer
+* @param int res_x the width of the framebuffer
+* @param int x0 the left edge of the part of it that is the frame
+* @param int y0 the top edge of the part of it that is the frame
+* @param int * stored set to the number of tiles written for the frame
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int sequence_add_frame(sequence_writer * writer, color * pixels, int res_x, int x0, int y0, int * stored);
+
+/**
+* Writes the index of the frames and finishes the file. The writer is freed either way
+*
+* @param sequence_writer * writer the writer
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int sequence_finish(sequence_writer * writer);
+
+/**
+* an open sequence file, remembering the last frame it read so that reading the frames in order reads every tile once
+*/
+typedef struct sequence_reader sequence_reader;
+
+/**
+* Opens a sequence file written by sequence_finish
+*
+* @param char * path the file
+*
+* @return sequence_reader * the reader, NULL if the file can't be read or is not a finished sequence file, see
+* get_sequence_error
+*/
+sequence_reader * sequence_open(char * path);
+
+/**
+* Gets the size of the frames of a sequence, the number of frames and the frames from one keyframe to the next
+*/
+void sequence_info(sequence_reader * reader, int * width, int * height, int * frame_count, int * keyframe_interval);
+
+/**
+* Gets the number of tiles stored for a frame, out of every tile of the image
+*
+* @param sequence_reader * reader the reader
+* @param int frame the frame
+* @param int * tiles set to the number of tiles in a frame
+*
+* @return int the tiles stored, -1 if the frame record can't be read
+*/
+int sequence_frame_tiles(sequence_reader * reader, int frame, int * tiles);
+
+/**
+* Rebuilds a frame
+*
+* @param sequence_reader * reader the reader
+* @param int frame the frame, from 0
+* @param int * channels where to put it, 3 numbers from quantize_channel per pixel, width * height pixels in rows.
+* Must be the same buffer on every call, as the frames after the last one read are built on top of it
+*
+* @return int 0 if the file is damaged or the frame doesn't exist, see get_sequence_error, positive number if it succeeds
+*/
+int sequence_read_frame(sequence_reader * reader, int frame, int * channels);
+
+/**
+* Closes a sequence file
+*/
+void sequence_close(sequence_reader * reader);
+
+/**
+* Gets the reason the last sequence function failed
+*
+* @return char * the message
+*/
+char * get_sequence_error();
+
+#endif
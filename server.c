@@ -0,0 +1,602 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "fparser.h"
+#include "hash.h"
+#include "image.h"
+#include "ray.h"
+
+#define LEN_ERROR 256
+#define LEN_JOB 4096
+
+/**
+* a parsed scene in the cache. users counts the jobs still rendering it, so it is only destroyed once they are finished
+*/
+struct cached_scene
+{
+	unsigned long long key;
+	scene * scn;
+	int users;
+	int evicted;
+	struct cached_scene * next;
+};
+
+typedef struct cached_scene cached_scene;
+
+struct connection;
+
+/**
+* state shared by every connection. The cache list is kept in order of use, most recent first.
+* The open connections are kept in a list so they can be woken up at shutdown
+*/
+typedef struct
+{
+	int listen_fd;
+	int stopping;
+	int verbose;
+	int cache_count;
+	int cache_capacity;
+	cached_scene * cache;
+	render_pool * pool;
+	pthread_mutex_t cache_lock;
+	pthread_mutex_t parse_lock;
+	struct connection * conns;
+	int live;
+	pthread_cond_t idle;
+} server;
+
+/**
+* one client connection, handled on its own detached thread that frees it when the client leaves
+*/
+struct connection
+{
+	server * srv;
+	int fd;
+	struct connection * prev;
+	struct connection * next;
+};
+
+typedef struct connection connection;
+
+/**
+* a job after its line has been parsed
+*/
+typedef struct
+{
+	char * scene_path;
+	char * out_path;
+	int res_x;
+	int res_y;
+	int depth;
+	int has_from;
+	vec_d from;
+	double fov;
+} job;
+
+char g_server_err[LEN_ERROR];
+
+/**
+* Connection thread entry point. Runs every job the client sends, one after the other
+*
+* @param void * arg the connection
+*
+* @return void * always NULL
+*/
+void * connection_thread(void * arg);
+
+/**
+* Splits a job line into its settings
+*
+* @param char * line the job line. Modified by this function
+* @param job * j where the settings are stored
+* @param char * err where a description of the problem is stored, LEN_ERROR long
+*
+* @return int 0 if the line is invalid, positive number if it succeeds
+*/
+int parse_job(char * line, job * j, char * err);
+
+/**
+* Renders a job and writes its image
+*
+* @param server * srv the server
+* @param job * j the job
+* @param char * reply where the answer line is stored, LEN_ERROR long
+*/
+void run_job(server * srv, job * j, char * reply);
+
+/**
+* Finds a scene in the cache by the hash of its file, or parses it and adds it to the cache.
+* Either way the scene is marked as in use until release_scene is called
+*
+* @param server * srv the server
+* @param char * path the location of the scene file
+* @param int * hit set to positive number if the scene was already in the cache
+* @param char * err where a description of the problem is stored, LEN_ERROR long
+*
+* @return cached_scene * the cache entry, NULL if the scene couldn't be read
+*/
+cached_scene * acquire_scene(server * srv, char * path, int * hit, char * err);
+
+/**
+* Marks a cached scene as no longer used by a job, destroying it if it has been evicted in the meantime
+*
+* @param server * srv the server
+* @param cached_scene * entry the cache entry
+*/
+void release_scene(server * srv, cached_scene * entry);
+
+/**
+* Calculates the milliseconds between two times
+*/
+double elapsed_ms(struct timespec * start, struct timespec * end);
+
+int run_server(char * socket_path, int threads, int cache_capacity, int verbose)
+{
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		snprintf(g_server_err, LEN_ERROR, "Socket path '%s' is too long\n", socket_path);
+		return 0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+
+	server srv;
+	srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv.listen_fd < 0 || bind(srv.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(srv.listen_fd, 16))
+	{
+		snprintf(g_server_err, LEN_ERROR, "Could not listen on '%s': %s\n", socket_path, strerror(errno));
+		if (srv.listen_fd >= 0)
+		{
+			close(srv.listen_fd);
+		}
+		return 0;
+	}
+	srv.pool = create_pool(threads);
+	if (!srv.pool)
+	{
+		snprintf(g_server_err, LEN_ERROR, "Could not start render threads\n");
+		close(srv.listen_fd);
+		return 0;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	srv.stopping = 0;
+	srv.verbose = verbose;
+	srv.cache = NULL;
+	srv.cache_count = 0;
+	srv.cache_capacity = cache_capacity;
+	pthread_mutex_init(&srv.cache_lock, NULL);
+	pthread_mutex_init(&srv.parse_lock, NULL);
+	pthread_cond_init(&srv.idle, NULL);
+	srv.conns = NULL;
+	srv.live = 0;
+	if (verbose)
+	{
+		printf("Listening on '%s' with %d render threads\n", socket_path, threads);
+		fflush(stdout);
+	}
+
+	//connection threads are detached so a closed connection gives its thread back right away
+	pthread_attr_t attr;
+	pthread_t thread;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (!srv.stopping)
+	{
+		int fd = accept(srv.listen_fd, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		connection * conn = (connection *) malloc(sizeof(connection));
+		if (!conn)
+		{
+			close(fd);
+			continue;
+		}
+		conn->srv = &srv;
+		conn->fd = fd;
+		conn->prev = NULL;
+		pthread_mutex_lock(&srv.cache_lock);
+		conn->next = srv.conns;
+		if (srv.conns)
+		{
+			srv.conns->prev = conn;
+		}
+		srv.conns = conn;
+		srv.live++;
+		if (pthread_create(&thread, &attr, connection_thread, conn))
+		{
+			srv.conns = conn->next;
+			if (srv.conns)
+			{
+				srv.conns->prev = NULL;
+			}
+			srv.live--;
+			close(fd);
+			free(conn);
+		}
+		pthread_mutex_unlock(&srv.cache_lock);
+	}
+	pthread_attr_destroy(&attr);
+	//clients that are still connected get to finish their current job, then see the end of their input
+	pthread_mutex_lock(&srv.cache_lock);
+	connection * conn;
+	for (conn = srv.conns; conn; conn = conn->next)
+	{
+		shutdown(conn->fd, SHUT_RD);
+	}
+	while (srv.live > 0)
+	{
+		pthread_cond_wait(&srv.idle, &srv.cache_lock);
+	}
+	pthread_mutex_unlock(&srv.cache_lock);
+	close(srv.listen_fd);
+	unlink(socket_path);
+	destroy_pool(srv.pool);
+	while (srv.cache)
+	{
+		cached_scene * next = srv.cache->next;
+		destroy_scene(srv.cache->scn);
+		free(srv.cache);
+		srv.cache = next;
+	}
+	pthread_mutex_destroy(&srv.cache_lock);
+	pthread_mutex_destroy(&srv.parse_lock);
+	pthread_cond_destroy(&srv.idle);
+	return 1;
+}
+
+void * connection_thread(void * arg)
+{
+	connection * conn = (connection *) arg;
+	server * srv = conn->srv;
+	FILE * in = fdopen(conn->fd, "r");
+	char line[LEN_JOB];
+	char reply[LEN_ERROR];
+	job j;
+	while (fgets(line, sizeof(line), in))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+		{
+			continue;
+		}
+		if (!strcmp(line, "QUIT"))
+		{
+			break;
+		}
+		if (!strcmp(line, "SHUTDOWN"))
+		{
+			srv->stopping = 1;
+			//wakes up the accept loop
+			shutdown(srv->listen_fd, SHUT_RDWR);
+			snprintf(reply, LEN_ERROR, "OK shutting down");
+		}
+		else if (parse_job(line, &j, reply))
+		{
+			run_job(srv, &j, reply);
+		}
+		size_t len = strlen(reply);
+		reply[len++] = '\n';
+		if (send(conn->fd, reply, len, MSG_NOSIGNAL) != (ssize_t) len)
+		{
+			break;
+		}
+		if (srv->stopping)
+		{
+			break;
+		}
+	}
+	pthread_mutex_lock(&srv->cache_lock);
+	if (conn->prev)
+	{
+		conn->prev->next = conn->next;
+	}
+	else
+	{
+		srv->conns = conn->next;
+	}
+	if (conn->next)
+	{
+		conn->next->prev = conn->prev;
+	}
+	fclose(in);
+	free(conn);
+	srv->live--;
+	pthread_cond_signal(&srv->idle);
+	pthread_mutex_unlock(&srv->cache_lock);
+	return NULL;
+}
+
+int parse_job(char * line, job * j, char * err)
+{
+	j->scene_path = NULL;
+	j->out_path = NULL;
+	j->res_x = 1080;
+	j->res_y = 1080;
+	j->depth = 5;
+	j->has_from = 0;
+	j->fov = 0;
+	char * save;
+	char * word = strtok_r(line, " \t", &save);
+	while (word)
+	{
+		char * value = strchr(word, '=');
+		if (!value)
+		{
+			snprintf(err, LEN_ERROR, "ERR expected key=value, got '%s'", word);
+			return 0;
+		}
+		*value++ = '\0';
+		char extra;
+		int ok = 1;
+		if (!strcmp(word, "scene"))
+		{
+			j->scene_path = value;
+		}
+		else if (!strcmp(word, "out"))
+		{
+			j->out_path = value;
+		}
+		else if (!strcmp(word, "res"))
+		{
+			if (sscanf(value, "%dx%d%c", &j->res_x, &j->res_y, &extra) != 2)
+			{
+				ok = sscanf(value, "%d%c", &j->res_x, &extra) == 1;
+				j->res_y = j->res_x;
+			}
+			ok = ok && j->res_x > 0 && j->res_y > 0;
+		}
+		else if (!strcmp(word, "from"))
+		{
+			ok = sscanf(value, "%lf,%lf,%lf%c", &j->from.x, &j->from.y, &j->from.z, &extra) == 3;
+			j->has_from = 1;
+		}
+		else if (!strcmp(word, "fov"))
+		{
+			ok = sscanf(value, "%lf%c", &j->fov, &extra) == 1 && j->fov > 0;
+		}
+		else if (!strcmp(word, "depth"))
+		{
+			ok = sscanf(value, "%d%c", &j->depth, &extra) == 1 && j->depth >= 0;
+		}
+		else
+		{
+			snprintf(err, LEN_ERROR, "ERR unknown job setting '%s'", word);
+			return 0;
+		}
+		if (!ok)
+		{
+			snprintf(err, LEN_ERROR, "ERR invalid value for %s: '%s'", word, value);
+			return 0;
+		}
+		word = strtok_r(NULL, " \t", &save);
+	}
+	if (!j->scene_path || !j->out_path)
+	{
+		snprintf(err, LEN_ERROR, "ERR a job needs both scene= and out=");
+		return 0;
+	}
+	return 1;
+}
+
+void run_job(server * srv, job * j, char * reply)
+{
+	struct timespec start, render_start, render_end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int hit;
+	cached_scene * entry = acquire_scene(srv, j->scene_path, &hit, reply);
+	if (!entry)
+	{
+		return;
+	}
+	//camera overrides go on a copy, since other jobs may be rendering the cached scene right now
+	scene job_scn = *entry->scn;
+	camera cam = *entry->scn->cam;
+	job_scn.cam = &cam;
+	if (j->has_from)
+	{
+		cam.from = j->from;
+	}
+	if (j->fov)
+	{
+		job_scn.fov = j->fov;
+	}
+
+	render_opts opts;
+	init_render_opts(&opts, j->res_x, j->res_y);
+	opts.depth = j->depth;
+	opts.pool = srv->pool;
+	color * pixels = (color *) malloc(sizeof(color) * j->res_x * j->res_y);
+	clock_gettime(CLOCK_MONOTONIC, &render_start);
+	int ok = ray_trace(&job_scn, pixels, &opts);
+	clock_gettime(CLOCK_MONOTONIC, &render_end);
+	release_scene(srv, entry);
+	if (!ok)
+	{
+		snprintf(reply, LEN_ERROR, "ERR render failed");
+	}
+	else if (!write_ppm(j->out_path, pixels, j->res_x, 0, 0, j->res_x, j->res_y))
+	{
+		snprintf(reply, LEN_ERROR, "ERR could not write image to '%s'", j->out_path);
+	}
+	else
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		snprintf(reply, LEN_ERROR, "OK %s %.1f %.1f", hit ? "hit" : "miss", elapsed_ms(&render_start, &render_end), elapsed_ms(&start, &end));
+	}
+	free(pixels);
+	if (srv->verbose)
+	{
+		printf("%s -> %s %dx%d: %s\n", j->scene_path, j->out_path, j->res_x, j->res_y, reply);
+		fflush(stdout);
+	}
+}
+
+cached_scene * acquire_scene(server * srv, char * path, int * hit, char * err)
+{
+	unsigned long long key;
+	if (!hash_file(path, &key))
+	{
+		snprintf(err, LEN_ERROR, "ERR could not read scene '%s'", path);
+		return NULL;
+	}
+	pthread_mutex_lock(&srv->cache_lock);
+	cached_scene ** link = &srv->cache;
+	while (*link && (*link)->key != key)
+	{
+		link = &(*link)->next;
+	}
+	if (*link)
+	{
+		//move it to the front, it is now the most recently used
+		cached_scene * entry = *link;
+		*link = entry->next;
+		entry->next = srv->cache;
+		srv->cache = entry;
+		entry->users++;
+		pthread_mutex_unlock(&srv->cache_lock);
+		*hit = 1;
+		return entry;
+	}
+	pthread_mutex_unlock(&srv->cache_lock);
+
+	//the parser keeps its state in globals, so only one scene can be parsed at a time
+	pthread_mutex_lock(&srv->parse_lock);
+	scene * scn = (scene *) malloc(sizeof(scene));
+	//parse_file frees scn and what it parsed into it when it fails, so a bad job leaves nothing behind
+	if (!parse_file(path, scn))
+	{
+		char * error_msg = get_file_parse_error();
+		error_msg[strcspn(error_msg, "\r\n")] = '\0';
+		snprintf(err, LEN_ERROR, "ERR %s", error_msg);
+		free(error_msg);
+		pthread_mutex_unlock(&srv->parse_lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&srv->parse_lock);
+
+	cached_scene * entry = (cached_scene *) malloc(sizeof(cached_scene));
+	entry->key = key;
+	entry->scn = scn;
+	entry->users = 1;
+	entry->evicted = 0;
+	pthread_mutex_lock(&srv->cache_lock);
+	//another job may have parsed the same scene while this one was
+	link = &srv->cache;
+	while (*link && (*link)->key != key)
+	{
+		link = &(*link)->next;
+	}
+	if (*link)
+	{
+		cached_scene * existing = *link;
+		existing->users++;
+		pthread_mutex_unlock(&srv->cache_lock);
+		destroy_scene(scn);
+		free(entry);
+		*hit = 1;
+		return existing;
+	}
+	entry->next = srv->cache;
+	srv->cache = entry;
+	srv->cache_count++;
+	while (srv->cache_count > srv->cache_capacity)
+	{
+		link = &srv->cache;
+		while ((*link)->next)
+		{
+			link = &(*link)->next;
+		}
+		cached_scene * last = *link;
+		*link = NULL;
+		srv->cache_count--;
+		if (last->users)
+		{
+			last->evicted = 1;
+		}
+		else
+		{
+			destroy_scene(last->scn);
+			free(last);
+		}
+	}
+	pthread_mutex_unlock(&srv->cache_lock);
+	*hit = 0;
+	return entry;
+}
+
+void release_scene(server * srv, cached_scene * entry)
+{
+	pthread_mutex_lock(&srv->cache_lock);
+	entry->users--;
+	int destroy = entry->evicted && !entry->users;
+	pthread_mutex_unlock(&srv->cache_lock);
+	if (destroy)
+	{
+		destroy_scene(entry->scn);
+		free(entry);
+	}
+}
+
+int submit_job(char * socket_path, char * job_line)
+{
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		snprintf(g_server_err, LEN_ERROR, "Socket path '%s' is too long\n", socket_path);
+		return 0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		snprintf(g_server_err, LEN_ERROR, "Could not connect to '%s': %s\n", socket_path, strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return 0;
+	}
+	FILE * f = fdopen(fd, "r+");
+	char reply[LEN_ERROR];
+	fprintf(f, "%s\n", job_line);
+	fflush(f);
+	if (!fgets(reply, sizeof(reply), f))
+	{
+		snprintf(g_server_err, LEN_ERROR, "No answer from '%s'\n", socket_path);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	printf("%s", reply);
+	return !strncmp(reply, "OK", 2);
+}
+
+double elapsed_ms(struct timespec * start, struct timespec * end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+char * get_server_error()
+{
+	return g_server_err;
+}
@@ -0,0 +1,38 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/**
+* Runs a render server on a Unix domain socket until it is sent SHUTDOWN.
+* Each line a client sends is a job made of key=value words:
+*   scene=<path> out=<path> [res=<n> or res=<w>x<h>] [from=<x>,<y>,<z>] [fov=<degrees>] [depth=<n>]
+* and is answered with one line, either "OK <hit|miss> <render ms> <total ms>" or "ERR <message>".
+* Parsed scenes are kept in a least recently used cache keyed by a hash of the file contents, and every
+* job renders on one shared pool of threads, so several clients can be served at once
+*
+* @param char * socket_path where to create the socket
+* @param int threads the number of render threads
+* @param int cache_capacity the most scenes to keep parsed
+* @param int verbose positive number to log every job
+*
+* @return int 0 if the server couldn't start, positive number once it has shut down
+*/
+int run_server(char * socket_path, int threads, int cache_capacity, int verbose);
+
+/**
+* Sends one job to a render server and prints its answer
+*
+* @param char * socket_path the server's socket
+* @param char * job the job line, without the line break
+*
+* @return int 0 if the job failed, positive number if it succeeds
+*/
+int submit_job(char * socket_path, char * job);
+
+/**
+* Used to check what error occured when a function fails
+*
+* @return char * a description of the error. Not malloc'd
+*/
+char * get_server_error();
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+#include "shadowmap.h"
+#include "ray.h"
+#include "particles.h"
+
+//texels nobody reaches into
+#define EMPTY (-FLT_MAX)
+//a height difference between neighboring texels of more than this many texel widths is taken as a silhouette
+#define DISCONTINUITY_TEXELS 4
+//surfaces closer than this to edge on, as the cosine to the light, are left to the exact test
+#define GRAZING 0.05
+
+/**
+* the map of one light. u and v span the map plane, dir points to the light, and heights are distances along dir
+*/
+typedef struct
+{
+	vec_d dir;
+	vec_d u;
+	vec_d v;
+	double u0;
+	double v0;
+	double texel;
+	float * heights;
+} light_map;
+
+struct shadow_maps
+{
+	int count;
+	int resolution;
+	light_map * maps;
+};
+
+/**
+* Renders the height map of one light
+*
+* @param light_map * map the map, with dir set
+* @param scene * scn the scene
+* @param int resolution the width and height of the map in texels
+*
+* @return int 0 if there is not enough memory for the map, positive number if it succeeds
+*/
+int build_light_map(light_map * map, scene * scn, int resolution);
+
+/**
+* Gets the height of a texel, EMPTY outside of the map
+*/
+double texel_height(light_map * map, int resolution, int i, int j);
+
+shadow_maps * build_shadow_maps(scene * scn, int resolution)
+{
+	shadow_maps * maps = (shadow_maps *) malloc(sizeof(shadow_maps));
+	maps->count = 0;
+	maps->resolution = resolution;
+	maps->maps = (light_map *) malloc(sizeof(light_map) * (scn->light_count ? scn->light_count : 1));
+	int i;
+	for (i = 0; i < scn->light_count; i++)
+	{
+		maps->maps[i].dir = scn->lights[i]->to_dir;
+		if (!build_light_map(&maps->maps[i], scn, resolution))
+		{
+			destroy_shadow_maps(maps);
+			return NULL;
+		}
+		maps->count++;
+	}
+	return maps;
+}
+
+void destroy_shadow_maps(shadow_maps * maps)
+{
+	if (!maps)
+	{
+		return;
+	}
+	int i;
+	for (i = 0; i < maps->count; i++)
+	{
+		free(maps->maps[i].heights);
+	}
+	free(maps->maps);
+	free(maps);
+}
+
+int shadow_map_resolution(shadow_maps * maps)
+{
+	return maps ? maps->resolution : 0;
+}
+
+int build_light_map(light_map * map, scene * scn, int resolution)
+{
+	//any vector that isn't parallel to the light gives the map plane
+	vec_d axis = {1, 0, 0};
+	if (fabs(map->dir.x) > 0.9)
+	{
+		axis.x = 0;
+		axis.y = 1;
+	}
+	map->u = vec_cross(&map->dir, &axis);
+	vec_normalize(&map->u);
+	map->v = vec_cross(&map->dir, &map->u);
+
+	double lo_u = DBL_MAX, hi_u = -DBL_MAX, lo_v = DBL_MAX, hi_v = -DBL_MAX, top = -DBL_MAX;
+	int i, j, k;
+	for (i = 0; i < scn->sphere_count; i++)
+	{
+		sphere * sph = scn->spheres[i];
+		double cu = dot(&sph->center, &map->u), cv = dot(&sph->center, &map->v), ch = dot(&sph->center, &map->dir);
+		lo_u = fmin(lo_u, cu - sph->radius);
+		hi_u = fmax(hi_u, cu + sph->radius);
+		lo_v = fmin(lo_v, cv - sph->radius);
+		hi_v = fmax(hi_v, cv + sph->radius);
+		top = fmax(top, ch + sph->radius);
+	}
+	for (i = 0; i < scn->triangle_count; i++)
+	{
+		vec_d * corners[3] = {&scn->triangles[i]->p1, &scn->triangles[i]->p2, &scn->triangles[i]->p3};
+		for (k = 0; k < 3; k++)
+		{
+			double cu = dot(corners[k], &map->u), cv = dot(corners[k], &map->v);
+			lo_u = fmin(lo_u, cu);
+			hi_u = fmax(hi_u, cu);
+			lo_v = fmin(lo_v, cv);
+			hi_v = fmax(hi_v, cv);
+			top = fmax(top, dot(corners[k], &map->dir));
+		}
+	}
+	//the corners of the box of a cloud hold all of its particles in the map
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		vec_d lo, hi;
+		particle_cloud_bounds(scn->clouds[i], &lo, &hi);
+		for (k = 0; k < 8 && particle_count(scn->clouds[i]); k++)
+		{
+			vec_d corner = {k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z};
+			double cu = dot(&corner, &map->u), cv = dot(&corner, &map->v);
+			lo_u = fmin(lo_u, cu);
+			hi_u = fmax(hi_u, cu);
+			lo_v = fmin(lo_v, cv);
+			hi_v = fmax(hi_v, cv);
+			top = fmax(top, dot(&corner, &map->dir));
+		}
+	}
+	if (top == -DBL_MAX)
+	{
+		top = 0;
+		lo_u = hi_u = lo_v = hi_v = 0;
+	}
+	//one texel of margin all around, so that the edge texels of the scene have neighbors
+	double size = fmax(hi_u - lo_u, hi_v - lo_v);
+	map->texel = (size > 0 ? size : 1) / (resolution - 2);
+	map->u0 = lo_u - map->texel;
+	map->v0 = lo_v - map->texel;
+	map->heights = (float *) malloc(sizeof(float) * (size_t) resolution * resolution);
+	if (!map->heights)
+	{
+		return 0;
+	}
+	for (i = 0; i < resolution * resolution; i++)
+	{
+		map->heights[i] = EMPTY;
+	}
+
+	//every primitive only shoots the texels its projection covers, keeping the highest hit of each
+	ray_d ray;
+	ray.dir = vec_neg(&map->dir);
+	vec_d position;
+	//particles come after the triangles, each shot like a sphere, a cluster of a cloud at a time
+	long long prim_count = scn->sphere_count + scn->triangle_count, cluster_start = prim_count, p;
+	long long cluster = 0;
+	int cloud = 0;
+	for (i = 0; i < scn->cloud_count; i++)
+	{
+		prim_count += particle_count(scn->clouds[i]);
+	}
+	sphere particle;
+	for (p = 0; p < prim_count; p++)
+	{
+		sphere * sph = p < scn->sphere_count ? scn->spheres[p] : NULL;
+		triangle * tri = sph || p >= scn->sphere_count + scn->triangle_count ? NULL : scn->triangles[p - scn->sphere_count];
+		if (p >= scn->sphere_count + scn->triangle_count)
+		{
+			while (p - cluster_start >= particle_cluster_size(scn->clouds[cloud], cluster))
+			{
+				cluster_start += particle_cluster_size(scn->clouds[cloud], cluster);
+				if (++cluster == particle_cluster_count(scn->clouds[cloud]))
+				{
+					cloud++;
+					cluster = 0;
+				}
+			}
+			get_particle(scn->clouds[cloud], cluster, p - cluster_start, &particle.center, &particle.radius);
+			sph = &particle;
+		}
+		double lo[2], hi[2];
+		if (sph)
+		{
+			lo[0] = dot(&sph->center, &map->u) - sph->radius;
+			hi[0] = lo[0] + 2 * sph->radius;
+			lo[1] = dot(&sph->center, &map->v) - sph->radius;
+			hi[1] = lo[1] + 2 * sph->radius;
+		}
+		else
+		{
+			vec_d * corners[3] = {&tri->p1, &tri->p2, &tri->p3};
+			lo[0] = lo[1] = DBL_MAX;
+			hi[0] = hi[1] = -DBL_MAX;
+			int c;
+			for (c = 0; c < 3; c++)
+			{
+				lo[0] = fmin(lo[0], dot(corners[c], &map->u));
+				hi[0] = fmax(hi[0], dot(corners[c], &map->u));
+				lo[1] = fmin(lo[1], dot(corners[c], &map->v));
+				hi[1] = fmax(hi[1], dot(corners[c], &map->v));
+			}
+		}
+		int i0 = (int) fmax(0, floor((lo[0] - map->u0) / map->texel - 0.5));
+		int i1 = (int) fmin(resolution - 1, ceil((hi[0] - map->u0) / map->texel - 0.5));
+		int j0 = (int) fmax(0, floor((lo[1] - map->v0) / map->texel - 0.5));
+		int j1 = (int) fmin(resolution - 1, ceil((hi[1] - map->v0) / map->texel - 0.5));
+		for (j = j0; j <= j1; j++)
+		{
+			for (i = i0; i <= i1; i++)
+			{
+				vec_d along = vec_mult(&map->dir, top + 1);
+				vec_d across_u = vec_mult(&map->u, map->u0 + (i + 0.5) * map->texel);
+				vec_d across_v = vec_mult(&map->v, map->v0 + (j + 0.5) * map->texel);
+				ray.pos = sum_vecs(&along, &across_u);
+				ray.pos = sum_vecs(&ray.pos, &across_v);
+				if (!(sph ? sphere_collide(&ray, sph, &position) : triangle_collide(&ray, tri, &position)))
+				{
+					continue;
+				}
+				float height = (float) (top + 1 - vec_distance(&ray.pos, &position));
+				if (height > map->heights[j * resolution + i])
+				{
+					map->heights[j * resolution + i] = height;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+double texel_height(light_map * map, int resolution, int i, int j)
+{
+	if (i < 0 || j < 0 || i >= resolution || j >= resolution)
+	{
+		return EMPTY;
+	}
+	return map->heights[j * resolution + i];
+}
+
+int shadow_map_lookup(shadow_maps * maps, int light, vec_d * point, vec_d * normal)
+{
+	light_map * map = &maps->maps[light];
+	double facing = dot(normal, &map->dir);
+	if (facing <= GRAZING)
+	{
+		//the map only holds the surfaces facing the light, what hides the back of a surface is not in it
+		return SHADOW_UNKNOWN;
+	}
+	int res = maps->resolution;
+	int i = (int) floor((dot(point, &map->u) - map->u0) / map->texel);
+	int j = (int) floor((dot(point, &map->v) - map->v0) / map->texel);
+	double height = dot(point, &map->dir);
+	double center = texel_height(map, res, i, j);
+	double spread = 0;
+	int empty = 0, di, dj;
+	for (dj = -1; dj <= 1; dj++)
+	{
+		for (di = -1; di <= 1; di++)
+		{
+			double h = texel_height(map, res, i + di, j + dj);
+			if (h == EMPTY)
+			{
+				empty++;
+			}
+			else if (center != EMPTY)
+			{
+				spread = fmax(spread, fabs(h - center));
+			}
+		}
+	}
+	//nothing anywhere above the point or around it
+	if (empty == 9)
+	{
+		return SHADOW_LIT;
+	}
+	if (empty || spread > DISCONTINUITY_TEXELS * map->texel)
+	{
+		return SHADOW_UNKNOWN;
+	}
+	//on a smooth surface the top of the point's own column is at most spread away from the texel center's
+	double tolerance = spread + map->texel;
+	if (height >= center - tolerance)
+	{
+		return SHADOW_LIT;
+	}
+	if (height < center - 2 * tolerance)
+	{
+		return SHADOW_OCCLUDED;
+	}
+	return SHADOW_UNKNOWN;
+}
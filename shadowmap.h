@@ -0,0 +1,61 @@
+#ifndef SHADOWMAP_H_
+#define SHADOWMAP_H_
+
+#include "scene.h"
+
+//the answers of shadow_map_lookup
+#define SHADOW_LIT 0
+#define SHADOW_OCCLUDED 1
+#define SHADOW_UNKNOWN 2
+
+//the largest width and height of a map, so that the texel indices fit in an int
+#define MAX_SHADOW_MAP_SIZE 16384
+
+/**
+* an orthographic height map per directional light, holding how far towards the light the topmost surface
+* of the scene reaches in every texel
+*/
+typedef struct shadow_maps shadow_maps;
+
+/**
+* Casts one ray per texel from beyond the scene bounds towards the scene for every light
+*
+* @param scene * scn the scene. Its geometry and lights must not change while the maps are used
+* @param int resolution the width and height of each map in texels, at most MAX_SHADOW_MAP_SIZE
+*
+* @return shadow_maps * the maps, NULL if there is not enough memory for them
+*/
+shadow_maps * build_shadow_maps(scene * scn, int resolution);
+
+/**
+* Frees the maps
+*
+* @param shadow_maps * maps the maps, NULL does nothing
+*/
+void destroy_shadow_maps(shadow_maps * maps);
+
+/**
+* Gets the width and height of the maps
+*
+* @param shadow_maps * maps the maps, or NULL
+*
+* @return int the resolution given to build_shadow_maps, 0 for NULL
+*/
+int shadow_map_resolution(shadow_maps * maps);
+
+/**
+* Answers whether a point can see a light from its map. A point at the topmost surface of its texel is lit and a point
+* well below it is in shadow. For surfaces facing away from the light or edge on to it, near silhouettes, where
+* neighboring texels jump in height or are partly empty, and in the band just below the top surface, the map can't
+* tell and the answer is SHADOW_UNKNOWN
+*
+* @param shadow_maps * maps the maps
+* @param int light the index of the light in the scene
+* @param vec_d * point the start of the shadow ray
+* @param vec_d * normal the normal of the surface the point is on, facing the way the point was offset
+*
+* @return int SHADOW_LIT, SHADOW_OCCLUDED or SHADOW_UNKNOWN
+*/
+int shadow_map_lookup(shadow_maps * maps, int light, vec_d * point, vec_d * normal);
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "stats.h"
+
+/**
+* Divides two counters, giving 0 instead of dividing by 0
+*/
+double ratio(unsigned long long a, unsigned long long b);
+
+void clear_stats(render_stats * stats)
+{
+	memset(stats, 0, sizeof(render_stats));
+}
+
+void merge_stats(render_stats * total, render_stats * part)
+{
+	int i;
+	total->primary_rays += part->primary_rays;
+	total->reflection_rays += part->reflection_rays;
+	total->shadow_rays += part->shadow_rays;
+	total->shadow_occluded += part->shadow_occluded;
+	total->shadow_map_answers += part->shadow_map_answers;
+	total->shadow_map_fallbacks += part->shadow_map_fallbacks;
+	total->area_shadow_rays += part->area_shadow_rays;
+	total->area_rays_saved += part->area_rays_saved;
+	total->sphere_tests += part->sphere_tests;
+	total->sphere_hits += part->sphere_hits;
+	total->triangle_tests += part->triangle_tests;
+	total->triangle_hits += part->triangle_hits;
+	total->node_visits += part->node_visits;
+	total->clusters_deferred += part->clusters_deferred;
+	total->clusters_skipped += part->clusters_skipped;
+	for (i = 0; i < STATS_MAX_DEPTH; i++)
+	{
+		total->depth_hist[i] += part->depth_hist[i];
+	}
+}
+
+void print_stats(FILE * f, render_stats * stats, int json)
+{
+	unsigned long long rays = stats->primary_rays + stats->reflection_rays + stats->shadow_rays;
+	unsigned long long tests = stats->sphere_tests + stats->triangle_tests;
+	int i, last = 0;
+	for (i = 0; i < STATS_MAX_DEPTH; i++)
+	{
+		if (stats->depth_hist[i])
+		{
+			last = i;
+		}
+	}
+	if (json)
+	{
+		fprintf(f, "{\n");
+		fprintf(f, "  \"primary_rays\": %llu,\n", stats->primary_rays);
+		fprintf(f, "  \"reflection_rays\": %llu,\n", stats->reflection_rays);
+		fprintf(f, "  \"shadow_rays\": %llu,\n", stats->shadow_rays);
+		fprintf(f, "  \"shadow_occluded\": %llu,\n", stats->shadow_occluded);
+		fprintf(f, "  \"shadow_map_answers\": %llu,\n", stats->shadow_map_answers);
+		fprintf(f, "  \"shadow_map_fallbacks\": %llu,\n", stats->shadow_map_fallbacks);
+		fprintf(f, "  \"area_shadow_rays\": %llu,\n", stats->area_shadow_rays);
+		fprintf(f, "  \"area_rays_saved\": %llu,\n", stats->area_rays_saved);
+		fprintf(f, "  \"sphere_tests\": %llu,\n", stats->sphere_tests);
+		fprintf(f, "  \"sphere_hits\": %llu,\n", stats->sphere_hits);
+		fprintf(f, "  \"triangle_tests\": %llu,\n", stats->triangle_tests);
+		fprintf(f, "  \"triangle_hits\": %llu,\n", stats->triangle_hits);
+		fprintf(f, "  \"node_visits\": %llu,\n", stats->node_visits);
+		fprintf(f, "  \"clusters_deferred\": %llu,\n", stats->clusters_deferred);
+		fprintf(f, "  \"clusters_skipped\": %llu,\n", stats->clusters_skipped);
+		fprintf(f, "  \"tests_per_ray\": %.3f,\n", ratio(tests, rays));
+		fprintf(f, "  \"depth_histogram\": [");
+		for (i = 0; i <= last; i++)
+		{
+			fprintf(f, "%s%llu", i ? ", " : "", stats->depth_hist[i]);
+		}
+		fprintf(f, "]\n}\n");
+		return;
+	}
+	fprintf(f, "Rays:           %llu (%llu primary, %llu reflection, %llu shadow)\n", rays,
+		stats->primary_rays, stats->reflection_rays, stats->shadow_rays);
+	fprintf(f, "Shadow rays:    %.1f%% occluded\n", 100 * ratio(stats->shadow_occluded, stats->shadow_rays));
+	if (stats->shadow_map_answers || stats->shadow_map_fallbacks)
+	{
+		fprintf(f, "Shadow maps:    %llu answered, %llu exact fallbacks\n", stats->shadow_map_answers, stats->shadow_map_fallbacks);
+	}
+	if (stats->area_shadow_rays || stats->area_rays_saved)
+	{
+		//uniform sampling would have cast every saved ray as well
+		fprintf(f, "Area lights:    %.2f shadow rays per primary ray, %.2f saved against uniform sampling (%.1f%%)\n",
+			ratio(stats->area_shadow_rays, stats->primary_rays), ratio(stats->area_rays_saved, stats->primary_rays),
+			100 * ratio(stats->area_rays_saved, stats->area_shadow_rays + stats->area_rays_saved));
+	}
+	fprintf(f, "Sphere tests:   %llu (%.2f%% hit)\n", stats->sphere_tests, 100 * ratio(stats->sphere_hits, stats->sphere_tests));
+	fprintf(f, "Triangle tests: %llu (%.2f%% hit)\n", stats->triangle_tests, 100 * ratio(stats->triangle_hits, stats->triangle_tests));
+	fprintf(f, "Node visits:    %llu\n", stats->node_visits);
+	if (stats->clusters_deferred)
+	{
+		//clusters of paged clouds a ray got to before they were in memory, and how many of them it never had to read
+		fprintf(f, "Paged clusters: %llu deferred, %llu never read\n", stats->clusters_deferred, stats->clusters_skipped);
+	}
+	fprintf(f, "Tests per ray:  %.2f\n", ratio(tests, rays));
+	fprintf(f, "Rays by depth:\n");
+	for (i = 0; i <= last; i++)
+	{
+		fprintf(f, "  %2d%s %llu\n", i, i == STATS_MAX_DEPTH - 1 ? "+" : " ", stats->depth_hist[i]);
+	}
+}
+
+double ratio(unsigned long long a, unsigned long long b)
+{
+	return b ? (double) a / b : 0;
+}
@@ -0,0 +1,68 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+
+#define STATS_MAX_DEPTH 16
+
+/**
+* counters for the work done by one render thread. Padded to a whole cache line so that threads
+* counting side by side never share one
+*/
+typedef struct
+{
+	unsigned long long primary_rays;
+	unsigned long long reflection_rays;
+	unsigned long long shadow_rays;
+	unsigned long long shadow_occluded;
+	unsigned long long shadow_map_answers;
+	unsigned long long shadow_map_fallbacks;
+	unsigned long long area_shadow_rays;
+	unsigned long long area_rays_saved;
+	unsigned long long sphere_tests;
+	unsigned long long sphere_hits;
+	unsigned long long triangle_tests;
+	unsigned long long triangle_hits;
+	unsigned long long node_visits;
+	unsigned long long clusters_deferred;
+	unsigned long long clusters_skipped;
+	unsigned long long depth_hist[STATS_MAX_DEPTH];
+} __attribute__((aligned(64))) render_stats;
+
+/**
+* STAT_ADD adds n to a counter of the render_stats in a trace_ctx, if it has one.
+* Counting is only compiled in when RT_STATS is defined (make STATS=1); otherwise it costs nothing
+*/
+#ifdef RT_STATS
+#define STATS_ENABLED 1
+#define STAT_ADD(ctx, field, n) do { if ((ctx) && (ctx)->stats) { (ctx)->stats->field += (n); } } while (0)
+#else
+#define STATS_ENABLED 0
+#define STAT_ADD(ctx, field, n) do { } while (0)
+#endif
+
+/**
+* Sets every counter to 0
+*
+* @param render_stats * stats the counters
+*/
+void clear_stats(render_stats * stats);
+
+/**
+* Adds one set of counters to another
+*
+* @param render_stats * total the counters to add to
+* @param render_stats * part the counters to add
+*/
+void merge_stats(render_stats * total, render_stats * part);
+
+/**
+* Prints a report of the counters
+*
+* @param FILE * f where to print
+* @param render_stats * stats the counters
+* @param int json positive number for JSON, 0 for text
+*/
+void print_stats(FILE * f, render_stats * stats, int json);
+
+#endif
@@ -19,14 +19,10 @@ char ** strsplit(char * str, char delimiter, int * w_count)
 	char ** dest;
 	int word_count = 0;
 	int i = 0;
-	while (str[i])
+	while (str[i] && str[i] != '\r' && str[i] != '\n')
 	{
-		if (str[i] == delimiter)
+		if (str[i] != delimiter && (i == 0 || str[i - 1] == delimiter))
 		{
-			while (str[i] == delimiter)
-			{
-				i++;
-			}
 			word_count++;
 		}
 		i++;
@@ -38,9 +34,14 @@ char ** strsplit(char * str, char delimiter, int * w_count)
 	i = 0;
 	while (str[i] && str[i] != '\r' && str[i] != '\n')
 	{
+		if (str[i] == delimiter)
+		{
+			i++;
+			continue;
+		}
 		c_count = 0;
 		word_start = i;
-		while (str[i] != delimiter && str[i] != '\r' && str[i] != '\n')
+		while (str[i] && str[i] != delimiter && str[i] != '\r' && str[i] != '\n')
 		{
 			c_count++;
 			i++;
@@ -50,7 +51,6 @@ char ** strsplit(char * str, char delimiter, int * w_count)
 		segment[c_count] = '\0';
 		dest[word_count] = segment;
 		word_count++;
-		while (str[++i] == delimiter);
 	}
 	*w_count = word_count;
 	return dest;
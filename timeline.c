@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "timeline.h"
+
+typedef struct
+{
+	const char * name;
+	long long start;
+	long long end;
+	int arg;
+} timeline_event;
+
+/**
+* the spans recorded by one thread. Only that thread appends to it, the list of buffers is protected by g_timeline_lock
+*/
+struct thread_timeline
+{
+	int tid;
+	timeline_event * events;
+	int count;
+	int capacity;
+	struct thread_timeline * next;
+};
+
+typedef struct thread_timeline thread_timeline;
+
+int g_timeline_enabled = 0;
+struct timespec g_timeline_origin;
+pthread_mutex_t g_timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_timeline * g_timelines = NULL;
+int g_timeline_threads = 0;
+__thread thread_timeline * t_timeline = NULL;
+
+void timeline_enable(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &g_timeline_origin);
+	g_timeline_enabled = 1;
+}
+
+long long timeline_now(void)
+{
+	if (!g_timeline_enabled)
+	{
+		return 0;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - g_timeline_origin.tv_sec) * 1000000000LL + (now.tv_nsec - g_timeline_origin.tv_nsec);
+}
+
+void timeline_span(const char * name, long long start, int arg)
+{
+	if (!g_timeline_enabled)
+	{
+		return;
+	}
+	thread_timeline * tl = t_timeline;
+	if (!tl)
+	{
+		tl = (thread_timeline *) malloc(sizeof(thread_timeline));
+		tl->count = 0;
+		tl->capacity = 256;
+		tl->events = (timeline_event *) malloc(sizeof(timeline_event) * tl->capacity);
+		pthread_mutex_lock(&g_timeline_lock);
+		tl->tid = ++g_timeline_threads;
+		tl->next = g_timelines;
+		g_timelines = tl;
+		pthread_mutex_unlock(&g_timeline_lock);
+		t_timeline = tl;
+	}
+	if (tl->count == tl->capacity)
+	{
+		tl->capacity *= 2;
+		tl->events = (timeline_event *) realloc(tl->events, sizeof(timeline_event) * tl->capacity);
+	}
+	timeline_event * e = &tl->events[tl->count++];
+	e->name = name;
+	e->start = start;
+	e->end = timeline_now();
+	e->arg = arg;
+}
+
+int timeline_write(char * file_path)
+{
+	FILE * f = fopen(file_path, "w");
+	if (!f)
+	{
+		return 0;
+	}
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"raytracer\"}}");
+	pthread_mutex_lock(&g_timeline_lock);
+	thread_timeline * tl;
+	int i;
+	for (tl = g_timelines; tl; tl = tl->next)
+	{
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+			tl->tid, tl->tid);
+		for (i = 0; i < tl->count; i++)
+		{
+			timeline_event * e = &tl->events[i];
+			fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+				e->name, tl->tid, e->start / 1e3, (e->end - e->start) / 1e3);
+			if (e->arg >= 0)
+			{
+				fprintf(f, ", \"args\": {\"n\": %d}", e->arg);
+			}
+			fprintf(f, "}");
+		}
+	}
+	pthread_mutex_unlock(&g_timeline_lock);
+	fprintf(f, "\n]}\n");
+	return !fclose(f);
+}
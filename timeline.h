@@ -0,0 +1,35 @@
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+/**
+* Starts recording spans. Until this is called every other timeline function returns at once
+*/
+void timeline_enable(void);
+
+/**
+* Gets a timestamp to start a span with
+*
+* @return long long nanoseconds since the timeline was enabled, 0 when it is not
+*/
+long long timeline_now(void);
+
+/**
+* Records a span that ends now on the calling thread's own buffer, without taking a lock
+*
+* @param const char * name the name shown on the span, must stay valid until timeline_write
+* @param long long start the timestamp from timeline_now when the span began
+* @param int arg a number shown with the span, negative for none
+*/
+void timeline_span(const char * name, long long start, int arg);
+
+/**
+* Writes every recorded span as Chrome trace event JSON, which chrome://tracing and Perfetto can open.
+* No thread may be recording spans while this runs
+*
+* @param char * file_path where to write the trace
+*
+* @return int 0 if it fails, positive number if it succeeds
+*/
+int timeline_write(char * file_path);
+
+#endif
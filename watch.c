@@ -0,0 +1,227 @@
+#include <libgen.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "fparser.h"
+#include "image.h"
+
+#define LEN_PATH 4096
+#define SETTLE_MS 50
+
+/**
+* Parses a scene file, printing the error if it fails
+*
+* @param char * scene_path the location of the file
+*
+* @return scene * the scene, NULL if it fails
+*/
+scene * load_watched_scene(char * scene_path);
+
+/**
+* Renders the tiles that aren't marked in opts->tile_done and writes the image
+*
+* @param scene * scn the scene
+* @param color * pixels the framebuffer
+* @param render_opts * opts the render options
+* @param char * out_path where to write the image
+* @param int crop_full positive number to write the full frame when cropping
+* @param int tiles the number of tiles that will be rendered, for the report
+*/
+void render_update(scene * scn, color * pixels, render_opts * opts, char * out_path, int crop_full, int tiles);
+
+/**
+* Blocks until the watched file has been written, then waits for the writes to settle
+*
+* @param int fd the inotify descriptor
+* @param char * name the file name to wait for
+*
+* @return int 0 if reading events fails, positive number once the file has changed
+*/
+int wait_for_change(int fd, char * name);
+
+int run_watch(char * scene_path, char * out_path, render_opts * opts, int crop_full)
+{
+	char dir_buf[LEN_PATH], name_buf[LEN_PATH];
+	snprintf(dir_buf, sizeof(dir_buf), "%s", scene_path);
+	snprintf(name_buf, sizeof(name_buf), "%s", scene_path);
+	char * dir = dirname(dir_buf);
+	char * name = basename(name_buf);
+	//editors often save by writing a new file and renaming it over the old one, so watch the directory
+	int fd = inotify_init();
+	if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		printf("Could not watch '%s'\n", scene_path);
+		return 0;
+	}
+
+	scene * scn = load_watched_scene(scene_path);
+	if (!scn)
+	{
+		close(fd);
+		return 0;
+	}
+	int tile_count = get_tile_count(opts);
+	color * pixels = (color *) malloc(sizeof(color) * opts->res_x * opts->res_y);
+	opts->hit_records = (unsigned char *) calloc((size_t) tile_count * get_hit_record_size(scn), 1);
+	opts->tile_done = (char *) calloc(tile_count, sizeof(char));
+	render_update(scn, pixels, opts, out_path, crop_full, tile_count);
+
+	while (wait_for_change(fd, name))
+	{
+		scene * next = load_watched_scene(scene_path);
+		if (!next)
+		{
+			continue;
+		}
+		int prim_count = scn->sphere_count + scn->triangle_count;
+		char * changed = (char *) malloc(prim_count + 1);
+		int diff = compare_scenes(scn, next, changed);
+		int i, t, dirty = tile_count;
+		if (diff == SCENE_PRIMS_CHANGED)
+		{
+			for (i = 0; i < prim_count; i++)
+			{
+				if (changed[i] & PRIM_GEOMETRY)
+				{
+					//a moved object can cover or shadow pixels that never hit it before
+					diff = SCENE_CHANGED;
+					break;
+				}
+			}
+		}
+		if (diff == SCENE_SAME)
+		{
+			printf("No visible change\n");
+		}
+		else if (diff == SCENE_PRIMS_CHANGED)
+		{
+			int record_size = get_hit_record_size(scn);
+			unsigned char * mask = (unsigned char *) calloc(record_size, 1);
+			for (i = 0; i < prim_count; i++)
+			{
+				if (changed[i])
+				{
+					mask[i >> 3] |= 1 << (i & 7);
+				}
+			}
+			dirty = 0;
+			for (t = 0; t < tile_count; t++)
+			{
+				unsigned char * record = opts->hit_records + (size_t) t * record_size;
+				opts->tile_done[t] = 1;
+				for (i = 0; i < record_size; i++)
+				{
+					if (record[i] & mask[i])
+					{
+						opts->tile_done[t] = 0;
+						dirty++;
+						break;
+					}
+				}
+			}
+			free(mask);
+			render_update(next, pixels, opts, out_path, crop_full, dirty);
+		}
+		else
+		{
+			free(opts->hit_records);
+			opts->hit_records = (unsigned char *) calloc((size_t) tile_count * get_hit_record_size(next), 1);
+			memset(opts->tile_done, 0, tile_count);
+			render_update(next, pixels, opts, out_path, crop_full, tile_count);
+		}
+		free(changed);
+		destroy_scene(scn);
+		scn = next;
+	}
+	close(fd);
+	free(opts->hit_records);
+	opts->hit_records = NULL;
+	free(opts->tile_done);
+	opts->tile_done = NULL;
+	free(pixels);
+	destroy_scene(scn);
+	return 0;
+}
+
+scene * load_watched_scene(char * scene_path)
+{
+	scene * scn = (scene *) malloc(sizeof(scene));
+	if (!parse_file(scene_path, scn))
+	{
+		char * error_msg = get_file_parse_error();
+		printf("%s", error_msg);
+		free(error_msg);
+		return NULL;
+	}
+	return scn;
+}
+
+void render_update(scene * scn, color * pixels, render_opts * opts, char * out_path, int crop_full, int tiles)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int cropped = opts->crop_x0 || opts->crop_y0 || opts->crop_x1 != opts->res_x || opts->crop_y1 != opts->res_y;
+	if (cropped && tiles == get_tile_count(opts))
+	{
+		int i;
+		for (i = 0; i < opts->res_x * opts->res_y; i++)
+		{
+			pixels[i] = *scn->bg_color;
+		}
+	}
+	ray_trace(scn, pixels, opts);
+	int written;
+	if (cropped && !crop_full)
+	{
+		written = write_ppm(out_path, pixels, opts->res_x, opts->crop_x0, opts->crop_y0, opts->crop_x1, opts->crop_y1);
+	}
+	else
+	{
+		written = write_ppm(out_path, pixels, opts->res_x, 0, 0, opts->res_x, opts->res_y);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!written)
+	{
+		printf("Could not write image to '%s'\n", out_path);
+	}
+	printf("Rendered %d of %d tiles in %.1f ms\n", tiles, get_tile_count(opts),
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	fflush(stdout);
+}
+
+int wait_for_change(int fd, char * name)
+{
+	char buf[sizeof(struct inotify_event) * 16 + LEN_PATH] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	while (1)
+	{
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		//once the file has changed, keep reading until it has been quiet for a moment
+		if (changed && poll(&pfd, 1, SETTLE_MS) == 0)
+		{
+			return 1;
+		}
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len <= 0)
+		{
+			return 0;
+		}
+		char * p = buf;
+		while (p < buf + len)
+		{
+			struct inotify_event * event = (struct inotify_event *) p;
+			if (event->len && !strcmp(event->name, name))
+			{
+				changed = 1;
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
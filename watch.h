@@ -0,0 +1,20 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include "ray.h"
+
+/**
+* Renders a scene, then keeps watching its file and renders it again every time it is saved, until the process is stopped.
+* Edits that only change the materials of some primitives re-render just the tiles whose rays hit those primitives;
+* any other edit re-renders the whole image
+*
+* @param char * scene_path the location of the .rayTracing file
+* @param char * out_path where to write the image after every render
+* @param render_opts * opts the render options. hit_records and tile_done are managed by this function
+* @param int crop_full positive number to write the full frame when cropping, instead of just the crop window
+*
+* @return int 0 if the first render or the file watch fails, otherwise it does not return
+*/
+int run_watch(char * scene_path, char * out_path, render_opts * opts, int crop_full);
+
+#endif